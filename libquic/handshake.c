@@ -18,6 +18,7 @@
  * 02110-1301, USA.
  */
 
+#define _GNU_SOURCE	/* sendmmsg */
 #include <sys/syslog.h>
 #include <linux/tls.h>
 #include <stdlib.h>
@@ -37,13 +38,16 @@ struct quic_msg {
 	struct quic_msg *next;
 	uint8_t *data;
 	uint32_t len;
+	uint32_t off;	/* bytes already accepted by a partial send */
 	uint8_t level;
 };
 
+/* crypto messages sent in one sendmmsg() */
+#define QUIC_MSG_BATCH		16
+
 struct quic_ctx {
 	struct quic_msg *send_list;
 	struct quic_msg *send_last;
-	uint8_t data[65536];
 	uint8_t completed:1;
 	uint8_t is_serv:1;
 };
@@ -246,6 +250,69 @@ ssize_t quic_sendmsg(int sockfd, const void *msg, size_t len, int64_t sid, uint3
 	return sendmsg(sockfd, &outmsg, (int)(flags & ~QUIC_MSG_STREAM_FLAGS));
 }
 
+/**
+ * quic_sendmsg_batch - send msgs to multiple streams in one call
+ * @sockfd: IPPROTO_QUIC type socket
+ * @msgs: msgs to send, each with its stream ID and stream flag
+ * @count: the number of msgs
+ * @flags: message flag for all msgs
+ *
+ * The msgs are queued in order and transmitted together, so that small msgs to
+ * different streams are packed into the same packets. A msg with MSG_DATAGRAM in
+ * its flags is sent as a datagram, and its stream ID is ignored.
+ *
+ * Return values:
+ * - On success, the number of bytes sent is returned, which is less than the total
+ *   length of the msgs if one of them could not be sent entirely.
+ * - On error, -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t quic_sendmsg_batch(int sockfd, const struct quic_stream_msg *msgs, unsigned int count,
+			   uint32_t flags)
+{
+	struct quic_record_info *info;
+	struct msghdr outmsg;
+	struct cmsghdr *cmsg;
+	struct iovec *iov;
+	unsigned int i;
+	ssize_t ret;
+	char *ctl;
+
+	iov = calloc(count, sizeof(*iov));
+	ctl = calloc(count, CMSG_SPACE(sizeof(*info)));
+	if (!iov || !ctl) {
+		free(iov);
+		free(ctl);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(&outmsg, 0, sizeof(outmsg));
+	outmsg.msg_iov = iov;
+	outmsg.msg_iovlen = count;
+	outmsg.msg_control = ctl;
+	outmsg.msg_controllen = count * CMSG_SPACE(sizeof(*info));
+
+	cmsg = CMSG_FIRSTHDR(&outmsg);
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = (void *)msgs[i].msg;
+		iov[i].iov_len = msgs[i].len;
+
+		cmsg->cmsg_level = SOL_QUIC;
+		cmsg->cmsg_type = QUIC_RECORD_INFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*info));
+		info = (struct quic_record_info *)CMSG_DATA(cmsg);
+		info->stream_id = msgs[i].sid;
+		info->len = msgs[i].len;
+		info->flags = (msgs[i].flags & (QUIC_MSG_STREAM_FLAGS | MSG_DATAGRAM));
+		cmsg = CMSG_NXTHDR(&outmsg, cmsg);
+	}
+
+	ret = sendmsg(sockfd, &outmsg, (int)(flags & ~QUIC_MSG_STREAM_FLAGS));
+	free(iov);
+	free(ctl);
+	return ret;
+}
+
 static uint32_t quic_tls_cipher_type(gnutls_cipher_algorithm_t cipher)
 {
 	switch (cipher) {
@@ -466,32 +533,58 @@ err:
 	return ret;
 }
 
-static int quic_handshake_sendmsg(int sockfd, struct quic_msg *msg)
+/* Send the queued crypto messages with one sendmmsg() per QUIC_MSG_BATCH of them. The kernel
+ * sets MSG_BATCH on all but the last message of each call, so the crypto frames of all levels
+ * are packed together and transmitted once, when the last one is queued.
+ */
+static int quic_handshake_sendmsg(int sockfd, struct quic_ctx *ctx)
 {
-	char outcmsg[CMSG_SPACE(sizeof(struct quic_handshake_info))];
+	char outcmsg[QUIC_MSG_BATCH][CMSG_SPACE(sizeof(struct quic_handshake_info))];
+	struct mmsghdr outmsg[QUIC_MSG_BATCH];
 	struct quic_handshake_info *info;
-	struct msghdr outmsg;
+	struct iovec iov[QUIC_MSG_BATCH];
 	struct cmsghdr *cmsg;
-	struct iovec iov;
-
-	iov.iov_base = (void *)msg->data;
-	iov.iov_len = msg->len;
-
-	memset(&outmsg, 0, sizeof(outmsg));
-	outmsg.msg_iov = &iov;
-	outmsg.msg_iovlen = 1;
-	outmsg.msg_control = outcmsg;
-	outmsg.msg_controllen = sizeof(outcmsg);
-
-	cmsg = CMSG_FIRSTHDR(&outmsg);
-	cmsg->cmsg_level = SOL_QUIC;
-	cmsg->cmsg_type = QUIC_HANDSHAKE_INFO;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(*info));
+	struct quic_msg *msg;
+	int i, n, ret;
 
-	info = (struct quic_handshake_info *)CMSG_DATA(cmsg);
-	info->crypto_level = msg->level;
+	while (ctx->send_list) {
+		memset(outmsg, 0, sizeof(outmsg));
+		msg = ctx->send_list;
+		for (n = 0; msg && n < QUIC_MSG_BATCH; n++, msg = msg->next) {
+			quic_log_debug("< Handshake SEND: %u %u", msg->len, msg->level);
+			iov[n].iov_base = (void *)(msg->data + msg->off);
+			iov[n].iov_len = msg->len - msg->off;
+			outmsg[n].msg_hdr.msg_iov = &iov[n];
+			outmsg[n].msg_hdr.msg_iovlen = 1;
+			outmsg[n].msg_hdr.msg_control = outcmsg[n];
+			outmsg[n].msg_hdr.msg_controllen = sizeof(outcmsg[n]);
+
+			cmsg = CMSG_FIRSTHDR(&outmsg[n].msg_hdr);
+			cmsg->cmsg_level = SOL_QUIC;
+			cmsg->cmsg_type = QUIC_HANDSHAKE_INFO;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(*info));
+
+			info = (struct quic_handshake_info *)CMSG_DATA(cmsg);
+			info->crypto_level = msg->level;
+		}
 
-	return sendmsg(sockfd, &outmsg, (msg->next ? MSG_MORE : 0));
+		ret = sendmmsg(sockfd, outmsg, n, (msg ? MSG_MORE : 0) | MSG_DONTWAIT);
+		if (ret < 0)
+			return -errno;
+		for (i = 0; i < ret; i++) {
+			msg = ctx->send_list;
+			/* with MSG_DONTWAIT a message may be taken only in part; keep the
+			 * rest queued and wait for the socket to be writable again
+			 */
+			if (outmsg[i].msg_len < iov[i].iov_len) {
+				msg->off += outmsg[i].msg_len;
+				return -EAGAIN;
+			}
+			ctx->send_list = msg->next;
+			quic_msg_destroy(msg);
+		}
+	}
+	return 0;
 }
 
 static int quic_handshake_recvmsg(int sockfd, struct quic_msg *msg)
@@ -538,17 +631,16 @@ static int quic_storage_add(void *dbf, time_t exp_time, const gnutls_datum_t *ke
 static gnutls_anti_replay_t quic_anti_replay;
 
 /**
- * quic_handshake - Drive the handshake interaction with TLS session
- * @session: TLS session
+ * quic_handshake_init - Prepare a TLS session for quic_handshake_step()
+ * @session: TLS session, with the QUIC socket set by gnutls_transport_set_int()
  *
  * Return values:
  * - On success, 0 is returned.
  * - On error, a negative error value is returned.
  */
-int quic_handshake(gnutls_session_t session)
+int quic_handshake_init(gnutls_session_t session)
 {
 	int ret, sockfd = gnutls_transport_get_int(session);
-	struct quic_msg *msg, _msg = {};
 	struct quic_ctx *ctx;
 	unsigned int len;
 	uint8_t opt[128];
@@ -574,83 +666,100 @@ int quic_handshake(gnutls_session_t session)
 		GNUTLS_EXT_TLS, quic_tp_recv, quic_tp_send, NULL, NULL, NULL,
 		GNUTLS_EXT_FLAG_TLS | GNUTLS_EXT_FLAG_CLIENT_HELLO | GNUTLS_EXT_FLAG_EE);
 	if (ret)
-		goto out;
+		goto err;
 
 	if (!ctx->is_serv) {
+		/* the Initial is sent by the first quic_handshake_step() */
 		ret = quic_handshake_process(session, QUIC_CRYPTO_INITIAL, NULL, 0);
 		if (ret)
-			goto out;
+			goto err;
+		return 0;
+	}
 
-		msg = ctx->send_list;
-		while (msg) {
-			quic_log_debug("< Handshake SEND: %d %d", msg->len, msg->level);
-			ret = quic_handshake_sendmsg(sockfd, msg);
-			if (ret < 0) {
-				quic_log_error("socket sendmsg error %d", errno);
-				ret = -errno;
-				goto out;
-			}
-			ctx->send_list = msg->next;
-			quic_msg_destroy(msg);
-			msg = ctx->send_list;
-		}
-	} else {
-		if (!quic_anti_replay) {
-			ret = gnutls_anti_replay_init(&quic_anti_replay);
-			if (ret)
-				goto out;
-			gnutls_anti_replay_set_add_function(quic_anti_replay, quic_storage_add);
-			gnutls_anti_replay_set_ptr(quic_anti_replay, NULL);
-		}
-		gnutls_anti_replay_enable(session, quic_anti_replay);
+	if (!quic_anti_replay) {
+		ret = gnutls_anti_replay_init(&quic_anti_replay);
+		if (ret)
+			goto err;
+		gnutls_anti_replay_set_add_function(quic_anti_replay, quic_storage_add);
+		gnutls_anti_replay_set_ptr(quic_anti_replay, NULL);
 	}
+	gnutls_anti_replay_enable(session, quic_anti_replay);
+	return 0;
+err:
+	quic_handshake_deinit(session);
+	return ret;
+}
 
-	while (!ctx->completed) {
-		struct pollfd pfd = {
-			.fd = sockfd,
-			.events = POLLIN,
-		};
+/**
+ * quic_handshake_step - Make progress on the handshake without blocking
+ * @session: TLS session prepared by quic_handshake_init()
+ *
+ * Process all the handshake messages that are ready on the socket and send the replies.
+ * It never blocks, so a server can drive many handshakes from one epoll or io_uring
+ * loop, calling it whenever the socket becomes readable, or writable after
+ * QUIC_HANDSHAKE_WANT_WRITE.
+ *
+ * Return values:
+ * - 0 when the handshake is completed.
+ * - QUIC_HANDSHAKE_WANT_READ or QUIC_HANDSHAKE_WANT_WRITE to be called again once the
+ *   socket is readable or writable.
+ * - On error, a negative error value is returned.
+ */
+int quic_handshake_step(gnutls_session_t session)
+{
+	int ret, sockfd = gnutls_transport_get_int(session);
+	struct quic_ctx *ctx = gnutls_db_get_ptr(session);
+	uint8_t data[65536];
+	struct quic_msg msg;
 
-		ret = poll(&pfd, 1, 1000);
-		if (ret < 0) {
-			quic_log_error("socket poll() error %d", errno);
-			ret = -errno;
-			goto out;
-		}
-		msg = &_msg;
-		while (!ctx->completed) {
-			msg->data = ctx->data;
-			msg->len = sizeof(ctx->data);
-			ret = quic_handshake_recvmsg(sockfd, msg);
-			if (ret <= 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
-				quic_log_error("socket recvmsg error %d", errno);
-				ret = -errno;
-				goto out;
-			}
-			quic_log_debug("> Handshake RECV: %u %u", msg->len, msg->level);
-			ret = quic_handshake_process(session, msg->level, msg->data, msg->len);
-			if (ret)
-				goto out;
-		}
+	if (!ctx)
+		return -EINVAL;
 
-		msg = ctx->send_list;
-		while (msg) {
-			quic_log_debug("< Handshake SEND: %u %u", msg->len, msg->level);
-			ret = quic_handshake_sendmsg(sockfd, msg);
-			if (ret < 0) {
-				quic_log_error("socket sendmsg error %d", errno);
-				ret = -errno;
-				goto out;
-			}
-			ctx->send_list = msg->next;
-			quic_msg_destroy(msg);
-			msg = ctx->send_list;
+	ret = quic_handshake_sendmsg(sockfd, ctx);
+	if (ret)
+		goto out;
+
+	while (!ctx->completed) {
+		msg.data = data;
+		msg.len = sizeof(data);
+		ret = quic_handshake_recvmsg(sockfd, &msg);
+		if (ret <= 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			quic_log_error("socket recvmsg error %d", errno);
+			return -errno;
 		}
+		quic_log_debug("> Handshake RECV: %u %u", msg.len, msg.level);
+		ret = quic_handshake_process(session, msg.level, msg.data, msg.len);
+		if (ret)
+			return ret;
 	}
 
+	ret = quic_handshake_sendmsg(sockfd, ctx);
 out:
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+		return QUIC_HANDSHAKE_WANT_WRITE;
+	if (ret) {
+		quic_log_error("socket sendmsg error %d", -ret);
+		return ret;
+	}
+	return ctx->completed ? 0 : QUIC_HANDSHAKE_WANT_READ;
+}
+
+/**
+ * quic_handshake_deinit - Release what quic_handshake_init() set up
+ * @session: TLS session
+ *
+ * Called once quic_handshake_step() returns 0 or an error, or when the handshake is
+ * abandoned.
+ */
+void quic_handshake_deinit(gnutls_session_t session)
+{
+	struct quic_ctx *ctx = gnutls_db_get_ptr(session);
+	struct quic_msg *msg;
+
+	if (!ctx)
+		return;
 	gnutls_db_set_ptr(session, NULL);
 
 	msg = ctx->send_list;
@@ -660,7 +769,43 @@ out:
 		msg = ctx->send_list;
 	}
 	free(ctx);
-	return ret < 0 ? ret : 0;
+}
+
+/**
+ * quic_handshake - Drive the handshake interaction with TLS session
+ * @session: TLS session
+ *
+ * Return values:
+ * - On success, 0 is returned.
+ * - On error, a negative error value is returned.
+ */
+int quic_handshake(gnutls_session_t session)
+{
+	int ret, sockfd = gnutls_transport_get_int(session);
+	struct pollfd pfd = {
+		.fd = sockfd,
+	};
+
+	ret = quic_handshake_init(session);
+	if (ret)
+		return ret;
+
+	while (1) {
+		ret = quic_handshake_step(session);
+		if (ret <= 0)
+			break;
+
+		pfd.events = (ret == QUIC_HANDSHAKE_WANT_WRITE) ? POLLOUT : POLLIN;
+		ret = poll(&pfd, 1, 1000);
+		if (ret < 0) {
+			quic_log_error("socket poll() error %d", errno);
+			ret = -errno;
+			break;
+		}
+	}
+
+	quic_handshake_deinit(session);
+	return ret;
 }
 
 /**
@@ -36,6 +36,14 @@ int quic_server_handshake(int sockfd, const char *pkey_file,
 
 int quic_handshake(gnutls_session_t session);
 
+/* quic_handshake_step() return values, besides 0 for completed and negative errors */
+#define QUIC_HANDSHAKE_WANT_READ	1
+#define QUIC_HANDSHAKE_WANT_WRITE	2
+
+int quic_handshake_init(gnutls_session_t session);
+int quic_handshake_step(gnutls_session_t session);
+void quic_handshake_deinit(gnutls_session_t session);
+
 int quic_session_get_data(gnutls_session_t session,
 			  void *data, size_t *size);
 int quic_session_set_data(gnutls_session_t session,
@@ -46,8 +54,17 @@ int quic_session_get_alpn(gnutls_session_t session,
 int quic_session_set_alpn(gnutls_session_t session,
 			  const void *data, size_t size);
 
+struct quic_stream_msg {
+	const void *msg;
+	size_t len;
+	int64_t sid;
+	uint32_t flags;
+};
+
 ssize_t quic_sendmsg(int sockfd, const void *msg, size_t len,
 		     int64_t sid, uint32_t flags);
+ssize_t quic_sendmsg_batch(int sockfd, const struct quic_stream_msg *msgs,
+			   unsigned int count, uint32_t flags);
 ssize_t quic_recvmsg(int sockfd, void *msg, size_t len,
 		     int64_t *sid, uint32_t *flags);
 
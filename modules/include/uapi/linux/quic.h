@@ -28,6 +28,7 @@ enum {
 enum quic_cmsg_type {
 	QUIC_STREAM_INFO,
 	QUIC_HANDSHAKE_INFO,
+	QUIC_RECORD_INFO,
 };
 
 #define QUIC_STREAM_TYPE_SERVER_MASK	0x01
@@ -45,6 +46,9 @@ enum quic_msg_flags {
 	/* extented flags for msg_flags */
 	MSG_DATAGRAM		= 0x10,
 	MSG_NOTIFICATION	= 0x8000,
+
+	/* recvmsg flag to return many records, each with a QUIC_RECORD_INFO cmsg */
+	MSG_RECORD_BATCH	= 0x1000000,
 };
 
 enum quic_crypto_level {
@@ -64,6 +68,17 @@ struct quic_stream_info {
 	uint32_t stream_flags;
 };
 
+/* one per record returned by recvmsg with MSG_RECORD_BATCH or passed to sendmsg, in the order
+ * of the data. recvmsg fails with EINVAL if there is no room for even one, and sets MSG_CTRUNC
+ * when it stops early because the control buffer is full.
+ */
+struct quic_record_info {
+	int64_t  stream_id;	/* -1 for datagram, or as in quic_stream_info on send */
+	uint64_t offset;	/* stream offset of the record data, unused on send */
+	uint32_t len;
+	uint32_t flags;		/* MSG_STREAM_FIN, MSG_DATAGRAM or MSG_EOR; stream flags on send */
+};
+
 /* Socket Options APIs */
 #define QUIC_SOCKOPT_EVENT				0
 #define QUIC_SOCKOPT_STREAM_OPEN			1
@@ -80,6 +95,10 @@ struct quic_stream_info {
 #define QUIC_SOCKOPT_SESSION_TICKET			12
 #define QUIC_SOCKOPT_CRYPTO_SECRET			13
 #define QUIC_SOCKOPT_TRANSPORT_PARAM_EXT		14
+#define QUIC_SOCKOPT_STREAM_PRIORITY			15
+#define QUIC_SOCKOPT_CONGESTION				16
+#define QUIC_SOCKOPT_CONNECTION_ID_PREFIX		17
+#define QUIC_SOCKOPT_INFO				18
 
 #define QUIC_VERSION_V1			0x1
 #define QUIC_VERSION_V2			0x6b3343cf
@@ -103,7 +122,8 @@ struct quic_transport_param {
 	uint64_t	max_stream_data_bidi_local;
 	uint64_t	max_stream_data_bidi_remote;
 	uint64_t	max_stream_data_uni;
-	uint64_t	reserved;
+	uint32_t	min_ack_delay;
+	uint32_t	reserved;
 };
 
 struct quic_config {
@@ -116,7 +136,10 @@ struct quic_config {
 	uint8_t		stream_data_nodelay;
 	uint8_t		receive_session_ticket;
 	uint8_t		certificate_request;
-	uint8_t		reserved[3];
+	uint8_t		stream_scheduler;
+	uint8_t		edt_pacing;
+	uint8_t		disable_hystart;
+	uint32_t	datagram_ttl;
 };
 
 struct quic_crypto_secret {
@@ -129,9 +152,77 @@ struct quic_crypto_secret {
 enum quic_cong_algo {
 	QUIC_CONG_ALG_RENO,
 	QUIC_CONG_ALG_CUBIC,
+	QUIC_CONG_ALG_BBR,
 	QUIC_CONG_ALG_MAX,
 };
 
+enum quic_stream_sched {
+	QUIC_STREAM_SCHED_FIFO,		/* streams drained in the order they have data */
+	QUIC_STREAM_SCHED_RR,		/* one frame per stream in turn */
+	QUIC_STREAM_SCHED_WFQ,		/* like RR, more frames per turn for lower urgency */
+	QUIC_STREAM_SCHED_PRIO,		/* RFC 9218 urgency and incremental */
+	QUIC_STREAM_SCHED_MAX,
+};
+
+#define QUIC_STREAM_URGENCY_DEFAULT	3
+#define QUIC_STREAM_URGENCY_MAX		7
+
+struct quic_stream_priority {
+	int64_t  stream_id;
+	uint8_t  urgency;	/* 0 (highest) to 7 */
+	uint8_t  incremental;
+};
+
+/* QUIC_SOCKOPT_INFO, times in usecs and rates in bytes per second */
+struct quic_info {
+	uint32_t	smoothed_rtt;
+	uint32_t	latest_rtt;
+	uint32_t	min_rtt;
+	uint32_t	rttvar;
+	uint32_t	pto;
+	uint32_t	pto_count;
+
+	uint32_t	window;		/* congestion window */
+	uint32_t	ssthresh;
+	uint32_t	inflight;
+	uint32_t	mss;
+	uint64_t	pacing_rate;
+	uint64_t	delivery_rate;	/* from the latest ACK */
+	uint8_t		cong_state;	/* 0 slow start, 1 recovery, 2 congestion avoidance */
+	uint8_t		pl_state;	/* PLPMTUD: 0 disabled, 1 base, 2 search, 3 complete, 4 error */
+	uint16_t	pl_pmtu;	/* 0 until a PLPMTU is confirmed by probing */
+	uint32_t	reserved;
+
+	uint64_t	bytes_sent;	/* of ack-eliciting packets */
+	uint64_t	bytes_acked;
+	uint64_t	bytes_lost;
+	uint64_t	bytes_retrans;	/* of frames queued again after a loss */
+	uint64_t	packets_sent;
+	uint64_t	packets_acked;
+	uint64_t	packets_lost;
+	uint64_t	frames_retrans;
+	uint64_t	blocked_time;	/* blocked by the peer's connection flow control */
+};
+
+/* INET_DIAG_INFO of a QUIC socket in an inet_diag dump, see the quic_diag module */
+#define QUIC_DIAG_ALPN_LEN	64
+
+struct quic_diag_info {
+	struct quic_info	info;
+	uint8_t		source_cid[20];	/* the active connection IDs */
+	uint8_t		dest_cid[20];
+	uint8_t		source_cid_len;
+	uint8_t		dest_cid_len;
+	uint8_t		alpn_len;	/* truncated to QUIC_DIAG_ALPN_LEN */
+	uint8_t		reserved;
+	uint32_t	version;
+	uint16_t	send_streams_bidi;	/* open streams */
+	uint16_t	send_streams_uni;
+	uint16_t	recv_streams_bidi;
+	uint16_t	recv_streams_uni;
+	uint8_t		alpn[QUIC_DIAG_ALPN_LEN];
+};
+
 struct quic_errinfo {
 	int64_t  stream_id;
 	uint32_t errcode;
@@ -160,6 +251,7 @@ enum quic_event_type {
 	QUIC_EVENT_KEY_UPDATE,
 	QUIC_EVENT_NEW_TOKEN,
 	QUIC_EVENT_NEW_SESSION_TICKET,
+	QUIC_EVENT_STREAM_WRITABLE,
 	QUIC_EVENT_END,
 	QUIC_EVENT_MAX = QUIC_EVENT_END - 1,
 };
@@ -204,6 +296,7 @@ union quic_event {
 	struct quic_connection_close close;
 	struct quic_connection_id_info info;
 	uint64_t max_stream;
+	int64_t writable_stream;
 	uint8_t local_migration;
 	uint8_t key_update_phase;
 };
@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is part of the QUIC kernel implementation
+ *
+ * BPF struct_ops for QUIC congestion control.
+ *
+ * Written or modified by:
+ *    Xin Long <lucien.xin@gmail.com>
+ */
+
+#include <linux/bpf_verifier.h>
+#include <linux/version.h>
+#include <linux/btf_ids.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <net/sock.h>
+
+#include "common.h"
+#include "cong.h"
+
+#ifdef QUIC_CONG_BPF
+
+__bpf_kfunc_start_defs();
+
+__bpf_kfunc u32 bpf_quic_cong_smoothed_rtt(struct quic_cong *cong)
+{
+	return cong->smoothed_rtt;
+}
+
+__bpf_kfunc u32 bpf_quic_cong_latest_rtt(struct quic_cong *cong)
+{
+	return cong->latest_rtt;
+}
+
+__bpf_kfunc u32 bpf_quic_cong_min_rtt(struct quic_cong *cong)
+{
+	return cong->min_rtt;
+}
+
+__bpf_kfunc u32 bpf_quic_cong_window(struct quic_cong *cong)
+{
+	return cong->window;
+}
+
+__bpf_kfunc u32 bpf_quic_cong_mss(struct quic_cong *cong)
+{
+	return cong->mss;
+}
+
+__bpf_kfunc u32 bpf_quic_cong_pacing_rate(struct quic_cong *cong)
+{
+	return cong->pacing_rate;
+}
+
+/* bytes per second from the latest ACK, 0 if it gave no valid sample */
+__bpf_kfunc u32 bpf_quic_cong_delivery_rate(struct quic_cong *cong)
+{
+	return cong->rs.rate;
+}
+
+__bpf_kfunc void bpf_quic_cong_set_window(struct quic_cong *cong, u32 window)
+{
+	cong->window = clamp(window, cong->min_window, cong->max_window);
+}
+
+__bpf_kfunc void bpf_quic_cong_set_ssthresh(struct quic_cong *cong, u32 ssthresh)
+{
+	cong->ssthresh = ssthresh;
+}
+
+__bpf_kfunc void bpf_quic_cong_set_state(struct quic_cong *cong, u32 state)
+{
+	if (state <= QUIC_CONG_CONGESTION_AVOIDANCE)
+		cong->state = state;
+}
+
+/* only used with an on_ack_recv op, otherwise the pacing rate is derived from cwnd */
+__bpf_kfunc void bpf_quic_cong_set_pacing_rate(struct quic_cong *cong, u32 rate)
+{
+	WRITE_ONCE(cong->pacing_rate, rate);
+}
+
+/* private storage for the algorithm, cleared before on_init */
+__bpf_kfunc u8 *bpf_quic_cong_priv(struct quic_cong *cong, const int rdwr_buf_size)
+{
+	if (rdwr_buf_size <= 0 || rdwr_buf_size > sizeof(cong->priv))
+		return NULL;
+	return (u8 *)cong->priv;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(bpf_quic_cong_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_quic_cong_smoothed_rtt, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_latest_rtt, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_min_rtt, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_window, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_mss, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_pacing_rate, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_delivery_rate, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_set_window, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_set_ssthresh, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_set_state, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_set_pacing_rate, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_quic_cong_priv, KF_TRUSTED_ARGS | KF_RET_NULL)
+BTF_KFUNCS_END(bpf_quic_cong_kfunc_ids)
+
+static const struct btf_kfunc_id_set bpf_quic_cong_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &bpf_quic_cong_kfunc_ids,
+};
+
+static const struct bpf_func_proto *
+bpf_quic_cong_get_func_proto(enum bpf_func_id func_id, const struct bpf_prog *prog)
+{
+	return bpf_base_func_proto(func_id, prog);
+}
+
+/* struct quic_cong is read-only to programs, it is updated through the kfuncs above */
+static bool bpf_quic_cong_is_valid_access(int off, int size, enum bpf_access_type type,
+					  const struct bpf_prog *prog,
+					  struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_verifier_ops bpf_quic_cong_verifier_ops = {
+	.get_func_proto		= bpf_quic_cong_get_func_proto,
+	.is_valid_access	= bpf_quic_cong_is_valid_access,
+};
+
+static int bpf_quic_cong_init(struct btf *btf)
+{
+	return 0;
+}
+
+static int bpf_quic_cong_init_member(const struct btf_type *t, const struct btf_member *member,
+				     void *kdata, const void *udata)
+{
+	const struct quic_cong_ops *uops = udata;
+	struct quic_cong_ops *ops = kdata;
+	u32 moff;
+
+	moff = __btf_member_bit_offset(t, member) / 8;
+	if (moff != offsetof(struct quic_cong_ops, name))
+		return 0;
+
+	if (!uops->name[0] || strnlen(uops->name, QUIC_CONG_NAME_MAX) == QUIC_CONG_NAME_MAX)
+		return -EINVAL;
+	strscpy(ops->name, uops->name, QUIC_CONG_NAME_MAX);
+	return 1;
+}
+
+static int bpf_quic_cong_validate(void *kdata)
+{
+	return quic_cong_validate(kdata);
+}
+
+static int bpf_quic_cong_reg(void *kdata, struct bpf_link *link)
+{
+	return quic_cong_register(kdata);
+}
+
+static void bpf_quic_cong_unreg(void *kdata, struct bpf_link *link)
+{
+	quic_cong_unregister(kdata);
+}
+
+/* CFI stubs */
+static void bpf_quic_cong_on_packet_acked(struct quic_cong *cong, u32 time, u32 bytes,
+					  s64 number)
+{
+}
+
+static void bpf_quic_cong_on_packet_lost(struct quic_cong *cong, u32 time, u32 bytes,
+					 s64 number)
+{
+}
+
+static void bpf_quic_cong_on_process_ecn(struct quic_cong *cong)
+{
+}
+
+static void bpf_quic_cong_on_init(struct quic_cong *cong)
+{
+}
+
+static void bpf_quic_cong_on_packet_sent(struct quic_cong *cong, u32 time, u32 bytes,
+					 s64 number)
+{
+}
+
+static void bpf_quic_cong_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 max_rate)
+{
+}
+
+static void bpf_quic_cong_on_rtt_update(struct quic_cong *cong)
+{
+}
+
+static void bpf_quic_cong_on_release(struct quic_cong *cong)
+{
+}
+
+static struct quic_cong_ops __bpf_ops_quic_cong_ops = {
+	.on_packet_acked	= bpf_quic_cong_on_packet_acked,
+	.on_packet_lost		= bpf_quic_cong_on_packet_lost,
+	.on_process_ecn		= bpf_quic_cong_on_process_ecn,
+	.on_init		= bpf_quic_cong_on_init,
+	.on_packet_sent		= bpf_quic_cong_on_packet_sent,
+	.on_ack_recv		= bpf_quic_cong_on_ack_recv,
+	.on_rtt_update		= bpf_quic_cong_on_rtt_update,
+	.on_release		= bpf_quic_cong_on_release,
+};
+
+static struct bpf_struct_ops bpf_quic_cong_ops = {
+	.verifier_ops	= &bpf_quic_cong_verifier_ops,
+	.init		= bpf_quic_cong_init,
+	.init_member	= bpf_quic_cong_init_member,
+	.validate	= bpf_quic_cong_validate,
+	.reg		= bpf_quic_cong_reg,
+	.unreg		= bpf_quic_cong_unreg,
+	.name		= "quic_cong_ops",
+	.cfi_stubs	= &__bpf_ops_quic_cong_ops,
+	.owner		= THIS_MODULE,
+};
+
+int quic_bpf_cong_init(void)
+{
+	int err;
+
+	err = register_btf_kfunc_id_set(BPF_PROG_TYPE_STRUCT_OPS, &bpf_quic_cong_kfunc_set);
+	if (err)
+		return err;
+
+	return register_bpf_struct_ops(&bpf_quic_cong_ops, quic_cong_ops);
+}
+
+#endif /* QUIC_CONG_BPF */
@@ -10,6 +10,11 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <linux/sizes.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+
 #include "common.h"
 
 static struct quic_hash_table quic_hash_tables[QUIC_HT_MAX_TABLES];
@@ -18,6 +23,19 @@ struct quic_hash_head *quic_sock_hash(u32 hash)
 {
 	return &quic_hash_tables[QUIC_HT_SOCK].hash[hash];
 }
+EXPORT_SYMBOL_GPL(quic_sock_hash);
+
+/* the slot of a sock hash head, as the nulls value of its chain */
+u32 quic_sock_hash_slot(struct quic_hash_head *head)
+{
+	return head - quic_hash_tables[QUIC_HT_SOCK].hash;
+}
+
+u32 quic_sock_hash_size(void)
+{
+	return quic_hash_tables[QUIC_HT_SOCK].size;
+}
+EXPORT_SYMBOL_GPL(quic_sock_hash_size);
 
 struct quic_hash_head *quic_sock_head(struct net *net, union quic_addr *s, union quic_addr *d)
 {
@@ -40,11 +58,11 @@ struct quic_hash_head *quic_bind_port_head(struct net *net, u16 port)
 	return &ht->hash[port & (ht->size - 1)];
 }
 
-struct quic_hash_head *quic_source_conn_id_head(struct net *net, u8 *scid)
+struct quic_hash_head *quic_listen_alpn_head(struct net *net, u16 port, u8 *alpn, u32 len)
 {
-	struct quic_hash_table *ht = &quic_hash_tables[QUIC_HT_CONNECTION_ID];
+	struct quic_hash_table *ht = &quic_hash_tables[QUIC_HT_LISTEN_ALPN];
 
-	return &ht->hash[jhash(scid, 4, 0) & (ht->size - 1)];
+	return &ht->hash[jhash(alpn, len, port ^ net_hash_mix(net)) & (ht->size - 1)];
 }
 
 struct quic_hash_head *quic_udp_sock_head(struct net *net, u16 port)
@@ -56,7 +74,7 @@ struct quic_hash_head *quic_udp_sock_head(struct net *net, u16 port)
 
 struct quic_hash_head *quic_stream_head(struct quic_hash_table *ht, s64 stream_id)
 {
-	return &ht->hash[stream_id & (ht->size - 1)];
+	return &ht->hash[hash_64(stream_id, ilog2(ht->size))];
 }
 
 void quic_hash_tables_destroy(void)
@@ -66,11 +84,29 @@ void quic_hash_tables_destroy(void)
 
 	for (table = 0; table < QUIC_HT_MAX_TABLES; table++) {
 		ht = &quic_hash_tables[table];
-		ht->size = 64;
-		kfree(ht->hash);
+		kvfree(ht->hash);
+		ht->hash = NULL;
 	}
 }
 
+#define QUIC_HT_MIN_SIZE	64
+#define QUIC_HT_MAX_SIZE	(64 * 1024)
+
+/* The sock, bind port and listen ALPN tables are sized from the memory size at load, like the SCTP
+ * ones, a bucket for each 64 KB, as they can not be resized under the lockless lookup.
+ */
+static int quic_hash_table_size(int table)
+{
+	unsigned long size;
+
+	if (table == QUIC_HT_UDP_SOCK)
+		return QUIC_HT_MIN_SIZE;
+
+	size = totalram_pages() / max(SZ_64K / PAGE_SIZE, 1UL);
+	size = clamp_t(unsigned long, size, QUIC_HT_MIN_SIZE, QUIC_HT_MAX_SIZE);
+	return (int)rounddown_pow_of_two(size);
+}
+
 int quic_hash_tables_init(void)
 {
 	struct quic_hash_head *head;
@@ -79,14 +115,18 @@ int quic_hash_tables_init(void)
 
 	for (table = 0; table < QUIC_HT_MAX_TABLES; table++) {
 		ht = &quic_hash_tables[table];
-		ht->size = 64;
-		head = kmalloc_array(ht->size, sizeof(*head), GFP_KERNEL);
+		ht->size = quic_hash_table_size(table);
+		head = kvmalloc_array(ht->size, sizeof(*head), GFP_KERNEL);
 		if (!head) {
 			quic_hash_tables_destroy();
 			return -ENOMEM;
 		}
 		for (i = 0; i < ht->size; i++) {
 			spin_lock_init(&head[i].lock);
+			if (table == QUIC_HT_SOCK) {
+				INIT_HLIST_NULLS_HEAD(&head[i].nulls_head, i);
+				continue;
+			}
 			INIT_HLIST_HEAD(&head[i].head);
 		}
 		ht->hash = head;
@@ -239,7 +279,7 @@ u8 *quic_put_data(u8 *p, u8 *data, u32 len)
 	return p + len;
 }
 
-u8 *quic_put_param(u8 *p, u16 id, u64 value)
+u8 *quic_put_param(u8 *p, u64 id, u64 value)
 {
 	p = quic_put_var(p, id);
 	p = quic_put_var(p, quic_var_len(value));
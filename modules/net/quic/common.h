@@ -8,6 +8,8 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <linux/rhashtable-types.h>
+#include <linux/list_nulls.h>
 #include <net/netns/hash.h>
 #include <linux/jhash.h>
 
@@ -54,8 +56,9 @@ struct quic_crypto_cb {
 	u8 key_phase:1;
 	u8 backlog:1;
 	u8 resume:1;
-	u8 path:1;
+	u8 path:2;
 	u8 ecn:2;
+	u8 hp_batch:1;
 };
 
 #define QUIC_CRYPTO_CB(skb)	((struct quic_crypto_cb *)&((skb)->cb[0]))
@@ -117,8 +120,11 @@ static inline union quic_addr *quic_addr(const void *addr)
 }
 
 struct quic_hash_head {
-	spinlock_t		lock; /* protect the 'head' member access */
-	struct hlist_head	head;
+	spinlock_t		lock; /* protect the 'head' member updates */
+	union {
+		struct hlist_head	head;
+		struct hlist_nulls_head	nulls_head; /* QUIC_HT_SOCK, the nulls value is the slot */
+	};
 };
 
 struct quic_hash_table {
@@ -129,8 +135,8 @@ struct quic_hash_table {
 enum  {
 	QUIC_HT_SOCK,
 	QUIC_HT_UDP_SOCK,
-	QUIC_HT_CONNECTION_ID,
 	QUIC_HT_BIND_PORT,
+	QUIC_HT_LISTEN_ALPN,
 	QUIC_HT_MAX_TABLES,
 };
 
@@ -192,12 +198,14 @@ static inline void quic_data_free(struct quic_data *d)
 struct quic_hash_head *quic_sock_head(struct net *net, union quic_addr *s, union quic_addr *d);
 struct quic_hash_head *quic_listen_sock_head(struct net *net, u16 port);
 struct quic_hash_head *quic_bind_port_head(struct net *net, u16 port);
+struct quic_hash_head *quic_listen_alpn_head(struct net *net, u16 port, u8 *alpn, u32 len);
 
 struct quic_hash_head *quic_stream_head(struct quic_hash_table *ht, s64 stream_id);
-struct quic_hash_head *quic_source_conn_id_head(struct net *net, u8 *scid);
 struct quic_hash_head *quic_udp_sock_head(struct net *net, u16 port);
 
 struct quic_hash_head *quic_sock_hash(u32 hash);
+u32 quic_sock_hash_slot(struct quic_hash_head *head);
+u32 quic_sock_hash_size(void);
 void quic_hash_tables_destroy(void);
 int quic_hash_tables_init(void);
 
@@ -206,7 +214,7 @@ s64 quic_get_num(s64 max_pkt_num, s64 pkt_num, u32 n);
 int quic_get_param(u64 *pdest, u8 **pp, u32 *plen);
 u8 quic_get_var(u8 **pp, u32 *plen, u64 *val);
 
-u8 *quic_put_param(u8 *p, u16 id, u64 value);
+u8 *quic_put_param(u8 *p, u64 id, u64 value);
 u8 *quic_put_data(u8 *p, u8 *data, u32 len);
 u8 *quic_put_int(u8 *p, u64 num, u8 len);
 u8 *quic_put_var(u8 *p, u64 num);
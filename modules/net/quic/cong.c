@@ -11,32 +11,16 @@
  */
 
 #include <uapi/linux/quic.h>
+#include <linux/win_minmax.h>
+#include <linux/version.h>
 #include <linux/jiffies.h>
+#include <linux/bpf.h>
 #include <net/sock.h>
 
 #include "common.h"
 #include "cong.h"
 
-/* CUBIC APIs */
-struct quic_cubic {
-	u32 pending_w_add;
-	u32 origin_point;
-	u32 epoch_start;
-	u32 pending_add;
-	u32 w_last_max;
-	u32 w_tcp;
-	u64 k;
-
-	/* HyStart++ variables */
-	u32 current_round_min_rtt;
-	u32 css_baseline_min_rtt;
-	u32 last_round_min_rtt;
-	u16 rtt_sample_count;
-	u16 css_rounds;
-	s64 window_end;
-};
-
-/* HyStart++ constants */
+/* HyStart++ APIs */
 #define QUIC_HS_MIN_SSTHRESH		16
 #define QUIC_HS_N_RTT_SAMPLE		8
 #define QUIC_HS_MIN_ETA			4000
@@ -45,63 +29,141 @@ struct quic_cubic {
 #define QUIC_HS_CSS_GROWTH_DIVISOR	4
 #define QUIC_HS_CSS_ROUNDS		5
 
-static u64 cubic_root(u64 n)
+static void quic_hystart_init(struct quic_cong *cong)
 {
-	u64 a, d;
-
-	if (!n)
-		return 0;
-
-	d = (64 - __builtin_clzll(n)) / 3;
-	a = 1ULL << (d + 1);
-
-	for (; a * a * a > n;) {
-		d = div64_ul(n, a * a);
-		a = div64_ul(2 * a + d, 3);
-	}
-	return a;
+	struct quic_hystart *hs = &cong->hystart;
+
+	hs->current_round_min_rtt = U32_MAX;
+	hs->css_baseline_min_rtt = U32_MAX;
+	hs->last_round_min_rtt = U32_MAX;
+	hs->rtt_sample_count = 0;
+	hs->window_end = -1;
+	hs->css_rounds = 0;
 }
 
-static void cubic_slow_start(struct quic_cong *cong, u32 bytes, s64 number)
+/* grow cwnd in slow start, and return true once CSS is done and cwnd is the new ssthresh */
+static bool quic_hystart_slow_start(struct quic_cong *cong, u32 bytes, s64 number)
 {
-	struct quic_cubic *cubic = quic_cong_priv(cong);
+	struct quic_hystart *hs = &cong->hystart;
+	bool round_end = false;
 	u32 eta;
 
-	if (cubic->window_end <= number)
-		cubic->window_end = -1;
+	if (hs->disabled) {
+		cong->window = min_t(u32, cong->window + bytes, cong->max_window);
+		return false;
+	}
+
+	if (hs->window_end <= number) {
+		round_end = (hs->window_end != -1);
+		hs->window_end = -1;
+	}
 
-	if (cubic->css_baseline_min_rtt != U32_MAX)
+	if (hs->css_baseline_min_rtt != U32_MAX)
 		bytes = bytes / QUIC_HS_CSS_GROWTH_DIVISOR;
 	cong->window = min_t(u32, cong->window + bytes, cong->max_window);
 
-	if (cubic->css_baseline_min_rtt != U32_MAX) {
+	if (hs->css_baseline_min_rtt != U32_MAX) {
 		/* If CSS_ROUNDS rounds are complete, enter congestion avoidance */
-		if (++cubic->css_rounds > QUIC_HS_CSS_ROUNDS) {
-			cubic->css_baseline_min_rtt = U32_MAX;
-			cubic->w_last_max = cong->window;
+		if (round_end && ++hs->css_rounds >= QUIC_HS_CSS_ROUNDS) {
+			pr_debug("%s: css -> cong_avoid, cwnd: %u\n", __func__, cong->window);
+			hs->css_baseline_min_rtt = U32_MAX;
+			hs->css_rounds = 0;
 			cong->ssthresh = cong->window;
-			cubic->css_rounds = 0;
+			return true;
 		}
-		return;
+		return false;
 	}
 
-	if (cubic->last_round_min_rtt != U32_MAX &&
-	    cubic->current_round_min_rtt != U32_MAX &&
+	if (hs->last_round_min_rtt != U32_MAX &&
+	    hs->current_round_min_rtt != U32_MAX &&
 	    cong->window >= QUIC_HS_MIN_SSTHRESH * cong->mss &&
-	    cubic->rtt_sample_count >= QUIC_HS_N_RTT_SAMPLE) {
-		eta = cubic->last_round_min_rtt / QUIC_HS_MIN_RTT_DIVISOR;
+	    hs->rtt_sample_count >= QUIC_HS_N_RTT_SAMPLE) {
+		eta = hs->last_round_min_rtt / QUIC_HS_MIN_RTT_DIVISOR;
 		if (eta < QUIC_HS_MIN_ETA)
 			eta = QUIC_HS_MIN_ETA;
 		else if (eta > QUIC_HS_MAX_ETA)
 			eta = QUIC_HS_MAX_ETA;
 
 		pr_debug("%s: current_round_min_rtt: %u, last_round_min_rtt: %u, eta: %u\n",
-			 __func__, cubic->current_round_min_rtt, cubic->last_round_min_rtt, eta);
+			 __func__, hs->current_round_min_rtt, hs->last_round_min_rtt, eta);
 
 		/* delay increase triggers slow start exit and enter CSS */
-		if (cubic->current_round_min_rtt >= cubic->last_round_min_rtt + eta)
-			cubic->css_baseline_min_rtt = cubic->current_round_min_rtt;
+		if (hs->current_round_min_rtt >= hs->last_round_min_rtt + eta)
+			hs->css_baseline_min_rtt = hs->current_round_min_rtt;
 	}
+	return false;
+}
+
+static void quic_hystart_on_packet_sent(struct quic_cong *cong, u32 time, u32 bytes, s64 number)
+{
+	struct quic_hystart *hs = &cong->hystart;
+
+	if (hs->window_end != -1)
+		return;
+
+	hs->window_end = number;
+	hs->last_round_min_rtt = hs->current_round_min_rtt;
+	hs->current_round_min_rtt = U32_MAX;
+	hs->rtt_sample_count = 0;
+
+	pr_debug("%s: last_round_min_rtt: %u\n", __func__, hs->last_round_min_rtt);
+}
+
+static void quic_hystart_on_rtt_update(struct quic_cong *cong)
+{
+	struct quic_hystart *hs = &cong->hystart;
+
+	if (hs->window_end == -1)
+		return;
+
+	pr_debug("%s: current_round_min_rtt: %u, latest_rtt: %u\n",
+		 __func__, hs->current_round_min_rtt, cong->latest_rtt);
+
+	if (hs->current_round_min_rtt > cong->latest_rtt) {
+		hs->current_round_min_rtt = cong->latest_rtt;
+		/* a lower rtt means the delay increase was spurious: back to slow start */
+		if (hs->current_round_min_rtt < hs->css_baseline_min_rtt) {
+			hs->css_baseline_min_rtt = U32_MAX;
+			hs->css_rounds = 0;
+		}
+	}
+	hs->rtt_sample_count++;
+}
+
+/* CUBIC APIs */
+struct quic_cubic {
+	u32 pending_w_add;
+	u32 origin_point;
+	u32 epoch_start;
+	u32 pending_add;
+	u32 w_last_max;
+	u32 w_tcp;
+	u64 k;
+};
+
+static u64 cubic_root(u64 n)
+{
+	u64 a, d;
+
+	if (!n)
+		return 0;
+
+	d = (64 - __builtin_clzll(n)) / 3;
+	a = 1ULL << (d + 1);
+
+	for (; a * a * a > n;) {
+		d = div64_ul(n, a * a);
+		a = div64_ul(2 * a + d, 3);
+	}
+	return a;
+}
+
+static void cubic_slow_start(struct quic_cong *cong, u32 bytes, s64 number)
+{
+	struct quic_cubic *cubic = quic_cong_priv(cong);
+
+	if (quic_hystart_slow_start(cong, bytes, number))
+		cubic->w_last_max = cong->window;
 }
 
 static void cubic_cong_avoid(struct quic_cong *cong, u32 bytes)
@@ -325,47 +387,7 @@ static void quic_cubic_on_init(struct quic_cong *cong)
 	cubic->w_tcp = 0;
 	cubic->k = 0;
 
-	cubic->current_round_min_rtt = U32_MAX;
-	cubic->css_baseline_min_rtt = U32_MAX;
-	cubic->last_round_min_rtt = U32_MAX;
-	cubic->rtt_sample_count = 0;
-	cubic->window_end = -1;
-	cubic->css_rounds = 0;
-}
-
-static void quic_cubic_on_packet_sent(struct quic_cong *cong, u32 time, u32 bytes, s64 number)
-{
-	struct quic_cubic *cubic = quic_cong_priv(cong);
-
-	if (cubic->window_end != -1)
-		return;
-
-	cubic->window_end = number;
-	cubic->last_round_min_rtt = cubic->current_round_min_rtt;
-	cubic->current_round_min_rtt = U32_MAX;
-	cubic->rtt_sample_count = 0;
-
-	pr_debug("%s: last_round_min_rtt: %u\n", __func__, cubic->last_round_min_rtt);
-}
-
-static void quic_cubic_on_rtt_update(struct quic_cong *cong)
-{
-	struct quic_cubic *cubic = quic_cong_priv(cong);
-
-	if (cubic->window_end == -1)
-		return;
-
-	pr_debug("%s: current_round_min_rtt: %u, latest_rtt: %u\n",
-		 __func__, cubic->current_round_min_rtt, cong->latest_rtt);
-
-	if (cubic->current_round_min_rtt > cong->latest_rtt) {
-		cubic->current_round_min_rtt = cong->latest_rtt;
-		if (cubic->current_round_min_rtt < cubic->css_baseline_min_rtt) {
-			cubic->css_baseline_min_rtt = U32_MAX;
-			cubic->css_rounds = 0;
-		}
-	}
-	cubic->rtt_sample_count++;
+	quic_hystart_init(cong);
 }
 
 /* NEW RENO APIs */
@@ -411,7 +433,7 @@ static void quic_reno_on_packet_acked(struct quic_cong *cong, u32 time, u32 byte
 {
 	switch (cong->state) {
 	case QUIC_CONG_SLOW_START:
-		cong->window = min_t(u32, cong->window + bytes, cong->max_window);
+		quic_hystart_slow_start(cong, bytes, number);
 		if (cong->window >= cong->ssthresh) {
 			cong->state = QUIC_CONG_CONGESTION_AVOIDANCE;
 			pr_debug("%s: slow_start -> cong_avoid, cwnd: %u, ssthresh: %u\n",
@@ -460,25 +482,465 @@ static void quic_reno_on_process_ecn(struct quic_cong *cong)
 
 static void quic_reno_on_init(struct quic_cong *cong)
 {
+	quic_hystart_init(cong);
+}
+
+/* BBR APIs */
+struct quic_bbr {
+	struct minmax max_bw;		/* windowed max delivery rate in bytes per second */
+	u64 next_round_delivered;	/* cong->delivered that ends the current round */
+	u32 round_count;
+	u32 round_lost;			/* bytes lost in the current round */
+	u32 min_rtt;
+	u32 min_rtt_stamp;
+	u32 probe_rtt_done_stamp;
+	u32 cycle_stamp;
+	u32 prior_cwnd;
+	u32 full_bw;
+	u16 pacing_gain;
+	u16 cwnd_gain;
+	u8  mode;
+	u8  cycle_idx;
+	u8  full_bw_count;
+	u8  full_bw_reached:1;
+	u8  round_start:1;
+	u8  probe_rtt_round_done:1;
+	u8  rtt_sampled:1;
+};
+
+enum quic_bbr_mode {
+	QUIC_BBR_STARTUP,
+	QUIC_BBR_DRAIN,
+	QUIC_BBR_PROBE_BW,
+	QUIC_BBR_PROBE_RTT,
+};
+
+/* BBR constants, gains in 1/QUIC_BBR_UNIT */
+#define QUIC_BBR_SCALE			8
+#define QUIC_BBR_UNIT			(1 << QUIC_BBR_SCALE)
+#define QUIC_BBR_STARTUP_GAIN		(QUIC_BBR_UNIT * 277 / 100)	/* 2.77 as in BBRv3 */
+#define QUIC_BBR_DRAIN_GAIN		(QUIC_BBR_UNIT * 35 / 100)	/* 1 / 2.77 */
+#define QUIC_BBR_CWND_GAIN		(QUIC_BBR_UNIT * 2)
+#define QUIC_BBR_PROBE_RTT_GAIN		(QUIC_BBR_UNIT / 2)		/* cwnd of BDP / 2 */
+#define QUIC_BBR_FULL_BW_THRESH		(QUIC_BBR_UNIT * 5 / 4)
+#define QUIC_BBR_FULL_BW_COUNT		3
+#define QUIC_BBR_BW_RTTS		10
+#define QUIC_BBR_CYCLE_LEN		8
+#define QUIC_BBR_PROBE_RTT_INTERVAL	5000000U
+#define QUIC_BBR_PROBE_RTT_TIME		200000U
+#define QUIC_BBR_LOSS_THRESH		50	/* over 1/50 loss in a round ends STARTUP */
+#define QUIC_BBR_MIN_CWND		4	/* in packets */
+#define QUIC_BBR_PACING_MARGIN		1	/* pace at 1% below the estimated bw */
+
+static const u16 quic_bbr_pacing_gain[QUIC_BBR_CYCLE_LEN] = {
+	QUIC_BBR_UNIT * 5 / 4,	/* probe for more available bw */
+	QUIC_BBR_UNIT * 3 / 4,	/* drain the queue created by probing */
+	QUIC_BBR_UNIT, QUIC_BBR_UNIT, QUIC_BBR_UNIT,
+	QUIC_BBR_UNIT, QUIC_BBR_UNIT, QUIC_BBR_UNIT,
+};
+
+static u32 bbr_max_bw(struct quic_bbr *bbr)
+{
+	return minmax_get(&bbr->max_bw);
+}
+
+/* gain * estimated bandwidth-delay product, in bytes */
+static u32 bbr_bdp(struct quic_cong *cong, u32 gain)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u64 bdp;
+
+	if (bbr->min_rtt == U32_MAX || !bbr_max_bw(bbr))
+		return cong->min_window;
+
+	bdp = div64_ul((u64)bbr_max_bw(bbr) * bbr->min_rtt, USEC_PER_SEC);
+	return (u32)min_t(u64, (bdp * gain) >> QUIC_BBR_SCALE, U32_MAX);
+}
+
+static u32 bbr_probe_rtt_cwnd(struct quic_cong *cong)
+{
+	return max(bbr_bdp(cong, QUIC_BBR_PROBE_RTT_GAIN), QUIC_BBR_MIN_CWND * cong->mss);
+}
+
+static void bbr_enter_startup(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+
+	bbr->mode = QUIC_BBR_STARTUP;
+	bbr->pacing_gain = QUIC_BBR_STARTUP_GAIN;
+	bbr->cwnd_gain = QUIC_BBR_CWND_GAIN;
+	cong->state = QUIC_CONG_SLOW_START;
+}
+
+static void bbr_enter_probe_bw(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+
+	bbr->mode = QUIC_BBR_PROBE_BW;
+	bbr->cwnd_gain = QUIC_BBR_CWND_GAIN;
+	/* start at a random cruising phase, so that flows do not probe in sync */
+	bbr->cycle_idx = 2 + cong->time % (QUIC_BBR_CYCLE_LEN - 2);
+	bbr->pacing_gain = quic_bbr_pacing_gain[bbr->cycle_idx];
+	bbr->cycle_stamp = cong->time;
+	cong->state = QUIC_CONG_CONGESTION_AVOIDANCE;
+}
+
+/* a round trip ends when a packet sent after the start of the round is acked */
+static void bbr_update_round(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u64 delivered;
+
+	bbr->round_start = 0;
+	if (!cong->rs.acked || cong->rs.prior_delivered < bbr->next_round_delivered)
+		return;
+
+	/* BBRv2: leave STARTUP also if the loss in the last round is too high */
+	delivered = cong->delivered - bbr->next_round_delivered;
+	if (bbr->mode == QUIC_BBR_STARTUP && bbr->round_lost &&
+	    (u64)bbr->round_lost * QUIC_BBR_LOSS_THRESH > delivered) {
+		pr_debug("%s: startup -> drain on loss, lost: %u, delivered: %llu\n",
+			 __func__, bbr->round_lost, delivered);
+		bbr->full_bw_reached = 1;
+	}
+
+	bbr->next_round_delivered = cong->delivered;
+	bbr->round_lost = 0;
+	bbr->round_count++;
+	bbr->round_start = 1;
+}
+
+static void bbr_update_bw(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	struct quic_cong_rate_sample *rs = &cong->rs;
+
+	if (!rs->rate)
+		return;
+
+	/* app-limited samples only count if they show a higher bw */
+	if (!rs->app_limited || rs->rate >= bbr_max_bw(bbr))
+		minmax_running_max(&bbr->max_bw, QUIC_BBR_BW_RTTS, bbr->round_count, rs->rate);
+}
+
+static void bbr_update_cycle(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u32 inflight = cong->rs.inflight;
+	bool elapsed, next;
+
+	if (bbr->mode != QUIC_BBR_PROBE_BW)
+		return;
+
+	elapsed = cong->time - bbr->cycle_stamp > bbr->min_rtt;
+	if (bbr->pacing_gain == QUIC_BBR_UNIT)
+		next = elapsed;
+	else if (bbr->pacing_gain > QUIC_BBR_UNIT)
+		next = elapsed && (bbr->round_lost || inflight >= bbr_bdp(cong, bbr->pacing_gain));
+	else
+		next = elapsed || inflight <= bbr_bdp(cong, QUIC_BBR_UNIT);
+	if (!next)
+		return;
+
+	bbr->cycle_idx = (bbr->cycle_idx + 1) % QUIC_BBR_CYCLE_LEN;
+	bbr->pacing_gain = quic_bbr_pacing_gain[bbr->cycle_idx];
+	bbr->cycle_stamp = cong->time;
+}
+
+/* the pipe is full once bw stops growing by 25% for 3 rounds in STARTUP */
+static void bbr_check_full_bw(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u32 bw = bbr_max_bw(bbr);
+
+	if (bbr->full_bw_reached || !bbr->round_start || cong->rs.app_limited)
+		return;
+
+	if ((u64)bw >= ((u64)bbr->full_bw * QUIC_BBR_FULL_BW_THRESH) >> QUIC_BBR_SCALE) {
+		bbr->full_bw = bw;
+		bbr->full_bw_count = 0;
+		return;
+	}
+	if (++bbr->full_bw_count >= QUIC_BBR_FULL_BW_COUNT)
+		bbr->full_bw_reached = 1;
+}
+
+static void bbr_check_drain(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+
+	if (bbr->mode == QUIC_BBR_STARTUP && bbr->full_bw_reached) {
+		pr_debug("%s: startup -> drain, bw: %u, cwnd: %u\n",
+			 __func__, bbr_max_bw(bbr), cong->window);
+		bbr->mode = QUIC_BBR_DRAIN;
+		bbr->pacing_gain = QUIC_BBR_DRAIN_GAIN;
+		bbr->cwnd_gain = QUIC_BBR_CWND_GAIN;
+		cong->state = QUIC_CONG_CONGESTION_AVOIDANCE;
+	}
+	if (bbr->mode == QUIC_BBR_DRAIN && cong->rs.inflight <= bbr_bdp(cong, QUIC_BBR_UNIT)) {
+		pr_debug("%s: drain -> probe_bw, inflight: %u\n", __func__, cong->rs.inflight);
+		bbr_enter_probe_bw(cong);
+	}
+}
+
+/* refresh min_rtt every QUIC_BBR_PROBE_RTT_INTERVAL by draining the queue in PROBE_RTT */
+static void bbr_update_min_rtt(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	bool expired;
+
+	if (bbr->min_rtt == U32_MAX && cong->min_rtt_valid) {
+		bbr->min_rtt = cong->min_rtt;
+		bbr->min_rtt_stamp = cong->time;
+	}
+
+	expired = bbr->min_rtt != U32_MAX &&
+		  cong->time - bbr->min_rtt_stamp > QUIC_BBR_PROBE_RTT_INTERVAL;
+	if (bbr->rtt_sampled && (cong->latest_rtt <= bbr->min_rtt || expired)) {
+		bbr->min_rtt = cong->latest_rtt;
+		bbr->min_rtt_stamp = cong->time;
+	}
+	bbr->rtt_sampled = 0;
+
+	if (expired && bbr->mode != QUIC_BBR_PROBE_RTT) {
+		pr_debug("%s: -> probe_rtt, min_rtt: %u, cwnd: %u\n",
+			 __func__, bbr->min_rtt, cong->window);
+		bbr->mode = QUIC_BBR_PROBE_RTT;
+		bbr->pacing_gain = QUIC_BBR_UNIT;
+		bbr->prior_cwnd = cong->window;
+		bbr->probe_rtt_done_stamp = 0;
+	}
+
+	if (bbr->mode != QUIC_BBR_PROBE_RTT)
+		return;
+
+	if (!bbr->probe_rtt_done_stamp) {
+		if (cong->rs.inflight > bbr_probe_rtt_cwnd(cong))
+			return;
+		/* stay for at least QUIC_BBR_PROBE_RTT_TIME and one round */
+		bbr->probe_rtt_done_stamp = cong->time + QUIC_BBR_PROBE_RTT_TIME;
+		bbr->probe_rtt_round_done = 0;
+		bbr->next_round_delivered = cong->delivered;
+		return;
+	}
+	if (bbr->round_start)
+		bbr->probe_rtt_round_done = 1;
+	if (!bbr->probe_rtt_round_done || (s32)(cong->time - bbr->probe_rtt_done_stamp) < 0)
+		return;
+
+	bbr->min_rtt_stamp = cong->time;
+	cong->window = max(cong->window, bbr->prior_cwnd);
+	if (bbr->full_bw_reached)
+		bbr_enter_probe_bw(cong);
+	else
+		bbr_enter_startup(cong);
+}
+
+static void bbr_set_pacing_rate(struct quic_cong *cong, u32 max_rate)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u64 rate = bbr_max_bw(bbr);
+
+	if (!rate) { /* no bw sample yet: use cwnd / srtt */
+		rate = (u64)cong->window * USEC_PER_SEC;
+		if (likely(cong->smoothed_rtt))
+			rate = div64_ul(rate, cong->smoothed_rtt);
+	}
+	rate = (rate * bbr->pacing_gain) >> QUIC_BBR_SCALE;
+	rate = div64_ul(rate * (100 - QUIC_BBR_PACING_MARGIN), 100);
+	rate = min_t(u64, rate, max_rate);
+
+	/* only speed up until the pipe is found full */
+	if (bbr->full_bw_reached || rate > cong->pacing_rate)
+		WRITE_ONCE(cong->pacing_rate, rate);
+}
+
+static void bbr_set_cwnd(struct quic_cong *cong, u32 bytes)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u32 target;
+
+	/* plus some room for ACK aggregation and delayed ACKs */
+	target = bbr_bdp(cong, bbr->cwnd_gain) + 3 * cong->mss;
+	if (bbr->full_bw_reached)
+		cong->window = min(cong->window + bytes, target);
+	else if (cong->window < target)
+		cong->window += bytes;
+
+	cong->window = max(cong->window, QUIC_BBR_MIN_CWND * cong->mss);
+	if (bbr->mode == QUIC_BBR_PROBE_RTT)
+		cong->window = min(cong->window, bbr_probe_rtt_cwnd(cong));
+	cong->window = min(cong->window, cong->max_window);
+}
+
+static void quic_bbr_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 max_rate)
+{
+	bbr_update_round(cong);
+	bbr_update_bw(cong);
+	bbr_update_cycle(cong);
+	bbr_check_full_bw(cong);
+	bbr_check_drain(cong);
+	bbr_update_min_rtt(cong);
+
+	bbr_set_pacing_rate(cong, max_rate);
+	bbr_set_cwnd(cong, bytes);
+}
+
+static void quic_bbr_on_packet_lost(struct quic_cong *cong, u32 time, u32 bytes, s64 number)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+	u32 time_ssthresh;
+
+	bbr->round_lost += bytes;
+
+	time_ssthresh = cong->smoothed_rtt + max(4 * cong->rttvar, 1000U);
+	time_ssthresh = (time_ssthresh + cong->max_ack_delay) * 3;
+	if (cong->time - time > time_ssthresh) {
+		/* persistent congestion: restart from min_window, the model is kept */
+		pr_debug("%s: permanent congestion, cwnd: %u\n", __func__, cong->window);
+		bbr->prior_cwnd = cong->window;
+		cong->window = cong->min_window;
+	}
+}
+
+static void quic_bbr_on_packet_acked(struct quic_cong *cong, u32 time, u32 bytes, s64 number)
+{
+	/* cwnd and pacing rate are updated once per ACK in quic_bbr_on_ack_recv() */
+}
+
+static void quic_bbr_on_process_ecn(struct quic_cong *cong)
+{
+	/* the model is driven by delivery rate and rtt, not by ECN */
+}
+
+static void quic_bbr_on_rtt_update(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+
+	bbr->rtt_sampled = 1;
+}
+
+static void quic_bbr_on_init(struct quic_cong *cong)
+{
+	struct quic_bbr *bbr = quic_cong_priv(cong);
+
+	BUILD_BUG_ON(sizeof(*bbr) > sizeof(cong->priv));
+
+	minmax_reset(&bbr->max_bw, 0, 0);
+	bbr->next_round_delivered = cong->delivered;
+	bbr->round_count = 0;
+	bbr->round_lost = 0;
+	bbr->min_rtt = U32_MAX;
+	bbr->min_rtt_stamp = 0;
+	bbr->probe_rtt_done_stamp = 0;
+	bbr->cycle_stamp = 0;
+	bbr->prior_cwnd = 0;
+	bbr->full_bw = 0;
+	bbr->full_bw_count = 0;
+	bbr->full_bw_reached = 0;
+	bbr->round_start = 0;
+	bbr->probe_rtt_round_done = 0;
+	bbr->rtt_sampled = 0;
+	bbr->cycle_idx = 0;
+	bbr_enter_startup(cong);
 }
 
 static struct quic_cong_ops quic_congs[] = {
 	{ /* QUIC_CONG_ALG_RENO */
+		.name = "reno",
 		.on_packet_acked = quic_reno_on_packet_acked,
 		.on_packet_lost = quic_reno_on_packet_lost,
 		.on_process_ecn = quic_reno_on_process_ecn,
 		.on_init = quic_reno_on_init,
+		.on_packet_sent = quic_hystart_on_packet_sent,
+		.on_rtt_update = quic_hystart_on_rtt_update,
 	},
 	{ /* QUIC_CONG_ALG_CUBIC */
+		.name = "cubic",
 		.on_packet_acked = quic_cubic_on_packet_acked,
 		.on_packet_lost = quic_cubic_on_packet_lost,
 		.on_process_ecn = quic_cubic_on_process_ecn,
 		.on_init = quic_cubic_on_init,
-		.on_packet_sent = quic_cubic_on_packet_sent,
-		.on_rtt_update = quic_cubic_on_rtt_update,
+		.on_packet_sent = quic_hystart_on_packet_sent,
+		.on_rtt_update = quic_hystart_on_rtt_update,
+	},
+	{ /* QUIC_CONG_ALG_BBR */
+		.name = "bbr",
+		.on_packet_acked = quic_bbr_on_packet_acked,
+		.on_packet_lost = quic_bbr_on_packet_lost,
+		.on_process_ecn = quic_bbr_on_process_ecn,
+		.on_init = quic_bbr_on_init,
+		.on_ack_recv = quic_bbr_on_ack_recv,
+		.on_rtt_update = quic_bbr_on_rtt_update,
 	},
 };
 
+/* algorithms registered at runtime, e.g. BPF struct_ops, looked up by name */
+static LIST_HEAD(quic_cong_list);
+static DEFINE_SPINLOCK(quic_cong_list_lock);
+
+static struct quic_cong_ops *quic_cong_find(const char *name)
+{
+	struct quic_cong_ops *ops;
+	u8 i;
+
+	for (i = 0; i < QUIC_CONG_ALG_MAX; i++) {
+		if (!strcmp(quic_congs[i].name, name))
+			return &quic_congs[i];
+	}
+	/* callers hold either rcu_read_lock() or quic_cong_list_lock */
+	list_for_each_entry_rcu(ops, &quic_cong_list, list,
+				lockdep_is_held(&quic_cong_list_lock)) {
+		if (!strcmp(ops->name, name))
+			return ops;
+	}
+	return NULL;
+}
+
+int quic_cong_validate(struct quic_cong_ops *ops)
+{
+	if (!ops->on_packet_acked || !ops->on_packet_lost ||
+	    !ops->on_process_ecn || !ops->on_init) {
+		pr_err("%s: %s does not implement required ops\n", __func__, ops->name);
+		return -EINVAL;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_cong_validate);
+
+int quic_cong_register(struct quic_cong_ops *ops)
+{
+	int err;
+
+	err = quic_cong_validate(ops);
+	if (err)
+		return err;
+
+	spin_lock(&quic_cong_list_lock);
+	if (quic_cong_find(ops->name)) {
+		spin_unlock(&quic_cong_list_lock);
+		pr_debug("%s: %s already registered\n", __func__, ops->name);
+		return -EEXIST;
+	}
+	list_add_tail_rcu(&ops->list, &quic_cong_list);
+	spin_unlock(&quic_cong_list_lock);
+
+	pr_debug("%s: %s registered\n", __func__, ops->name);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_cong_register);
+
+/* sockets using ops hold a reference to its owner, so it stays valid for them */
+void quic_cong_unregister(struct quic_cong_ops *ops)
+{
+	spin_lock(&quic_cong_list_lock);
+	list_del_rcu(&ops->list);
+	spin_unlock(&quic_cong_list_lock);
+
+	synchronize_rcu();
+}
+EXPORT_SYMBOL_GPL(quic_cong_unregister);
+
 /* COMMON APIs */
 void quic_cong_on_packet_lost(struct quic_cong *cong, u32 time, u32 bytes, s64 number)
 {
@@ -549,13 +1011,86 @@ void quic_cong_on_packet_sent(struct quic_cong *cong, u32 time, u32 bytes, s64 n
 }
 EXPORT_SYMBOL_GPL(quic_cong_on_packet_sent);
 
-void quic_cong_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 max_rate)
+/* Delivery Rate Estimation */
+void quic_cong_rate_on_sent(struct quic_cong *cong, struct quic_cong_rate_state *st,
+			    u32 time, u32 inflight)
+{
+	if (!inflight) {
+		cong->first_sent_time = time;
+		cong->delivered_time = time;
+	}
+	st->delivered = cong->delivered;
+	st->delivered_time = cong->delivered_time;
+	st->first_sent_time = cong->first_sent_time;
+	st->app_limited = !!cong->app_limited;
+}
+EXPORT_SYMBOL_GPL(quic_cong_rate_on_sent);
+
+void quic_cong_rate_on_acked(struct quic_cong *cong, struct quic_cong_rate_state *st,
+			     u32 sent_time, u32 bytes)
+{
+	struct quic_cong_rate_sample *rs = &cong->rs;
+
+	cong->delivered += bytes;
+	cong->delivered_time = cong->time;
+
+	/* sample from the most recently sent packet of those acked */
+	if (rs->acked && st->delivered <= rs->prior_delivered)
+		return;
+
+	rs->prior_delivered = st->delivered;
+	rs->prior_time = st->delivered_time;
+	rs->app_limited = st->app_limited;
+	rs->send_elapsed = sent_time - st->first_sent_time;
+	rs->ack_elapsed = cong->delivered_time - st->delivered_time;
+	cong->first_sent_time = sent_time;
+	rs->acked = 1;
+}
+EXPORT_SYMBOL_GPL(quic_cong_rate_on_acked);
+
+void quic_cong_rate_check_app_limited(struct quic_cong *cong, u32 inflight)
+{
+	if (inflight >= cong->window)
+		return;
+	/* samples are app-limited until the data in flight now is delivered */
+	cong->app_limited = max_t(u64, cong->delivered + inflight, 1);
+}
+EXPORT_SYMBOL_GPL(quic_cong_rate_check_app_limited);
+
+static void quic_cong_rate_sample(struct quic_cong *cong)
+{
+	struct quic_cong_rate_sample *rs = &cong->rs;
+	u64 rate;
+
+	if (cong->app_limited && cong->delivered > cong->app_limited)
+		cong->app_limited = 0;
+
+	rs->rate = 0;
+	if (!rs->acked)
+		return;
+
+	rs->interval = max(rs->send_elapsed, rs->ack_elapsed);
+	rs->delivered = (u32)(cong->delivered - rs->prior_delivered);
+	/* an interval below min_rtt is likely from ACK compression, not the rate */
+	if (!rs->interval || rs->interval < cong->min_rtt)
+		return;
+
+	rate = div64_ul((u64)rs->delivered * USEC_PER_SEC, rs->interval);
+	rs->rate = (u32)min_t(u64, rate, U32_MAX);
+}
+
+void quic_cong_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 inflight, u32 max_rate)
 {
 	if (!bytes)
 		return;
+
+	cong->rs.inflight = inflight;
+	quic_cong_rate_sample(cong);
 	if (cong->ops->on_ack_recv)
 		cong->ops->on_ack_recv(cong, bytes, max_rate);
-	quic_cong_pace_update(cong, bytes, max_rate);
+	else
+		quic_cong_pace_update(cong, bytes, max_rate);
+	cong->rs.acked = 0;
 }
 EXPORT_SYMBOL_GPL(quic_cong_on_ack_recv);
 
@@ -598,18 +1133,55 @@ void quic_cong_rtt_update(struct quic_cong *cong, u32 time, u32 ack_delay)
 }
 EXPORT_SYMBOL_GPL(quic_cong_rtt_update);
 
-void quic_cong_set_algo(struct quic_cong *cong, u8 algo)
+static void quic_cong_release(struct quic_cong *cong)
 {
-	if (algo >= QUIC_CONG_ALG_MAX)
-		algo = QUIC_CONG_ALG_RENO;
+	struct quic_cong_ops *ops = cong->ops;
 
+	if (!ops)
+		return;
+	if (ops->on_release)
+		ops->on_release(cong);
+	bpf_module_put(ops, ops->owner);
+	cong->ops = NULL;
+}
+
+static void quic_cong_assign(struct quic_cong *cong, struct quic_cong_ops *ops)
+{
+	quic_cong_release(cong);
+
+	memset(cong->priv, 0, sizeof(cong->priv));
 	cong->state = QUIC_CONG_SLOW_START;
 	cong->ssthresh = U32_MAX;
-	cong->ops = &quic_congs[algo];
+	cong->ops = ops;
 	cong->ops->on_init(cong);
 }
+
+void quic_cong_set_algo(struct quic_cong *cong, u8 algo)
+{
+	if (algo >= QUIC_CONG_ALG_MAX)
+		algo = QUIC_CONG_ALG_RENO;
+
+	quic_cong_assign(cong, &quic_congs[algo]);
+}
 EXPORT_SYMBOL_GPL(quic_cong_set_algo);
 
+int quic_cong_set_algo_name(struct quic_cong *cong, const char *name)
+{
+	struct quic_cong_ops *ops;
+
+	rcu_read_lock();
+	ops = quic_cong_find(name);
+	if (!ops || !bpf_try_module_get(ops, ops->owner)) {
+		rcu_read_unlock();
+		return -ENOENT;
+	}
+	rcu_read_unlock();
+
+	quic_cong_assign(cong, ops);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_cong_set_algo_name);
+
 void quic_cong_set_srtt(struct quic_cong *cong, u32 srtt)
 {
 	cong->latest_rtt = srtt;
@@ -619,6 +1191,22 @@ void quic_cong_set_srtt(struct quic_cong *cong, u32 srtt)
 }
 EXPORT_SYMBOL_GPL(quic_cong_set_srtt);
 
+/* start from what an earlier connection to the same peer learned, see quic_metrics */
+void quic_cong_seed(struct quic_cong *cong, u32 srtt, u32 rttvar, u32 ssthresh, u32 window)
+{
+	cong->latest_rtt = srtt;
+	cong->smoothed_rtt = srtt;
+	cong->rttvar = rttvar;
+	quic_cong_pto_update(cong);
+
+	if (ssthresh != U32_MAX)
+		cong->ssthresh = max(ssthresh, cong->min_window);
+
+	/* half of the last cwnd, not over ssthresh, as the path may be busier now */
+	window = min3(window / 2, cong->ssthresh, cong->max_window);
+	cong->window = max(cong->window, window);
+}
+
 void quic_cong_init(struct quic_cong *cong)
 {
 	quic_cong_set_max_ack_delay(cong, QUIC_DEF_ACK_DELAY);
@@ -626,3 +1214,8 @@ void quic_cong_init(struct quic_cong *cong)
 	quic_cong_set_max_window(cong, S32_MAX / 2);
 	quic_cong_set_srtt(cong, QUIC_RTT_INIT);
 }
+
+void quic_cong_free(struct quic_cong *cong)
+{
+	quic_cong_release(cong);
+}
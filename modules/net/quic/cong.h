@@ -12,12 +12,52 @@
 #define QUIC_RTO_MIN		30000U
 #define QUIC_RTO_MAX		6000000U
 
+#define QUIC_CONG_NAME_MAX	16
+
+#if defined(CONFIG_BPF_JIT) && defined(CONFIG_BPF_SYSCALL) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define QUIC_CONG_BPF
+#endif
+
 enum quic_cong_state {
 	QUIC_CONG_SLOW_START,
 	QUIC_CONG_RECOVERY_PERIOD,
 	QUIC_CONG_CONGESTION_AVOIDANCE,
 };
 
+/* delivery state when a packet is sent, to take a delivery rate sample once it is acked */
+struct quic_cong_rate_state {
+	u64 delivered;
+	u32 delivered_time;
+	u32 first_sent_time;
+	u8  app_limited:1;
+};
+
+/* delivery rate sample from the latest ACK, see draft-cheng-iccrg-delivery-rate-estimation */
+struct quic_cong_rate_sample {
+	u64 prior_delivered;	/* delivered when the most recent acked packet was sent */
+	u32 prior_time;
+	u32 send_elapsed;
+	u32 ack_elapsed;
+	u32 delivered;		/* bytes delivered over the sample interval */
+	u32 interval;
+	u32 rate;		/* delivery rate in bytes per second, 0 if no valid sample */
+	u32 inflight;		/* bytes in flight after the ACK is processed */
+	u8  app_limited:1;
+	u8  acked:1;		/* any packet acked and sampled by this ACK */
+};
+
+/* HyStart++ (RFC 9406) state, used in slow start by the loss-based algorithms */
+struct quic_hystart {
+	u32 current_round_min_rtt;
+	u32 css_baseline_min_rtt;	/* U32_MAX if not in Conservative Slow Start */
+	u32 last_round_min_rtt;
+	u16 rtt_sample_count;
+	u16 css_rounds;
+	s64 window_end;			/* the round ends when this pn is acked, -1 for none */
+	u8  disabled;
+};
+
 struct quic_cong {
 	u32 smoothed_rtt;
 	u32 latest_rtt;
@@ -37,8 +77,15 @@ struct quic_cong {
 	u32 window;
 	u32 mss;
 
+	u64 delivered;		/* bytes delivered so far */
+	u32 delivered_time;	/* time when delivered was last updated */
+	u32 first_sent_time;	/* send time of the packet starting the current flight */
+	u64 app_limited;	/* delivered after which samples are not app-limited, or 0 */
+	struct quic_cong_rate_sample rs;
+	struct quic_hystart hystart;
+
 	struct quic_cong_ops *ops;
-	u64 priv[8];
+	u64 priv[12];
 
 	u8 min_rtt_valid;
 	u8 is_rtt_set;
@@ -54,8 +101,14 @@ struct quic_cong_ops {
 
 	/* optional */
 	void (*on_packet_sent)(struct quic_cong *cong, u32 time, u32 bytes, s64 number);
+	/* the algorithm sets cong->pacing_rate itself if this is provided */
 	void (*on_ack_recv)(struct quic_cong *cong, u32 bytes, u32 max_rate);
 	void (*on_rtt_update)(struct quic_cong *cong);
+	void (*on_release)(struct quic_cong *cong);
+
+	char name[QUIC_CONG_NAME_MAX];
+	struct list_head list;	/* in quic_cong_list if registered at runtime */
+	struct module *owner;
 };
 
 static inline void quic_cong_set_time(struct quic_cong *cong, u32 time)
@@ -85,6 +138,11 @@ static inline void quic_cong_set_max_ack_delay(struct quic_cong *cong, u32 max_a
 	cong->max_ack_delay = max_ack_delay;
 }
 
+static inline void quic_cong_set_hystart(struct quic_cong *cong, u8 enable)
+{
+	cong->hystart.disabled = !enable;
+}
+
 static inline void *quic_cong_priv(struct quic_cong *cong)
 {
 	return (void *)cong->priv;
@@ -100,6 +158,11 @@ static inline u32 quic_cong_window(struct quic_cong *cong)
 	return cong->window;
 }
 
+static inline u32 quic_cong_smoothed_rtt(struct quic_cong *cong)
+{
+	return cong->smoothed_rtt;
+}
+
 static inline u32 quic_cong_pto(struct quic_cong *cong)
 {
 	return cong->pto;
@@ -115,9 +178,31 @@ void quic_cong_on_packet_lost(struct quic_cong *cong, u32 time, u32 bytes, s64 n
 void quic_cong_on_process_ecn(struct quic_cong *cong);
 
 void quic_cong_on_packet_sent(struct quic_cong *cong, u32 time, u32 bytes, s64 number);
-void quic_cong_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 max_rate);
+void quic_cong_on_ack_recv(struct quic_cong *cong, u32 bytes, u32 inflight, u32 max_rate);
+
+void quic_cong_rate_on_sent(struct quic_cong *cong, struct quic_cong_rate_state *st,
+			    u32 time, u32 inflight);
+void quic_cong_rate_on_acked(struct quic_cong *cong, struct quic_cong_rate_state *st,
+			     u32 sent_time, u32 bytes);
+void quic_cong_rate_check_app_limited(struct quic_cong *cong, u32 inflight);
 void quic_cong_rtt_update(struct quic_cong *cong, u32 time, u32 ack_delay);
 
 void quic_cong_set_srtt(struct quic_cong *cong, u32 srtt);
+int quic_cong_set_algo_name(struct quic_cong *cong, const char *name);
 void quic_cong_set_algo(struct quic_cong *cong, u8 algo);
+void quic_cong_seed(struct quic_cong *cong, u32 srtt, u32 rttvar, u32 ssthresh, u32 window);
 void quic_cong_init(struct quic_cong *cong);
+void quic_cong_free(struct quic_cong *cong);
+
+int quic_cong_register(struct quic_cong_ops *ops);
+void quic_cong_unregister(struct quic_cong_ops *ops);
+int quic_cong_validate(struct quic_cong_ops *ops);
+
+#ifdef QUIC_CONG_BPF
+int quic_bpf_cong_init(void);
+#else
+static inline int quic_bpf_cong_init(void)
+{
+	return 0;
+}
+#endif
@@ -10,28 +10,98 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <linux/rhashtable.h>
 #include <uapi/linux/quic.h>
 #include <net/sock.h>
 
 #include "common.h"
 #include "connid.h"
 
-struct quic_conn_id *quic_conn_id_lookup(struct net *net, u8 *scid, u32 len)
+/* Source connection IDs of all sockets, keyed on the full ID and the netns. */
+static struct rhashtable quic_conn_id_table;
+
+struct quic_conn_id_key {
+	struct net *net;
+	u8 *data;
+	u32 len;
+};
+
+static u32 quic_conn_id_hash(struct net *net, u8 *data, u32 len, u32 seed)
 {
-	struct quic_hash_head *head = quic_source_conn_id_head(net, scid);
-	struct quic_source_conn_id *tmp, *s_conn_id = NULL;
+	return jhash(data, len, seed ^ net_hash_mix(net));
+}
 
-	spin_lock(&head->lock);
-	hlist_for_each_entry(tmp, &head->head, node) {
-		if (net == sock_net(tmp->sk) && tmp->common.id.len <= len &&
-		    !memcmp(scid, &tmp->common.id.data, tmp->common.id.len)) {
-			s_conn_id = tmp;
-			break;
-		}
-	}
+static u32 quic_conn_id_key_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct quic_conn_id_key *key = data;
+
+	return quic_conn_id_hash(key->net, key->data, key->len, seed);
+}
+
+static u32 quic_conn_id_obj_hashfn(const void *data, u32 len, u32 seed)
+{
+	const struct quic_source_conn_id *s_conn_id = data;
+	struct quic_conn_id *id = (struct quic_conn_id *)&s_conn_id->common.id;
+
+	return quic_conn_id_hash(sock_net(s_conn_id->sk), id->data, id->len, seed);
+}
+
+static int quic_conn_id_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj)
+{
+	const struct quic_source_conn_id *s_conn_id = obj;
+	const struct quic_conn_id_key *key = arg->key;
+
+	if (key->net != sock_net(s_conn_id->sk) || key->len != s_conn_id->common.id.len)
+		return 1;
+	return memcmp(key->data, s_conn_id->common.id.data, key->len);
+}
+
+static const struct rhashtable_params quic_conn_id_params = {
+	.head_offset		= offsetof(struct quic_source_conn_id, node),
+	.hashfn			= quic_conn_id_key_hashfn,
+	.obj_hashfn		= quic_conn_id_obj_hashfn,
+	.obj_cmpfn		= quic_conn_id_obj_cmpfn,
+	.automatic_shrinking	= true,
+};
 
-	spin_unlock(&head->lock);
-	return &s_conn_id->common.id;
+/* Look up the socket by a source connection ID under RCU, and return it held. A source
+ * connection ID is freed after a grace period, but its socket may be freed and reused at
+ * any time as the sock slab is SLAB_TYPESAFE_BY_RCU. A socket unhashes all of its source
+ * connection IDs before it is freed, so it is still the owner if the ID is still hashed
+ * once the reference is held.
+ *
+ * All source connection IDs are generated with QUIC_CONN_ID_DEF_LEN, which is how long
+ * the DCID of a short header packet is.
+ */
+struct sock *quic_conn_id_lookup(struct net *net, u8 *scid, u32 len,
+				 struct quic_conn_id **conn_id)
+{
+	struct quic_conn_id_key key = { .net = net, .data = scid, .len = QUIC_CONN_ID_DEF_LEN };
+	struct quic_source_conn_id *s_conn_id;
+	struct sock *sk = NULL;
+
+	if (len < QUIC_CONN_ID_DEF_LEN)
+		return NULL;
+
+	rcu_read_lock();
+	s_conn_id = rhashtable_lookup(&quic_conn_id_table, &key, quic_conn_id_params);
+	if (!s_conn_id)
+		goto out;
+
+	sk = s_conn_id->sk;
+	if (unlikely(!refcount_inc_not_zero(&sk->sk_refcnt))) {
+		sk = NULL;
+		goto out;
+	}
+	if (unlikely(!READ_ONCE(s_conn_id->common.hashed))) {
+		sock_put(sk);
+		sk = NULL;
+		goto out;
+	}
+	*conn_id = &s_conn_id->common.id;
+out:
+	rcu_read_unlock();
+	return sk;
 }
 
 struct quic_conn_id *quic_conn_id_get(struct quic_conn_id_set *id_set, u8 *scid, u32 len)
@@ -73,15 +143,8 @@ static void quic_source_conn_id_free_rcu(struct rcu_head *head)
 
 static void quic_source_conn_id_free(struct quic_source_conn_id *s_conn_id)
 {
-	u8 *data = s_conn_id->common.id.data;
-	struct quic_hash_head *head;
-
-	if (!hlist_unhashed(&s_conn_id->node)) {
-		head = quic_source_conn_id_head(sock_net(s_conn_id->sk), data);
-		spin_lock(&head->lock);
-		hlist_del_init(&s_conn_id->node);
-		spin_unlock(&head->lock);
-	}
+	rhashtable_remove_fast(&quic_conn_id_table, &s_conn_id->node, quic_conn_id_params);
+	WRITE_ONCE(s_conn_id->common.hashed, 0);
 
 	call_rcu(&s_conn_id->rcu, quic_source_conn_id_free_rcu);
 }
@@ -102,8 +165,8 @@ int quic_conn_id_add(struct quic_conn_id_set *id_set,
 	struct quic_source_conn_id *s_conn_id;
 	struct quic_dest_conn_id *d_conn_id;
 	struct quic_common_conn_id *common;
-	struct quic_hash_head *head;
 	struct list_head *list;
+	int err;
 
 	/* find the position */
 	list = &id_set->head;
@@ -130,14 +193,19 @@ int quic_conn_id_add(struct quic_conn_id_set *id_set,
 			memcpy(d_conn_id->token, data, 16);
 		}
 	} else {
-		common->hashed = 1;
 		s_conn_id = (struct quic_source_conn_id *)common;
 		s_conn_id->sk = data;
 
-		head = quic_source_conn_id_head(sock_net(s_conn_id->sk), common->id.data);
-		spin_lock(&head->lock);
-		hlist_add_head(&s_conn_id->node, &head->head);
-		spin_unlock(&head->lock);
+		/* set before the insert publishes the entry to lockless lookups */
+		WRITE_ONCE(common->hashed, 1);
+		/* fails with -EEXIST in the unlikely case that the random ID is in use */
+		err = rhashtable_lookup_insert_fast(&quic_conn_id_table, &s_conn_id->node,
+						    quic_conn_id_params);
+		if (err) {
+			WRITE_ONCE(common->hashed, 0);
+			kfree(common);
+			return err;
+		}
 	}
 	list_add_tail(&common->list, list);
 
@@ -208,3 +276,13 @@ void quic_conn_id_set_param(struct quic_conn_id_set *id_set, struct quic_transpo
 {
 	id_set->max_count = p->active_connection_id_limit;
 }
+
+void quic_conn_id_table_destroy(void)
+{
+	rhashtable_destroy(&quic_conn_id_table);
+}
+
+int quic_conn_id_table_init(void)
+{
+	return rhashtable_init(&quic_conn_id_table, &quic_conn_id_params);
+}
@@ -12,6 +12,8 @@
 #define QUIC_CONN_ID_DEF	7
 #define QUIC_CONN_ID_LEAST	2
 
+#define QUIC_CONN_ID_PREFIX_MAX_LEN	4
+
 struct quic_common_conn_id {
 	struct quic_conn_id id;
 	struct list_head list;
@@ -21,7 +23,7 @@ struct quic_common_conn_id {
 
 struct quic_source_conn_id {
 	struct quic_common_conn_id common;
-	struct hlist_node node;
+	struct rhash_head node;
 	struct rcu_head rcu;
 	struct sock *sk;
 };
@@ -38,6 +40,10 @@ struct quic_conn_id_set {
 	u8 entry_size;
 	u8 max_count;
 	u8 count;
+
+	/* for source IDs, e.g. a worker id for reuseport steering */
+	u8 prefix[QUIC_CONN_ID_PREFIX_MAX_LEN];
+	u8 prefix_len;
 };
 
 static inline u32 quic_conn_id_first_number(struct quic_conn_id_set *id_set)
@@ -59,6 +65,21 @@ static inline void quic_conn_id_generate(struct quic_conn_id *conn_id)
 	conn_id->len = QUIC_CONN_ID_DEF_LEN;
 }
 
+/* a new source connection ID, starting with the prefix of the set */
+static inline void quic_conn_id_set_generate(struct quic_conn_id_set *id_set,
+					     struct quic_conn_id *conn_id)
+{
+	quic_conn_id_generate(conn_id);
+	memcpy(conn_id->data, id_set->prefix, id_set->prefix_len);
+}
+
+static inline bool quic_conn_id_has_prefix(struct quic_conn_id_set *id_set,
+					   struct quic_conn_id *conn_id)
+{
+	return id_set->prefix_len && conn_id->len >= id_set->prefix_len &&
+	       !memcmp(conn_id->data, id_set->prefix, id_set->prefix_len);
+}
+
 static inline bool quic_conn_id_select_alt(struct quic_conn_id_set *id_set, bool active)
 {
 	if (id_set->alt)
@@ -139,7 +160,10 @@ void quic_conn_id_remove(struct quic_conn_id_set *id_set, u32 number);
 
 struct quic_conn_id *quic_conn_id_get(struct quic_conn_id_set *id_set, u8 *scid, u32 len);
 struct quic_conn_id *quic_conn_id_find(struct quic_conn_id_set *id_set, u32 number);
-struct quic_conn_id *quic_conn_id_lookup(struct net *net, u8 *scid, u32 len);
+struct sock *quic_conn_id_lookup(struct net *net, u8 *scid, u32 len,
+				 struct quic_conn_id **conn_id);
+void quic_conn_id_table_destroy(void);
+int quic_conn_id_table_init(void);
 
 void quic_conn_id_get_param(struct quic_conn_id_set *id_set, struct quic_transport_param *p);
 void quic_conn_id_set_param(struct quic_conn_id_set *id_set, struct quic_transport_param *p);
@@ -12,10 +12,12 @@
 
 #include <uapi/linux/quic.h>
 #include <crypto/skcipher.h>
+#include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <crypto/aead.h>
 #include <crypto/hash.h>
 #include <net/tls.h>
+#include <net/dst.h>
 
 #include "common.h"
 #include "crypto.h"
@@ -132,104 +134,132 @@ static int quic_crypto_keys_derive(struct crypto_shash *tfm, struct quic_data *s
 	return quic_crypto_hkdf_expand(tfm, s, &hp_k_l, &z, hp_k);
 }
 
-static int quic_crypto_tx_keys_derive_and_install(struct quic_crypto *crypto)
+/* Derive the packet protection keys of one direction from its secret and install them
+ * in the transform and IV of the given key phase. The hp key is only derived from the
+ * first 1-RTT secret, as key update does not change it.
+ */
+static int quic_crypto_keys_derive_and_install(struct quic_crypto *crypto, u8 send, u8 phase,
+					       u8 *secret, bool hp)
 {
-	struct quic_data srt = {}, k, iv, hp_k = {}, *hp = NULL;
-	int err, phase = crypto->key_phase;
+	struct crypto_skcipher *hp_tfm = send ? crypto->tx_hp_tfm : crypto->rx_hp_tfm;
+	struct crypto_aead *tfm = send ? crypto->tx_tfm[phase] : crypto->rx_tfm[phase];
+	struct quic_data srt = {}, k, iv, hp_k = {}, *hp_p = NULL;
 	u32 keylen, ivlen = QUIC_IV_LEN;
-	u8 tx_key[32], tx_hp_key[32];
+	u8 key[32], hp_key[32];
+	int err;
 
 	keylen = crypto->cipher->keylen;
-	quic_data(&srt, crypto->tx_secret, crypto->cipher->secretlen);
-	quic_data(&k, tx_key, keylen);
-	quic_data(&iv, crypto->tx_iv[phase], ivlen);
-	if (!crypto->key_pending)
-		hp = quic_data(&hp_k, tx_hp_key, keylen);
-	err = quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &iv, hp, crypto->version);
+	quic_data(&srt, secret, crypto->cipher->secretlen);
+	quic_data(&k, key, keylen);
+	quic_data(&iv, send ? crypto->tx_iv[phase] : crypto->rx_iv[phase], ivlen);
+	if (hp)
+		hp_p = quic_data(&hp_k, hp_key, keylen);
+	err = quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &iv, hp_p, crypto->version);
 	if (err)
-		return err;
-	err = crypto_aead_setauthsize(crypto->tx_tfm[phase], QUIC_TAG_LEN);
+		goto out;
+	err = crypto_aead_setauthsize(tfm, QUIC_TAG_LEN);
 	if (err)
-		return err;
-	err = crypto_aead_setkey(crypto->tx_tfm[phase], tx_key, keylen);
+		goto out;
+	err = crypto_aead_setkey(tfm, key, keylen);
 	if (err)
-		return err;
+		goto out;
 	if (hp) {
-		err = crypto_skcipher_setkey(crypto->tx_hp_tfm, tx_hp_key, keylen);
+		err = crypto_skcipher_setkey(hp_tfm, hp_key, keylen);
 		if (err)
-			return err;
+			goto out;
 	}
 	pr_debug("%s: k: %16phN, iv: %12phN, hp_k:%16phN\n", __func__, k.data, iv.data, hp_k.data);
-	return 0;
+out:
+	memzero_explicit(key, sizeof(key));
+	memzero_explicit(hp_key, sizeof(hp_key));
+	return err;
 }
 
-static int quic_crypto_rx_keys_derive_and_install(struct quic_crypto *crypto)
+/* Header protection, synchronous payload protection, Retry tags and address validation
+ * tokens run for every packet, so their masks and requests are laid out in a per-CPU
+ * scratch buffer with BHs disabled instead of memory allocated for each packet. A request
+ * that does not fit, or that may complete asynchronously and so outlive the call, falls
+ * back to kzalloc(). The buffers come from kmalloc(), as the scatterlists point into them.
+ */
+#define QUIC_CRYPTO_SCRATCH_LEN	2048
+
+static void * __percpu *quic_crypto_scratch __read_mostly;
+
+static void *quic_crypto_scratch_alloc(u32 len, bool *scratch)
 {
-	struct quic_data srt = {}, k, iv, hp_k = {}, *hp = NULL;
-	int err, phase = crypto->key_phase;
-	u32 keylen, ivlen = QUIC_IV_LEN;
-	u8 rx_key[32], rx_hp_key[32];
+	u8 *mem;
 
-	keylen = crypto->cipher->keylen;
-	quic_data(&srt, crypto->rx_secret, crypto->cipher->secretlen);
-	quic_data(&k, rx_key, keylen);
-	quic_data(&iv, crypto->rx_iv[phase], ivlen);
-	if (!crypto->key_pending)
-		hp = quic_data(&hp_k, rx_hp_key, keylen);
-	err = quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &iv, hp, crypto->version);
-	if (err)
-		return err;
-	err = crypto_aead_setauthsize(crypto->rx_tfm[phase], QUIC_TAG_LEN);
-	if (err)
-		return err;
-	err = crypto_aead_setkey(crypto->rx_tfm[phase], rx_key, keylen);
-	if (err)
-		return err;
-	if (hp) {
-		err = crypto_skcipher_setkey(crypto->rx_hp_tfm, rx_hp_key, keylen);
-		if (err)
-			return err;
+	*scratch = len <= QUIC_CRYPTO_SCRATCH_LEN;
+	if (!*scratch)
+		return kzalloc(len, GFP_ATOMIC);
+
+	local_bh_disable();
+	mem = *this_cpu_ptr(quic_crypto_scratch);
+	memset(mem, 0, len);
+	return mem;
+}
+
+static void quic_crypto_scratch_put(void *mem, bool scratch)
+{
+	if (!scratch) {
+		kfree(mem);
+		return;
 	}
-	pr_debug("%s: k: %16phN, iv: %12phN, hp_k:%16phN\n", __func__, k.data, iv.data, hp_k.data);
-	return 0;
+	local_bh_enable();
 }
 
-static void *quic_crypto_skcipher_mem_alloc(struct crypto_skcipher *tfm, u32 mask_size,
-					    u8 **iv, struct skcipher_request **req)
+static u32 quic_crypto_skcipher_mem_len(struct crypto_skcipher *tfm, u32 mask_size)
 {
-	unsigned int iv_size, req_size;
 	unsigned int len;
-	u8 *mem;
-
-	iv_size = crypto_skcipher_ivsize(tfm);
-	req_size = sizeof(**req) + crypto_skcipher_reqsize(tfm);
 
 	len = mask_size;
-	len += iv_size;
+	len += crypto_skcipher_ivsize(tfm);
 	len += crypto_skcipher_alignmask(tfm) & ~(crypto_tfm_ctx_alignment() - 1);
 	len = ALIGN(len, crypto_tfm_ctx_alignment());
-	len += req_size;
+	len += sizeof(struct skcipher_request) + crypto_skcipher_reqsize(tfm);
 
-	mem = kzalloc(len, GFP_ATOMIC);
+	return len;
+}
+
+/* The header protection transforms are sync, so the masks never outlive the call */
+static void *quic_crypto_skcipher_mem_get(struct crypto_skcipher *tfm, u32 mask_size,
+					  u8 **iv, struct skcipher_request **req, bool *scratch)
+{
+	u8 *mem;
+
+	mem = quic_crypto_scratch_alloc(quic_crypto_skcipher_mem_len(tfm, mask_size), scratch);
 	if (!mem)
 		return NULL;
 
 	*iv = (u8 *)PTR_ALIGN(mem + mask_size, crypto_skcipher_alignmask(tfm) + 1);
-	*req = (struct skcipher_request *)PTR_ALIGN(*iv + iv_size,
+	*req = (struct skcipher_request *)PTR_ALIGN(*iv + crypto_skcipher_ivsize(tfm),
 			crypto_tfm_ctx_alignment());
 
 	return (void *)mem;
 }
 
+static void quic_crypto_header_mask(struct sk_buff *skb, u8 *mask)
+{
+	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
+	u8 *p = skb->data;
+	int i;
+
+	*p = (u8)(*p ^ (mask[0] & (((*p & 0x80) == 0x80) ? 0x0f : 0x1f)));
+	p = skb->data + cb->number_offset;
+	for (i = 1; i <= cb->number_len; i++)
+		*p++ ^= mask[i];
+}
+
 static int quic_crypto_header_encrypt(struct crypto_skcipher *tfm, struct sk_buff *skb, bool chacha)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	struct skcipher_request *req;
 	struct scatterlist sg;
-	u8 *mask, *iv, *p;
-	int err, i;
+	u8 *mask, *iv;
+	bool scratch;
+	int err;
 
-	mask = quic_crypto_skcipher_mem_alloc(tfm, 16, &iv, &req);
+	mask = quic_crypto_skcipher_mem_get(tfm, 16, &iv, &req, &scratch);
 	if (!mask)
 		return -ENOMEM;
 
@@ -238,48 +268,60 @@ static int quic_crypto_header_encrypt(struct crypto_skcipher *tfm, struct sk_buf
 	skcipher_request_set_tfm(req, tfm);
 	skcipher_request_set_crypt(req, &sg, &sg, 16, iv);
 	err = crypto_skcipher_encrypt(req);
-	if (err)
-		goto err;
+	if (!err)
+		quic_crypto_header_mask(skb, mask);
 
-	p = skb->data;
-	*p = (u8)(*p ^ (mask[0] & (((*p & 0x80) == 0x80) ? 0x0f : 0x1f)));
-	p = skb->data + cb->number_offset;
-	for (i = 1; i <= cb->number_len; i++)
-		*p++ ^= mask[i];
-err:
-	kfree(mask);
+	quic_crypto_scratch_put(mask, scratch);
 	return err;
 }
 
-static void *quic_crypto_aead_mem_alloc(struct crypto_aead *tfm, u32 ctx_size,
-					u8 **iv, struct aead_request **req,
-					struct scatterlist **sg, u32 nsg)
+static u32 quic_crypto_aead_mem_len(struct crypto_aead *tfm, u32 ctx_size, u32 nsg)
 {
-	unsigned int iv_size, req_size;
 	unsigned int len;
-	u8 *mem;
-
-	iv_size = crypto_aead_ivsize(tfm);
-	req_size = sizeof(**req) + crypto_aead_reqsize(tfm);
 
 	len = ctx_size;
-	len += iv_size;
+	len += crypto_aead_ivsize(tfm);
 	len += crypto_aead_alignmask(tfm) & ~(crypto_tfm_ctx_alignment() - 1);
 	len = ALIGN(len, crypto_tfm_ctx_alignment());
-	len += req_size;
+	len += sizeof(struct aead_request) + crypto_aead_reqsize(tfm);
 	len = ALIGN(len, __alignof__(struct scatterlist));
-	len += nsg * sizeof(**sg);
+	len += nsg * sizeof(struct scatterlist);
 
-	mem = kzalloc(len, GFP_ATOMIC);
-	if (!mem)
-		return NULL;
+	return len;
+}
+
+static void quic_crypto_aead_mem_layout(u8 *mem, struct crypto_aead *tfm, u32 ctx_size,
+					u8 **iv, struct aead_request **req,
+					struct scatterlist **sg)
+{
+	unsigned int iv_size = crypto_aead_ivsize(tfm);
+	unsigned int req_size = sizeof(**req) + crypto_aead_reqsize(tfm);
 
 	*iv = (u8 *)PTR_ALIGN(mem + ctx_size, crypto_aead_alignmask(tfm) + 1);
 	*req = (struct aead_request *)PTR_ALIGN(*iv + iv_size,
 			crypto_tfm_ctx_alignment());
 	*sg = (struct scatterlist *)PTR_ALIGN((u8 *)*req + req_size,
 			__alignof__(struct scatterlist));
+}
+
+/* An async tfm may complete after the call returns, so its memory is always allocated */
+static void *quic_crypto_aead_mem_get(struct crypto_aead *tfm, u32 ctx_size, u8 **iv,
+				      struct aead_request **req, struct scatterlist **sg,
+				      u32 nsg, bool async, bool *scratch)
+{
+	u32 len = quic_crypto_aead_mem_len(tfm, ctx_size, nsg);
+	u8 *mem;
+
+	if (async) {
+		*scratch = false;
+		mem = kzalloc(len, GFP_ATOMIC);
+	} else {
+		mem = quic_crypto_scratch_alloc(len, scratch);
+	}
+	if (!mem)
+		return NULL;
 
+	quic_crypto_aead_mem_layout(mem, tfm, ctx_size, iv, req, sg);
 	return (void *)mem;
 }
 
@@ -297,11 +339,15 @@ static void quic_crypto_done(void *data, int err)
 	if (base->flags == CRYPTO_TFM_REQ_MAY_BACKLOG)
 		skb = base->data;
 
+	/* a backlogged request was just moved to the engine queue, wait for its completion */
+	if (err == -EINPROGRESS)
+		return;
+
 	QUIC_CRYPTO_CB(skb)->crypto_done(skb, err);
 }
 
 static int quic_crypto_payload_encrypt(struct crypto_aead *tfm, struct sk_buff *skb,
-				       u8 *tx_iv, bool ccm)
+				       u8 *tx_iv, bool ccm, bool async)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	struct quichdr *hdr = quic_hdr(skb);
@@ -310,6 +356,7 @@ static int quic_crypto_payload_encrypt(struct crypto_aead *tfm, struct sk_buff *
 	struct sk_buff *trailer;
 	struct scatterlist *sg;
 	u32 nsg, hlen, len;
+	bool scratch;
 	void *ctx;
 	__be64 n;
 	int err;
@@ -322,7 +369,7 @@ static int quic_crypto_payload_encrypt(struct crypto_aead *tfm, struct sk_buff *
 	pskb_put(skb, trailer, QUIC_TAG_LEN);
 	hdr->key = cb->key_phase;
 
-	ctx = quic_crypto_aead_mem_alloc(tfm, 0, &iv, &req, &sg, nsg);
+	ctx = quic_crypto_aead_mem_get(tfm, 0, &iv, &req, &sg, nsg, async, &scratch);
 	if (!ctx)
 		return -ENOMEM;
 
@@ -345,19 +392,19 @@ static int quic_crypto_payload_encrypt(struct crypto_aead *tfm, struct sk_buff *
 	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG, (void *)quic_crypto_done, skb);
 
 	err = crypto_aead_encrypt(req);
-	if (err == -EINPROGRESS) {
+	if (err == -EINPROGRESS || err == -EBUSY) { /* -EBUSY: queued in the backlog */
 		skb->destructor = quic_crypto_destruct_skb;
 		skb_shinfo(skb)->destructor_arg = ctx;
-		return err;
+		return -EINPROGRESS;
 	}
 
 err:
-	kfree(ctx);
+	quic_crypto_scratch_put(ctx, scratch);
 	return err;
 }
 
 static int quic_crypto_payload_decrypt(struct crypto_aead *tfm, struct sk_buff *skb,
-				       u8 *rx_iv, bool ccm)
+				       u8 *rx_iv, bool ccm, bool async)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	u8 *iv, i, nonce[QUIC_IV_LEN];
@@ -365,6 +412,7 @@ static int quic_crypto_payload_decrypt(struct crypto_aead *tfm, struct sk_buff *
 	struct sk_buff *trailer;
 	int nsg, hlen, len, err;
 	struct scatterlist *sg;
+	bool scratch;
 	void *ctx;
 	__be64 n;
 
@@ -375,7 +423,7 @@ static int quic_crypto_payload_decrypt(struct crypto_aead *tfm, struct sk_buff *
 	nsg = skb_cow_data(skb, 0, &trailer);
 	if (nsg < 0)
 		return nsg;
-	ctx = quic_crypto_aead_mem_alloc(tfm, 0, &iv, &req, &sg, nsg);
+	ctx = quic_crypto_aead_mem_get(tfm, 0, &iv, &req, &sg, nsg, async, &scratch);
 	if (!ctx)
 		return -ENOMEM;
 
@@ -398,13 +446,13 @@ static int quic_crypto_payload_decrypt(struct crypto_aead *tfm, struct sk_buff *
 	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG, (void *)quic_crypto_done, skb);
 
 	err = crypto_aead_decrypt(req);
-	if (err == -EINPROGRESS) {
+	if (err == -EINPROGRESS || err == -EBUSY) { /* -EBUSY: queued in the backlog */
 		skb->destructor = quic_crypto_destruct_skb;
 		skb_shinfo(skb)->destructor_arg = ctx;
-		return err;
+		return -EINPROGRESS;
 	}
 err:
-	kfree(ctx);
+	quic_crypto_scratch_put(ctx, scratch);
 	return err;
 }
 
@@ -433,8 +481,9 @@ static int quic_crypto_header_decrypt(struct crypto_skcipher *tfm, struct sk_buf
 	struct skcipher_request *req;
 	struct scatterlist sg;
 	u8 *mask, *iv, *p;
+	bool scratch;
 
-	mask = quic_crypto_skcipher_mem_alloc(tfm, 16, &iv, &req);
+	mask = quic_crypto_skcipher_mem_get(tfm, 16, &iv, &req, &scratch);
 	if (!mask)
 		return -ENOMEM;
 
@@ -460,7 +509,7 @@ static int quic_crypto_header_decrypt(struct crypto_skcipher *tfm, struct sk_buf
 	quic_crypto_get_header(skb);
 
 err:
-	kfree(mask);
+	quic_crypto_scratch_put(mask, scratch);
 	return err;
 }
 
@@ -488,6 +537,90 @@ static struct quic_cipher ciphers[QUIC_CIPHER_MAX + 1 - QUIC_CIPHER_MIN] = {
 		    "rfc7539(chacha20,poly1305)", "chacha20", "hmac(sha256)"),
 };
 
+/* Transforms of a destroyed crypto are kept in these pools and reused by the next crypto
+ * of the same cipher, as allocating them in the crypto API is slow and takes locks. They
+ * are always rekeyed before use. The pools are not per netns as transforms hold no netns
+ * state.
+ */
+enum {
+	QUIC_CRYPTO_TFM_SHASH,
+	QUIC_CRYPTO_TFM_AEAD,		/* allocated with CRYPTO_ALG_ASYNC masked */
+	QUIC_CRYPTO_TFM_AEAD_ASYNC,
+	QUIC_CRYPTO_TFM_SKCIPHER,
+	QUIC_CRYPTO_TFM_MAX,
+};
+
+#define QUIC_CRYPTO_POOL_SIZE	64
+
+struct quic_crypto_pool {
+	spinlock_t lock;	/* protects count and tfms */
+	u32 count;
+	void *tfms[QUIC_CRYPTO_POOL_SIZE];
+};
+
+static struct quic_crypto_pool quic_crypto_pools[ARRAY_SIZE(ciphers)][QUIC_CRYPTO_TFM_MAX];
+
+static void *quic_crypto_tfm_get(struct quic_cipher *cipher, u8 type)
+{
+	struct quic_crypto_pool *pool = &quic_crypto_pools[cipher - ciphers][type];
+	void *tfm = NULL;
+
+	spin_lock_bh(&pool->lock);
+	if (pool->count)
+		tfm = pool->tfms[--pool->count];
+	spin_unlock_bh(&pool->lock);
+	if (tfm)
+		return tfm;
+
+	switch (type) {
+	case QUIC_CRYPTO_TFM_SHASH:
+		return crypto_alloc_shash(cipher->shash, 0, 0);
+	case QUIC_CRYPTO_TFM_AEAD:
+		return crypto_alloc_aead(cipher->aead, 0, CRYPTO_ALG_ASYNC);
+	case QUIC_CRYPTO_TFM_AEAD_ASYNC:
+		return crypto_alloc_aead(cipher->aead, 0, 0);
+	default:
+		return crypto_alloc_sync_skcipher(cipher->skc, 0, 0);
+	}
+}
+
+static void quic_crypto_tfm_free(void *tfm, u8 type)
+{
+	switch (type) {
+	case QUIC_CRYPTO_TFM_SHASH:
+		crypto_free_shash(tfm);
+		break;
+	case QUIC_CRYPTO_TFM_AEAD:
+	case QUIC_CRYPTO_TFM_AEAD_ASYNC:
+		crypto_free_aead(tfm);
+		break;
+	default:
+		crypto_free_skcipher(tfm);
+	}
+}
+
+static void quic_crypto_tfm_put(struct quic_cipher *cipher, u8 type, void *tfm)
+{
+	struct quic_crypto_pool *pool = &quic_crypto_pools[cipher - ciphers][type];
+
+	if (!tfm)
+		return;
+
+	spin_lock_bh(&pool->lock);
+	if (pool->count < QUIC_CRYPTO_POOL_SIZE) {
+		pool->tfms[pool->count++] = tfm;
+		tfm = NULL;
+	}
+	spin_unlock_bh(&pool->lock);
+	if (tfm)
+		quic_crypto_tfm_free(tfm, type);
+}
+
+static u8 quic_crypto_aead_type(u8 async)
+{
+	return async ? QUIC_CRYPTO_TFM_AEAD_ASYNC : QUIC_CRYPTO_TFM_AEAD;
+}
+
 static bool quic_crypto_is_cipher_ccm(struct quic_crypto *crypto)
 {
 	return crypto->cipher_type == TLS_CIPHER_AES_CCM_128;
@@ -498,6 +631,336 @@ static bool quic_crypto_is_cipher_chacha(struct quic_crypto *crypto)
 	return crypto->cipher_type == TLS_CIPHER_CHACHA20_POLY1305;
 }
 
+/* skb->decrypted marks a plaintext skb for the device on tx, and an skb already
+ * unprotected by the device on rx, as it does for TLS device offload.
+ */
+#define QUIC_CRYPTO_OFFLOAD	(IS_ENABLED(CONFIG_SKB_DECRYPTED) || IS_ENABLED(CONFIG_TLS_DEVICE))
+
+#if QUIC_CRYPTO_OFFLOAD
+#define quic_crypto_skb_decrypted(skb)		((skb)->decrypted)
+#define quic_crypto_skb_set_decrypted(skb)	((skb)->decrypted = 1)
+#else
+#define quic_crypto_skb_decrypted(skb)		0
+#define quic_crypto_skb_set_decrypted(skb)
+#endif
+
+struct quic_crypto_offload {
+	struct list_head list;
+	struct net_device *dev;
+	const struct quic_crypto_offload_ops *ops;
+};
+
+static LIST_HEAD(quic_crypto_offload_list);
+static LIST_HEAD(quic_crypto_offload_cryptos);
+static DEFINE_SPINLOCK(quic_crypto_offload_lock);
+
+int quic_crypto_offload_register(struct net_device *dev, const struct quic_crypto_offload_ops *ops)
+{
+	struct quic_crypto_offload *offload;
+
+	if (!QUIC_CRYPTO_OFFLOAD)
+		return -EOPNOTSUPP;
+	offload = kzalloc(sizeof(*offload), GFP_KERNEL);
+	if (!offload)
+		return -ENOMEM;
+	offload->dev = dev;
+	offload->ops = ops;
+
+	spin_lock_bh(&quic_crypto_offload_lock);
+	list_add_rcu(&offload->list, &quic_crypto_offload_list);
+	spin_unlock_bh(&quic_crypto_offload_lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_crypto_offload_register);
+
+/* Each offloaded crypto holds a reference on its device. Here the device is taken from
+ * all of them, which then fall back to the software crypto: the packet paths compare
+ * offload_dev under RCU, and del and update look the ops up again under RCU, so none of
+ * them use the device or its ops once this returns. The driver releases the state it
+ * keeps for these connections itself, and copes with packets that were already marked
+ * for it, as with TLS device offload.
+ */
+void quic_crypto_offload_unregister(struct net_device *dev)
+{
+	struct quic_crypto_offload *offload, *found = NULL;
+	struct quic_crypto *crypto, *tmp;
+	u32 refs = 0;
+
+	spin_lock_bh(&quic_crypto_offload_lock);
+	list_for_each_entry(offload, &quic_crypto_offload_list, list) {
+		if (offload->dev == dev) {
+			list_del_rcu(&offload->list);
+			found = offload;
+			break;
+		}
+	}
+	list_for_each_entry_safe(crypto, tmp, &quic_crypto_offload_cryptos, offload_list) {
+		if (crypto->offload_dev != dev)
+			continue;
+		list_del(&crypto->offload_list);
+		WRITE_ONCE(crypto->offload_dev, NULL);
+		refs++;
+	}
+	spin_unlock_bh(&quic_crypto_offload_lock);
+
+	if (!found && !refs)
+		return;
+	synchronize_rcu();
+	kfree(found);
+	while (refs--)
+		dev_put(dev);
+}
+EXPORT_SYMBOL_GPL(quic_crypto_offload_unregister);
+
+/* Called under rcu_read_lock() */
+static const struct quic_crypto_offload_ops *quic_crypto_offload_ops(struct net_device *dev)
+{
+	struct quic_crypto_offload *offload;
+
+	list_for_each_entry_rcu(offload, &quic_crypto_offload_list, list)
+		if (offload->dev == dev)
+			return offload->ops;
+	return NULL;
+}
+
+/* The hp key comes from the first 1-RTT secret and is not changed by key update, so it
+ * is only derived for add.
+ */
+static int quic_crypto_offload_keys_get(struct quic_crypto *crypto,
+					struct quic_crypto_offload_keys *keys, u8 send, u8 hp)
+{
+	struct quic_data srt, k, iv, hp_k = {}, *hp_p = NULL;
+
+	keys->cipher_type = crypto->cipher_type;
+	keys->keylen = crypto->cipher->keylen;
+	keys->key_phase = crypto->key_phase;
+	quic_data(&srt, send ? crypto->tx_secret : crypto->rx_secret, crypto->cipher->secretlen);
+	quic_data(&k, keys->key, keys->keylen);
+	quic_data(&iv, keys->iv, QUIC_IV_LEN);
+	if (hp)
+		hp_p = quic_data(&hp_k, keys->hp_key, keys->keylen);
+	return quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &iv, hp_p, crypto->version);
+}
+
+/* Push the 1-RTT keys of one direction to the device of the socket's route if it has
+ * registered for offload. Not being able to offload is not an error, the software
+ * crypto keeps protecting the packets.
+ */
+void quic_crypto_offload_add(struct quic_crypto *crypto, struct sock *sk, u8 send)
+{
+	const struct quic_crypto_offload_ops *ops;
+	struct quic_crypto_offload_keys keys = {};
+	struct dst_entry *dst;
+	struct net_device *dev;
+
+	dst = __sk_dst_get(sk);
+	if (!dst || !dst->dev)
+		return;
+	dev = dst->dev;
+	if (READ_ONCE(crypto->offload_dev) && crypto->offload_dev != dev)
+		return;
+
+	rcu_read_lock();
+	ops = quic_crypto_offload_ops(dev);
+	if (!ops || quic_crypto_offload_keys_get(crypto, &keys, send, 1))
+		goto out;
+	if (ops->add(dev, sk, crypto, &keys, send))
+		goto out;
+	spin_lock_bh(&quic_crypto_offload_lock);
+	if (!quic_crypto_offload_ops(dev)) { /* unregistered meanwhile, it drops the state */
+		spin_unlock_bh(&quic_crypto_offload_lock);
+		goto out;
+	}
+	if (!crypto->offload_dev) {
+		/* the other direction may be left from a device that was unregistered */
+		crypto->tx_offload = 0;
+		crypto->rx_offload = 0;
+		dev_hold(dev);
+		list_add(&crypto->offload_list, &quic_crypto_offload_cryptos);
+		WRITE_ONCE(crypto->offload_dev, dev);
+	}
+	spin_unlock_bh(&quic_crypto_offload_lock);
+	if (send)
+		crypto->tx_offload = 1;
+	else
+		crypto->rx_offload = 1;
+out:
+	rcu_read_unlock();
+	memzero_explicit(&keys, sizeof(keys));
+}
+EXPORT_SYMBOL_GPL(quic_crypto_offload_add);
+
+static void quic_crypto_offload_del(struct quic_crypto *crypto)
+{
+	struct net_device *dev = READ_ONCE(crypto->offload_dev);
+	const struct quic_crypto_offload_ops *ops;
+
+	if (dev) {
+		rcu_read_lock();
+		ops = quic_crypto_offload_ops(dev);
+		if (ops && crypto->tx_offload)
+			ops->del(dev, crypto, 1);
+		if (ops && crypto->rx_offload)
+			ops->del(dev, crypto, 0);
+		rcu_read_unlock();
+	}
+
+	/* drop the device reference unless quic_crypto_offload_unregister() took it */
+	spin_lock_bh(&quic_crypto_offload_lock);
+	dev = crypto->offload_dev;
+	if (dev) {
+		list_del(&crypto->offload_list);
+		WRITE_ONCE(crypto->offload_dev, NULL);
+	}
+	spin_unlock_bh(&quic_crypto_offload_lock);
+	if (dev)
+		dev_put(dev);
+
+	crypto->tx_offload = 0;
+	crypto->rx_offload = 0;
+}
+
+/* After a key update, hand the new phase keys to the device, or fall back to the
+ * software crypto for good if it can not take them.
+ */
+static void quic_crypto_offload_update(struct quic_crypto *crypto)
+{
+	struct net_device *dev = READ_ONCE(crypto->offload_dev);
+	const struct quic_crypto_offload_ops *ops;
+	struct quic_crypto_offload_keys keys = {};
+	int err = -ENODEV;
+
+	if (!dev)
+		goto out;
+	rcu_read_lock();
+	ops = quic_crypto_offload_ops(dev);
+	if (!ops)
+		goto out;
+	if (crypto->tx_offload) {
+		err = quic_crypto_offload_keys_get(crypto, &keys, 1, 0);
+		if (!err)
+			err = ops->update(dev, crypto, &keys, 1);
+		if (err)
+			goto out;
+	}
+	if (crypto->rx_offload) {
+		err = quic_crypto_offload_keys_get(crypto, &keys, 0, 0);
+		if (!err)
+			err = ops->update(dev, crypto, &keys, 0);
+	}
+	rcu_read_unlock();
+out:
+	memzero_explicit(&keys, sizeof(keys));
+	if (err)
+		quic_crypto_offload_del(crypto);
+}
+
+/* Leave the payload and header protection to the device when the packet is routed via
+ * it, and only make room for the tag it fills in.
+ */
+static int quic_crypto_offload_encrypt(struct quic_crypto *crypto, struct sk_buff *skb)
+{
+	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
+	struct sk_buff *trailer;
+	struct dst_entry *dst;
+	bool via;
+	int err;
+
+	dst = skb->sk ? __sk_dst_get(skb->sk) : NULL;
+	rcu_read_lock();
+	via = dst && dst->dev == READ_ONCE(crypto->offload_dev);
+	rcu_read_unlock();
+	if (!via)
+		return -EOPNOTSUPP;
+
+	err = skb_cow_data(skb, QUIC_TAG_LEN, &trailer);
+	if (err < 0)
+		return err;
+	pskb_put(skb, trailer, QUIC_TAG_LEN);
+	quic_hdr(skb)->key = cb->key_phase;
+	quic_crypto_skb_set_decrypted(skb);
+	return 0;
+}
+
+static bool quic_crypto_offload_decrypted(struct quic_crypto *crypto, struct sk_buff *skb)
+{
+	bool via;
+
+	if (!quic_crypto_skb_decrypted(skb))
+		return false;
+	rcu_read_lock();
+	via = skb->dev == READ_ONCE(crypto->offload_dev);
+	rcu_read_unlock();
+	return via;
+}
+
+static struct sk_buff *quic_crypto_batch_next(struct sk_buff *head, struct sk_buff *skb)
+{
+	for (skb = (skb == head ? skb_shinfo(head)->frag_list : skb->next); skb; skb = skb->next)
+		if (QUIC_CRYPTO_CB(skb)->hp_batch)
+			break;
+	return skb;
+}
+
+#define QUIC_CRYPTO_HP_BATCH	64
+
+/* Apply the header protection left by quic_crypto_encrypt() to the packets marked with
+ * hp_batch in an skb and its frag_list. With AES the mask of a packet is one block of
+ * ECB over its sample, so the samples of up to QUIC_CRYPTO_HP_BATCH packets are put
+ * next to each other and encrypted in one request, which lets the cipher use its multi
+ * block path. With ChaCha20 the sample is the counter and nonce, so each packet still
+ * takes a request of its own.
+ */
+int quic_crypto_header_encrypt_batch(struct quic_crypto *crypto, struct sk_buff *head)
+{
+	struct crypto_skcipher *tfm = crypto->tx_hp_tfm;
+	struct sk_buff *skb, *first;
+	struct skcipher_request *req;
+	struct scatterlist sg;
+	u8 *masks, *iv, *p;
+	bool scratch;
+	int err, n;
+
+	skb = QUIC_CRYPTO_CB(head)->hp_batch ? head : quic_crypto_batch_next(head, head);
+	if (quic_crypto_is_cipher_chacha(crypto)) {
+		for (; skb; skb = quic_crypto_batch_next(head, skb)) {
+			err = quic_crypto_header_encrypt(tfm, skb, true);
+			if (err)
+				return err;
+		}
+		return 0;
+	}
+
+	while (skb) {
+		masks = quic_crypto_skcipher_mem_get(tfm, QUIC_CRYPTO_HP_BATCH * 16, &iv, &req,
+						     &scratch);
+		if (!masks)
+			return -ENOMEM;
+
+		first = skb;
+		for (n = 0; skb && n < QUIC_CRYPTO_HP_BATCH; n++) {
+			p = skb->data + QUIC_CRYPTO_CB(skb)->number_offset + 4;
+			memcpy(masks + n * 16, p, 16);
+			skb = quic_crypto_batch_next(head, skb);
+		}
+		sg_init_one(&sg, masks, n * 16);
+		skcipher_request_set_tfm(req, tfm);
+		skcipher_request_set_crypt(req, &sg, &sg, n * 16, iv);
+		err = crypto_skcipher_encrypt(req);
+		if (!err) {
+			for (n = 0; first != skb; n++) {
+				quic_crypto_header_mask(first, masks + n * 16);
+				first = quic_crypto_batch_next(head, first);
+			}
+		}
+		quic_crypto_scratch_put(masks, scratch);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_crypto_header_encrypt_batch);
+
 int quic_crypto_encrypt(struct quic_crypto *crypto, struct sk_buff *skb)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
@@ -512,11 +975,21 @@ int quic_crypto_encrypt(struct quic_crypto *crypto, struct sk_buff *skb)
 	if (crypto->key_pending && !crypto->key_update_send_time)
 		crypto->key_update_send_time = jiffies_to_usecs(jiffies);
 
+	if (crypto->tx_offload) {
+		err = quic_crypto_offload_encrypt(crypto, skb);
+		if (err != -EOPNOTSUPP) {
+			cb->hp_batch = 0; /* the header is protected by the device as well */
+			return err;
+		}
+	}
+
 	ccm = quic_crypto_is_cipher_ccm(crypto);
-	err = quic_crypto_payload_encrypt(crypto->tx_tfm[phase], skb, iv, ccm);
+	err = quic_crypto_payload_encrypt(crypto->tx_tfm[phase], skb, iv, ccm, crypto->tx_async);
 	if (err)
 		return err;
 out:
+	if (cb->hp_batch) /* left to quic_crypto_header_encrypt_batch() */
+		return 0;
 	cha = quic_crypto_is_cipher_chacha(crypto);
 	return quic_crypto_header_encrypt(crypto->tx_hp_tfm, skb, cha);
 }
@@ -529,6 +1002,8 @@ int quic_crypto_decrypt(struct quic_crypto *crypto, struct sk_buff *skb)
 	int err = 0;
 	u32 time;
 
+	if (crypto->rx_offload && quic_crypto_offload_decrypted(crypto, skb))
+		cb->resume = 1;
 	if (cb->resume) {
 		quic_crypto_get_header(skb);
 		goto out;
@@ -555,7 +1030,7 @@ int quic_crypto_decrypt(struct quic_crypto *crypto, struct sk_buff *skb)
 	phase = cb->key_phase;
 	iv = crypto->rx_iv[phase];
 	ccm = quic_crypto_is_cipher_ccm(crypto);
-	err = quic_crypto_payload_decrypt(crypto->rx_tfm[phase], skb, iv, ccm);
+	err = quic_crypto_payload_decrypt(crypto->rx_tfm[phase], skb, iv, ccm, crypto->rx_async);
 	if (err) {
 		if (err == -EINPROGRESS)
 			return err;
@@ -592,6 +1067,7 @@ int quic_crypto_set_secret(struct quic_crypto *crypto, struct quic_crypto_secret
 	struct quic_cipher *cipher;
 	int err = -EINVAL;
 	u32 secretlen;
+	u8 type;
 	void *tfm;
 
 	if (!crypto->cipher) {
@@ -600,47 +1076,45 @@ int quic_crypto_set_secret(struct quic_crypto *crypto, struct quic_crypto_secret
 			return -EINVAL;
 
 		cipher = &ciphers[srt->type - QUIC_CIPHER_MIN];
-		tfm = crypto_alloc_shash(cipher->shash, 0, 0);
-		if (IS_ERR(tfm))
-			return PTR_ERR(tfm);
-		crypto->secret_tfm = tfm;
-
-		tfm = crypto_alloc_aead(cipher->aead, 0, CRYPTO_ALG_ASYNC);
+		crypto->cipher = cipher;
+		crypto->cipher_type = srt->type;
+		tfm = quic_crypto_tfm_get(cipher, QUIC_CRYPTO_TFM_SHASH);
 		if (IS_ERR(tfm)) {
 			err = PTR_ERR(tfm);
 			goto err;
 		}
-		crypto->tag_tfm = tfm;
-		crypto->cipher = cipher;
-		crypto->cipher_type = srt->type;
+		crypto->secret_tfm = tfm;
 	}
 
 	cipher = crypto->cipher;
 	secretlen = cipher->secretlen;
+	type = quic_crypto_aead_type(!(flag & CRYPTO_ALG_ASYNC));
 	if (!srt->send) {
 		if (crypto->recv_ready)
 			goto err;
 		memcpy(crypto->rx_secret, srt->secret, secretlen);
-		tfm = crypto_alloc_aead(cipher->aead, 0, flag);
+		crypto->rx_async = !(flag & CRYPTO_ALG_ASYNC);
+		tfm = quic_crypto_tfm_get(cipher, type);
 		if (IS_ERR(tfm)) {
 			err = PTR_ERR(tfm);
 			goto err;
 		}
 		crypto->rx_tfm[0] = tfm;
-		tfm = crypto_alloc_aead(cipher->aead, 0, flag);
+		tfm = quic_crypto_tfm_get(cipher, type);
 		if (IS_ERR(tfm)) {
 			err = PTR_ERR(tfm);
 			goto err;
 		}
 		crypto->rx_tfm[1] = tfm;
-		tfm = crypto_alloc_sync_skcipher(cipher->skc, 0, 0);
+		tfm = quic_crypto_tfm_get(cipher, QUIC_CRYPTO_TFM_SKCIPHER);
 		if (IS_ERR(tfm)) {
 			err = PTR_ERR(tfm);
 			goto err;
 		}
 		crypto->rx_hp_tfm = tfm;
 
-		err = quic_crypto_rx_keys_derive_and_install(crypto);
+		err = quic_crypto_keys_derive_and_install(crypto, 0, crypto->key_phase,
+							  crypto->rx_secret, true);
 		if (err)
 			goto err;
 		crypto->recv_ready = 1;
@@ -650,25 +1124,27 @@ int quic_crypto_set_secret(struct quic_crypto *crypto, struct quic_crypto_secret
 	if (crypto->send_ready)
 		goto err;
 	memcpy(crypto->tx_secret, srt->secret, secretlen);
-	tfm = crypto_alloc_aead(cipher->aead, 0, flag);
+	crypto->tx_async = !(flag & CRYPTO_ALG_ASYNC);
+	tfm = quic_crypto_tfm_get(cipher, type);
 	if (IS_ERR(tfm)) {
 		err = PTR_ERR(tfm);
 		goto err;
 	}
 	crypto->tx_tfm[0] = tfm;
-	tfm = crypto_alloc_aead(cipher->aead, 0, flag);
+	tfm = quic_crypto_tfm_get(cipher, type);
 	if (IS_ERR(tfm)) {
 		err = PTR_ERR(tfm);
 		goto err;
 	}
 	crypto->tx_tfm[1] = tfm;
-	tfm = crypto_alloc_sync_skcipher(cipher->skc, 0, 0);
+	tfm = quic_crypto_tfm_get(cipher, QUIC_CRYPTO_TFM_SKCIPHER);
 	if (IS_ERR(tfm)) {
 		err = PTR_ERR(tfm);
 		goto err;
 	}
 	crypto->tx_hp_tfm = tfm;
-	err = quic_crypto_tx_keys_derive_and_install(crypto);
+	err = quic_crypto_keys_derive_and_install(crypto, 1, crypto->key_phase, crypto->tx_secret,
+						  true);
 	if (err)
 		goto err;
 	crypto->send_ready = 1;
@@ -694,75 +1170,109 @@ int quic_crypto_get_secret(struct quic_crypto *crypto, struct quic_crypto_secret
 #define LABEL_V1	"quic ku"
 #define LABEL_V2	"quicv2 ku"
 
-int quic_crypto_key_update(struct quic_crypto *crypto)
+/* Derive the secrets of the next key phase and install their keys in the transforms of
+ * the other phase, which are unused once the previous phase is retired. This runs in
+ * process context under lock_sock(), when the connection is established and from
+ * quic_sock_key_work_schedule() after each retirement, as crypto_aead_setkey() may sleep.
+ * The key update itself then only flips the phase on the packet path.
+ */
+int quic_crypto_key_prepare(struct quic_crypto *crypto)
 {
-	u8 tx_secret[QUIC_SECRET_LEN], rx_secret[QUIC_SECRET_LEN];
 	struct quic_data l = {LABEL_V1, 7}, z = {}, k, srt;
+	u8 phase = !crypto->key_phase;
 	u32 secret_len;
 	int err;
 
-	if (crypto->key_pending || !crypto->recv_ready)
-		return -EINVAL;
+	if (crypto->key_pending || crypto->key_next_ready ||
+	    !crypto->send_ready || !crypto->recv_ready)
+		return 0;
 
 	secret_len = crypto->cipher->secretlen;
 	if (crypto->version == QUIC_VERSION_V2)
 		quic_data(&l, LABEL_V2, 9);
 
-	crypto->key_pending = 1;
-	memcpy(tx_secret, crypto->tx_secret, secret_len);
-	memcpy(rx_secret, crypto->rx_secret, secret_len);
-	crypto->key_phase = !crypto->key_phase;
-
-	quic_data(&srt, tx_secret, secret_len);
-	quic_data(&k, crypto->tx_secret, secret_len);
+	quic_data(&srt, crypto->tx_secret, secret_len);
+	quic_data(&k, crypto->tx_next_secret, secret_len);
 	err = quic_crypto_hkdf_expand(crypto->secret_tfm, &srt, &l, &z, &k);
 	if (err)
-		goto err;
-	err = quic_crypto_tx_keys_derive_and_install(crypto);
+		return err;
+	err = quic_crypto_keys_derive_and_install(crypto, 1, phase, crypto->tx_next_secret, false);
 	if (err)
-		goto err;
+		return err;
 
-	quic_data(&srt, rx_secret, secret_len);
-	quic_data(&k, crypto->rx_secret, secret_len);
+	quic_data(&srt, crypto->rx_secret, secret_len);
+	quic_data(&k, crypto->rx_next_secret, secret_len);
 	err = quic_crypto_hkdf_expand(crypto->secret_tfm, &srt, &l, &z, &k);
 	if (err)
-		goto err;
-	err = quic_crypto_rx_keys_derive_and_install(crypto);
+		return err;
+	err = quic_crypto_keys_derive_and_install(crypto, 0, phase, crypto->rx_next_secret, false);
 	if (err)
-		goto err;
+		return err;
+
+	crypto->key_next_queued = 0;
+	crypto->key_next_ready = 1;
 	return 0;
-err:
-	crypto->key_pending = 0;
-	memcpy(crypto->tx_secret, tx_secret, secret_len);
-	memcpy(crypto->rx_secret, rx_secret, secret_len);
+}
+EXPORT_SYMBOL_GPL(quic_crypto_key_prepare);
+
+/* Switch to the next key phase, whose keys are normally prepared already. They are only
+ * derived here if the update comes before quic_crypto_key_prepare() ran, such as when the
+ * peer starts a new update right after the previous phase is retired.
+ */
+int quic_crypto_key_update(struct quic_crypto *crypto)
+{
+	u32 secret_len;
+	int err;
+
+	if (crypto->key_pending || !crypto->recv_ready)
+		return -EINVAL;
+
+	if (!crypto->key_next_ready) {
+		err = quic_crypto_key_prepare(crypto);
+		if (err)
+			return err;
+	}
+
+	secret_len = crypto->cipher->secretlen;
+	memcpy(crypto->tx_secret, crypto->tx_next_secret, secret_len);
+	memcpy(crypto->rx_secret, crypto->rx_next_secret, secret_len);
 	crypto->key_phase = !crypto->key_phase;
-	return err;
+	crypto->key_next_queued = 0;
+	crypto->key_next_ready = 0;
+	crypto->key_pending = 1;
+	if (crypto->tx_offload || crypto->rx_offload)
+		quic_crypto_offload_update(crypto);
+	return 0;
 }
 EXPORT_SYMBOL_GPL(quic_crypto_key_update);
 
 void quic_crypto_destroy(struct quic_crypto *crypto)
 {
-	if (crypto->tag_tfm)
-		crypto_free_aead(crypto->tag_tfm);
-	if (crypto->rx_tfm[0])
-		crypto_free_aead(crypto->rx_tfm[0]);
-	if (crypto->rx_tfm[1])
-		crypto_free_aead(crypto->rx_tfm[1]);
-	if (crypto->tx_tfm[0])
-		crypto_free_aead(crypto->tx_tfm[0]);
-	if (crypto->tx_tfm[1])
-		crypto_free_aead(crypto->tx_tfm[1]);
-	if (crypto->secret_tfm)
-		crypto_free_shash(crypto->secret_tfm);
-	if (crypto->rx_hp_tfm)
-		crypto_free_skcipher(crypto->rx_hp_tfm);
-	if (crypto->tx_hp_tfm)
-		crypto_free_skcipher(crypto->tx_hp_tfm);
+	struct quic_cipher *cipher = crypto->cipher;
+	u8 type;
+
+	if (!cipher)
+		goto out;
 
+	if (crypto->tx_offload || crypto->rx_offload)
+		quic_crypto_offload_del(crypto);
+	type = quic_crypto_aead_type(crypto->rx_async);
+	quic_crypto_tfm_put(cipher, type, crypto->rx_tfm[0]);
+	quic_crypto_tfm_put(cipher, type, crypto->rx_tfm[1]);
+	type = quic_crypto_aead_type(crypto->tx_async);
+	quic_crypto_tfm_put(cipher, type, crypto->tx_tfm[0]);
+	quic_crypto_tfm_put(cipher, type, crypto->tx_tfm[1]);
+	quic_crypto_tfm_put(cipher, QUIC_CRYPTO_TFM_SHASH, crypto->secret_tfm);
+	quic_crypto_tfm_put(cipher, QUIC_CRYPTO_TFM_SKCIPHER, crypto->rx_hp_tfm);
+	quic_crypto_tfm_put(cipher, QUIC_CRYPTO_TFM_SKCIPHER, crypto->tx_hp_tfm);
+out:
 	memset(crypto, 0, offsetof(struct quic_crypto, send_offset));
 }
 EXPORT_SYMBOL_GPL(quic_crypto_destroy);
 
+/* Initial packets are always protected with AEAD_AES_128_GCM */
+#define QUIC_INITIAL_CIPHER	(&ciphers[TLS_CIPHER_AES_GCM_128 - QUIC_CIPHER_MIN])
+
 #define QUIC_INITIAL_SALT_V1    \
 	"\x38\x76\x2c\xf7\xf5\x59\x34\xb3\x4d\x17\x9a\xe6\xa4\xc8\x0c\xad\xcc\xbb\x7f\x0a"
 #define QUIC_INITIAL_SALT_V2    \
@@ -778,7 +1288,7 @@ int quic_crypto_initial_keys_install(struct quic_crypto *crypto, struct quic_con
 	u8 secret[32];
 	int err;
 
-	tfm = crypto_alloc_shash("hmac(sha256)", 0, 0);
+	tfm = quic_crypto_tfm_get(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_SHASH);
 	if (IS_ERR(tfm))
 		return PTR_ERR(tfm);
 	if (is_serv) {
@@ -819,39 +1329,99 @@ int quic_crypto_initial_keys_install(struct quic_crypto *crypto, struct quic_con
 		goto out;
 	err = quic_crypto_set_secret(crypto, &srt, version, CRYPTO_ALG_ASYNC);
 out:
-	crypto_free_shash(tfm);
+	quic_crypto_tfm_put(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_SHASH, tfm);
 	return err;
 }
 EXPORT_SYMBOL_GPL(quic_crypto_initial_keys_install);
 
+/* Install the Initial rx keys of the server side only. Once the crypto has been set up,
+ * the existing transforms are just rekeyed, so a listener can keep one crypto to probe
+ * the Initial packets of all new connections without allocating transforms each time.
+ */
+int quic_crypto_initial_rx_keys_install(struct quic_crypto *crypto, struct quic_conn_id *conn_id,
+					u32 version)
+{
+	struct quic_data salt, s, k, l, dcid, z = {};
+	struct quic_crypto_secret srt = {};
+	struct crypto_shash *tfm;
+	u8 secret[32];
+	char *sal;
+	int err;
+
+	if (crypto->recv_ready) {
+		tfm = crypto->secret_tfm;
+	} else {
+		tfm = quic_crypto_tfm_get(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_SHASH);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+	}
+	sal = QUIC_INITIAL_SALT_V1;
+	if (version == QUIC_VERSION_V2)
+		sal = QUIC_INITIAL_SALT_V2;
+	quic_data(&salt, sal, 20);
+	quic_data(&dcid, conn_id->data, conn_id->len);
+	quic_data(&s, secret, 32);
+	err = quic_crypto_hkdf_extract(tfm, &salt, &dcid, &s);
+	if (err)
+		goto out;
+
+	quic_data(&l, "client in", 9);
+	quic_data(&k, srt.secret, 32);
+	err = quic_crypto_hkdf_expand(tfm, &s, &l, &z, &k);
+	if (err)
+		goto out;
+
+	if (crypto->recv_ready) {
+		crypto->version = version;
+		memcpy(crypto->rx_secret, srt.secret, 32);
+		err = quic_crypto_keys_derive_and_install(crypto, 0, crypto->key_phase,
+							  crypto->rx_secret, true);
+		goto out;
+	}
+	srt.type = TLS_CIPHER_AES_GCM_128;
+	err = quic_crypto_set_secret(crypto, &srt, version, CRYPTO_ALG_ASYNC);
+	if (err)
+		quic_crypto_destroy(crypto);
+out:
+	if (tfm != crypto->secret_tfm)
+		quic_crypto_tfm_put(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_SHASH, tfm);
+	return err;
+}
+EXPORT_SYMBOL_GPL(quic_crypto_initial_rx_keys_install);
+
+/* Retry tags and address validation tokens are computed for every Retry a listener sends
+ * and every token it receives, so they use transforms keyed once instead of the ones in
+ * each sock's crypto. All of these transforms are sync, as CRYPTO_ALG_ASYNC is masked.
+ */
+static struct crypto_aead *quic_retry_tag_tfms[2] __read_mostly;	/* V1 and V2 */
+
+/* Larger requests, which no valid token or Retry needs, fall back to kzalloc() */
+static void *quic_crypto_scratch_get(struct crypto_aead *tfm, u32 ctx_size, u8 **iv,
+				     struct aead_request **req, struct scatterlist **sg,
+				     bool *scratch)
+{
+	return quic_crypto_aead_mem_get(tfm, ctx_size, iv, req, sg, 1, false, scratch);
+}
+
 #define QUIC_RETRY_KEY_V1 "\xbe\x0c\x69\x0b\x9f\x66\x57\x5a\x1d\x76\x6b\x54\xe3\x68\xc8\x4e"
 #define QUIC_RETRY_KEY_V2 "\x8f\xb4\xb0\x1b\x56\xac\x48\xe2\x60\xfb\xcb\xce\xad\x7c\xcc\x92"
 
 #define QUIC_RETRY_NONCE_V1 "\x46\x15\x99\xd3\x5d\x63\x2b\xf2\x23\x98\x25\xbb"
 #define QUIC_RETRY_NONCE_V2 "\xd8\x69\x69\xbc\x2d\x7c\x6d\x99\x90\xef\xb0\x4a"
 
-int quic_crypto_get_retry_tag(struct quic_crypto *crypto, struct sk_buff *skb,
-			      struct quic_conn_id *odcid, u32 version, u8 *tag)
+int quic_crypto_get_retry_tag(struct sk_buff *skb, struct quic_conn_id *odcid, u32 version,
+			      u8 *tag)
 {
-	struct crypto_aead *tfm = crypto->tag_tfm;
-	u8 *pseudo_retry, *p, *iv, *key;
+	struct crypto_aead *tfm = quic_retry_tag_tfms[version == QUIC_VERSION_V2];
+	u8 *pseudo_retry, *p, *iv;
 	struct aead_request *req;
 	struct scatterlist *sg;
+	bool scratch;
 	u32 plen;
 	int err;
 
-	err = crypto_aead_setauthsize(tfm, QUIC_TAG_LEN);
-	if (err)
-		return err;
-	key = QUIC_RETRY_KEY_V1;
-	if (version == QUIC_VERSION_V2)
-		key = QUIC_RETRY_KEY_V2;
-	err = crypto_aead_setkey(tfm, key, 16);
-	if (err)
-		return err;
-
 	plen = 1 + odcid->len + skb->len - 16;
-	pseudo_retry = quic_crypto_aead_mem_alloc(tfm, plen + 16, &iv, &req, &sg, 1);
+	pseudo_retry = quic_crypto_scratch_get(tfm, plen + 16, &iv, &req, &sg, &scratch);
 	if (!pseudo_retry)
 		return -ENOMEM;
 
@@ -870,91 +1440,201 @@ int quic_crypto_get_retry_tag(struct quic_crypto *crypto, struct sk_buff *skb,
 	err = crypto_aead_encrypt(req);
 	if (!err)
 		memcpy(tag, p, 16);
-	kfree(pseudo_retry);
+	quic_crypto_scratch_put(pseudo_retry, scratch);
 	return err;
 }
 EXPORT_SYMBOL_GPL(quic_crypto_get_retry_tag);
 
-int quic_crypto_generate_token(struct quic_crypto *crypto, void *addr, u32 addrlen,
+static struct crypto_aead *quic_crypto_retry_tfm_get(u8 *key)
+{
+	struct crypto_aead *tfm;
+	int err;
+
+	tfm = quic_crypto_tfm_get(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_AEAD);
+	if (IS_ERR(tfm))
+		return tfm;
+	err = crypto_aead_setauthsize(tfm, QUIC_TAG_LEN);
+	if (!err)
+		err = crypto_aead_setkey(tfm, key, 16);
+	if (err) {
+		quic_crypto_tfm_put(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_AEAD, tfm);
+		return ERR_PTR(err);
+	}
+	return tfm;
+}
+
+static void quic_crypto_token_key_free(struct quic_token_key *key)
+{
+	if (!key)
+		return;
+	quic_crypto_tfm_put(QUIC_INITIAL_CIPHER, QUIC_CRYPTO_TFM_AEAD, key->tfm);
+	kfree_sensitive(key);
+}
+
+static struct quic_token_key *quic_crypto_token_key_alloc(void)
+{
+	struct quic_token_key *key;
+	u8 k[16];
+
+	key = kzalloc(sizeof(*key), GFP_KERNEL);
+	if (!key)
+		return NULL;
+
+	get_random_bytes(k, sizeof(k));
+	key->tfm = quic_crypto_retry_tfm_get(k);
+	memzero_explicit(k, sizeof(k));
+	if (IS_ERR(key->tfm)) {
+		kfree_sensitive(key);
+		return NULL;
+	}
+	return key;
+}
+
+/* Tokens from NEW_TOKEN frames are valid for 36 seconds, so a key that stops being the
+ * current one is kept for one more lifetime to verify the tokens it still protects.
+ */
+#define QUIC_TOKEN_KEY_LIFETIME	(60 * HZ)
+
+static void quic_crypto_token_keys_rotate(struct work_struct *work)
+{
+	struct quic_token_keys *keys = container_of(to_delayed_work(work),
+						    struct quic_token_keys, work);
+	struct quic_token_key *key, *old;
+	u8 phase = !keys->phase;
+
+	key = quic_crypto_token_key_alloc();
+	if (key) {
+		old = rcu_replace_pointer(keys->key[phase], key, true);
+		smp_store_release(&keys->phase, phase);
+		synchronize_rcu();
+		quic_crypto_token_key_free(old);
+	}
+	schedule_delayed_work(&keys->work, QUIC_TOKEN_KEY_LIFETIME);
+}
+
+int quic_crypto_token_keys_init(struct quic_token_keys *keys)
+{
+	struct quic_token_key *key;
+
+	key = quic_crypto_token_key_alloc();
+	if (!key)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(keys->key[0], key);
+	RCU_INIT_POINTER(keys->key[1], NULL);
+	keys->phase = 0;
+	INIT_DELAYED_WORK(&keys->work, quic_crypto_token_keys_rotate);
+	schedule_delayed_work(&keys->work, QUIC_TOKEN_KEY_LIFETIME);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_crypto_token_keys_init);
+
+void quic_crypto_token_keys_free(struct quic_token_keys *keys)
+{
+	cancel_delayed_work_sync(&keys->work);
+	synchronize_rcu();
+	quic_crypto_token_key_free(rcu_dereference_protected(keys->key[0], true));
+	quic_crypto_token_key_free(rcu_dereference_protected(keys->key[1], true));
+	RCU_INIT_POINTER(keys->key[0], NULL);
+	RCU_INIT_POINTER(keys->key[1], NULL);
+}
+EXPORT_SYMBOL_GPL(quic_crypto_token_keys_free);
+
+/* Token {
+ *   Flags (8) = QUIC_TOKEN_FLAG_*,
+ *   Nonce (96),
+ *   Client Address (..),
+ *   Encrypted Timestamp (32),
+ *   Encrypted Original Destination Connection ID (0..160),
+ *   Tag (128),
+ * }
+ *
+ * The flags are set by the caller, except for the key phase.  The nonce is random for
+ * each token, as AES-GCM must never see the same one twice under a key.
+ */
+int quic_crypto_generate_token(struct quic_token_keys *keys, void *addr, u32 addrlen,
 			       struct quic_conn_id *conn_id, u8 *token, u32 *tlen)
 {
-	u8 key[16], iv[12], *retry_token, *tx_iv, *p;
-	struct crypto_aead *tfm = crypto->tag_tfm;
 	u32 ts = jiffies_to_usecs(jiffies), len;
-	struct quic_data srt = {}, k, i;
+	struct quic_token_key *key;
+	u8 *retry_token, *iv, *p;
 	struct aead_request *req;
 	struct scatterlist *sg;
-	int err;
+	int err = -EINVAL;
+	bool scratch;
+	u8 phase;
+
+	rcu_read_lock();
+	phase = smp_load_acquire(&keys->phase);
+	key = rcu_dereference(keys->key[phase]);
+	if (!key)
+		goto out;
 
-	quic_data(&srt, quic_random_data, 32);
-	quic_data(&k, key, 16);
-	quic_data(&i, iv, 12);
-	err = quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &i, NULL, QUIC_VERSION_V1);
-	if (err)
-		return err;
-	err = crypto_aead_setauthsize(tfm, QUIC_TAG_LEN);
-	if (err)
-		return err;
-	err = crypto_aead_setkey(tfm, key, 16);
-	if (err)
-		return err;
-	token++;
 	len = addrlen + sizeof(ts) + conn_id->len + QUIC_TAG_LEN;
-	retry_token = quic_crypto_aead_mem_alloc(tfm, len, &tx_iv, &req, &sg, 1);
+	err = -ENOMEM;
+	retry_token = quic_crypto_scratch_get(key->tfm, len, &iv, &req, &sg, &scratch);
 	if (!retry_token)
-		return -ENOMEM;
+		goto out;
 
 	p = retry_token;
 	p = quic_put_data(p, addr, addrlen);
 	p = quic_put_int(p, ts, sizeof(ts));
 	quic_put_data(p, conn_id->data, conn_id->len);
 	sg_init_one(sg, retry_token, len);
-	aead_request_set_tfm(req, tfm);
+	get_random_bytes(iv, QUIC_IV_LEN);
+	memcpy(token + 1, iv, QUIC_IV_LEN);
+	aead_request_set_tfm(req, key->tfm);
 	aead_request_set_ad(req, addrlen);
 	aead_request_set_crypt(req, sg, sg, len - addrlen - QUIC_TAG_LEN, iv);
 	err = crypto_aead_encrypt(req);
 	if (!err) {
-		memcpy(token, retry_token, len);
-		*tlen = len + 1;
+		token[0] &= ~QUIC_TOKEN_FLAG_PHASE;
+		if (phase)
+			token[0] |= QUIC_TOKEN_FLAG_PHASE;
+		memcpy(token + 1 + QUIC_IV_LEN, retry_token, len);
+		*tlen = 1 + QUIC_IV_LEN + len;
 	}
-	kfree(retry_token);
+	quic_crypto_scratch_put(retry_token, scratch);
+out:
+	rcu_read_unlock();
 	return err;
 }
 EXPORT_SYMBOL_GPL(quic_crypto_generate_token);
 
-int quic_crypto_verify_token(struct quic_crypto *crypto, void *addr, u32 addrlen,
+int quic_crypto_verify_token(struct quic_token_keys *keys, void *addr, u32 addrlen,
 			     struct quic_conn_id *conn_id, u8 *token, u32 len)
 {
-	u8 key[16], iv[12], *retry_token, *rx_iv, *p, retry = *token;
+	u8 *retry_token, *iv, *p, *nonce, retry = token[0] & QUIC_TOKEN_FLAG_RETRY;
 	u32 ts = jiffies_to_usecs(jiffies), timeout = 3000000;
-	struct crypto_aead *tfm = crypto->tag_tfm;
-	struct quic_data srt = {}, k, i;
+	u8 phase = !!(token[0] & QUIC_TOKEN_FLAG_PHASE);
+	struct quic_token_key *key;
 	struct aead_request *req;
 	struct scatterlist *sg;
-	int err;
+	int err = -EINVAL;
+	bool scratch;
 	u64 t;
 
-	quic_data(&srt, quic_random_data, 32);
-	quic_data(&k, key, 16);
-	quic_data(&i, iv, 12);
-	err = quic_crypto_keys_derive(crypto->secret_tfm, &srt, &k, &i, NULL, QUIC_VERSION_V1);
-	if (err)
-		return err;
-	err = crypto_aead_setauthsize(tfm, QUIC_TAG_LEN);
-	if (err)
-		return err;
-	err = crypto_aead_setkey(tfm, key, 16);
-	if (err)
+	if (len < 1 + QUIC_IV_LEN + addrlen + 4 + QUIC_TAG_LEN ||
+	    len > 1 + QUIC_IV_LEN + addrlen + 4 + QUIC_CONN_ID_MAX_LEN + QUIC_TAG_LEN)
 		return err;
-	len--;
-	token++;
-	retry_token = quic_crypto_aead_mem_alloc(tfm, len, &rx_iv, &req, &sg, 1);
+	nonce = token + 1;
+	token += 1 + QUIC_IV_LEN;
+	len -= 1 + QUIC_IV_LEN;
+
+	rcu_read_lock();
+	key = rcu_dereference(keys->key[phase]);
+	if (!key)
+		goto unlock;
+
+	err = -ENOMEM;
+	retry_token = quic_crypto_scratch_get(key->tfm, len, &iv, &req, &sg, &scratch);
 	if (!retry_token)
-		return -ENOMEM;
+		goto unlock;
 
 	memcpy(retry_token, token, len);
 	sg_init_one(sg, retry_token, len);
-	aead_request_set_tfm(req, tfm);
+	memcpy(iv, nonce, QUIC_IV_LEN);
+	aead_request_set_tfm(req, key->tfm);
 	aead_request_set_ad(req, addrlen);
 	aead_request_set_crypt(req, sg, sg, len - addrlen, iv);
 	err = crypto_aead_decrypt(req);
@@ -972,14 +1652,14 @@ int quic_crypto_verify_token(struct quic_crypto *crypto, void *addr, u32 addrlen
 	if (!quic_get_int(&p, &len, &t, 4) || t + timeout < ts)
 		goto out;
 	len -= QUIC_TAG_LEN;
-	if (len > QUIC_CONN_ID_MAX_LEN)
-		goto out;
 
 	if (retry)
 		quic_conn_id_update(conn_id, p, len);
 	err = 0;
 out:
-	kfree(retry_token);
+	quic_crypto_scratch_put(retry_token, scratch);
+unlock:
+	rcu_read_unlock();
 	return err;
 }
 EXPORT_SYMBOL_GPL(quic_crypto_verify_token);
@@ -1018,7 +1698,61 @@ int quic_crypto_generate_session_ticket_key(struct quic_crypto *crypto, void *da
 }
 EXPORT_SYMBOL_GPL(quic_crypto_generate_session_ticket_key);
 
-void quic_crypto_init(void)
+int quic_crypto_init(void)
 {
+	struct crypto_aead *tfm;
+	int i, j, cpu;
+	void *mem;
+
+	for (i = 0; i < ARRAY_SIZE(ciphers); i++)
+		for (j = 0; j < QUIC_CRYPTO_TFM_MAX; j++)
+			spin_lock_init(&quic_crypto_pools[i][j].lock);
 	get_random_bytes(quic_random_data, 32);
+
+	quic_crypto_scratch = alloc_percpu(void *);
+	if (!quic_crypto_scratch)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		mem = kmalloc_node(QUIC_CRYPTO_SCRATCH_LEN, GFP_KERNEL, cpu_to_node(cpu));
+		if (!mem) {
+			quic_crypto_exit();
+			return -ENOMEM;
+		}
+		*per_cpu_ptr(quic_crypto_scratch, cpu) = mem;
+	}
+	for (i = 0; i < ARRAY_SIZE(quic_retry_tag_tfms); i++) {
+		tfm = quic_crypto_retry_tfm_get(i ? QUIC_RETRY_KEY_V2 : QUIC_RETRY_KEY_V1);
+		if (IS_ERR(tfm)) {
+			quic_crypto_exit();
+			return PTR_ERR(tfm);
+		}
+		quic_retry_tag_tfms[i] = tfm;
+	}
+	return 0;
+}
+
+void quic_crypto_exit(void)
+{
+	struct quic_crypto_pool *pool;
+	int i, j, cpu;
+
+	for (i = 0; i < ARRAY_SIZE(quic_retry_tag_tfms); i++) {
+		if (quic_retry_tag_tfms[i])
+			crypto_free_aead(quic_retry_tag_tfms[i]);
+		quic_retry_tag_tfms[i] = NULL;
+	}
+	if (quic_crypto_scratch) {
+		for_each_possible_cpu(cpu)
+			kfree(*per_cpu_ptr(quic_crypto_scratch, cpu));
+		free_percpu(quic_crypto_scratch);
+		quic_crypto_scratch = NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ciphers); i++) {
+		for (j = 0; j < QUIC_CRYPTO_TFM_MAX; j++) {
+			pool = &quic_crypto_pools[i][j];
+			while (pool->count)
+				quic_crypto_tfm_free(pool->tfms[--pool->count], j);
+		}
+	}
 }
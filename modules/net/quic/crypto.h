@@ -21,18 +21,38 @@ struct quic_cipher {
 	char *skc;
 };
 
+#define QUIC_TOKEN_FLAG_RETRY	0x1	/* from a Retry packet, not a NEW_TOKEN frame */
+#define QUIC_TOKEN_FLAG_PHASE	0x2	/* the token key that protects it */
+
+/* flags, nonce, an IPv6 address, timestamp, the longest conn ID and tag, rounded up */
+#define QUIC_TOKEN_MAX_LEN	96
+
+struct quic_token_key {
+	struct crypto_aead *tfm;
+};
+
+/* Per-netns keys for address validation tokens, replaced by random ones periodically.
+ * The current key is key[phase], and the other one is kept to verify older tokens.
+ */
+struct quic_token_keys {
+	struct quic_token_key __rcu *key[2];
+	struct delayed_work work;
+	u8 phase;
+};
+
 struct quic_crypto {
 	struct crypto_skcipher *tx_hp_tfm;
 	struct crypto_skcipher *rx_hp_tfm;
 	struct crypto_shash *secret_tfm;
 	struct crypto_aead *tx_tfm[2];
 	struct crypto_aead *rx_tfm[2];
-	struct crypto_aead *tag_tfm;
 	struct quic_cipher *cipher;
 	u32 cipher_type;
 
 	u8 tx_secret[QUIC_SECRET_LEN];
 	u8 rx_secret[QUIC_SECRET_LEN];
+	u8 tx_next_secret[QUIC_SECRET_LEN];	/* of the next key phase */
+	u8 rx_next_secret[QUIC_SECRET_LEN];
 	u8 tx_iv[2][QUIC_IV_LEN];
 	u8 rx_iv[2][QUIC_IV_LEN];
 
@@ -45,11 +65,40 @@ struct quic_crypto {
 	u8 send_ready:1;
 	u8 recv_ready:1;
 	u8 key_phase:1;
+	u8 key_next_ready:1;	/* next phase keys are in the transforms of !key_phase */
+	u8 key_next_queued:1;	/* quic_crypto_key_prepare() is queued */
+	u8 tx_async:1;
+	u8 rx_async:1;
+	u8 tx_offload:1;
+	u8 rx_offload:1;
+	struct net_device *offload_dev;	/* held, cleared by quic_crypto_offload_unregister() */
+	struct list_head offload_list;	/* in the offloaded crypto list while offload_dev set */
 
 	u64 send_offset;
 	u64 recv_offset;
 };
 
+/* Keys of one direction in the current key phase handed to an offloading device */
+struct quic_crypto_offload_keys {
+	u32 cipher_type;
+	u32 keylen;
+	u8 key[32];
+	u8 hp_key[32];
+	u8 iv[QUIC_IV_LEN];
+	u8 key_phase;
+};
+
+/* Ops of a device protecting 1-RTT packets inline. All are called in atomic context,
+ * and the crypto pointer identifies the connection in del and update.
+ */
+struct quic_crypto_offload_ops {
+	int (*add)(struct net_device *dev, struct sock *sk, struct quic_crypto *crypto,
+		   struct quic_crypto_offload_keys *keys, u8 send);
+	int (*update)(struct net_device *dev, struct quic_crypto *crypto,
+		      struct quic_crypto_offload_keys *keys, u8 send);
+	void (*del)(struct net_device *dev, struct quic_crypto *crypto, u8 send);
+};
+
 static inline u32 quic_crypto_cipher_type(struct quic_crypto *crypto)
 {
 	return crypto->cipher_type;
@@ -105,26 +154,49 @@ static inline void quic_crypto_set_key_update_time(struct quic_crypto *crypto, u
 	crypto->key_update_time = key_update_time;
 }
 
+/* Whether the socket work should prepare the keys of the next phase, which is true once
+ * after the previous phase is retired.
+ */
+static inline bool quic_crypto_key_prepare_queue(struct quic_crypto *crypto)
+{
+	if (crypto->key_pending || crypto->key_next_ready || crypto->key_next_queued ||
+	    !crypto->send_ready || !crypto->recv_ready)
+		return false;
+	crypto->key_next_queued = 1;
+	return true;
+}
+
 int quic_crypto_set_secret(struct quic_crypto *crypto, struct quic_crypto_secret *srt,
 			   u32 version, u8 flag);
 int quic_crypto_get_secret(struct quic_crypto *crypto, struct quic_crypto_secret *srt);
 int quic_crypto_encrypt(struct quic_crypto *crypto, struct sk_buff *skb);
 int quic_crypto_decrypt(struct quic_crypto *crypto, struct sk_buff *skb);
+int quic_crypto_header_encrypt_batch(struct quic_crypto *crypto, struct sk_buff *head);
+int quic_crypto_key_prepare(struct quic_crypto *crypto);
 int quic_crypto_key_update(struct quic_crypto *crypto);
 
+int quic_crypto_offload_register(struct net_device *dev, const struct quic_crypto_offload_ops *ops);
+void quic_crypto_offload_unregister(struct net_device *dev);
+void quic_crypto_offload_add(struct quic_crypto *crypto, struct sock *sk, u8 send);
+
 int quic_crypto_initial_keys_install(struct quic_crypto *crypto, struct quic_conn_id *conn_id,
 				     u32 version, bool is_serv);
+int quic_crypto_initial_rx_keys_install(struct quic_crypto *crypto, struct quic_conn_id *conn_id,
+					u32 version);
 int quic_crypto_generate_session_ticket_key(struct quic_crypto *crypto, void *data,
 					    u32 len, u8 *key, u32 key_len);
 int quic_crypto_generate_stateless_reset_token(struct quic_crypto *crypto, void *data,
 					       u32 len, u8 *key, u32 key_len);
 
-int quic_crypto_generate_token(struct quic_crypto *crypto, void *addr, u32 addrlen,
+int quic_crypto_token_keys_init(struct quic_token_keys *keys);
+void quic_crypto_token_keys_free(struct quic_token_keys *keys);
+int quic_crypto_generate_token(struct quic_token_keys *keys, void *addr, u32 addrlen,
 			       struct quic_conn_id *conn_id, u8 *token, u32 *tlen);
-int quic_crypto_get_retry_tag(struct quic_crypto *crypto, struct sk_buff *skb,
-			      struct quic_conn_id *odcid, u32 version, u8 *tag);
-int quic_crypto_verify_token(struct quic_crypto *crypto, void *addr, u32 addrlen,
+int quic_crypto_verify_token(struct quic_token_keys *keys, void *addr, u32 addrlen,
 			     struct quic_conn_id *conn_id, u8 *token, u32 len);
+int quic_crypto_get_retry_tag(struct sk_buff *skb, struct quic_conn_id *odcid, u32 version,
+			      u8 *tag);
 
 void quic_crypto_destroy(struct quic_crypto *crypto);
-void quic_crypto_init(void);
+int quic_crypto_init(void);
+void quic_crypto_exit(void);
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is part of the QUIC kernel implementation
+ *
+ * Socket monitoring via inet_diag, so that ss and similar tools can dump
+ * QUIC sockets with their addresses, connection IDs, ALPN, streams, queue
+ * memory and congestion state.
+ *
+ * Written or modified by:
+ *    Xin Long <lucien.xin@gmail.com>
+ */
+
+#include <linux/inet_diag.h>
+#include <linux/sock_diag.h>
+#include <linux/version.h>
+#include <net/netlink.h>
+
+#include "socket.h"
+
+static void quic_diag_get_cid(struct quic_conn_id_set *id_set, u8 *data, u8 *len)
+{
+	struct quic_conn_id *id = quic_conn_id_active(id_set);
+
+	if (!id)
+		return;
+	*len = id->len;
+	memcpy(data, id->data, id->len);
+}
+
+static void quic_diag_get_info(struct sock *sk, struct inet_diag_msg *r, void *_info)
+{
+	struct quic_stream_table *streams = quic_streams(sk);
+	struct quic_diag_info *info = _info;
+	struct quic_data *alpn = quic_alpn(sk);
+
+	r->idiag_rqueue = sk_rmem_alloc_get(sk);
+	r->idiag_wqueue = READ_ONCE(sk->sk_wmem_queued);
+	if (!info)
+		return;
+
+	memset(info, 0, sizeof(*info));
+	quic_sock_info(sk, &info->info);
+	quic_diag_get_cid(quic_source(sk), info->source_cid, &info->source_cid_len);
+	quic_diag_get_cid(quic_dest(sk), info->dest_cid, &info->dest_cid_len);
+
+	info->alpn_len = min_t(u32, alpn->len, QUIC_DIAG_ALPN_LEN);
+	if (info->alpn_len)
+		memcpy(info->alpn, alpn->data, info->alpn_len);
+	info->version = quic_config(sk)->version;
+
+	info->send_streams_bidi = streams->send.streams_bidi;
+	info->send_streams_uni = streams->send.streams_uni;
+	info->recv_streams_bidi = streams->recv.streams_bidi;
+	info->recv_streams_uni = streams->recv.streams_uni;
+}
+
+static size_t quic_diag_msg_size(void)
+{
+	return nlmsg_total_size(sizeof(struct inet_diag_msg)) + inet_diag_msg_attrs_size() +
+	       nla_total_size(sizeof(u32) * SK_MEMINFO_VARS) +
+	       nla_total_size_64bit(sizeof(struct quic_diag_info)) +
+	       nla_total_size(QUIC_CONG_NAME_MAX);
+}
+
+/* Called with the socket locked, as the connection IDs and ALPN may be freed or replaced
+ * by the socket's owner or in softirq.
+ */
+static int quic_diag_fill(struct sock *sk, struct sk_buff *skb, struct netlink_callback *cb,
+			  const struct inet_diag_req_v2 *req, u16 flags, bool net_admin)
+{
+	struct user_namespace *user_ns = sk_user_ns(NETLINK_CB(cb->skb).sk);
+	struct quic_cong_ops *ops = quic_cong(sk)->ops;
+	struct quic_diag_info *info = NULL;
+	int ext = req->idiag_ext;
+	struct inet_diag_msg *r;
+	struct nlmsghdr *nlh;
+	struct nlattr *attr;
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type, sizeof(*r), flags);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	r = nlmsg_data(nlh);
+	inet_diag_msg_common_fill(r, sk);
+	r->idiag_state = sk->sk_state;
+	r->idiag_timer = 0;
+	r->idiag_retrans = 0;
+	r->idiag_expires = 0;
+
+	if (inet_diag_msg_attrs_fill(sk, skb, r, ext, user_ns, net_admin))
+		goto err;
+
+	if ((ext & (1 << (INET_DIAG_SKMEMINFO - 1))) &&
+	    sock_diag_put_meminfo(sk, skb, INET_DIAG_SKMEMINFO))
+		goto err;
+
+	if (ext & (1 << (INET_DIAG_INFO - 1))) {
+		attr = nla_reserve_64bit(skb, INET_DIAG_INFO, sizeof(*info), INET_DIAG_PAD);
+		if (!attr)
+			goto err;
+		info = nla_data(attr);
+	}
+	quic_diag_get_info(sk, r, info);
+
+	if ((ext & (1 << (INET_DIAG_CONG - 1))) && ops &&
+	    nla_put_string(skb, INET_DIAG_CONG, ops->name))
+		goto err;
+
+	nlmsg_end(skb, nlh);
+	return 0;
+
+err:
+	nlmsg_cancel(skb, nlh);
+	return -EMSGSIZE;
+}
+
+static bool quic_diag_match(struct sock *sk, struct inet_diag_dump_data *cb_data,
+			    const struct inet_diag_req_v2 *r)
+{
+	if (!(r->idiag_states & (1 << sk->sk_state)))
+		return false;
+	if (r->sdiag_family != AF_UNSPEC && sk->sk_family != r->sdiag_family)
+		return false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+	return inet_diag_bc_sk(cb_data, sk);
+#else
+	return inet_diag_bc_sk(cb_data->inet_diag_nla_bc, sk);
+#endif
+}
+
+#define QUIC_DIAG_BATCH	32
+
+/* cb->args[0] is the hash slot to resume from and cb->args[1] the sockets to skip in it.
+ * The sockets in a slot are held in batches under the hash lock and filled after it is
+ * dropped, as filling needs the socket lock.
+ */
+static void quic_diag_dump(struct sk_buff *skb, struct netlink_callback *cb,
+			   const struct inet_diag_req_v2 *r)
+{
+	bool net_admin = netlink_net_capable(cb->skb, CAP_NET_ADMIN);
+	u32 slot = cb->args[0], s_num = cb->args[1], num = 0, accum, i;
+	struct inet_diag_dump_data *cb_data = cb->data;
+	struct sock *sk_arr[QUIC_DIAG_BATCH];
+	u32 num_arr[QUIC_DIAG_BATCH];
+	struct net *net = sock_net(skb->sk);
+	struct hlist_nulls_node *node;
+	struct quic_hash_head *head;
+	struct sock *sk;
+	int err = 0;
+	bool slow;
+
+	for (; slot < quic_sock_hash_size(); s_num = 0, slot++) {
+		head = quic_sock_hash(slot);
+		if (hlist_nulls_empty(&head->nulls_head))
+			continue;
+next_batch:
+		num = 0;
+		accum = 0;
+		spin_lock_bh(&head->lock);
+		sk_nulls_for_each(sk, node, &head->nulls_head) {
+			if (!net_eq(sock_net(sk), net))
+				continue;
+			if (num < s_num || !quic_diag_match(sk, cb_data, r))
+				goto next;
+			sock_hold(sk);
+			num_arr[accum] = num;
+			sk_arr[accum] = sk;
+			if (++accum == QUIC_DIAG_BATCH)
+				break;
+next:
+			num++;
+		}
+		spin_unlock_bh(&head->lock);
+
+		for (i = 0; i < accum; i++) {
+			sk = sk_arr[i];
+			if (!err) {
+				slow = lock_sock_fast(sk);
+				err = quic_diag_fill(sk, skb, cb, r, NLM_F_MULTI, net_admin);
+				unlock_sock_fast(sk, slow);
+				if (err)
+					num = num_arr[i];
+			}
+			sock_put(sk);
+		}
+		if (err)
+			break;
+		cond_resched();
+		if (accum == QUIC_DIAG_BATCH) {
+			s_num = num + 1;
+			goto next_batch;
+		}
+	}
+	cb->args[0] = slot;
+	cb->args[1] = num;
+}
+
+static bool quic_diag_id_match(struct sock *sk, const struct inet_diag_req_v2 *req)
+{
+	const struct inet_diag_sockid *id = &req->id;
+	struct inet_sock *inet = inet_sk(sk);
+
+	if (sk->sk_family != req->sdiag_family ||
+	    id->idiag_sport != inet->inet_sport || id->idiag_dport != inet->inet_dport)
+		return false;
+	if (sk->sk_family == AF_INET6)
+		return !memcmp(id->idiag_src, &sk->sk_v6_rcv_saddr, sizeof(struct in6_addr)) &&
+		       !memcmp(id->idiag_dst, &sk->sk_v6_daddr, sizeof(struct in6_addr));
+	return id->idiag_src[0] == inet->inet_rcv_saddr && id->idiag_dst[0] == inet->inet_daddr;
+}
+
+/* Requests for a single socket are rare, so walk the whole table rather than hash the
+ * sockid, whose addresses may be v4-mapped while the paths are not.
+ */
+static struct sock *quic_diag_lookup(struct net *net, const struct inet_diag_req_v2 *req)
+{
+	struct hlist_nulls_node *node;
+	struct quic_hash_head *head;
+	struct sock *sk;
+	u32 slot;
+
+	for (slot = 0; slot < quic_sock_hash_size(); slot++) {
+		head = quic_sock_hash(slot);
+		spin_lock_bh(&head->lock);
+		sk_nulls_for_each(sk, node, &head->nulls_head) {
+			if (net_eq(sock_net(sk), net) && quic_diag_id_match(sk, req)) {
+				sock_hold(sk);
+				spin_unlock_bh(&head->lock);
+				return sk;
+			}
+		}
+		spin_unlock_bh(&head->lock);
+	}
+	return NULL;
+}
+
+static int quic_diag_dump_one(struct netlink_callback *cb, const struct inet_diag_req_v2 *req)
+{
+	struct sk_buff *in_skb = cb->skb;
+	struct net *net = sock_net(in_skb->sk);
+	struct sk_buff *rep;
+	struct sock *sk;
+	int err;
+
+	sk = quic_diag_lookup(net, req);
+	if (!sk)
+		return -ENOENT;
+
+	err = sock_diag_check_cookie(sk, req->id.idiag_cookie);
+	if (err)
+		goto out;
+
+	err = -ENOMEM;
+	rep = nlmsg_new(quic_diag_msg_size(), GFP_KERNEL);
+	if (!rep)
+		goto out;
+
+	lock_sock(sk);
+	err = quic_diag_fill(sk, rep, cb, req, 0, netlink_net_capable(in_skb, CAP_NET_ADMIN));
+	release_sock(sk);
+	if (err) {
+		WARN_ON(err == -EMSGSIZE);
+		kfree_skb(rep);
+		goto out;
+	}
+	err = nlmsg_unicast(net->diag_nlsk, rep, NETLINK_CB(in_skb).portid);
+out:
+	sock_put(sk);
+	return err;
+}
+
+static const struct inet_diag_handler quic_diag_handler = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	.owner		 = THIS_MODULE,
+#endif
+	.dump		 = quic_diag_dump,
+	.dump_one	 = quic_diag_dump_one,
+	.idiag_get_info	 = quic_diag_get_info,
+	.idiag_type	 = IPPROTO_QUIC,
+	.idiag_info_size = sizeof(struct quic_diag_info),
+};
+
+static int __init quic_diag_init(void)
+{
+	return inet_diag_register(&quic_diag_handler);
+}
+
+static void __exit quic_diag_exit(void)
+{
+	inet_diag_unregister(&quic_diag_handler);
+}
+
+module_init(quic_diag_init);
+module_exit(quic_diag_exit);
+
+MODULE_ALIAS_NET_PF_PROTO_TYPE(PF_NETLINK, NETLINK_SOCK_DIAG, 2-261 /* AF_INET - IPPROTO_QUIC */);
+MODULE_AUTHOR("Xin Long <lucien.xin@gmail.com>");
+MODULE_DESCRIPTION("QUIC socket monitoring via SOCK_DIAG");
+MODULE_LICENSE("GPL");
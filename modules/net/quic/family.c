@@ -43,6 +43,7 @@ struct quic_proto_family_ops {
 	int	(*get_sk_addr)(struct socket *sock, struct sockaddr *addr, int peer);
 	void	(*set_sk_addr)(struct sock *sk, union quic_addr *addr, bool src);
 	void	(*set_sk_ecn)(struct sock *sk, u8 ecn);
+	int	(*recv_error)(struct sock *sk, struct msghdr *msg, int len);
 
 	int	(*getsockopt)(struct sock *sk, int level, int optname, char __user *optval,
 			      int __user *optlen);
@@ -462,7 +463,9 @@ static void quic_v4_set_sk_addr(struct sock *sk, union quic_addr *a, bool src)
 {
 	if (src) {
 		inet_sk(sk)->inet_sport = a->v4.sin_port;
+		inet_sk(sk)->inet_num = ntohs(a->v4.sin_port);
 		inet_sk(sk)->inet_saddr = a->v4.sin_addr.s_addr;
+		inet_sk(sk)->inet_rcv_saddr = a->v4.sin_addr.s_addr;
 	} else {
 		inet_sk(sk)->inet_dport = a->v4.sin_port;
 		inet_sk(sk)->inet_daddr = a->v4.sin_addr.s_addr;
@@ -473,6 +476,7 @@ static void quic_v6_set_sk_addr(struct sock *sk, union quic_addr *a, bool src)
 {
 	if (src) {
 		inet_sk(sk)->inet_sport = a->v4.sin_port;
+		inet_sk(sk)->inet_num = ntohs(a->v4.sin_port);
 		if (a->sa.sa_family == AF_INET) {
 			sk->sk_v6_rcv_saddr.s6_addr32[0] = 0;
 			sk->sk_v6_rcv_saddr.s6_addr32[1] = 0;
@@ -505,6 +509,16 @@ static void quic_v6_set_sk_ecn(struct sock *sk, u8 ecn)
 	inet6_sk(sk)->tclass = ((inet6_sk(sk)->tclass & ~INET_ECN_MASK) | ecn);
 }
 
+static int quic_v4_recv_error(struct sock *sk, struct msghdr *msg, int len)
+{
+	return sock_recv_errqueue(sk, msg, len, SOL_IP, IP_RECVERR);
+}
+
+static int quic_v6_recv_error(struct sock *sk, struct msghdr *msg, int len)
+{
+	return sock_recv_errqueue(sk, msg, len, SOL_IPV6, IPV6_RECVERR);
+}
+
 static struct quic_proto_family_ops quic_pf_inet = {
 	.get_user_addr		= quic_v4_get_user_addr,
 	.get_pref_addr		= quic_v4_get_pref_addr,
@@ -513,6 +527,7 @@ static struct quic_proto_family_ops quic_pf_inet = {
 	.get_sk_addr		= quic_v4_get_sk_addr,
 	.set_sk_addr		= quic_v4_set_sk_addr,
 	.set_sk_ecn		= quic_v4_set_sk_ecn,
+	.recv_error		= quic_v4_recv_error,
 	.setsockopt		= ip_setsockopt,
 	.getsockopt		= ip_getsockopt,
 };
@@ -525,6 +540,7 @@ static struct quic_proto_family_ops quic_pf_inet6 = {
 	.get_sk_addr		= quic_v6_get_sk_addr,
 	.set_sk_addr		= quic_v6_set_sk_addr,
 	.set_sk_ecn		= quic_v6_set_sk_ecn,
+	.recv_error		= quic_v6_recv_error,
 	.setsockopt		= ipv6_setsockopt,
 	.getsockopt		= ipv6_getsockopt,
 };
@@ -631,3 +647,8 @@ void quic_set_sk_ecn(struct sock *sk, u8 ecn)
 {
 	quic_pf(sk)->set_sk_ecn(sk, ecn);
 }
+
+int quic_recv_error(struct sock *sk, struct msghdr *msg, int len)
+{
+	return quic_pf(sk)->recv_error(sk, msg, len);
+}
@@ -32,4 +32,5 @@ int quic_flow_route(struct sock *sk, union quic_addr *da, union quic_addr *sa);
 void quic_udp_conf_init(struct sock *sk, struct udp_port_cfg *conf, union quic_addr *a);
 int quic_get_mtu_info(struct sk_buff *skb, u32 *info);
 void quic_set_sk_ecn(struct sock *sk, u8 ecn);
+int quic_recv_error(struct sock *sk, struct msghdr *msg, int len);
 u8 quic_get_msg_ecn(struct sk_buff *skb);
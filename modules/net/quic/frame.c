@@ -10,7 +10,11 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <linux/errqueue.h>
+#include <linux/version.h>
+
 #include "socket.h"
+#include "trace.h"
 
 /* ACK Frame {
  *  Type (i) = 0x02..0x03,
@@ -33,27 +37,58 @@ static bool quic_frame_copy_from_iter_full(void *addr, size_t bytes, struct iov_
 	return false;
 }
 
+/* ACK ranges are budgeted to fit in a minimal packet along with other frames, and the
+ * lowest ones are left out when there are more
+ */
+#define QUIC_FRAME_ACK_RANGES_LEN	(QUIC_MIN_UDP_PAYLOAD / 2)
+
+/* the received block below the i-th range, or from min_pn_seen to base_pn for the lowest */
+static void quic_frame_ack_block(struct quic_pnspace *space, u16 i, s64 *start, s64 *end)
+{
+	const struct quic_pn_range *r;
+
+	if (!i) {
+		*start = quic_pnspace_min_pn_seen(space);
+		*end = quic_pnspace_base_pn(space) - 1;
+		return;
+	}
+	r = quic_pnspace_range(space, i - 1);
+	*start = r->start;
+	*end = r->end;
+}
+
 static struct quic_frame *quic_frame_ack_create(struct sock *sk, void *data, u8 type)
 {
-	struct quic_gap_ack_block gabs[QUIC_PN_MAX_GABS];
-	u64 largest, smallest, range, delay, *ecn_count;
+	u64 largest, smallest, range, delay, gap, *ecn_count;
 	struct quic_outqueue *outq = quic_outq(sk);
+	u32 frame_len, ranges_len = 0, count = 0;
 	u8 *p, level = *((u8 *)data);
+	s64 start, end, prev_start;
 	struct quic_pnspace *space;
-	u32 frame_len, num_gabs, i;
 	struct quic_frame *frame;
+	u16 num, i;
 
 	space = quic_pnspace(sk, level);
 	type += quic_pnspace_has_ecn_count(space);
-	num_gabs = quic_pnspace_num_gabs(space, gabs);
-	frame_len = sizeof(type) + sizeof(u32) * 7;
-	frame_len += sizeof(struct quic_gap_ack_block) * num_gabs;
+	num = quic_pnspace_num_ranges(space);
 
 	largest = quic_pnspace_max_pn_seen(space);
-	smallest = quic_pnspace_min_pn_seen(space);
-	if (num_gabs)
-		smallest = quic_pnspace_base_pn(space) + gabs[num_gabs - 1].end;
+	quic_frame_ack_block(space, num, &start, &end);
+	smallest = start;
 	range = largest - smallest;
+
+	/* count the Gap and ACK Range pairs that fit, from the top */
+	prev_start = start;
+	for (i = num; i > 0; i--) {
+		quic_frame_ack_block(space, i - 1, &start, &end);
+		ranges_len += quic_var_len(prev_start - end - 2) + quic_var_len(end - start);
+		if (ranges_len > QUIC_FRAME_ACK_RANGES_LEN)
+			break;
+		prev_start = start;
+		count++;
+	}
+
+	frame_len = sizeof(type) + sizeof(u32) * 7 + min_t(u32, ranges_len, QUIC_FRAME_ACK_RANGES_LEN);
 	frame = quic_frame_alloc(frame_len, NULL, GFP_ATOMIC);
 	if (!frame)
 		return NULL;
@@ -62,19 +97,16 @@ static struct quic_frame *quic_frame_ack_create(struct sock *sk, void *data, u8
 	p = quic_put_var(frame->data, type);
 	p = quic_put_var(p, largest); /* Largest Acknowledged */
 	p = quic_put_var(p, delay); /* ACK Delay */
-	p = quic_put_var(p, num_gabs); /* ACK Count */
+	p = quic_put_var(p, count); /* ACK Count */
 	p = quic_put_var(p, range); /* First ACK Range */
 
-	if (num_gabs) {
-		for (i = num_gabs - 1; i > 0; i--) {
-			p = quic_put_var(p, gabs[i].end - gabs[i].start); /* Gap */
-			/* ACK Range Length */
-			p = quic_put_var(p, gabs[i].start - gabs[i - 1].end - 2);
-		}
-		p = quic_put_var(p, gabs[0].end - gabs[0].start); /* Gap */
-		range = gabs[0].start - 1 + quic_pnspace_base_pn(space);
-		range -= (quic_pnspace_min_pn_seen(space) + 1);
-		p = quic_put_var(p, range); /* ACK Range Length */
+	prev_start = smallest;
+	for (i = num; i > num - count; i--) {
+		quic_frame_ack_block(space, i - 1, &start, &end);
+		gap = prev_start - end - 2;
+		p = quic_put_var(p, gap); /* Gap */
+		p = quic_put_var(p, end - start); /* ACK Range Length */
+		prev_start = start;
 	}
 	if (type == QUIC_FRAME_ACK_ECN) {
 		ecn_count = quic_pnspace_ecn_count(space);
@@ -130,15 +162,15 @@ static struct quic_frame *quic_frame_padding_create(struct sock *sk, void *data,
 
 static struct quic_frame *quic_frame_new_token_create(struct sock *sk, void *data, u8 type)
 {
-	struct quic_crypto *crypto = quic_crypto(sk, QUIC_CRYPTO_INITIAL);
+	struct quic_token_keys *keys = &quic_net(sock_net(sk))->token_keys;
 	struct quic_conn_id_set *id_set = quic_source(sk);
 	struct quic_path_group *paths = quic_paths(sk);
 	struct quic_frame *frame;
-	u8 token[72], *p;
+	u8 token[QUIC_TOKEN_MAX_LEN], *p;
 	u32 tlen;
 
 	quic_put_int(token, 0, 1); /* regular token */
-	if (quic_crypto_generate_token(crypto, quic_path_daddr(paths, 0), sizeof(union quic_addr),
+	if (quic_crypto_generate_token(keys, quic_path_daddr(paths, 0), sizeof(union quic_addr),
 				       quic_conn_id_active(id_set), token, &tlen))
 		return NULL;
 
@@ -154,17 +186,175 @@ static struct quic_frame *quic_frame_new_token_create(struct sock *sk, void *dat
 	return frame;
 }
 
-static struct quic_frame_frag *quic_frame_frag_alloc(u16 size)
+static struct quic_frame_frag *quic_frame_frag_alloc(u32 size)
 {
 	struct quic_frame_frag *frag;
 
-	frag = kzalloc(sizeof(*frag) + size, GFP_ATOMIC);
+	if (size <= QUIC_FRAME_FRAG_CACHE_SIZE) {
+		frag = kmem_cache_alloc(quic_frame_frag_cachep, GFP_ATOMIC);
+		if (frag) {
+			frag->next = NULL;
+			frag->page = NULL;
+			frag->offset = 0;
+		}
+	} else {
+		frag = kzalloc(sizeof(*frag) + size, GFP_ATOMIC);
+	}
 	if (frag)
 		frag->size = size;
 
 	return frag;
 }
 
+static void quic_frame_frag_free(struct quic_frame_frag *frag)
+{
+	struct quic_frame_frag *next;
+
+	for (; frag; frag = next) {
+		next = frag->next;
+		if (frag->page) {
+			put_page(frag->page);
+			kfree(frag);
+			continue;
+		}
+		if (frag->size <= QUIC_FRAME_FRAG_CACHE_SIZE) {
+			kmem_cache_free(quic_frame_frag_cachep, frag);
+			continue;
+		}
+		kfree(frag);
+	}
+}
+
+static ssize_t quic_frame_iter_get_pages(struct iov_iter *i, struct page **pages, size_t maxsize,
+					 unsigned int maxpages, size_t *start)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	return iov_iter_get_pages2(i, pages, maxsize, maxpages, start);
+#else
+	ssize_t ret = iov_iter_get_pages(i, pages, maxsize, maxpages, start);
+
+	if (ret > 0)
+		iov_iter_advance(i, ret);
+	return ret;
+#endif
+}
+
+#define QUIC_FRAME_MAX_PAGES	4
+
+/* Build a frag list that holds a reference on the pages of the iov_iter, which are
+ * either pinned user pages for MSG_ZEROCOPY or page cache pages from splice/sendfile.
+ */
+static struct quic_frame_frag *quic_frame_frag_get_pages(struct iov_iter *i, u32 len)
+{
+	struct quic_frame_frag *frag, *head = NULL, **tail = &head;
+	struct page *pages[QUIC_FRAME_MAX_PAGES];
+	u32 n, k, bytes = 0;
+	size_t off;
+	ssize_t ret;
+
+	while (bytes < len) {
+		ret = quic_frame_iter_get_pages(i, pages, len - bytes, QUIC_FRAME_MAX_PAGES, &off);
+		if (ret <= 0)
+			goto err;
+		bytes += ret;
+		n = DIV_ROUND_UP(off + ret, PAGE_SIZE);
+		for (k = 0; k < n; k++) {
+			frag = kzalloc(sizeof(*frag), GFP_ATOMIC);
+			if (!frag) {
+				while (k < n)
+					put_page(pages[k++]);
+				goto err;
+			}
+			frag->page = pages[k];
+			frag->offset = (u32)off;
+			frag->size = (u32)min_t(size_t, PAGE_SIZE - off, ret);
+			ret -= frag->size;
+			off = 0;
+			*tail = frag;
+			tail = &frag->next;
+		}
+	}
+	return head;
+err:
+	iov_iter_revert(i, bytes);
+	quic_frame_frag_free(head);
+	return NULL;
+}
+
+static struct quic_frame_frag *quic_frame_frag_create(struct quic_msginfo *info, u32 len)
+{
+	struct quic_frame_frag *frag;
+
+	if (info->pages)
+		return quic_frame_frag_get_pages(info->msg, len);
+
+	frag = quic_frame_frag_alloc(len);
+	if (!frag)
+		return NULL;
+	if (!quic_frame_copy_from_iter_full(frag->data, len, info->msg)) {
+		quic_frame_frag_free(frag);
+		return NULL;
+	}
+	return frag;
+}
+
+struct quic_frame_zc *quic_frame_zc_alloc(struct sock *sk, struct ubuf_info *ubuf)
+{
+	struct quic_frame_zc *zc;
+
+	zc = kzalloc(sizeof(*zc), GFP_KERNEL);
+	if (!zc)
+		return NULL;
+
+	refcount_set(&zc->refcnt, 1);
+	if (ubuf) {
+		net_zcopy_get(ubuf);
+		zc->ubuf = ubuf;
+	} else {
+		zc->id = (u32)atomic_inc_return(&sk->sk_zckey) - 1;
+	}
+	sock_hold(sk);
+	zc->sk = sk;
+	return zc;
+}
+
+static struct quic_frame_zc *quic_frame_zc_get(struct quic_frame_zc *zc)
+{
+	refcount_inc(&zc->refcnt);
+	return zc;
+}
+
+/* Report the completion the same way as TCP MSG_ZEROCOPY, with ee_info and ee_data
+ * both set to the id of the sendmsg call.
+ */
+void quic_frame_zc_put(struct quic_frame_zc *zc)
+{
+	struct sock_exterr_skb *serr;
+	struct sock *sk = zc->sk;
+	struct sk_buff *skb;
+
+	if (!refcount_dec_and_test(&zc->refcnt))
+		return;
+
+	if (zc->ubuf) {
+		net_zcopy_put(zc->ubuf);
+		goto out;
+	}
+	skb = alloc_skb(0, GFP_ATOMIC);
+	if (skb) {
+		serr = SKB_EXT_ERR(skb);
+		memset(serr, 0, sizeof(*serr));
+		serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+		serr->ee.ee_info = zc->id;
+		serr->ee.ee_data = zc->id;
+		if (sock_queue_err_skb(sk, skb))
+			kfree_skb(skb);
+	}
+out:
+	sock_put(sk);
+	kfree(zc);
+}
+
 /* STREAM Frame {
  *  Type (i) = 0x08..0x0f,
  *  Stream ID (i),
@@ -219,17 +409,14 @@ static struct quic_frame *quic_frame_stream_create(struct sock *sk, void *data,
 
 	/* attach the data into frag list */
 	if (msg_len) {
-		frag = quic_frame_frag_alloc(msg_len);
+		frag = quic_frame_frag_create(info, msg_len);
 		if (!frag) {
 			quic_frame_put(frame);
 			return NULL;
 		}
-		if (!quic_frame_copy_from_iter_full(frag->data, msg_len, info->msg)) {
-			quic_frame_put(frame);
-			kfree(frag);
-			return NULL;
-		}
 		frame->flist = frag;
+		if (info->zc)
+			frame->zc = quic_frame_zc_get(info->zc);
 	}
 
 	/* set up stream data header and frame fields */
@@ -265,6 +452,8 @@ int quic_frame_stream_append(struct sock *sk, struct quic_frame *frame,
 	hlen += quic_var_len(max_frame_len);
 	if (max_frame_len - hlen <= frame->bytes)
 		return -1;
+	if (info->zc && frame->zc && frame->zc != info->zc)
+		return -1;
 
 	msg_len = iov_iter_count(info->msg);
 	wspace = quic_outq_wspace(sk, stream);
@@ -288,13 +477,11 @@ int quic_frame_stream_append(struct sock *sk, struct quic_frame *frame,
 
 	/* attach the data into frag list */
 	if (msg_len) {
-		frag = quic_frame_frag_alloc(msg_len);
+		frag = quic_frame_frag_create(info, msg_len);
 		if (!frag)
 			return 0;
-		if (!quic_frame_copy_from_iter_full(frag->data, msg_len, info->msg)) {
-			kfree(frag);
-			return 0;
-		}
+		if (info->zc && !frame->zc)
+			frame->zc = quic_frame_zc_get(info->zc);
 		if (frame->flist) {
 			pos = frame->flist;
 			while (pos->next)
@@ -446,7 +633,7 @@ static struct quic_frame *quic_frame_new_conn_id_create(struct sock *sk, void *d
 	p = quic_put_var(buf, type);
 	p = quic_put_var(p, seqno);
 	p = quic_put_var(p, *prior);
-	quic_conn_id_generate(&scid);
+	quic_conn_id_set_generate(id_set, &scid);
 	p = quic_put_var(p, scid.len);
 	p = quic_put_data(p, scid.data, scid.len);
 	if (quic_crypto_generate_stateless_reset_token(crypto, scid.data, scid.len, token, 16))
@@ -850,7 +1037,7 @@ static int quic_frame_ack_process(struct sock *sk, struct quic_frame *frame, u8
 
 	if (!quic_get_var(&p, &len, &largest) ||
 	    !quic_get_var(&p, &len, &delay) ||
-	    !quic_get_var(&p, &len, &count) || count > QUIC_PN_MAX_GABS ||
+	    !quic_get_var(&p, &len, &count) ||
 	    !quic_get_var(&p, &len, &range))
 		return -EINVAL;
 
@@ -879,7 +1066,11 @@ static int quic_frame_ack_process(struct sock *sk, struct quic_frame *frame, u8
 		    !quic_get_var(&p, &len, &ecn_count[2]))
 			return -EINVAL;
 		if (quic_pnspace_set_ecn_count(space, ecn_count)) {
+			u8 state = cong->state;
+
 			quic_cong_on_process_ecn(cong);
+			if (cong->state != state)
+				trace_quic_cong_state(sk, state);
 			quic_outq_sync_window(sk, quic_cong_window(cong));
 		}
 	}
@@ -1093,7 +1284,7 @@ static int quic_frame_reset_stream_process(struct sock *sk, struct quic_frame *f
 
 	stream->recv.state = update.state;
 	stream->recv.finalsz = update.finalsz;
-	quic_inq_stream_list_purge(sk, stream);
+	quic_inq_stream_purge(sk, stream);
 	quic_stream_recv_put(streams, stream, quic_is_serv(sk));
 out:
 	return (int)(frame->len - len);
@@ -1186,6 +1377,7 @@ static int quic_frame_max_stream_data_process(struct sock *sk, struct quic_frame
 		data.id = stream->id;
 		data.max_data = max_bytes;
 		quic_inq_event_recv(sk, QUIC_EVENT_STREAM_MAX_DATA, &data);
+		quic_outq_stream_unblocked(sk, stream);
 		sk->sk_write_space(sk);
 	}
 
@@ -1292,7 +1484,7 @@ static int quic_frame_data_blocked_process(struct sock *sk, struct quic_frame *f
 		return -EINVAL;
 	recv_max_bytes = quic_inq_max_bytes(inq);
 
-	window = quic_inq_max_data(inq);
+	window = quic_inq_window(inq);
 	if (quic_under_memory_pressure(sk))
 		window >>= 1;
 
@@ -1457,6 +1649,46 @@ static struct quic_frame *quic_frame_datagram_create(struct sock *sk, void *data
 	return frame;
 }
 
+static struct quic_frame *quic_frame_immediate_ack_create(struct sock *sk, void *data, u8 type)
+{
+	struct quic_frame *frame;
+	u8 *p, buf[4];
+	u32 frame_len;
+
+	p = quic_put_var(buf, type);
+	frame_len = (u32)(p - buf);
+
+	frame = quic_frame_alloc(frame_len, NULL, GFP_ATOMIC);
+	if (!frame)
+		return NULL;
+	quic_put_data(frame->data, buf, frame_len);
+
+	return frame;
+}
+
+static struct quic_frame *quic_frame_ack_frequency_create(struct sock *sk, void *data, u8 type)
+{
+	struct quic_outqueue *outq = data;
+	struct quic_frame *frame;
+	u8 *p, buf[36];
+	u32 frame_len;
+
+	p = quic_put_var(buf, type);
+	p = quic_put_var(p, outq->ack_frequency_seq); /* Sequence Number */
+	p = quic_put_var(p, outq->ack_threshold); /* Ack-Eliciting Threshold */
+	p = quic_put_var(p, outq->ack_delay); /* Request Max Ack Delay */
+	p = quic_put_var(p, QUIC_ACK_REORDER_THRESHOLD); /* Reordering Threshold */
+	frame_len = (u32)(p - buf);
+
+	frame = quic_frame_alloc(frame_len, NULL, GFP_ATOMIC);
+	if (!frame)
+		return NULL;
+	quic_put_data(frame->data, buf, frame_len);
+	outq->ack_frequency_seq++;
+
+	return frame;
+}
+
 static int quic_frame_invalid_process(struct sock *sk, struct quic_frame *frame, u8 type)
 {
 	frame->errcode = QUIC_TRANSPORT_ERROR_FRAME_ENCODING;
@@ -1498,6 +1730,41 @@ static int quic_frame_datagram_process(struct sock *sk, struct quic_frame *frame
 	return (int)(frame->len - len);
 }
 
+static int quic_frame_immediate_ack_process(struct sock *sk, struct quic_frame *frame, u8 type)
+{
+	if (!quic_inq_min_ack_delay(quic_inq(sk))) {
+		frame->errcode = QUIC_TRANSPORT_ERROR_PROTOCOL_VIOLATION;
+		return -EINVAL;
+	}
+	return 0; /* the packet is ACKed at once as packet->ack_immediate is set */
+}
+
+static int quic_frame_ack_frequency_process(struct sock *sk, struct quic_frame *frame, u8 type)
+{
+	u64 seqno, threshold, delay, reorder;
+	struct quic_inqueue *inq = quic_inq(sk);
+	u32 len = frame->len;
+	u8 *p = frame->data;
+
+	if (!quic_get_var(&p, &len, &seqno) || !quic_get_var(&p, &len, &threshold) ||
+	    !quic_get_var(&p, &len, &delay) || !quic_get_var(&p, &len, &reorder))
+		return -EINVAL;
+
+	if (!quic_inq_min_ack_delay(inq) || delay < quic_inq_min_ack_delay(inq)) {
+		frame->errcode = QUIC_TRANSPORT_ERROR_PROTOCOL_VIOLATION;
+		return -EINVAL;
+	}
+
+	/* ignore the reordered ones older than the latest */
+	if (seqno >= inq->ack_frequency_seq) {
+		inq->ack_frequency_seq = seqno + 1;
+		quic_inq_set_ack_frequency(inq, min_t(u64, threshold, U16_MAX),
+					   min_t(u64, delay, QUIC_MAX_ACK_DELAY),
+					   min_t(u64, reorder, U16_MAX));
+	}
+	return (int)(frame->len - len);
+}
+
 #define quic_frame_create_and_process(type) \
 	{ .frame_create = quic_frame_##type##_create, .frame_process = quic_frame_##type##_process }
 
@@ -1533,7 +1800,7 @@ static struct quic_frame_ops quic_frame_ops[QUIC_FRAME_MAX + 1] = {
 	quic_frame_create_and_process(connection_close),
 	quic_frame_create_and_process(connection_close),
 	quic_frame_create_and_process(handshake_done),
-	quic_frame_create_and_process(invalid),
+	quic_frame_create_and_process(immediate_ack),
 	quic_frame_create_and_process(invalid), /* 0x20 */
 	quic_frame_create_and_process(invalid),
 	quic_frame_create_and_process(invalid),
@@ -1552,12 +1819,17 @@ static struct quic_frame_ops quic_frame_ops[QUIC_FRAME_MAX + 1] = {
 	quic_frame_create_and_process(invalid),
 	quic_frame_create_and_process(datagram), /* 0x30 */
 	quic_frame_create_and_process(datagram),
+	[QUIC_FRAME_DATAGRAM_LEN + 1 ... QUIC_FRAME_ACK_FREQUENCY - 1] =
+		quic_frame_create_and_process(invalid),
+	quic_frame_create_and_process(ack_frequency), /* 0xaf */
 };
 
 int quic_frame_process(struct sock *sk, struct quic_frame *frame)
 {
 	struct quic_packet *packet = quic_packet(sk);
 	u8 type, level = frame->level;
+	u64 ftype;
+	u32 len;
 	int ret;
 
 	if (!frame->len) {
@@ -1566,10 +1838,15 @@ int quic_frame_process(struct sock *sk, struct quic_frame *frame)
 	}
 
 	while (frame->len > 0) {
-		type = *frame->data++;
-		frame->len--;
+		len = frame->len;
+		if (!quic_get_var(&frame->data, &len, &ftype)) {
+			packet->errcode = QUIC_TRANSPORT_ERROR_FRAME_ENCODING;
+			return -EINVAL;
+		}
+		frame->len = (u16)len;
+		type = (u8)ftype;
 
-		if (type > QUIC_FRAME_MAX) {
+		if (ftype > QUIC_FRAME_MAX) {
 			pr_debug("%s: unsupported frame, type: %x, level: %d\n",
 				 __func__, type, level);
 			packet->errcode = QUIC_TRANSPORT_ERROR_FRAME_ENCODING;
@@ -1621,6 +1898,7 @@ struct quic_frame *quic_frame_create(struct sock *sk, u8 type, void *data)
 		frame->type = type;
 	return frame;
 }
+EXPORT_SYMBOL_GPL(quic_frame_create);
 
 static int quic_frame_get_conn_id(struct quic_conn_id *conn_id, u8 **pp, u32 *plen)
 {
@@ -1832,6 +2110,13 @@ int quic_frame_parse_transport_params_ext(struct sock *sk, struct quic_transport
 				return -1;
 			params->max_datagram_frame_size = value;
 			break;
+		case QUIC_TRANSPORT_PARAM_MIN_ACK_DELAY:
+			if (quic_get_param(&value, &p, &len))
+				return -1;
+			if (value >= QUIC_MAX_ACK_DELAY)
+				return -1;
+			params->min_ack_delay = value;
+			break;
 		case QUIC_TRANSPORT_PARAM_STATELESS_RESET_TOKEN:
 			if (quic_is_serv(sk))
 				return -1;
@@ -1871,6 +2156,9 @@ int quic_frame_parse_transport_params_ext(struct sock *sk, struct quic_transport
 		}
 	}
 
+	if (params->min_ack_delay > params->max_ack_delay)
+		return -1;
+
 	return quic_packet_select_version(sk, versions, count);
 }
 
@@ -1944,7 +2232,7 @@ int quic_frame_build_transport_params_ext(struct sock *sk, struct quic_transport
 			p = quic_frame_put_conn_id(p, param_id, quic_path_retry_dcid(paths));
 		}
 		if (quic_path_pref_addr(paths)) {
-			quic_conn_id_generate(&conn_id);
+			quic_conn_id_set_generate(id_set, &conn_id);
 			if (quic_crypto_generate_stateless_reset_token(crypto, conn_id.data,
 								       conn_id.len, token, 16))
 				return -1;
@@ -2021,6 +2309,10 @@ int quic_frame_build_transport_params_ext(struct sock *sk, struct quic_transport
 		p = quic_put_param(p, QUIC_TRANSPORT_PARAM_MAX_DATAGRAM_FRAME_SIZE,
 				   params->max_datagram_frame_size);
 	}
+	if (params->min_ack_delay) {
+		p = quic_put_param(p, QUIC_TRANSPORT_PARAM_MIN_ACK_DELAY,
+				   params->min_ack_delay);
+	}
 	*len = p - data;
 	return 0;
 }
@@ -2036,7 +2328,12 @@ struct quic_frame *quic_frame_alloc(u32 size, u8 *data, gfp_t gfp)
 		frame->data = data;
 		goto out;
 	}
-	frame->data = kmalloc(size, gfp);
+	if (size <= QUIC_FRAME_DATA_CACHE_SIZE) {
+		frame->data = kmem_cache_alloc(quic_frame_data_cachep, gfp);
+		frame->cached = 1;
+	} else {
+		frame->data = kmalloc(size, gfp);
+	}
 	if (!frame->data) {
 		kmem_cache_free(quic_frame_cachep, frame);
 		return NULL;
@@ -2051,18 +2348,18 @@ out:
 
 static void quic_frame_free(struct quic_frame *frame)
 {
-	struct quic_frame_frag *frag, *next;
-
 	if (!frame->type && frame->skb) {/* type is 0 on rx path */
 		kfree_skb(frame->skb);
 		goto out;
 	}
 
-	for (frag = frame->flist; frag; frag = next) {
-		next = frag->next;
-		kfree(frag);
-	}
-	kfree(frame->data);
+	quic_frame_frag_free(frame->flist);
+	if (frame->zc)
+		quic_frame_zc_put(frame->zc);
+	if (frame->cached)
+		kmem_cache_free(quic_frame_data_cachep, frame->data);
+	else
+		kfree(frame->data);
 out:
 	kmem_cache_free(quic_frame_cachep, frame);
 }
@@ -2078,3 +2375,4 @@ void quic_frame_put(struct quic_frame *frame)
 	if (refcount_dec_and_test(&frame->refcnt))
 		quic_frame_free(frame);
 }
+EXPORT_SYMBOL_GPL(quic_frame_put);
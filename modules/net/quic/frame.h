@@ -10,6 +10,10 @@
 
 #define QUIC_CLOSE_PHRASE_MAX_LEN	80
 
+/* frame data and frag sizes served by the dedicated slab caches, larger ones use kmalloc */
+#define QUIC_FRAME_DATA_CACHE_SIZE	64
+#define QUIC_FRAME_FRAG_CACHE_SIZE	ETH_DATA_LEN
+
 enum {
 	QUIC_FRAME_PADDING = 0x00,
 	QUIC_FRAME_PING = 0x01,
@@ -35,9 +39,11 @@ enum {
 	QUIC_FRAME_CONNECTION_CLOSE = 0x1c,
 	QUIC_FRAME_CONNECTION_CLOSE_APP = 0x1d,
 	QUIC_FRAME_HANDSHAKE_DONE = 0x1e,
+	QUIC_FRAME_IMMEDIATE_ACK = 0x1f, /* draft-ietf-quic-ack-frequency */
 	QUIC_FRAME_DATAGRAM = 0x30, /* RFC 9221 */
 	QUIC_FRAME_DATAGRAM_LEN = 0x31,
-	QUIC_FRAME_MAX = QUIC_FRAME_DATAGRAM_LEN,
+	QUIC_FRAME_ACK_FREQUENCY = 0xaf, /* draft-ietf-quic-ack-frequency */
+	QUIC_FRAME_MAX = QUIC_FRAME_ACK_FREQUENCY,
 };
 
 enum {
@@ -62,13 +68,39 @@ enum {
 	QUIC_TRANSPORT_PARAM_GREASE_QUIC_BIT = 0x2ab2,
 	QUIC_TRANSPORT_PARAM_VERSION_INFORMATION = 0x11,
 	QUIC_TRANSPORT_PARAM_DISABLE_1RTT_ENCRYPTION = 0xbaad,
+	QUIC_TRANSPORT_PARAM_MIN_ACK_DELAY = 0xff04de1b,
+};
+
+#ifdef MSG_SPLICE_PAGES
+#define QUIC_MSG_SPLICE_PAGES	MSG_SPLICE_PAGES
+#else
+#define QUIC_MSG_SPLICE_PAGES	0
+#endif
+
+/* the ubuf_info io_uring SEND_ZC passes in msghdr to be completed instead of the error queue */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define quic_msg_ubuf(msg)	((msg)->msg_ubuf)
+#else
+#define quic_msg_ubuf(msg)	NULL
+#endif
+
+/* MSG_ZEROCOPY completion, reported on the error queue, or to the ubuf_info of io_uring,
+ * once no frame refers to the data
+ */
+struct quic_frame_zc {
+	refcount_t refcnt;
+	struct ubuf_info *ubuf;
+	struct sock *sk;
+	u32 id;
 };
 
 struct quic_msginfo {
 	struct quic_stream *stream;
+	struct quic_frame_zc *zc;
 	struct iov_iter *msg;
 	u32 flags;
 	u8 level;
+	u8 pages:1;	/* refer to the pages of msg instead of copying the data */
 };
 
 struct quic_probeinfo {
@@ -83,7 +115,9 @@ struct quic_frame_ops {
 
 struct quic_frame_frag {
 	struct quic_frame_frag *next;
-	u16 size;
+	struct page *page;	/* data is in this page at offset if set, or in data[] */
+	u32 offset;
+	u32 size;	/* up to a whole page, which may be 64K */
 	u8 data[];
 };
 
@@ -93,7 +127,11 @@ struct quic_frame {
 		struct sk_buff *skb;
 	};
 	struct quic_stream *stream;
-	struct list_head list;
+	struct quic_frame_zc *zc;
+	union {
+		struct list_head list;
+		struct rb_node node;	/* in stream recv.frame_tree while out of order */
+	};
 	s64 offset;	/* stream/crypto/read offset or first packet number */
 	u8  *data;
 
@@ -104,6 +142,7 @@ struct quic_frame {
 	u16 bytes;	/* user data bytes */
 	u16 size;	/* alloc data size */
 	u16 len;	/* frame length including data in flist */
+	u32 expires;	/* datagram send deadline, see quic_outq_dgram_tail() */
 
 	u8  transmitted:1;
 	u8  stream_fin:1;
@@ -111,7 +150,8 @@ struct quic_frame {
 	u8  padding:1;
 	u8  dgram:1;
 	u8  event:1;
-	u8  path:1;
+	u8  path:2;
+	u8  cached:1;	/* data is from quic_frame_data_cachep */
 };
 
 static inline bool quic_frame_path_probing(u8 type)
@@ -129,7 +169,7 @@ static inline bool quic_frame_ack_eliciting(u8 type)
 static inline bool quic_frame_retransmittable(u8 type)
 {
 	return type != QUIC_FRAME_DATAGRAM && type != QUIC_FRAME_DATAGRAM_LEN &&
-	       type != QUIC_FRAME_PING;
+	       type != QUIC_FRAME_PING && type != QUIC_FRAME_IMMEDIATE_ACK;
 }
 
 static inline bool quic_frame_ack_immediate(u8 type)
@@ -202,6 +242,9 @@ int quic_frame_parse_transport_params_ext(struct sock *sk, struct quic_transport
 int quic_frame_stream_append(struct sock *sk, struct quic_frame *frame,
 			     struct quic_msginfo *info, u8 pack);
 
+struct quic_frame_zc *quic_frame_zc_alloc(struct sock *sk, struct ubuf_info *ubuf);
+void quic_frame_zc_put(struct quic_frame_zc *zc);
+
 struct quic_frame *quic_frame_alloc(u32 size, u8 *data, gfp_t gfp);
 struct quic_frame *quic_frame_get(struct quic_frame *frame);
 void quic_frame_put(struct quic_frame *frame);
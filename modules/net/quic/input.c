@@ -69,12 +69,41 @@ static void quic_inq_stream_tail(struct sock *sk, struct quic_stream *stream,
 
 #define QUIC_INQ_RWND_SHIFT	4
 
+/* Dynamic right-sizing, as in tcp_rcv_space_adjust(): once per RTT, a window is grown to
+ * twice what the application read in that RTT, so that the peer is not held to one window
+ * per RTT, up to sysctl_quic_rmem[2] or half of a locked sk_rcvbuf. Under memory pressure
+ * it is halved instead, down to the transport parameter it started from.
+ */
+static u64 quic_inq_window_adjust(struct sock *sk, u64 window, u64 *bytes, u32 *time,
+				  u64 init)
+{
+	u32 now = jiffies_to_usecs(jiffies), rtt = quic_cong_smoothed_rtt(quic_cong(sk));
+	u64 max;
+
+	if (now - *time < rtt)
+		return window;
+
+	if (quic_under_memory_pressure(sk)) {
+		window = max(window >> 1, init);
+	} else if (*bytes * 2 > window) {
+		max = READ_ONCE(sysctl_quic_rmem[2]);
+		if (sk->sk_userlocks & SOCK_RCVBUF_LOCK)
+			max = READ_ONCE(sk->sk_rcvbuf) / 2;
+		window = max(min(*bytes * 2, max), window);
+	}
+	*bytes = 0;
+	*time = now;
+	return window;
+}
+
 void quic_inq_flow_control(struct sock *sk, struct quic_stream *stream, u32 bytes)
 {
+	struct quic_stream_table *streams = quic_streams(sk);
 	struct quic_packet *packet = quic_packet(sk);
 	struct quic_inqueue *inq = quic_inq(sk);
 	u32 mss, window;
 	u8 frame = 0;
+	u64 init;
 
 	if (!bytes)
 		return;
@@ -83,24 +112,38 @@ void quic_inq_flow_control(struct sock *sk, struct quic_stream *stream, u32 byte
 	stream->recv.bytes += bytes;
 	inq->bytes += bytes;
 
+	inq->space_bytes += bytes;
+	inq->window = quic_inq_window_adjust(sk, inq->window, &inq->space_bytes,
+					     &inq->space_time, inq->max_data);
+	if (!(sk->sk_userlocks & SOCK_RCVBUF_LOCK) && inq->window * 2 > READ_ONCE(sk->sk_rcvbuf))
+		WRITE_ONCE(sk->sk_rcvbuf, (int)min_t(u64, inq->window * 2, INT_MAX));
+
+	stream->recv.space_bytes += bytes;
+	init = quic_stream_recv_init_window(streams, stream->id, quic_is_serv(sk));
+	stream->recv.window = quic_inq_window_adjust(sk, stream->recv.window,
+						     &stream->recv.space_bytes,
+						     &stream->recv.space_time, init);
+
 	/* recv flow control */
-	window = inq->max_data;
-	if (inq->bytes + window - inq->max_bytes >=
-	    max(mss, (window >> QUIC_INQ_RWND_SHIFT))) {
+	/* the window may have shrunk below what was already granted, which is never taken back */
+	window = inq->window;
+	if (inq->bytes + window > inq->max_bytes &&
+	    inq->bytes + window - inq->max_bytes >= max(mss, (window >> QUIC_INQ_RWND_SHIFT))) {
 		if (quic_under_memory_pressure(sk))
 			window >>= 1;
-		inq->max_bytes = inq->bytes + window;
+		inq->max_bytes = max(inq->max_bytes, inq->bytes + window);
 		if (!quic_outq_transmit_frame(sk, QUIC_FRAME_MAX_DATA, inq, 0, true))
 			frame = 1;
 	}
 
 	window = stream->recv.window;
 	if (stream->recv.state < QUIC_STREAM_RECV_STATE_RECVD &&
+	    stream->recv.bytes + window > stream->recv.max_bytes &&
 	    stream->recv.bytes + window - stream->recv.max_bytes >=
 	    max(mss, (window >> QUIC_INQ_RWND_SHIFT))) {
 		if (quic_under_memory_pressure(sk))
 			window >>= 1;
-		stream->recv.max_bytes = stream->recv.bytes + window;
+		stream->recv.max_bytes = max(stream->recv.max_bytes, stream->recv.bytes + window);
 		if (!quic_outq_transmit_frame(sk, QUIC_FRAME_MAX_STREAM_DATA, stream, 0, true))
 			frame = 1;
 	}
@@ -109,6 +152,82 @@ void quic_inq_flow_control(struct sock *sk, struct quic_stream *stream, u32 byte
 		quic_outq_transmit(sk);
 }
 
+/* Out-of-order frames of a stream wait in its recv.frame_tree, keyed by offset, so both
+ * inserting one and delivering the ones that become contiguous are O(log n) in the frames
+ * of that stream only.
+ */
+static struct quic_frame *quic_inq_stream_frame(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct quic_frame, node) : NULL;
+}
+
+/* the last frame starting at or before offset */
+static struct quic_frame *quic_inq_stream_floor(struct rb_root *root, s64 offset)
+{
+	struct rb_node *node = root->rb_node;
+	struct quic_frame *frame, *floor = NULL;
+
+	while (node) {
+		frame = rb_entry(node, struct quic_frame, node);
+		if (frame->offset > offset) {
+			node = node->rb_left;
+			continue;
+		}
+		floor = frame;
+		node = node->rb_right;
+	}
+	return floor;
+}
+
+static void quic_inq_stream_insert(struct sock *sk, struct quic_stream *stream,
+				   struct quic_frame *frame)
+{
+	struct rb_root *root = &stream->recv.frame_tree;
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct quic_frame *pos, *next;
+	s64 end;
+
+	while (*p) {
+		parent = *p;
+		pos = rb_entry(parent, struct quic_frame, node);
+		p = frame->offset < pos->offset ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&frame->node, parent, p);
+	rb_insert_color(&frame->node, root);
+	stream->recv.frags++;
+
+	/* drop the frames after it that it covers, which keeps the floor check complete */
+	end = frame->offset + frame->len;
+	for (pos = quic_inq_stream_frame(rb_next(&frame->node)); pos; pos = next) {
+		if (pos->offset + pos->len > end || (pos->stream_fin && !frame->stream_fin))
+			break;
+		next = quic_inq_stream_frame(rb_next(&pos->node));
+		rb_erase(&pos->node, root);
+		stream->recv.frags--;
+		quic_inq_rfree((int)pos->len, sk);
+		quic_frame_put(pos);
+	}
+}
+
+/* pop the first frame if it is now contiguous, dropping the ones already delivered */
+static struct quic_frame *quic_inq_stream_next(struct sock *sk, struct quic_stream *stream)
+{
+	struct rb_root *root = &stream->recv.frame_tree;
+	struct quic_frame *frame;
+
+	while ((frame = quic_inq_stream_frame(rb_first(root)))) {
+		if (frame->offset > stream->recv.offset)
+			return NULL;
+		rb_erase(&frame->node, root);
+		stream->recv.frags--;
+		if (stream->recv.offset < frame->offset + frame->len || frame->stream_fin)
+			return frame;
+		quic_inq_rfree((int)frame->len, sk); /* dup */
+		quic_frame_put(frame);
+	}
+	return NULL;
+}
+
 static bool quic_sk_rmem_schedule(struct sock *sk, int size)
 {
 	int delta;
@@ -126,8 +245,6 @@ int quic_inq_stream_recv(struct sock *sk, struct quic_frame *frame)
 	struct quic_inqueue *inq = quic_inq(sk);
 	struct quic_stream_update update = {};
 	struct net *net = sock_net(sk);
-	s64 stream_id = stream->id;
-	struct list_head *head;
 	struct quic_frame *pos;
 
 	if (stream->recv.offset >= offset + frame->len &&
@@ -164,25 +281,13 @@ int quic_inq_stream_recv(struct sock *sk, struct quic_frame *frame)
 		update.state = QUIC_STREAM_RECV_STATE_RECV;
 		quic_inq_event_recv(sk, QUIC_EVENT_STREAM_UPDATE, &update);
 	}
-	head = &inq->stream_list;
 	if (stream->recv.offset < offset) {
-		list_for_each_entry(pos, head, list) {
-			if (pos->stream->id < stream_id)
-				continue;
-			if (pos->stream->id > stream_id) {
-				head = &pos->list;
-				break;
-			}
-			if (pos->offset > offset) {
-				head = &pos->list;
-				break;
-			}
-			if (pos->offset + pos->len >= offset + frame->len &&
-			    (pos->stream_fin || !frame->stream_fin)) { /* dup */
-				quic_inq_rfree((int)frame->len, sk);
-				quic_frame_put(frame);
-				return 0;
-			}
+		pos = quic_inq_stream_floor(&stream->recv.frame_tree, offset);
+		if (pos && pos->offset + pos->len >= offset + frame->len &&
+		    (pos->stream_fin || !frame->stream_fin)) { /* dup */
+			quic_inq_rfree((int)frame->len, sk);
+			quic_frame_put(frame);
+			return 0;
 		}
 		if (frame->stream_fin) {
 			if (off < stream->recv.highest ||
@@ -199,8 +304,7 @@ int quic_inq_stream_recv(struct sock *sk, struct quic_frame *frame)
 			stream->recv.state = update.state;
 			stream->recv.finalsz = update.finalsz;
 		}
-		list_add_tail(&frame->list, head);
-		stream->recv.frags++;
+		quic_inq_stream_insert(sk, stream, frame);
 		inq->highest += highest;
 		stream->recv.highest += highest;
 		return 0;
@@ -209,47 +313,47 @@ int quic_inq_stream_recv(struct sock *sk, struct quic_frame *frame)
 	/* fast path: stream->recv.offset == offset */
 	inq->highest += highest;
 	stream->recv.highest += highest;
-	quic_inq_stream_tail(sk, stream, frame);
-	if (!stream->recv.frags)
-		return 0;
-
-	list_for_each_entry_safe(frame, pos, head, list) {
-		if (frame->stream->id < stream_id)
-			continue;
-		if (frame->stream->id > stream_id)
-			break;
-		if (frame->offset > stream->recv.offset)
-			break;
-		list_del(&frame->list);
-		stream->recv.frags--;
-		if (stream->recv.offset >= frame->offset + frame->len &&
-		    (stream->recv.state == QUIC_STREAM_RECV_STATE_RECVD ||
-		     !frame->stream_fin)) { /* dup */
-			quic_inq_rfree((int)frame->len, sk);
-			quic_frame_put(frame);
-			continue;
+	do {
+		if (frame->stream_fin) {
+			/* what is left is within the final size, and the stream may go with it */
+			quic_inq_stream_purge(sk, stream);
+			quic_inq_stream_tail(sk, stream, frame);
+			return 0;
 		}
 		quic_inq_stream_tail(sk, stream, frame);
-	}
+		frame = quic_inq_stream_next(sk, stream);
+	} while (frame);
 	return 0;
 }
 
-void quic_inq_stream_list_purge(struct sock *sk, struct quic_stream *stream)
+void quic_inq_stream_purge(struct sock *sk, struct quic_stream *stream)
 {
-	struct list_head *head = &quic_inq(sk)->stream_list;
+	struct rb_root *root = &stream->recv.frame_tree;
 	struct quic_frame *frame, *next;
 	int bytes = 0;
 
-	list_for_each_entry_safe(frame, next, head, list) {
-		if (frame->stream != stream)
-			continue;
-		list_del(&frame->list);
+	for (frame = quic_inq_stream_frame(rb_first(root)); frame; frame = next) {
+		next = quic_inq_stream_frame(rb_next(&frame->node));
+		rb_erase(&frame->node, root);
 		bytes += frame->len;
 		quic_frame_put(frame);
 	}
+	stream->recv.frags = 0;
 	quic_inq_rfree(bytes, sk);
 }
 
+static void quic_inq_streams_purge(struct sock *sk)
+{
+	struct quic_hash_table *ht = &quic_streams(sk)->ht;
+	struct quic_stream *stream;
+	int i;
+
+	for (i = 0; i < ht->size; i++) {
+		hlist_for_each_entry(stream, &ht->hash[i].head, node)
+			quic_inq_stream_purge(sk, stream);
+	}
+}
+
 static void quic_inq_list_purge(struct sock *sk, struct list_head *head)
 {
 	struct quic_frame *frame, *next;
@@ -400,6 +504,7 @@ void quic_inq_get_param(struct sock *sk, struct quic_transport_param *p)
 	p->grease_quic_bit = inq->grease_quic_bit;
 	p->stateless_reset = inq->stateless_reset;
 	p->max_ack_delay = inq->max_ack_delay;
+	p->min_ack_delay = inq->min_ack_delay;
 	p->max_data = inq->max_data;
 }
 
@@ -427,10 +532,12 @@ void quic_inq_set_param(struct sock *sk, struct quic_transport_param *p)
 	inq->grease_quic_bit = p->grease_quic_bit;
 	inq->stateless_reset = p->stateless_reset;
 	inq->max_ack_delay = p->max_ack_delay;
+	inq->min_ack_delay = p->min_ack_delay;
 	inq->max_data = p->max_data;
 
 	inq->timeout = inq->max_idle_timeout;
 	inq->max_bytes = inq->max_data;
+	inq->window = inq->max_data;
 	sk->sk_rcvbuf = (int)p->max_data * 2;
 }
 
@@ -455,6 +562,7 @@ int quic_inq_event_recv(struct sock *sk, u8 event, void *args)
 		args_len = sizeof(struct quic_stream_max_data);
 		break;
 	case QUIC_EVENT_STREAM_MAX_STREAM:
+	case QUIC_EVENT_STREAM_WRITABLE:
 		args_len = sizeof(u64);
 		break;
 	case QUIC_EVENT_CONNECTION_ID:
@@ -521,18 +629,15 @@ void quic_inq_data_read(struct sock *sk, u32 bytes)
 	quic_inq_rfree((int)bytes, sk);
 }
 
-static void quic_inq_decrypted_work(struct work_struct *work)
+/* Called by quic_sock_work_process() with the socket locked, see quic_inq_decrypted_tail() */
+void quic_inq_decrypted_process(struct sock *sk)
 {
-	struct quic_sock *qs = container_of(work, struct quic_sock, inq.work);
-	struct sock *sk = &qs->inet.sk;
-	struct sk_buff_head *head;
+	struct sk_buff_head *head = &sk->sk_receive_queue;
 	struct sk_buff *skb;
 
-	lock_sock(sk);
-	head = &sk->sk_receive_queue;
 	if (sock_flag(sk, SOCK_DEAD)) {
 		skb_queue_purge(head);
-		goto out;
+		return;
 	}
 
 	skb = skb_dequeue(head);
@@ -541,20 +646,12 @@ static void quic_inq_decrypted_work(struct work_struct *work)
 		quic_packet_process(sk, skb);
 		skb = skb_dequeue(head);
 	}
-out:
-	release_sock(sk);
-	sock_put(sk);
 }
 
 void quic_inq_decrypted_tail(struct sock *sk, struct sk_buff *skb)
 {
-	struct quic_inqueue *inq = quic_inq(sk);
-
-	sock_hold(sk);
 	skb_queue_tail(&sk->sk_receive_queue, skb);
-
-	if (!schedule_work(&inq->work))
-		sock_put(sk);
+	quic_sock_work_schedule(sk, QUIC_SOCK_WORK_DECRYPTED);
 }
 
 void quic_inq_backlog_tail(struct sock *sk, struct sk_buff *skb)
@@ -568,10 +665,8 @@ void quic_inq_init(struct sock *sk)
 
 	skb_queue_head_init(&inq->backlog_list);
 	INIT_LIST_HEAD(&inq->handshake_list);
-	INIT_LIST_HEAD(&inq->stream_list);
 	INIT_LIST_HEAD(&inq->early_list);
 	INIT_LIST_HEAD(&inq->recv_list);
-	INIT_WORK(&inq->work, quic_inq_decrypted_work);
 }
 
 void quic_inq_free(struct sock *sk)
@@ -581,7 +676,7 @@ void quic_inq_free(struct sock *sk)
 	__skb_queue_purge(&sk->sk_receive_queue);
 	__skb_queue_purge(&inq->backlog_list);
 	quic_inq_list_purge(sk, &inq->handshake_list);
-	quic_inq_list_purge(sk, &inq->stream_list);
+	quic_inq_streams_purge(sk);
 	quic_inq_list_purge(sk, &inq->early_list);
 	quic_inq_list_purge(sk, &inq->recv_list);
 }
@@ -14,29 +14,39 @@
 struct quic_inqueue {
 	struct sk_buff_head backlog_list;
 	struct list_head handshake_list;
-	struct list_head stream_list;
 	struct list_head early_list;
 	struct list_head recv_list;
-	struct work_struct work;
 	u64 max_bytes;
 	u64 max_data;
+	u64 window;		/* auto-tuned from max_data, see quic_inq_window_adjust() */
 	u64 highest;
 	u64 bytes;
+	u64 space_bytes;	/* read by the application since space_time */
+	u32 space_time;
 
 	u16 max_datagram_frame_size;
 	u16 max_udp_payload_size;
 	u8 ack_delay_exponent;
 	u32 max_idle_timeout;
 	u32 max_ack_delay;
+	u32 min_ack_delay;
 	u32 timeout;
 	u32 events;
 	u16 count;
 
+	/* ACK timing requested by the peer in ACK_FREQUENCY frames */
+	u64 ack_frequency_seq;	/* next expected Sequence Number */
+	u32 ack_delay;
+	u16 ack_threshold;
+	u16 reorder_threshold;
+
 	u8 disable_compatible_version:1;
 	u8 disable_1rtt_encryption:1;
 	u8 grease_quic_bit:1;
 	u8 stateless_reset:1;
 	u8 need_sack:2;
+	u8 ack_frequency:1;
+	u8 batch:1;
 };
 
 static inline u16 quic_inq_count(struct quic_inqueue *inq)
@@ -64,6 +74,25 @@ static inline u32 quic_inq_max_ack_delay(struct quic_inqueue *inq)
 	return inq->max_ack_delay;
 }
 
+static inline u32 quic_inq_min_ack_delay(struct quic_inqueue *inq)
+{
+	return inq->min_ack_delay;
+}
+
+static inline u32 quic_inq_ack_delay(struct quic_inqueue *inq)
+{
+	return inq->ack_frequency ? inq->ack_delay : inq->max_ack_delay;
+}
+
+static inline void quic_inq_set_ack_frequency(struct quic_inqueue *inq, u16 threshold,
+					      u32 delay, u16 reorder)
+{
+	inq->ack_threshold = threshold;
+	inq->ack_delay = delay;
+	inq->reorder_threshold = reorder;
+	inq->ack_frequency = 1;
+}
+
 static inline u16 quic_inq_max_dgram(struct quic_inqueue *inq)
 {
 	return inq->max_datagram_frame_size;
@@ -74,6 +103,11 @@ static inline u32 quic_inq_max_data(struct quic_inqueue *inq)
 	return inq->max_data;
 }
 
+static inline u64 quic_inq_window(struct quic_inqueue *inq)
+{
+	return inq->window;
+}
+
 static inline u64 quic_inq_bytes(struct quic_inqueue *inq)
 {
 	return inq->bytes;
@@ -129,12 +163,23 @@ static inline void quic_inq_set_need_sack(struct quic_inqueue *inq, u8 need_sack
 	inq->need_sack = need_sack;
 }
 
+static inline u8 quic_inq_batch(struct quic_inqueue *inq)
+{
+	return inq->batch;
+}
+
+static inline void quic_inq_set_batch(struct quic_inqueue *inq, u8 batch)
+{
+	inq->batch = batch;
+}
+
 int quic_inq_handshake_recv(struct sock *sk, struct quic_frame *frame);
 int quic_inq_stream_recv(struct sock *sk, struct quic_frame *frame);
 int quic_inq_dgram_recv(struct sock *sk, struct quic_frame *frame);
 int quic_inq_event_recv(struct sock *sk, u8 event, void *args);
 
-void quic_inq_stream_list_purge(struct sock *sk, struct quic_stream *stream);
+void quic_inq_stream_purge(struct sock *sk, struct quic_stream *stream);
+void quic_inq_decrypted_process(struct sock *sk);
 void quic_inq_decrypted_tail(struct sock *sk, struct sk_buff *skb);
 void quic_inq_backlog_tail(struct sock *sk, struct sk_buff *skb);
 void quic_inq_data_read(struct sock *sk, u32 bytes);
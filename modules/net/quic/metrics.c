@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is part of the QUIC kernel implementation
+ *
+ * Per-peer cache of path metrics used to seed new connections.
+ *
+ * Written or modified by:
+ *    Xin Long <lucien.xin@gmail.com>
+ */
+
+#include <linux/jhash.h>
+
+#include "socket.h"
+
+static u32 quic_metrics_hash(union quic_addr *a)
+{
+	u32 hash;
+
+	if (a->sa.sa_family == AF_INET6)
+		hash = jhash(&a->v6.sin6_addr, sizeof(a->v6.sin6_addr), 0);
+	else
+		hash = jhash_1word(a->v4.sin_addr.s_addr, 0);
+	return hash_32(hash, QUIC_METRICS_HASH_BITS);
+}
+
+static bool quic_metrics_match(struct quic_metrics *m, union quic_addr *a)
+{
+	if (m->addr.sa.sa_family != a->sa.sa_family)
+		return false;
+	if (a->sa.sa_family == AF_INET6)
+		return ipv6_addr_equal(&m->addr.v6.sin6_addr, &a->v6.sin6_addr);
+	return m->addr.v4.sin_addr.s_addr == a->v4.sin_addr.s_addr;
+}
+
+static struct quic_metrics_table *quic_metrics_table(struct sock *sk)
+{
+	return &quic_net(sock_net(sk))->metrics;
+}
+
+/* Save what this connection learned about the path at close, so that the next one to
+ * the same peer can start from it. The oldest entry in a full bucket is reused in
+ * place, as lookups under RCU may only read a stale or mixed entry.
+ */
+void quic_metrics_save(struct sock *sk)
+{
+	struct quic_metrics_table *t = quic_metrics_table(sk);
+	struct quic_path_group *paths = quic_paths(sk);
+	struct quic_metrics *m, *oldest = NULL;
+	struct quic_cong *cong = quic_cong(sk);
+	union quic_addr *da;
+	struct hlist_head *head;
+	u32 depth = 0;
+
+	if (!cong->is_rtt_set)
+		return;
+
+	da = quic_path_daddr(paths, 0);
+	head = &t->hash[quic_metrics_hash(da)];
+
+	spin_lock_bh(&t->lock);
+	hlist_for_each_entry(m, head, node) {
+		if (quic_metrics_match(m, da))
+			goto update;
+		if (!oldest || time_before(m->stamp, oldest->stamp))
+			oldest = m;
+		depth++;
+	}
+
+	if (depth >= QUIC_METRICS_DEPTH) {
+		m = oldest;
+	} else {
+		m = kzalloc(sizeof(*m), GFP_ATOMIC);
+		if (!m) {
+			spin_unlock_bh(&t->lock);
+			return;
+		}
+		hlist_add_head_rcu(&m->node, head);
+	}
+	m->addr = *da;
+
+update:
+	WRITE_ONCE(m->stamp, jiffies);
+	WRITE_ONCE(m->smoothed_rtt, cong->smoothed_rtt);
+	WRITE_ONCE(m->rttvar, cong->rttvar);
+	WRITE_ONCE(m->ssthresh, cong->ssthresh);
+	WRITE_ONCE(m->window, cong->window);
+	WRITE_ONCE(m->pmtu, (u16)quic_path_pl_pmtu(paths));
+	spin_unlock_bh(&t->lock);
+
+	pr_debug("%s: srtt: %u, rttvar: %u, ssthresh: %u, cwnd: %u\n", __func__,
+		 cong->smoothed_rtt, cong->rttvar, cong->ssthresh, cong->window);
+}
+
+/* Seed a new connection to a known peer: rtt for the first PTO, ssthresh and cwnd,
+ * and the PLPMTUD probe size. An initial_smoothed_rtt set by the user is kept.
+ */
+void quic_metrics_apply(struct sock *sk)
+{
+	struct quic_metrics_table *t = quic_metrics_table(sk);
+	struct quic_path_group *paths = quic_paths(sk);
+	u32 srtt, rttvar, ssthresh, window, pmtu;
+	struct quic_metrics *m;
+	union quic_addr *da;
+
+	if (quic_config(sk)->initial_smoothed_rtt)
+		return;
+
+	da = quic_path_daddr(paths, 0);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(m, &t->hash[quic_metrics_hash(da)], node) {
+		if (quic_metrics_match(m, da))
+			break;
+	}
+	if (!m || time_after(jiffies, READ_ONCE(m->stamp) + QUIC_METRICS_TIMEOUT)) {
+		rcu_read_unlock();
+		return;
+	}
+	srtt = READ_ONCE(m->smoothed_rtt);
+	rttvar = READ_ONCE(m->rttvar);
+	ssthresh = READ_ONCE(m->ssthresh);
+	window = READ_ONCE(m->window);
+	pmtu = READ_ONCE(m->pmtu);
+	rcu_read_unlock();
+
+	if (!srtt)
+		return;
+	srtt = min(srtt, QUIC_RTO_MAX);
+
+	quic_cong_seed(quic_cong(sk), srtt, rttvar, ssthresh, window);
+	quic_outq_sync_window(sk, quic_cong_window(quic_cong(sk)));
+	if (pmtu)
+		quic_path_pl_seed(paths, pmtu);
+
+	pr_debug("%s: srtt: %u, rttvar: %u, ssthresh: %u, cwnd: %u, pmtu: %u\n", __func__,
+		 srtt, rttvar, ssthresh, window, pmtu);
+}
+
+void quic_metrics_table_init(struct quic_metrics_table *t)
+{
+	spin_lock_init(&t->lock);
+}
+
+void quic_metrics_table_free(struct quic_metrics_table *t)
+{
+	struct hlist_node *tmp;
+	struct quic_metrics *m;
+	u32 i;
+
+	spin_lock_bh(&t->lock);
+	for (i = 0; i < ARRAY_SIZE(t->hash); i++) {
+		hlist_for_each_entry_safe(m, tmp, &t->hash[i], node) {
+			hlist_del_rcu(&m->node);
+			kfree_rcu(m, rcu);
+		}
+	}
+	spin_unlock_bh(&t->lock);
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is part of the QUIC kernel implementation
+ *
+ * Written or modified by:
+ *    Xin Long <lucien.xin@gmail.com>
+ */
+
+#define QUIC_METRICS_HASH_BITS	10
+#define QUIC_METRICS_DEPTH	5			/* entries per bucket before reuse */
+#define QUIC_METRICS_TIMEOUT	(60 * 60 * HZ)		/* entries older than this are stale */
+
+/* path metrics learned by the last connection to a peer address, see tcp_metrics */
+struct quic_metrics {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	union quic_addr addr;	/* port is ignored */
+	unsigned long stamp;
+
+	u32 smoothed_rtt;
+	u32 rttvar;
+	u32 ssthresh;
+	u32 window;
+	u16 pmtu;		/* validated by PLPMTUD, or 0 */
+};
+
+struct quic_metrics_table {
+	struct hlist_head hash[1 << QUIC_METRICS_HASH_BITS];
+	spinlock_t lock;
+};
+
+void quic_metrics_table_init(struct quic_metrics_table *t);
+void quic_metrics_table_free(struct quic_metrics_table *t);
+
+void quic_metrics_save(struct sock *sk);
+void quic_metrics_apply(struct sock *sk);
@@ -11,6 +11,7 @@
  */
 
 #include "socket.h"
+#include "trace.h"
 
 static int quic_outq_limit_check(struct sock *sk, u8 type, u16 frame_len)
 {
@@ -86,9 +87,41 @@ static void quic_outq_transmit_ctrl(struct sock *sk, u8 level)
 	}
 }
 
+static void quic_outq_wfree(int len, struct sock *sk)
+{
+	if (!len)
+		return;
+
+	WARN_ON(refcount_sub_and_test(len, &sk->sk_wmem_alloc));
+	sk_wmem_queued_add(sk, -len);
+	sk_mem_uncharge(sk, len);
+
+	/* as in tcp_check_space(), only when a writer ran out of space */
+	if (sk->sk_socket && test_bit(SOCK_NOSPACE, &sk->sk_socket->flags))
+		sk->sk_write_space(sk);
+}
+
+/* A datagram still queued past its deadline is dropped rather than sent late, as it is
+ * likely stale for the application, e.g. a media frame, by then. The deadlines are in
+ * queue order, so while the window is full the expired ones are always at the head and
+ * are dropped on the next transmit, such as the one on an ACK.
+ */
+static bool quic_outq_dgram_expired(struct sock *sk, struct quic_frame *frame, u32 now)
+{
+	if (!frame->expires || (s32)(now - frame->expires) < 0)
+		return false;
+
+	list_del(&frame->list);
+	quic_outq_wfree((int)frame->bytes, sk);
+	quic_frame_put(frame);
+	QUIC_INC_STATS(sock_net(sk), QUIC_MIB_FRM_DGRAMEXPIRED);
+	return true;
+}
+
 static void quic_outq_transmit_dgram(struct sock *sk, u8 level)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
+	u32 now = jiffies_to_usecs(jiffies);
 	struct quic_frame *frame, *next;
 	struct list_head *head;
 
@@ -99,6 +132,8 @@ static void quic_outq_transmit_dgram(struct sock *sk, u8 level)
 
 	head = &outq->datagram_list;
 	list_for_each_entry_safe(frame, next, head, list) {
+		if (quic_outq_dgram_expired(sk, frame, now))
+			continue;
 		if (quic_packet_config(sk, outq->data_level, frame->path))
 			break;
 		if (quic_outq_limit_check(sk, frame->type, frame->len))
@@ -128,6 +163,8 @@ int quic_outq_flow_control(struct sock *sk, struct quic_stream *stream, u16 byte
 		blocked = 1;
 	}
 	if (outq->bytes + bytes > outq->max_bytes) {
+		if (!outq->blocked_start)
+			outq->blocked_start = jiffies_to_usecs(jiffies) ?: 1;
 		blocked = outq->data_blocked;
 		if (!blocked && outq->last_max_bytes < outq->max_bytes) {
 			frame = QUIC_FRAME_DATA_BLOCKED;
@@ -158,6 +195,73 @@ u64 quic_outq_wspace(struct sock *sk, struct quic_stream *stream)
 	return len;
 }
 
+/* Like sk_stream_is_writeable(), wait for a third of sk_sndbuf to be free, so that an ACK
+ * freeing a few bytes does not wake up the writers only to block them again.
+ */
+bool quic_outq_writable(struct sock *sk)
+{
+	return quic_outq_wspace(sk, NULL) > 0 && sk_stream_wspace(sk) >= sk_stream_min_wspace(sk);
+}
+
+/* Record a stream whose nonblocking write failed, so that the application learns which
+ * streams to write again from QUIC_EVENT_STREAM_WRITABLE instead of retrying all of them
+ * on each EPOLLOUT.  A stream blocked by its own MAX_STREAM_DATA is only marked and
+ * reported from quic_outq_stream_unblocked(); the others wait on blocked_list for the
+ * connection to become writable in quic_outq_wake_streams().  Neither walks the streams
+ * that are not blocked.
+ */
+void quic_outq_stream_blocked(struct sock *sk, struct quic_stream *stream)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+
+	if (!(quic_inq_events(quic_inq(sk)) & (1 << QUIC_EVENT_STREAM_WRITABLE)))
+		return;
+
+	if (stream->send.bytes >= stream->send.max_bytes) {
+		stream->send.write_blocked = 1;
+		return;
+	}
+	if (list_empty(&stream->send.blocked))
+		list_add_tail(&stream->send.blocked, &outq->blocked_list);
+}
+
+/* called when a MAX_STREAM_DATA frame raised the stream's limit */
+void quic_outq_stream_unblocked(struct sock *sk, struct quic_stream *stream)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+
+	if (!stream->send.write_blocked)
+		return;
+	stream->send.write_blocked = 0;
+
+	if (!quic_outq_writable(sk)) {
+		if (list_empty(&stream->send.blocked))
+			list_add_tail(&stream->send.blocked, &outq->blocked_list);
+		return;
+	}
+	quic_inq_event_recv(sk, QUIC_EVENT_STREAM_WRITABLE, &stream->id);
+}
+
+/* called from sk_write_space() once a third of sk_sndbuf is free */
+void quic_outq_wake_streams(struct sock *sk)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_stream *stream, *tmp;
+
+	if (!quic_outq_wspace(sk, NULL))
+		return;
+	list_for_each_entry_safe(stream, tmp, &outq->blocked_list, send.blocked) {
+		list_del_init(&stream->send.blocked);
+		if (stream->send.state >= QUIC_STREAM_SEND_STATE_SENT)
+			continue;
+		if (stream->send.bytes >= stream->send.max_bytes) {
+			stream->send.write_blocked = 1;
+			continue;
+		}
+		quic_inq_event_recv(sk, QUIC_EVENT_STREAM_WRITABLE, &stream->id);
+	}
+}
+
 static int quic_outq_delay_check(struct sock *sk, u8 level, u8 nodelay)
 {
 	struct quic_packet *packet = quic_packet(sk);
@@ -167,9 +271,9 @@ static int quic_outq_delay_check(struct sock *sk, u8 level, u8 nodelay)
 	if (level || outq->close_frame) /* do not delay for early data or closing sockets */
 		return 0;
 
-	/* pacing control */
+	/* pacing control, done by the qdisc with EDT */
 	pacing_time = quic_cong_pacing_time(quic_cong(sk));
-	if (pacing_time > ktime_get_ns()) {
+	if (!quic_edt_pacing(sk) && pacing_time > ktime_get_ns()) {
 		quic_timer_start(sk, QUIC_TIMER_PACE, pacing_time);
 		return 1;
 	}
@@ -187,10 +291,79 @@ static int quic_outq_delay_check(struct sock *sk, u8 level, u8 nodelay)
 	return 1;
 }
 
+/* Stream scheduling: the frames of a stream are queued on its own send.frame_list, and
+ * a stream with frames queued is linked in outq->stream_list, in the order the streams
+ * are served. The first stream in it is always the one to send from next, and after
+ * each of its frames is packed, the scheduler decides whether it keeps its place.
+ */
+static u8 quic_outq_stream_quantum(struct sock *sk, struct quic_stream *stream)
+{
+	if (quic_config(sk)->stream_scheduler == QUIC_STREAM_SCHED_WFQ)
+		return QUIC_STREAM_URGENCY_MAX + 1 - stream->send.urgency;
+	return 1;
+}
+
+static void quic_outq_stream_sched_add(struct sock *sk, struct quic_stream *stream)
+{
+	struct list_head *head = &quic_outq(sk)->stream_list;
+	struct quic_stream *pos;
+	u8 urgency;
+
+	stream->send.quantum = quic_outq_stream_quantum(sk, stream);
+	if (quic_config(sk)->stream_scheduler != QUIC_STREAM_SCHED_PRIO)
+		goto out;
+
+	/* Behind the streams of the same or a higher urgency, and non-incremental
+	 * streams of the same urgency one after another in stream id order.
+	 */
+	urgency = stream->send.urgency;
+	list_for_each_entry(pos, head, send.list) {
+		if (pos->send.urgency > urgency ||
+		    (pos->send.urgency == urgency && !pos->send.incremental &&
+		     !stream->send.incremental && pos->id > stream->id)) {
+			head = &pos->send.list;
+			break;
+		}
+	}
+out:
+	list_add_tail(&stream->send.list, head);
+}
+
+static void quic_outq_stream_sched_next(struct sock *sk, struct quic_stream *stream)
+{
+	u8 sched = quic_config(sk)->stream_scheduler;
+
+	if (list_empty(&stream->send.frame_list)) {
+		list_del_init(&stream->send.list);
+		return;
+	}
+	if (sched == QUIC_STREAM_SCHED_FIFO ||
+	    (sched == QUIC_STREAM_SCHED_PRIO && !stream->send.incremental))
+		return;
+	if (stream->send.quantum && --stream->send.quantum)
+		return;
+
+	list_del(&stream->send.list);
+	quic_outq_stream_sched_add(sk, stream);
+}
+
+void quic_outq_stream_set_priority(struct sock *sk, struct quic_stream *stream,
+				   u8 urgency, u8 incremental)
+{
+	stream->send.urgency = urgency;
+	stream->send.incremental = !!incremental;
+	if (list_empty(&stream->send.list))
+		return;
+
+	list_del(&stream->send.list);
+	quic_outq_stream_sched_add(sk, stream);
+}
+
 static void quic_outq_transmit_stream(struct sock *sk, u8 level)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
-	struct quic_frame *frame, *next;
+	struct quic_stream *stream;
+	struct quic_frame *frame;
 	struct list_head *head;
 
 	if (level != QUIC_CRYPTO_APP)
@@ -199,7 +372,9 @@ static void quic_outq_transmit_stream(struct sock *sk, u8 level)
 		return;
 
 	head = &outq->stream_list;
-	list_for_each_entry_safe(frame, next, head, list) {
+	while (!list_empty(head)) {
+		stream = list_first_entry(head, struct quic_stream, send.list);
+		frame = list_first_entry(&stream->send.frame_list, struct quic_frame, list);
 		if (quic_packet_config(sk, outq->data_level, frame->path))
 			break;
 		if (quic_outq_limit_check(sk, frame->type, frame->len))
@@ -208,10 +383,10 @@ static void quic_outq_transmit_stream(struct sock *sk, u8 level)
 			break;
 		if (quic_packet_tail(sk, frame)) {
 			outq->stream_list_len -= frame->len;
+			quic_outq_stream_sched_next(sk, stream);
 			continue;
 		}
 		outq->count += quic_packet_create(sk);
-		next = frame;
 	}
 }
 
@@ -257,23 +432,12 @@ int quic_outq_transmit(struct sock *sk)
 	quic_outq_transmit_ctrl(sk, outq->level);
 	quic_outq_transmit_dgram(sk, outq->level);
 	quic_outq_transmit_stream(sk, outq->level);
+	if (!outq->stream_list_len)
+		quic_cong_rate_check_app_limited(quic_cong(sk), outq->inflight);
 
 	return quic_outq_transmit_flush(sk);
 }
 
-static void quic_outq_wfree(int len, struct sock *sk)
-{
-	if (!len)
-		return;
-
-	WARN_ON(refcount_sub_and_test(len, &sk->sk_wmem_alloc));
-	sk_wmem_queued_add(sk, -len);
-	sk_mem_uncharge(sk, len);
-
-	if (sk_stream_wspace(sk) > 0)
-		sk->sk_write_space(sk);
-}
-
 static void quic_outq_set_owner_w(int len, struct sock *sk)
 {
 	if (!len)
@@ -293,11 +457,11 @@ int quic_outq_stream_append(struct sock *sk, struct quic_msginfo *info, u8 pack)
 	struct list_head *head;
 	int len, bytes;
 
-	head = &outq->stream_list;
+	head = &stream->send.frame_list;
 	if (list_empty(head))
 		return -1;
 	frame = list_last_entry(head, struct quic_frame, list);
-	if (frame->stream != stream || frame->nodelay || frame->offset >= 0)
+	if (frame->nodelay || frame->offset >= 0)
 		return -1;
 
 	len = frame->len;
@@ -346,13 +510,19 @@ void quic_outq_stream_tail(struct sock *sk, struct quic_frame *frame, bool cork)
 	outq->stream_list_len += frame->len;
 	quic_outq_set_owner_w((int)frame->bytes, sk);
 
-	list_add_tail(&frame->list, &outq->stream_list);
+	list_add_tail(&frame->list, &stream->send.frame_list);
+	if (list_empty(&stream->send.list))
+		quic_outq_stream_sched_add(sk, stream);
 	if (!cork)
 		quic_outq_transmit(sk);
 }
 
 void quic_outq_dgram_tail(struct sock *sk, struct quic_frame *frame, bool cork)
 {
+	u32 ttl = quic_config(sk)->datagram_ttl;
+
+	if (ttl)
+		frame->expires = (jiffies_to_usecs(jiffies) + ttl) ?: 1;
 	quic_outq_set_owner_w((int)frame->bytes, sk);
 	list_add_tail(&frame->list, &quic_outq(sk)->datagram_list);
 	if (!cork)
@@ -424,24 +594,42 @@ offset:
 
 void quic_outq_packet_sent_tail(struct sock *sk, struct quic_packet_sent *sent)
 {
-	struct list_head *head = &quic_outq(sk)->packet_sent_list;
+	struct rb_root *root = &quic_outq(sk)->packet_sent_tree[sent->level];
+	struct rb_node **p = &root->rb_node, *parent = NULL;
 	struct quic_packet_sent *pos;
 
-	if (sent->level) {
-		list_for_each_entry(pos, head, list) {
-			if (!pos->level) {
-				head = &pos->list;
-				break;
-			}
-			if (sent->level > pos->level)
-				continue;
-			if (sent->level < pos->level) {
-				head = &pos->list;
-				break;
-			}
+	while (*p) {
+		parent = *p;
+		pos = rb_entry(parent, struct quic_packet_sent, node);
+		p = sent->number < pos->number ? &parent->rb_left : &parent->rb_right;
+	}
+	rb_link_node(&sent->node, parent, p);
+	rb_insert_color(&sent->node, root);
+}
+
+/* the sent packet with the largest number not greater than number */
+static struct quic_packet_sent *quic_outq_packet_sent_floor(struct rb_root *root, s64 number)
+{
+	struct quic_packet_sent *sent, *floor = NULL;
+	struct rb_node *node = root->rb_node;
+
+	while (node) {
+		sent = rb_entry(node, struct quic_packet_sent, node);
+		if (sent->number > number) {
+			node = node->rb_left;
+			continue;
 		}
+		floor = sent;
+		if (sent->number == number)
+			break;
+		node = node->rb_right;
 	}
-	list_add_tail(&sent->list, head);
+	return floor;
+}
+
+static struct quic_packet_sent *quic_outq_packet_sent_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct quic_packet_sent, node) : NULL;
 }
 
 void quic_outq_transmit_probe(struct sock *sk)
@@ -463,6 +651,7 @@ void quic_outq_transmit_probe(struct sock *sk)
 	info.size = quic_path_probe_size(paths);
 	info.level = QUIC_CRYPTO_APP;
 	number = quic_pnspace_next_pn(space);
+	trace_quic_pmtu_probe(sk, number, info.size);
 	if (!quic_outq_transmit_frame(sk, QUIC_FRAME_PING, &info, 0, false)) {
 		pathmtu = quic_path_pl_send(paths, number);
 		if (pathmtu)
@@ -588,6 +777,32 @@ static void quic_outq_path_confirm(struct sock *sk, u8 level, s64 largest, s64 s
 		quic_timer_reset(sk, QUIC_TIMER_PMTU, (u64)c->plpmtud_probe_interval * 30);
 }
 
+/* Once cwnd is several packets large, ask the peer to ACK less often than every other
+ * packet via ACK_FREQUENCY, and within rtt/4 bounded by its min and max_ack_delay so
+ * that the PTO needs no change. Only power of 2 thresholds are sent to avoid churn.
+ */
+static void quic_outq_update_ack_frequency(struct sock *sk)
+{
+	struct quic_packet *packet = quic_packet(sk);
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_cong *cong = quic_cong(sk);
+	u32 threshold, delay;
+
+	if (!outq->min_ack_delay || !quic_is_established(sk))
+		return;
+
+	threshold = quic_cong_window(cong) / quic_packet_mss(packet) / QUIC_ACK_FREQUENCY_DIV;
+	threshold = rounddown_pow_of_two(clamp_t(u32, threshold, 1, QUIC_ACK_THRESHOLD_MAX));
+	if (threshold == outq->ack_threshold)
+		return;
+
+	delay = quic_cong_smoothed_rtt(cong) / 4;
+	delay = clamp_t(u32, delay, outq->min_ack_delay, outq->max_ack_delay);
+	outq->ack_threshold = threshold;
+	outq->ack_delay = delay;
+	quic_outq_transmit_frame(sk, QUIC_FRAME_ACK_FREQUENCY, outq, 0, true);
+}
+
 void quic_outq_transmitted_sack(struct sock *sk, u8 level, s64 largest, s64 smallest,
 				s64 ack_largest, u32 ack_delay)
 {
@@ -595,19 +810,17 @@ void quic_outq_transmitted_sack(struct sock *sk, u8 level, s64 largest, s64 smal
 	struct quic_crypto *crypto = quic_crypto(sk, level);
 	struct quic_outqueue *outq = quic_outq(sk);
 	struct quic_cong *cong = quic_cong(sk);
-	struct quic_packet_sent *sent, *next;
+	struct rb_root *root = &outq->packet_sent_tree[level];
+	struct quic_packet_sent *sent, *prev;
 	u32 pto, acked = 0;
+	u8 state;
 
 	quic_outq_path_confirm(sk, level, largest, smallest);
 	pr_debug("%s: largest: %llu, smallest: %llu\n", __func__, largest, smallest);
 
-	list_for_each_entry_safe_reverse(sent, next, &outq->packet_sent_list, list) {
-		if (level != sent->level)
-			continue;
-		if (sent->number > largest)
-			continue;
-		if (sent->number < smallest)
-			break;
+	for (sent = quic_outq_packet_sent_floor(root, largest);
+	     sent && sent->number >= smallest; sent = prev) {
+		prev = quic_outq_packet_sent_entry(rb_prev(&sent->node));
 
 		if (sent->ecn)
 			quic_set_sk_ecn(sk, INET_ECN_ECT_0);
@@ -624,15 +837,28 @@ void quic_outq_transmitted_sack(struct sock *sk, u8 level, s64 largest, s64 smal
 			quic_pnspace_set_max_time_limit(space, pto * 2);
 			quic_crypto_set_key_update_time(crypto, pto * 2);
 		}
+		quic_cong_rate_on_acked(cong, &sent->rate, sent->sent_time, sent->frame_len);
+		state = cong->state;
 		quic_cong_on_packet_acked(cong, sent->sent_time, sent->frame_len, sent->number);
+		if (cong->state != state)
+			trace_quic_cong_state(sk, state);
 		quic_outq_sync_window(sk, quic_cong_window(cong));
 
 		acked += sent->frame_len;
-		list_del(&sent->list);
-		kfree(sent);
+		outq->packets_acked++;
+		rb_erase(&sent->node, root);
+		quic_packet_sent_free(sent);
 	}
 
-	quic_cong_on_ack_recv(cong, acked, READ_ONCE(sk->sk_max_pacing_rate));
+	outq->bytes_acked += acked;
+	state = cong->state;
+	quic_cong_on_ack_recv(cong, acked, outq->inflight, READ_ONCE(sk->sk_max_pacing_rate));
+	if (cong->state != state)
+		trace_quic_cong_state(sk, state);
+	quic_outq_sync_window(sk, quic_cong_window(cong));
+	trace_quic_sack(sk, level, largest, smallest, acked);
+	if (level == QUIC_CRYPTO_APP && acked)
+		quic_outq_update_ack_frequency(sk);
 }
 
 /* GetLossTimeAndSpace() */
@@ -733,9 +959,16 @@ out:
 	quic_timer_reset(sk, QUIC_TIMER_LOSS, time);
 }
 
+/* Size sk_sndbuf from the congestion window, as tcp_sndbuf_expand() does: cwnd is the data
+ * sent per RTT, and twice that leaves the application one more RTT of data queued behind
+ * what is in flight, enough to ride out fast recovery.  It only grows, up to
+ * sysctl_quic_wmem[2], so that a loss halving cwnd does not stall the writers, and it is
+ * moderated under memory pressure instead.
+ */
 void quic_outq_sync_window(struct sock *sk, u32 window)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
+	int sndbuf;
 
 	if (outq->window == window)
 		return;
@@ -743,10 +976,18 @@ void quic_outq_sync_window(struct sock *sk, u32 window)
 
 	if (sk->sk_userlocks & SOCK_SNDBUF_LOCK)
 		return;
-	if (sk->sk_sndbuf > (int)window * 2)
-		if (sk_stream_wspace(sk) > 0)
-			sk->sk_write_space(sk);
-	sk->sk_sndbuf = (int)window * 2;
+	if (sk_under_memory_pressure(sk)) {
+		sk_stream_moderate_sndbuf(sk);
+		return;
+	}
+	if (sk_memory_allocated(sk) >= sk_prot_mem_limits(sk, 0))
+		return;
+
+	sndbuf = (int)min_t(u64, (u64)window * 2, READ_ONCE(sysctl_quic_wmem[2]));
+	if (sndbuf <= sk->sk_sndbuf)
+		return;
+	WRITE_ONCE(sk->sk_sndbuf, sndbuf);
+	sk->sk_write_space(sk);
 }
 
 /* put the timeout frame back to the corresponding outqueue */
@@ -758,7 +999,9 @@ static void quic_outq_retransmit_frame(struct sock *sk, struct quic_frame *frame
 
 	head = &outq->control_list;
 	if (quic_frame_stream(frame->type)) {
-		head = &outq->stream_list;
+		head = &frame->stream->send.frame_list;
+		if (list_empty(&frame->stream->send.list))
+			quic_outq_stream_sched_add(sk, frame->stream);
 
 		outq->stream_list_len += frame->len;
 	}
@@ -786,6 +1029,8 @@ offset:
 		}
 	}
 	list_add_tail(&frame->list, head);
+	outq->bytes_retrans += frame->len;
+	outq->frames_retrans++;
 	QUIC_INC_STATS(sock_net(sk), QUIC_MIB_FRM_RETRANS);
 }
 
@@ -823,9 +1068,11 @@ void quic_outq_retransmit_mark(struct sock *sk, u8 level, u8 immediate)
 	struct quic_pnspace *space = quic_pnspace(sk, level);
 	struct quic_outqueue *outq = quic_outq(sk);
 	struct quic_cong *cong = quic_cong(sk);
+	struct rb_root *root = &outq->packet_sent_tree[level];
 	struct quic_packet_sent *sent, *next;
 	u32 time, now, pto, loss_time;
 	s64 seen;
+	u8 state;
 
 	seen = quic_pnspace_max_pn_acked_seen(space);
 	time = quic_pnspace_max_pn_acked_time(space);
@@ -835,11 +1082,8 @@ void quic_outq_retransmit_mark(struct sock *sk, u8 level, u8 immediate)
 	quic_pnspace_set_loss_time(space, 0);
 	quic_cong_set_time(cong, now);
 
-	list_for_each_entry_safe(sent, next, &outq->packet_sent_list, list) {
-		if (level && !sent->level)
-			break;
-		if (level != sent->level)
-			continue;
+	for (sent = quic_outq_packet_sent_entry(rb_first(root)); sent; sent = next) {
+		next = quic_outq_packet_sent_entry(rb_next(&sent->node));
 		if (!immediate && sent->number > seen)
 			break;
 
@@ -856,11 +1100,17 @@ void quic_outq_retransmit_mark(struct sock *sk, u8 level, u8 immediate)
 		quic_outq_psent_retransmit_frames(sk, sent);
 		quic_pnspace_dec_inflight(space, sent->frame_len);
 
+		trace_quic_packet_lost(sk, level, sent->number, sent->frame_len);
+		state = cong->state;
 		quic_cong_on_packet_lost(cong, time, sent->frame_len, sent->number);
+		if (cong->state != state)
+			trace_quic_cong_state(sk, state);
 		quic_outq_sync_window(sk, quic_cong_window(cong));
+		outq->bytes_lost += sent->frame_len;
+		outq->packets_lost++;
 
-		list_del(&sent->list);
-		kfree(sent);
+		rb_erase(&sent->node, root);
+		quic_packet_sent_free(sent);
 	}
 }
 
@@ -900,6 +1150,7 @@ void quic_outq_transmit_pto(struct sock *sk)
 	}
 
 	quic_outq_get_pto_time(sk, &level);
+	trace_quic_pto(sk, level, outq->pto_count);
 
 	outq->single = 1;
 	outq->level = level;
@@ -911,6 +1162,9 @@ void quic_outq_transmit_pto(struct sock *sk)
 
 	info.size = 0;
 	info.level = level;
+	/* a peer using ACK_FREQUENCY may hold off the ACK to a PING */
+	if (level == QUIC_CRYPTO_APP && outq->min_ack_delay)
+		quic_outq_transmit_frame(sk, QUIC_FRAME_IMMEDIATE_ACK, NULL, 0, true);
 	quic_outq_transmit_frame(sk, QUIC_FRAME_PING, &info, 0, false);
 
 out:
@@ -974,15 +1228,13 @@ void quic_outq_stream_list_purge(struct sock *sk, struct quic_stream *stream)
 		quic_frame_put(frame);
 	}
 
-	list_for_each_entry_safe(frame, next, &outq->stream_list, list) {
-		if (frame->stream != stream)
-			continue;
-
+	list_for_each_entry_safe(frame, next, &stream->send.frame_list, list) {
 		outq->stream_list_len -= frame->len;
 		bytes += frame->bytes;
 		list_del_init(&frame->list);
 		quic_frame_put(frame);
 	}
+	list_del_init(&stream->send.list);
 	quic_outq_wfree(bytes, sk);
 }
 
@@ -1031,19 +1283,16 @@ int quic_outq_transmit_retire_conn_id(struct sock *sk, u64 prior, u8 path, u8 co
 	return 0;
 }
 
-static void quic_outq_encrypted_work(struct work_struct *work)
+/* Called by quic_sock_work_process() with the socket locked, see quic_outq_encrypted_tail() */
+void quic_outq_encrypted_process(struct sock *sk)
 {
-	struct quic_sock *qs = container_of(work, struct quic_sock, outq.work);
-	struct sock *sk = &qs->inet.sk;
-	struct sk_buff_head *head;
+	struct sk_buff_head *head = &sk->sk_write_queue;
 	struct quic_crypto_cb *cb;
 	struct sk_buff *skb;
 
-	lock_sock(sk);
-	head = &sk->sk_write_queue;
 	if (sock_flag(sk, SOCK_DEAD)) {
 		skb_queue_purge(head);
-		goto out;
+		return;
 	}
 
 	skb = skb_dequeue(head);
@@ -1060,20 +1309,28 @@ static void quic_outq_encrypted_work(struct work_struct *work)
 		skb = skb_dequeue(head);
 	}
 	quic_packet_flush(sk);
-out:
-	release_sock(sk);
-	sock_put(sk);
 }
 
-void quic_outq_encrypted_tail(struct sock *sk, struct sk_buff *skb)
+/* Async encrypted packets are not sent one by one on completion. The work is only kicked
+ * once all packets submitted for encryption are done or enough of them are ready, so that
+ * they are bundled into GSO skbs and sent together.
+ */
+#define QUIC_OUTQ_ENCRYPTED_BATCH	64
+
+void quic_outq_encrypted_tail(struct sock *sk, struct sk_buff *skb, int err)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
+	struct sk_buff_head *head = &sk->sk_write_queue;
+	bool last;
 
-	sock_hold(sk);
-	skb_queue_tail(&sk->sk_write_queue, skb);
+	last = atomic_dec_and_test(&outq->encrypting);
+	if (err)
+		kfree_skb(skb);
+	else
+		skb_queue_tail(head, skb);
 
-	if (!schedule_work(&outq->work))
-		sock_put(sk);
+	if (last || skb_queue_len(head) >= QUIC_OUTQ_ENCRYPTED_BATCH)
+		quic_sock_work_schedule(sk, QUIC_SOCK_WORK_ENCRYPTED);
 }
 
 void quic_outq_set_param(struct sock *sk, struct quic_transport_param *p)
@@ -1095,6 +1352,7 @@ void quic_outq_set_param(struct sock *sk, struct quic_transport_param *p)
 	outq->grease_quic_bit = p->grease_quic_bit;
 	outq->stateless_reset = p->stateless_reset;
 	outq->max_ack_delay = p->max_ack_delay;
+	outq->min_ack_delay = p->min_ack_delay;
 	outq->max_data = p->max_data;
 
 	outq->max_bytes = outq->max_data;
@@ -1121,31 +1379,36 @@ void quic_outq_get_param(struct sock *sk, struct quic_transport_param *p)
 	p->grease_quic_bit = outq->grease_quic_bit;
 	p->stateless_reset = outq->stateless_reset;
 	p->max_ack_delay = outq->max_ack_delay;
+	p->min_ack_delay = outq->min_ack_delay;
 	p->max_data = outq->max_data;
 }
 
 void quic_outq_init(struct sock *sk)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
+	int i;
 
 	INIT_LIST_HEAD(&outq->stream_list);
+	INIT_LIST_HEAD(&outq->blocked_list);
 	INIT_LIST_HEAD(&outq->control_list);
 	INIT_LIST_HEAD(&outq->datagram_list);
 	INIT_LIST_HEAD(&outq->transmitted_list);
-	INIT_LIST_HEAD(&outq->packet_sent_list);
+	for (i = 0; i < QUIC_PNSPACE_MAX; i++)
+		outq->packet_sent_tree[i] = RB_ROOT;
 	skb_queue_head_init(&sk->sk_write_queue);
-	INIT_WORK(&outq->work, quic_outq_encrypted_work);
+	atomic_set(&outq->encrypting, 0);
+	outq->ack_threshold = 1; /* the default Ack-Eliciting Threshold */
 }
 
-static void quic_outq_psent_list_purge(struct sock *sk, struct list_head *head)
+static void quic_outq_psent_tree_purge(struct sock *sk, struct rb_root *root)
 {
 	struct quic_packet_sent *sent, *next;
 
-	list_for_each_entry_safe(sent, next, head, list) {
+	rbtree_postorder_for_each_entry_safe(sent, next, root, node) {
 		quic_outq_psent_sack_frames(sk, sent);
-		list_del(&sent->list);
-		kfree(sent);
+		quic_packet_sent_free(sent);
 	}
+	*root = RB_ROOT;
 }
 
 static void quic_outq_list_purge(struct sock *sk, struct list_head *head)
@@ -1164,11 +1427,19 @@ static void quic_outq_list_purge(struct sock *sk, struct list_head *head)
 void quic_outq_free(struct sock *sk)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_stream *stream, *tmp;
+	int i;
 
-	quic_outq_psent_list_purge(sk, &outq->packet_sent_list);
+	for (i = 0; i < QUIC_PNSPACE_MAX; i++)
+		quic_outq_psent_tree_purge(sk, &outq->packet_sent_tree[i]);
 	quic_outq_list_purge(sk, &outq->transmitted_list);
 	quic_outq_list_purge(sk, &outq->datagram_list);
 	quic_outq_list_purge(sk, &outq->control_list);
-	quic_outq_list_purge(sk, &outq->stream_list);
+	list_for_each_entry_safe(stream, tmp, &outq->stream_list, send.list) {
+		quic_outq_list_purge(sk, &stream->send.frame_list);
+		list_del_init(&stream->send.list);
+	}
+	list_for_each_entry_safe(stream, tmp, &outq->blocked_list, send.blocked)
+		list_del_init(&stream->send.blocked);
 	kfree(outq->close_phrase);
 }
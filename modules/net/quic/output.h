@@ -8,13 +8,19 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+/* ask the peer to ACK about every quarter cwnd, up to every 64 packets, see ACK_FREQUENCY */
+#define QUIC_ACK_FREQUENCY_DIV		4
+#define QUIC_ACK_THRESHOLD_MAX		64
+#define QUIC_ACK_REORDER_THRESHOLD	1
+
 struct quic_outqueue {
-	struct list_head packet_sent_list;
+	struct rb_root packet_sent_tree[QUIC_PNSPACE_MAX];
 	struct list_head transmitted_list;
 	struct list_head datagram_list;
 	struct list_head control_list;
-	struct list_head stream_list;
-	struct work_struct work;
+	struct list_head stream_list;	/* streams with frames to send, in schedule order */
+	struct list_head blocked_list;	/* streams to report writable, see quic_outq_stream_blocked() */
+	atomic_t encrypting;	/* packets under async encryption */
 	u64 last_max_bytes;
 	u64 max_bytes;
 	u64 max_data;
@@ -26,6 +32,7 @@ struct quic_outqueue {
 	u32 max_idle_timeout;
 	u32 stream_list_len;	/* all frames len in stream list */
 	u32 max_ack_delay;
+	u32 min_ack_delay;	/* the peer supports ACK_FREQUENCY if set */
 	u32 inflight;		/* all inflight ack_eliciting frames len */
 	u32 window;
 	u16 count;
@@ -37,11 +44,29 @@ struct quic_outqueue {
 	 * when the corresponding crypto is ready for send.
 	 */
 	u8 data_level;
+
+	/* ACK timing last requested from the peer in ACK_FREQUENCY */
+	u64 ack_frequency_seq;
+	u32 ack_delay;
+	u16 ack_threshold;
+
 	u8 *close_phrase;
 	u32 close_errcode;
 	u8 close_frame;
 	u8 pto_count;
 
+	/* counters for QUIC_SOCKOPT_INFO */
+	u64 bytes_sent;
+	u64 bytes_acked;
+	u64 bytes_lost;
+	u64 bytes_retrans;
+	u64 packets_sent;
+	u64 packets_acked;
+	u64 packets_lost;
+	u64 frames_retrans;
+	u64 blocked_time;
+	u32 blocked_start;	/* when connection flow control blocked sending, or 0 */
+
 	u8 disable_compatible_version:1;
 	u8 disable_1rtt_encryption:1;
 	u8 grease_quic_bit:1;
@@ -54,6 +79,8 @@ struct quic_outqueue {
 static inline void quic_outq_inc_inflight(struct quic_outqueue *outq, u32 len)
 {
 	outq->inflight += len;
+	outq->bytes_sent += len;
+	outq->packets_sent++;
 }
 
 static inline u32 quic_outq_inflight(struct quic_outqueue *outq)
@@ -83,6 +110,10 @@ static inline u64 quic_outq_max_bytes(struct quic_outqueue *outq)
 
 static inline void quic_outq_set_max_bytes(struct quic_outqueue *outq, u64 bytes)
 {
+	if (outq->blocked_start && bytes > outq->max_bytes) {
+		outq->blocked_time += jiffies_to_usecs(jiffies) - outq->blocked_start;
+		outq->blocked_start = 0;
+	}
 	outq->max_bytes = bytes;
 }
 
@@ -136,6 +167,16 @@ static inline void quic_outq_set_force_delay(struct quic_outqueue *outq, u8 dela
 	outq->force_delay = !!delay;
 }
 
+static inline void quic_outq_inc_encrypting(struct quic_outqueue *outq)
+{
+	atomic_inc(&outq->encrypting);
+}
+
+static inline void quic_outq_dec_encrypting(struct quic_outqueue *outq)
+{
+	atomic_dec(&outq->encrypting);
+}
+
 void quic_outq_stream_tail(struct sock *sk, struct quic_frame *frame, bool cork);
 void quic_outq_dgram_tail(struct sock *sk, struct quic_frame *frame, bool cork);
 void quic_outq_ctrl_tail(struct sock *sk, struct quic_frame *frame, bool cork);
@@ -159,7 +200,10 @@ void quic_outq_update_loss_timer(struct sock *sk);
 
 void quic_outq_transmit_close(struct sock *sk, u8 frame, u32 errcode, u8 level);
 void quic_outq_stream_list_purge(struct sock *sk, struct quic_stream *stream);
-void quic_outq_encrypted_tail(struct sock *sk, struct sk_buff *skb);
+void quic_outq_stream_set_priority(struct sock *sk, struct quic_stream *stream,
+				   u8 urgency, u8 incremental);
+void quic_outq_encrypted_process(struct sock *sk);
+void quic_outq_encrypted_tail(struct sock *sk, struct sk_buff *skb, int err);
 void quic_outq_transmit_app_close(struct sock *sk);
 void quic_outq_transmit_probe(struct sock *sk);
 
@@ -171,3 +215,8 @@ void quic_outq_free(struct sock *sk);
 
 int quic_outq_flow_control(struct sock *sk, struct quic_stream *stream, u16 bytes, u8 sndblock);
 u64 quic_outq_wspace(struct sock *sk, struct quic_stream *stream);
+bool quic_outq_writable(struct sock *sk);
+
+void quic_outq_stream_blocked(struct sock *sk, struct quic_stream *stream);
+void quic_outq_stream_unblocked(struct sock *sk, struct quic_stream *stream);
+void quic_outq_wake_streams(struct sock *sk);
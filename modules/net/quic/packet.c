@@ -10,7 +10,10 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <linux/version.h>
+
 #include "socket.h"
+#include "trace.h"
 
 #define QUIC_HLEN(dcid, scid)	(1 + QUIC_VERSION_LEN + 1 + (dcid)->len + 1 + (scid)->len)
 
@@ -100,6 +103,25 @@ static int quic_packet_get_version_and_connid(struct quic_conn_id *dcid, struct
 	return 0;
 }
 
+/* The DCID of a received packet at the QUIC header, the one of a short header packet is
+ * QUIC_CONN_ID_DEF_LEN long, as all source connection IDs are.
+ */
+int quic_packet_get_dcid(struct quic_conn_id *dcid, struct sk_buff *skb)
+{
+	struct quic_conn_id scid;
+	u32 len = skb->len;
+	u8 *p = skb->data;
+	u32 version;
+
+	if (!quic_hdr(skb)->form) {
+		if (len < 1 + QUIC_CONN_ID_DEF_LEN)
+			return -EINVAL;
+		quic_conn_id_update(dcid, p + 1, QUIC_CONN_ID_DEF_LEN);
+		return 0;
+	}
+	return quic_packet_get_version_and_connid(dcid, &scid, &version, &p, &len);
+}
+
 static int quic_packet_version_change(struct sock *sk, struct quic_conn_id *dcid, u32 version)
 {
 	struct quic_crypto *crypto = quic_crypto(sk, QUIC_CRYPTO_INITIAL);
@@ -238,57 +260,126 @@ static int quic_packet_rcv_err(struct sk_buff *skb)
 	quic_packet_rcv_err_pmtu(sk);
 out:
 	bh_unlock_sock(sk);
+	sock_put(sk);
 	return ret;
 }
 
-int quic_packet_rcv(struct sk_buff *skb, u8 err)
+static struct sock *quic_packet_rcv_sock(struct sk_buff *skb)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	struct net *net = dev_net(skb->dev);
-	struct quic_conn_id *conn_id;
-	struct sock *sk = NULL;
-	u8 *dcid;
-
-	if (unlikely(err))
-		return quic_packet_rcv_err(skb);
+	struct quic_conn_id *conn_id, dcid;
+	struct sock *sk;
 
 	skb_pull(skb, skb_transport_offset(skb));
 
 	if (skb->len < sizeof(struct quichdr))
-		goto err;
+		return NULL;
 
 	if (!quic_hdr(skb)->form) { /* search scid hashtable for post-handshake packets */
-		dcid = (u8 *)quic_hdr(skb) + 1;
-		conn_id = quic_conn_id_lookup(net, dcid, skb->len - 1);
-		if (conn_id) {
+		sk = quic_conn_id_lookup(net, (u8 *)quic_hdr(skb) + 1, skb->len - 1, &conn_id);
+		if (sk) {
 			cb->conn_id = conn_id;
-			sk = quic_conn_id_sk(conn_id);
+			return sk;
 		}
-	}
-	if (!sk) {
-		sk = quic_packet_get_sock(sk, skb);
-		if (!sk)
-			goto err;
-	}
+	} else if (!quic_packet_get_dcid(&dcid, skb) && dcid.len == QUIC_CONN_ID_DEF_LEN) {
+		/* a long header packet to an ID we chose, e.g. a Handshake one from a client
+		 * whose address changed, is for its socket whatever the 4-tuple is
+		 */
+		sk = quic_conn_id_lookup(net, dcid.data, dcid.len, &conn_id);
+		if (sk)
+			return sk;
+	}
+	return quic_packet_get_sock(NULL, skb);
+}
+
+/* Check if the skb is a short header packet with the same dcid as the batch's first one. */
+static bool quic_packet_rcv_batched(struct sk_buff *skb, struct quic_conn_id *conn_id)
+{
+	skb_pull(skb, skb_transport_offset(skb));
+
+	if (skb->len <= conn_id->len || quic_hdr(skb)->form ||
+	    memcmp((u8 *)quic_hdr(skb) + 1, conn_id->data, conn_id->len))
+		return false;
+
+	QUIC_CRYPTO_CB(skb)->conn_id = conn_id;
+	return true;
+}
+
+static void quic_packet_rcv_queue(struct sock *sk, struct sk_buff_head *head)
+{
+	struct quic_inqueue *inq = quic_inq(sk);
+	struct net *net = sock_net(sk);
+	struct sk_buff *skb;
+
 	bh_lock_sock(sk);
 	if (sock_owned_by_user(sk)) {
-		cb->backlog = 1;
-		if (sk_add_backlog(sk, skb, READ_ONCE(sk->sk_rcvbuf))) {
-			QUIC_INC_STATS(net, QUIC_MIB_PKT_RCVDROP);
-			bh_unlock_sock(sk);
-			goto err;
+		while ((skb = __skb_dequeue(head))) {
+			QUIC_CRYPTO_CB(skb)->backlog = 1;
+			if (sk_add_backlog(sk, skb, READ_ONCE(sk->sk_rcvbuf))) {
+				QUIC_INC_STATS(net, QUIC_MIB_PKT_RCVDROP);
+				kfree_skb(skb);
+				continue;
+			}
+			QUIC_INC_STATS(net, QUIC_MIB_PKT_RCVBACKLOGS);
 		}
-		QUIC_INC_STATS(net, QUIC_MIB_PKT_RCVBACKLOGS);
-	} else {
+		goto out;
+	}
+
+	/* a batch transmits (ACKs and data) once after all its packets are processed */
+	quic_inq_set_batch(inq, skb_queue_len(head) > 1);
+	while ((skb = __skb_dequeue(head))) {
 		QUIC_INC_STATS(net, QUIC_MIB_PKT_RCVFASTPATHS);
 		sk->sk_backlog_rcv(sk, skb); /* quic_packet_process */
 	}
+	if (quic_inq_batch(inq)) {
+		quic_inq_set_batch(inq, 0);
+		if (quic_is_established(sk))
+			quic_outq_transmit(sk);
+	}
+out:
 	bh_unlock_sock(sk);
-	return 0;
+}
 
-err:
-	kfree_skb(skb);
-	return -EINVAL;
+/* The skb may be the first of an skb list, split from a UDP GRO skb in quic_udp_rcv().
+ * The following short header packets with the same dcid share the socket lookup and
+ * locking with it.
+ */
+int quic_packet_rcv(struct sk_buff *skb, u8 err)
+{
+	struct quic_conn_id *conn_id;
+	struct sk_buff_head head;
+	struct sk_buff *next;
+	struct sock *sk;
+
+	if (unlikely(err))
+		return quic_packet_rcv_err(skb);
+
+	__skb_queue_head_init(&head);
+	while (skb) {
+		next = skb->next;
+		skb_mark_not_on_list(skb);
+		sk = quic_packet_rcv_sock(skb);
+		if (!sk) {
+			kfree_skb(skb);
+			skb = next;
+			continue;
+		}
+		__skb_queue_tail(&head, skb);
+
+		conn_id = QUIC_CRYPTO_CB(skb)->conn_id;
+		while (conn_id && next && quic_packet_rcv_batched(next, conn_id)) {
+			skb = next;
+			next = skb->next;
+			skb_mark_not_on_list(skb);
+			__skb_queue_tail(&head, skb);
+		}
+		sk_incoming_cpu_update(sk); /* see quic_sock_work_schedule() */
+		quic_packet_rcv_queue(sk, &head);
+		sock_put(sk);
+		skb = next;
+	}
+	return 0;
 }
 
 /* Retry Packet {
@@ -308,16 +399,16 @@ err:
 
 static struct sk_buff *quic_packet_retry_create(struct sock *sk)
 {
-	struct quic_crypto *crypto = quic_crypto(sk, QUIC_CRYPTO_INITIAL);
+	struct quic_token_keys *keys = &quic_net(sock_net(sk))->token_keys;
 	struct quic_packet *packet = quic_packet(sk);
-	u8 *p, token[72], tag[16];
+	u8 *p, token[QUIC_TOKEN_MAX_LEN], tag[16];
 	struct quic_conn_id dcid;
 	struct quichshdr *hdr;
 	struct sk_buff *skb;
 	u32 len, tlen, hlen;
 
-	quic_put_int(token, 1, 1); /* retry token flag */
-	if (quic_crypto_generate_token(crypto, &packet->daddr, sizeof(packet->daddr),
+	quic_put_int(token, QUIC_TOKEN_FLAG_RETRY, 1); /* retry token flag */
+	if (quic_crypto_generate_token(keys, &packet->daddr, sizeof(packet->daddr),
 				       &packet->dcid, token, &tlen))
 		return NULL;
 
@@ -344,7 +435,7 @@ static struct sk_buff *quic_packet_retry_create(struct sock *sk)
 	p = quic_put_int(p, dcid.len, 1);
 	p = quic_put_data(p, dcid.data, dcid.len);
 	p = quic_put_data(p, token, tlen);
-	if (quic_crypto_get_retry_tag(crypto, skb, &packet->dcid, packet->version, tag)) {
+	if (quic_crypto_get_retry_tag(skb, &packet->dcid, packet->version, tag)) {
 		kfree_skb(skb);
 		return NULL;
 	}
@@ -527,7 +618,6 @@ static int quic_packet_listen_process(struct sock *sk, struct sk_buff *skb)
 	u32 version, errcode, len = skb->len;
 	u8 *p = skb->data, type, retry = 0;
 	struct net *net = sock_net(sk);
-	struct quic_crypto *crypto;
 	struct quic_conn_id odcid;
 	struct quic_data token;
 	int err = 0;
@@ -586,16 +676,15 @@ static int quic_packet_listen_process(struct sock *sk, struct sk_buff *skb)
 			consume_skb(skb);
 			goto out;
 		}
-		crypto = quic_crypto(sk, QUIC_CRYPTO_INITIAL);
-		err = quic_crypto_verify_token(crypto, &packet->daddr, sizeof(packet->daddr),
-					       &odcid, token.data, token.len);
+		err = quic_crypto_verify_token(&quic_net(net)->token_keys, &packet->daddr,
+					       sizeof(packet->daddr), &odcid, token.data, token.len);
 		if (err) {
 			errcode = QUIC_TRANSPORT_ERROR_INVALID_TOKEN;
 			err = quic_packet_refuse_close_transmit(sk, errcode);
 			consume_skb(skb);
 			goto out;
 		}
-		retry = *(u8 *)token.data;
+		retry = *(u8 *)token.data & QUIC_TOKEN_FLAG_RETRY;
 	}
 
 	err = quic_request_sock_enqueue(sk, &odcid, retry);
@@ -642,7 +731,6 @@ static int quic_packet_stateless_reset_process(struct sock *sk, struct sk_buff *
 
 static int quic_packet_handshake_retry_process(struct sock *sk, struct sk_buff *skb)
 {
-	struct quic_crypto *crypto = quic_crypto(sk, QUIC_CRYPTO_INITIAL);
 	struct quic_path_group *paths = quic_paths(sk);
 	struct quic_packet *packet = quic_packet(sk);
 	struct quic_conn_id *active;
@@ -655,7 +743,7 @@ static int quic_packet_handshake_retry_process(struct sock *sk, struct sk_buff *
 		goto err;
 	p = skb->data + hlen;
 	version = packet->version;
-	if (quic_crypto_get_retry_tag(crypto, skb, quic_path_orig_dcid(paths), version, tag) ||
+	if (quic_crypto_get_retry_tag(skb, quic_path_orig_dcid(paths), version, tag) ||
 	    memcmp(tag, p + len - 16, 16))
 		goto err;
 	if (quic_data_dup(quic_token(sk), p, len - 16))
@@ -852,6 +940,7 @@ static int quic_packet_handshake_process(struct sock *sk, struct sk_buff *skb)
 
 		pr_debug("%s: recvd, num: %llu, level: %d, len: %d\n",
 			 __func__, cb->number, packet->level, skb->len);
+		trace_quic_packet_rcv(sk, packet->level, cb->number, skb->len);
 
 		quic_pnspace_set_time(space, cb->time);
 		err = quic_pnspace_check(space, cb->number);
@@ -950,6 +1039,32 @@ static void quic_packet_path_alt_process(struct sock *sk, struct sk_buff *skb)
 	quic_conn_id_set_active(quic_source(sk), cb->conn_id);
 }
 
+/* whether the ACK to this ack-eliciting packet can wait for the SACK timer, following
+ * the peer's ACK_FREQUENCY if any: the ACK is sent once more than Ack-Eliciting Threshold
+ * packets are unacknowledged, or a packet is missing Reordering Threshold packets below
+ * the largest received.
+ */
+static bool quic_packet_sack_delayable(struct sock *sk)
+{
+	struct quic_pnspace *space = quic_pnspace(sk, QUIC_CRYPTO_APP);
+	struct quic_packet *packet = quic_packet(sk);
+	struct quic_inqueue *inq = quic_inq(sk);
+	s64 reorder;
+
+	if (packet->ack_immediate)
+		return false;
+
+	if (!inq->ack_frequency)
+		return !quic_pnspace_has_gap(space) &&
+		       quic_inq_count(inq) < (u16)(QUIC_PATH_MAX_PMTU / packet->mss[0] + 1);
+
+	reorder = quic_pnspace_max_pn_seen(space) - quic_pnspace_base_pn(space);
+	if (inq->reorder_threshold && quic_pnspace_has_gap(space) &&
+	    reorder >= inq->reorder_threshold)
+		return false;
+	return quic_inq_count(inq) < inq->ack_threshold;
+}
+
 static int quic_packet_app_process_done(struct sock *sk, struct sk_buff *skb)
 {
 	struct quic_pnspace *space = quic_pnspace(sk, QUIC_CRYPTO_APP);
@@ -990,11 +1105,10 @@ static int quic_packet_app_process_done(struct sock *sk, struct sk_buff *skb)
 	if (!packet->ack_eliciting)
 		goto out;
 
-	if (!packet->ack_immediate && !quic_pnspace_has_gap(space) &&
-	    quic_inq_count(inq) < (u16)(QUIC_PATH_MAX_PMTU / packet->mss[0] + 1)) {
+	if (quic_packet_sack_delayable(sk)) {
 		quic_inq_set_count(inq, quic_inq_count(inq) + 1);
 		if (!quic_inq_need_sack(inq))
-			quic_timer_reset(sk, QUIC_TIMER_SACK, quic_inq_max_ack_delay(inq));
+			quic_timer_reset(sk, QUIC_TIMER_SACK, quic_inq_ack_delay(inq));
 		quic_inq_set_need_sack(inq, 2);
 		goto out;
 	}
@@ -1006,7 +1120,8 @@ out:
 	if (quic_is_established(sk)) {
 		if (!quic_inq_need_sack(inq))
 			quic_timer_reset(sk, QUIC_TIMER_IDLE, quic_inq_timeout(inq));
-		quic_outq_transmit(sk);
+		if (!quic_inq_batch(inq))
+			quic_outq_transmit(sk);
 	} else if (!quic_inq_need_sack(inq)) {
 		quic_inq_set_need_sack(inq, 1);
 		quic_timer_reset(sk, QUIC_TIMER_SACK, quic_inq_max_ack_delay(inq));
@@ -1076,6 +1191,9 @@ static int quic_packet_app_process(struct sock *sk, struct sk_buff *skb)
 		key_phase = cb->key_phase;
 		quic_inq_event_recv(sk, QUIC_EVENT_KEY_UPDATE, &key_phase);
 	}
+	/* the previous key phase may just have been retired by this packet */
+	if (quic_crypto_key_prepare_queue(crypto))
+		quic_sock_key_work_schedule(sk);
 	if (!cb->resume)
 		QUIC_INC_STATS(net, QUIC_MIB_PKT_DECFASTPATHS);
 	if (quic_hdr(skb)->reserved) {
@@ -1085,6 +1203,7 @@ static int quic_packet_app_process(struct sock *sk, struct sk_buff *skb)
 	}
 
 	pr_debug("%s: recvd, num: %llu, len: %d\n", __func__, cb->number, skb->len);
+	trace_quic_packet_rcv(sk, packet->level, cb->number, skb->len);
 
 	quic_pnspace_set_time(space, cb->time);
 	err = quic_pnspace_check(space, cb->number);
@@ -1227,14 +1346,19 @@ static int quic_packet_get_alpn(struct quic_data *alpn, u8 *p, u32 len)
 	return 0;
 }
 
+/* Per-cpu Initial crypto used to decrypt the first packet of new connections for
+ * listener lookup by ALPN, and its transforms are only rekeyed for each packet.
+ */
+static DEFINE_PER_CPU(struct quic_crypto, quic_packet_alpn_crypto);
+
 int quic_packet_parse_alpn(struct sk_buff *skb, struct quic_data *alpn)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	struct net *net = dev_net(skb->dev);
-	u8 *p = skb->data, *data, type;
 	struct quic_conn_id dcid, scid;
 	u32 len = skb->len, version;
 	struct quic_crypto *crypto;
+	u8 *p = skb->data, type;
 	struct quic_data token;
 	u64 offset, length;
 	int err = -EINVAL;
@@ -1252,28 +1376,29 @@ int quic_packet_parse_alpn(struct sk_buff *skb, struct quic_data *alpn)
 		return -EINVAL;
 	if (!quic_get_var(&p, &len, &length) || length > (u64)len)
 		return err;
-	cb->length = (u16)length;
-	crypto = kzalloc(sizeof(*crypto), GFP_ATOMIC);
-	if (!crypto)
-		return -ENOMEM;
-	data = kmemdup(skb->data, skb->len, GFP_ATOMIC);
-	if (!data) {
-		kfree(crypto);
-		return -ENOMEM;
-	}
-	err = quic_crypto_initial_keys_install(crypto, &dcid, version, 1);
-	if (err)
-		goto out;
-	cb->number_offset = (u16)(p - skb->data);
-	cb->crypto_done = quic_packet_decrypt_done;
-	err = quic_crypto_decrypt(crypto, skb);
-	if (err) {
-		QUIC_INC_STATS(net, QUIC_MIB_PKT_DECDROP);
-		memcpy(skb->data, data, skb->len);
-		goto out;
+
+	/* The plaintext is left in the skb with cb->resume set, so that neither the
+	 * listener nor the accepted socket decrypts it again, and a lookup for an skb
+	 * that was already decrypted, like from quic_accept_sock_exists(), skips it.
+	 */
+	if (!cb->resume) {
+		cb->length = (u16)length;
+		cb->number_offset = (u16)(p - skb->data);
+		cb->crypto_done = quic_packet_decrypt_done;
+		local_bh_disable();
+		crypto = this_cpu_ptr(&quic_packet_alpn_crypto);
+		err = quic_crypto_initial_rx_keys_install(crypto, &dcid, version);
+		if (!err) {
+			err = quic_crypto_decrypt(crypto, skb);
+			if (err)
+				QUIC_INC_STATS(net, QUIC_MIB_PKT_DECDROP);
+		}
+		local_bh_enable();
+		if (err) /* the packet is dropped, no need to restore it */
+			return err;
+		QUIC_INC_STATS(net, QUIC_MIB_PKT_DECFASTPATHS);
+		cb->resume = 1;
 	}
-	QUIC_INC_STATS(net, QUIC_MIB_PKT_DECFASTPATHS);
-	cb->resume = 1;
 
 	/* QUIC CRYPTO frame */
 	p += cb->number_len;
@@ -1281,26 +1406,44 @@ int quic_packet_parse_alpn(struct sk_buff *skb, struct quic_data *alpn)
 	for (; len && !(*p); p++, len--) /* skip the padding frame */
 		;
 	if (!len-- || *p++ != QUIC_FRAME_CRYPTO)
-		goto out;
+		return 0;
 	if (!quic_get_var(&p, &len, &offset) || offset)
-		goto out;
+		return 0;
 	if (!quic_get_var(&p, &len, &length) || length > (u64)len)
-		goto out;
+		return 0;
 
 	/* TLS CLIENT_HELLO message */
-	err = quic_packet_get_alpn(alpn, p, length);
+	return quic_packet_get_alpn(alpn, p, length);
+}
 
-out:
-	quic_crypto_destroy(crypto);
-	kfree(crypto);
-	kfree(data);
-	return err;
+void quic_packet_destroy(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		quic_crypto_destroy(per_cpu_ptr(&quic_packet_alpn_crypto, cpu));
 }
 
 /* make these fixed for easy coding */
 #define QUIC_PACKET_NUMBER_LEN	4
 #define QUIC_PACKET_LENGTH_LEN	4
 
+/* EDT: the packet leaves at the pacing time planned for it, all of a GSO skb at once */
+static void quic_packet_set_tstamp(struct sock *sk, struct sk_buff *skb)
+{
+	u64 tstamp;
+
+	if (!quic_edt_pacing(sk) || !READ_ONCE(quic_cong(sk)->pacing_rate))
+		return;
+
+	tstamp = max(quic_cong_pacing_time(quic_cong(sk)), ktime_get_ns());
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	skb_set_delivery_time(skb, tstamp, SKB_CLOCK_MONOTONIC);
+#else
+	skb_set_delivery_time(skb, tstamp, true);
+#endif
+}
+
 static u8 *quic_packet_pack_frames(struct sock *sk, struct sk_buff *skb,
 				   struct quic_packet_sent *sent, u16 off)
 {
@@ -1328,8 +1471,14 @@ static u8 *quic_packet_pack_frames(struct sock *sk, struct sk_buff *skb,
 	list_for_each_entry_safe(frame, next, &packet->frame_list, list) {
 		list_del(&frame->list);
 		p = quic_put_data(p, frame->data, frame->size);
-		for (frag = frame->flist; frag; frag = frag->next)
+		for (frag = frame->flist; frag; frag = frag->next) {
+			if (frag->page) {
+				memcpy_from_page(p, frag->page, frag->offset, frag->size);
+				p += frag->size;
+				continue;
+			}
 			p = quic_put_data(p, frag->data, frag->size);
+		}
 		pr_debug("%s: num: %llu, type: %u, packet_len: %u, frame_len: %u, level: %u\n",
 			 __func__, number, frame->type, skb->len, frame->len, packet->level);
 		if (!quic_frame_ack_eliciting(frame->type)) {
@@ -1348,6 +1497,7 @@ static u8 *quic_packet_pack_frames(struct sock *sk, struct sk_buff *skb,
 	if (quic_is_established(sk) && !quic_path_alt_state(paths, QUIC_PATH_ALT_PROBING))
 		quic_timer_reset_path(sk);
 
+	trace_quic_packet_xmit(sk, packet->level, number, skb->len + quic_packet_taglen(packet));
 	if (!sent)
 		return p;
 
@@ -1360,7 +1510,10 @@ static u8 *quic_packet_pack_frames(struct sock *sk, struct sk_buff *skb,
 	sent->frame_len = packet->frame_len;
 	sent->sent_time = jiffies_to_usecs(jiffies);
 	sent->level = (packet->level % QUIC_CRYPTO_EARLY);
+	quic_packet_set_tstamp(sk, skb);
 
+	quic_cong_rate_on_sent(quic_cong(sk), &sent->rate, sent->sent_time,
+			       quic_outq_inflight(quic_outq(sk)));
 	quic_outq_inc_inflight(quic_outq(sk), sent->frame_len);
 	quic_pnspace_inc_inflight(space, sent->frame_len);
 	quic_pnspace_set_last_sent_time(space, sent->sent_time);
@@ -1376,13 +1529,25 @@ static struct quic_packet_sent *quic_packet_sent_alloc(u16 frames)
 	u32 len = frames * sizeof(struct quic_frame *);
 	struct quic_packet_sent *sent;
 
-	sent = kzalloc(sizeof(*sent) + len, GFP_ATOMIC);
+	if (frames <= QUIC_PACKET_SENT_CACHE_FRAMES)
+		sent = kmem_cache_zalloc(quic_packet_sent_cachep, GFP_ATOMIC);
+	else
+		sent = kzalloc(sizeof(*sent) + len, GFP_ATOMIC);
 	if (sent)
 		sent->frames = frames;
 
 	return sent;
 }
 
+void quic_packet_sent_free(struct quic_packet_sent *sent)
+{
+	if (sent->frames <= QUIC_PACKET_SENT_CACHE_FRAMES) {
+		kmem_cache_free(quic_packet_sent_cachep, sent);
+		return;
+	}
+	kfree(sent);
+}
+
 /* Initial Packet {
  *   Header Form (1) = 1,
  *   Fixed Bit (1) = 1,
@@ -1456,7 +1621,8 @@ static struct sk_buff *quic_packet_handshake_create(struct sock *sk)
 	hlen = packet->hlen + MAX_HEADER;
 	skb = alloc_skb(hlen + len + packet->taglen[1], GFP_ATOMIC);
 	if (!skb) {
-		kfree(sent);
+		if (sent)
+			quic_packet_sent_free(sent);
 		quic_outq_retransmit_list(sk, &packet->frame_list);
 		return NULL;
 	}
@@ -1563,7 +1729,8 @@ static struct sk_buff *quic_packet_app_create(struct sock *sk)
 	hlen = packet->hlen + MAX_HEADER;
 	skb = alloc_skb(hlen + len + packet->taglen[0], GFP_ATOMIC);
 	if (!skb) {
-		kfree(sent);
+		if (sent)
+			quic_packet_sent_free(sent);
 		quic_outq_retransmit_list(sk, &packet->frame_list);
 		return NULL;
 	}
@@ -1627,7 +1794,7 @@ int quic_packet_route(struct sock *sk)
 	pmtu = min_t(u32, dst_mtu(__sk_dst_get(sk)), QUIC_PATH_MAX_PMTU);
 	quic_packet_mss_update(sk, pmtu - packet->hlen);
 
-	quic_path_pl_reset(paths);
+	quic_path_pl_reset(paths, packet->mss[0] - packet->taglen[0]);
 	quic_timer_reset(sk, QUIC_TIMER_PMTU, c->plpmtud_probe_interval);
 	return 0;
 }
@@ -1642,6 +1809,7 @@ int quic_packet_config(struct sock *sk, u8 level, u8 path)
 	if (!quic_packet_empty(packet))
 		return 0;
 
+	path = quic_path_sched_select(quic_paths(sk), level, path);
 	packet->frame_len = 0;
 	packet->ipfragok = 0;
 	packet->padding = 0;
@@ -1662,6 +1830,7 @@ int quic_packet_config(struct sock *sk, u8 level, u8 path)
 	packet->overhead = (u8)hlen;
 
 	if (packet->path != path) {
+		quic_packet_flush(sk); /* the bundled packets still use the old path's route */
 		packet->path = path;
 		__sk_dst_reset(sk);
 	}
@@ -1675,34 +1844,91 @@ static void quic_packet_encrypt_done(struct sk_buff *skb, int err)
 {
 	if (err) {
 		QUIC_INC_STATS(sock_net(skb->sk), QUIC_MIB_PKT_ENCDROP);
-		kfree_skb(skb);
 		pr_debug("%s: err: %d\n", __func__, err);
-		return;
 	}
 
-	quic_outq_encrypted_tail(skb->sk, skb);
+	quic_outq_encrypted_tail(skb->sk, skb, err);
 }
 
-static int quic_packet_bundle(struct sock *sk, struct sk_buff *skb)
+#define QUIC_PACKET_GSO_MAX_SEGS	UDP_MAX_SEGMENTS
+#define QUIC_PACKET_GSO_MAX_SIZE	U16_MAX
+#define QUIC_PACKET_GSO_EDT_SEGS_MIN	2
+
+/* With EDT a GSO skb departs as one burst, so keep it to about 1ms at the pacing rate */
+static u16 quic_packet_gso_max_segs(struct sock *sk, u16 size)
+{
+	u32 rate = READ_ONCE(quic_cong(sk)->pacing_rate);
+	u32 segs;
+
+	if (!rate || !quic_edt_pacing(sk))
+		return QUIC_PACKET_GSO_MAX_SEGS;
+
+	segs = rate / MSEC_PER_SEC / size;
+	return (u16)clamp_t(u32, segs, QUIC_PACKET_GSO_EDT_SEGS_MIN, QUIC_PACKET_GSO_MAX_SEGS);
+}
+
+/* 1-RTT packets are chained on the head's frag_list and sent as one UDP GSO skb with
+ * gso_size set to the head's length. All segments must have the same size except the
+ * last one, which may be shorter and ends the bundle.
+ */
+static int quic_packet_gso_bundle(struct sock *sk, struct sk_buff *skb)
 {
 	struct quic_crypto_cb *head_cb, *cb = QUIC_CRYPTO_CB(skb);
 	struct quic_packet *packet = quic_packet(sk);
-	struct sk_buff *p;
+	struct sk_buff *p = packet->head;
+	struct skb_shared_info *shinfo;
+	u16 size, max_segs;
 
-	if (!packet->head) {
+	head_cb = QUIC_CRYPTO_CB(p);
+	shinfo = skb_shinfo(p);
+	size = shinfo->gso_size ?: (u16)p->len;
+	max_segs = quic_packet_gso_max_segs(sk, size);
+	if (skb->len > size || head_cb->last->len != size || cb->ecn != head_cb->ecn ||
+	    p->ignore_df || skb->ignore_df || shinfo->gso_segs >= max_segs ||
+	    p->len + skb->len + packet->hlen > QUIC_PACKET_GSO_MAX_SIZE) {
+		quic_packet_flush(sk);
 		packet->head = skb;
 		cb->last = skb;
-		goto out;
+		return 0;
 	}
 
-	if (packet->head->len + skb->len >= packet->mss[0]) {
-		quic_packet_flush(sk);
-		packet->head = skb;
-		cb->last = skb;
-		goto out;
+	if (head_cb->last == p) {
+		shinfo->frag_list = skb;
+		shinfo->gso_size = size;
+		shinfo->gso_type = SKB_GSO_UDP_L4;
+		shinfo->gso_segs = 1;
+	} else {
+		head_cb->last->next = skb;
 	}
+	shinfo->gso_segs++;
+	p->data_len += skb->len;
+	p->truesize += skb->truesize;
+	p->len += skb->len;
+	head_cb->last = skb;
+
+	return skb->len < size || shinfo->gso_segs >= max_segs;
+}
+
+static int quic_packet_bundle(struct sock *sk, struct sk_buff *skb)
+{
+	struct quic_crypto_cb *head_cb, *cb = QUIC_CRYPTO_CB(skb);
+	struct quic_packet *packet = quic_packet(sk);
+	struct sk_buff *p;
+
+	if (!packet->head)
+		goto new;
+
 	p = packet->head;
 	head_cb = QUIC_CRYPTO_CB(p);
+	if (!head_cb->level) {
+		if (!cb->level)
+			return quic_packet_gso_bundle(sk, skb);
+		goto flush; /* a short header packet must be the last one in a datagram */
+	}
+
+	if (p->len + skb->len >= packet->mss[0])
+		goto flush;
+
 	if (head_cb->last == p)
 		skb_shinfo(p)->frag_list = skb;
 	else
@@ -1712,15 +1938,21 @@ static int quic_packet_bundle(struct sock *sk, struct sk_buff *skb)
 	p->len += skb->len;
 	head_cb->last = skb;
 	head_cb->ecn |= cb->ecn;
-
-out:
 	return !cb->level;
+
+flush:
+	quic_packet_flush(sk);
+new:
+	packet->head = skb;
+	cb->last = skb;
+	return 0;
 }
 
 int quic_packet_xmit(struct sock *sk, struct sk_buff *skb)
 {
 	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
 	struct quic_packet *packet = quic_packet(sk);
+	struct quic_outqueue *outq = quic_outq(sk);
 	struct net *net = sock_net(sk);
 	int err;
 
@@ -1729,8 +1961,13 @@ int quic_packet_xmit(struct sock *sk, struct sk_buff *skb)
 	if (!packet->taglen[quic_hdr(skb)->form]) /* !taglen means disable_1rtt_encryption */
 		goto xmit;
 
+	/* counted before submitting, as an async completion may run right away */
 	cb->crypto_done = quic_packet_encrypt_done;
+	cb->hp_batch = !cb->level; /* 1-RTT header protection is applied in quic_packet_flush() */
+	quic_outq_inc_encrypting(outq);
 	err = quic_crypto_encrypt(quic_crypto(sk, packet->level), skb);
+	if (err != -EINPROGRESS)
+		quic_outq_dec_encrypting(outq);
 	if (err) {
 		if (err != -EINPROGRESS) {
 			QUIC_INC_STATS(net, QUIC_MIB_PKT_ENCDROP);
@@ -1783,13 +2020,27 @@ void quic_packet_flush(struct sock *sk)
 	struct quic_path_group *paths = quic_paths(sk);
 	struct quic_packet *packet = quic_packet(sk);
 	union quic_addr *sa, *da;
+	struct sk_buff *skb;
+
+	skb = packet->head;
+	if (!skb)
+		return;
+	packet->head = NULL;
 
-	if (packet->head) {
-		da = quic_path_daddr(paths, packet->path);
-		sa = quic_path_saddr(paths, packet->path);
-		quic_lower_xmit(sk, packet->head, da, sa);
-		packet->head = NULL;
+	if (quic_crypto_header_encrypt_batch(quic_crypto(sk, QUIC_CRYPTO_APP), skb)) {
+		QUIC_INC_STATS(sock_net(sk), QUIC_MIB_PKT_ENCDROP);
+		kfree_skb(skb);
+		return;
 	}
+
+	if (skb_is_gso(skb)) { /* leave the UDP checksums to the segmentation */
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		skb->csum_start = (u16)(skb_headroom(skb) - sizeof(struct udphdr));
+		skb->csum_offset = offsetof(struct udphdr, check);
+	}
+	da = quic_path_daddr(paths, packet->path);
+	sa = quic_path_saddr(paths, packet->path);
+	quic_lower_xmit(sk, skb, da, sa);
 }
 
 int quic_packet_tail(struct sock *sk, struct quic_frame *frame)
@@ -33,12 +33,12 @@ struct quic_packet {
 	u8 has_sack:1;
 	u8 ipfragok:1;
 	u8 padding:1;
-	u8 path:1;
+	u8 path:2;
 	u8 level;
 };
 
 struct quic_packet_sent {
-	struct list_head list;
+	struct rb_node node;	/* in outq packet_sent_tree[level], keyed by number */
 	u32 sent_time;
 	u16 frame_len;
 	u16 frames;
@@ -47,6 +47,8 @@ struct quic_packet_sent {
 	u8  level;
 	u8  ecn:2;
 
+	struct quic_cong_rate_state rate;
+
 	struct quic_frame *frame_array[];
 };
 
@@ -67,6 +69,9 @@ struct quic_packet_sent {
 
 #define QUIC_VERSION_LEN		4
 
+/* packet_sent with up to this many frames is from quic_packet_sent_cachep */
+#define QUIC_PACKET_SENT_CACHE_FRAMES	16
+
 static inline void quic_packet_set_version(struct quic_packet *packet, u32 version)
 {
 	packet->version = version;
@@ -138,7 +143,10 @@ void quic_packet_init(struct sock *sk);
 
 int quic_packet_select_version(struct sock *sk, u32 *versions, u8 count);
 int quic_packet_parse_alpn(struct sk_buff *skb, struct quic_data *alpn);
+int quic_packet_get_dcid(struct quic_conn_id *dcid, struct sk_buff *skb);
+void quic_packet_destroy(void);
 u32 *quic_packet_compatible_versions(u32 version);
 
+void quic_packet_sent_free(struct quic_packet_sent *sent);
 void quic_packet_rcv_err_pmtu(struct sock *sk);
 int quic_packet_rcv(struct sk_buff *skb, u8 err);
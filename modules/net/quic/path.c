@@ -20,16 +20,59 @@
 static int (*quic_path_rcv)(struct sk_buff *skb, u8 err);
 static struct workqueue_struct *quic_wq __read_mostly;
 
-static int quic_udp_rcv(struct sock *sk, struct sk_buff *skb)
+static int quic_udp_rcv_prepare(struct sk_buff *skb)
 {
 	if (skb_linearize(skb))
-		return 0;
+		return -ENOMEM;
 
 	memset(skb->cb, 0, sizeof(skb->cb));
 	QUIC_CRYPTO_CB(skb)->udph_offset = skb->transport_header;
 	QUIC_CRYPTO_CB(skb)->time = jiffies_to_usecs(jiffies);
 	skb_set_transport_header(skb, sizeof(struct udphdr));
-	quic_path_rcv(skb, 0);
+	return 0;
+}
+
+/* Split a UDP GRO skb back into its datagrams the way udp_queue_rcv_skb() does for sockets
+ * without UDP_GRO, and return them prepared as one skb list.
+ */
+struct sk_buff *quic_udp_rcv_segment(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff *segs, *next, *head = NULL, **tail = &head;
+
+	/* skb->data is at the UDP header, but GSO segmentation starts from the MAC header */
+	__skb_push(skb, -skb_mac_offset(skb));
+	segs = udp_rcv_segment(sk, skb, skb->protocol == htons(ETH_P_IP));
+	skb_list_walk_safe(segs, skb, next) {
+		skb_mark_not_on_list(skb);
+		__skb_pull(skb, skb_transport_offset(skb));
+		udp_post_segment_fix_csum(skb);
+		if (quic_udp_rcv_prepare(skb)) {
+			kfree_skb(skb);
+			continue;
+		}
+		*tail = skb;
+		tail = &skb->next;
+	}
+	return head;
+}
+EXPORT_SYMBOL_GPL(quic_udp_rcv_segment);
+
+static int quic_udp_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	if (!skb_is_gso(skb)) {
+		if (quic_udp_rcv_prepare(skb)) {
+			kfree_skb(skb);
+			return 0;
+		}
+		skb_mark_not_on_list(skb);
+		quic_path_rcv(skb, 0);
+		return 0;
+	}
+
+	/* UDP_GRO is set on the encap socks, so coalesced datagrams are passed up as one list */
+	skb = quic_udp_rcv_segment(sk, skb);
+	if (skb)
+		quic_path_rcv(skb, 0);
 	return 0;
 }
 
@@ -46,18 +89,78 @@ static void quic_udp_sock_destroy(struct work_struct *work)
 {
 	struct quic_udp_sock *us = container_of(work, struct quic_udp_sock, work);
 	struct quic_hash_head *head;
+	u32 i;
 
-	head = quic_udp_sock_head(sock_net(us->sk), ntohs(us->addr.v4.sin_port));
+	head = quic_udp_sock_head(sock_net(us->sk[0]), ntohs(us->addr.v4.sin_port));
 
 	spin_lock(&head->lock);
 	__hlist_del(&us->node);
 	spin_unlock(&head->lock);
 
-	udp_tunnel_sock_release(us->sk->sk_socket);
+	for (i = 0; i < us->count; i++)
+		udp_tunnel_sock_release(us->sk[i]->sk_socket);
 	kfree(us);
 }
 
-static struct quic_udp_sock *quic_udp_sock_create(struct sock *sk, union quic_addr *a)
+/* The number of encap UDP socks per local address and port when the port is chosen by
+ * the user, as a listener's usually is: 0 creates one per online CPU. With more than one,
+ * they form a reuseport group and UDP spreads the flows across them by 4-tuple hash, so
+ * that a busy port's receive path does not share one UDP sock on all CPUs. Transmit does
+ * not need this, as packets are sent with the QUIC sock, not the UDP one.
+ */
+int sysctl_quic_udp_socks __read_mostly = 1;
+
+#define QUIC_UDP_SOCKS_MAX	64
+
+static u32 quic_udp_sock_count(void)
+{
+	int count = READ_ONCE(sysctl_quic_udp_socks);
+
+	if (count <= 0)
+		count = num_online_cpus();
+	return min_t(u32, count, QUIC_UDP_SOCKS_MAX);
+}
+
+/* udp_sock_create() binds before SO_REUSEPORT could be set, so group members are created
+ * here, with the same options it sets for the quic_udp_conf_init() config.
+ */
+static int quic_udp_sock_create_reuseport(struct sock *sk, union quic_addr *a,
+					  struct socket **sockp)
+{
+	struct socket *sock;
+	int err, len;
+
+	err = sock_create_kern(sock_net(sk), a->sa.sa_family, SOCK_DGRAM, 0, &sock);
+	if (err)
+		return err;
+
+	len = sizeof(a->v4);
+	if (a->sa.sa_family == AF_INET6) {
+		len = sizeof(a->v6);
+		if (ipv6_only_sock(sk))
+			ip6_sock_set_v6only(sock->sk);
+		udp_set_no_check6_tx(sock->sk, true);
+	} else {
+		sock->sk->sk_no_check_tx = 1;
+	}
+	sock->sk->sk_reuseport = 1;
+	/* UDP only lets a socket join a reuseport group if its owner's uid matches the
+	 * group's, and no task can own INVALID_UID, so user sockets cannot join this group
+	 * and take a share of its flows; their bind fails with EADDRINUSE. sock_i_uid()
+	 * reads the inode's uid on older kernels and sk_uid on newer ones, so set both.
+	 */
+	SOCK_INODE(sock)->i_uid = INVALID_UID;
+	sock->sk->sk_uid = INVALID_UID;
+	err = kernel_bind(sock, (struct sockaddr *)a, len);
+	if (err) {
+		sock_release(sock);
+		return err;
+	}
+	*sockp = sock;
+	return 0;
+}
+
+static struct quic_udp_sock *quic_udp_sock_create(struct sock *sk, union quic_addr *a, u32 count)
 {
 	struct udp_tunnel_sock_cfg tuncfg = {};
 	struct udp_port_cfg udp_conf = {0};
@@ -65,25 +168,36 @@ static struct quic_udp_sock *quic_udp_sock_create(struct sock *sk, union quic_ad
 	struct quic_hash_head *head;
 	struct quic_udp_sock *us;
 	struct socket *sock;
+	int val = 1, err;
 
-	us = kzalloc(sizeof(*us), GFP_ATOMIC);
+	us = kzalloc(struct_size(us, sk, count), GFP_ATOMIC);
 	if (!us)
 		return NULL;
 
-	quic_udp_conf_init(sk, &udp_conf, a);
-	if (udp_sock_create(net, &udp_conf, &sock)) {
-		pr_debug("%s: failed to create udp sock\n", __func__);
-		kfree(us);
-		return NULL;
-	}
-
 	tuncfg.encap_type = 1;
 	tuncfg.encap_rcv = quic_udp_rcv;
 	tuncfg.encap_err_lookup = quic_udp_err;
-	setup_udp_tunnel_sock(net, sock, &tuncfg);
+
+	quic_udp_conf_init(sk, &udp_conf, a);
+	for (us->count = 0; us->count < count; us->count++) {
+		if (count > 1)
+			err = quic_udp_sock_create_reuseport(sk, a, &sock);
+		else
+			err = udp_sock_create(net, &udp_conf, &sock);
+		if (err) {
+			pr_debug("%s: failed to create udp sock: %d\n", __func__, err);
+			while (us->count--)
+				udp_tunnel_sock_release(us->sk[us->count]->sk_socket);
+			kfree(us);
+			return NULL;
+		}
+		setup_udp_tunnel_sock(net, sock, &tuncfg);
+		/* allow UDP GRO to coalesce the datagrams of a flow, see quic_udp_rcv() */
+		sock->ops->setsockopt(sock, SOL_UDP, UDP_GRO, KERNEL_SOCKPTR(&val), sizeof(val));
+		us->sk[us->count] = sock->sk;
+	}
 
 	refcount_set(&us->refcnt, 1);
-	us->sk = sock->sk;
 	memcpy(&us->addr, a, sizeof(*a));
 
 	head = quic_udp_sock_head(net, ntohs(a->v4.sin_port));
@@ -108,7 +222,8 @@ static void quic_udp_sock_put(struct quic_udp_sock *us)
 		queue_work(quic_wq, &us->work);
 }
 
-static struct quic_udp_sock *quic_udp_sock_lookup(struct sock *sk, union quic_addr *a)
+static struct quic_udp_sock *quic_udp_sock_lookup(struct sock *sk, union quic_addr *a,
+						  u32 count)
 {
 	struct quic_udp_sock *tmp, *us = NULL;
 	struct net *net = sock_net(sk);
@@ -117,25 +232,26 @@ static struct quic_udp_sock *quic_udp_sock_lookup(struct sock *sk, union quic_ad
 	head = quic_udp_sock_head(net, ntohs(a->v4.sin_port));
 	spin_lock(&head->lock);
 	hlist_for_each_entry(tmp, &head->head, node) {
-		if (net != sock_net(tmp->sk))
+		if (net != sock_net(tmp->sk[0]))
 			continue;
 
-		if (quic_cmp_sk_addr(tmp->sk, &tmp->addr, a)) {
+		if (quic_cmp_sk_addr(tmp->sk[0], &tmp->addr, a)) {
 			us = quic_udp_sock_get(tmp);
 			break;
 		}
 	}
 	spin_unlock(&head->lock);
 	if (!us)
-		us = quic_udp_sock_create(sk, a);
+		us = quic_udp_sock_create(sk, a, count);
 	return us;
 }
 
-static int quic_path_set_udp_sock(struct sock *sk, struct quic_path_group *paths, u8 path)
+static int quic_path_set_udp_sock(struct sock *sk, struct quic_path_group *paths, u8 path,
+				  u32 count)
 {
 	struct quic_udp_sock *usk;
 
-	usk = quic_udp_sock_lookup(sk, quic_path_saddr(paths, path));
+	usk = quic_udp_sock_lookup(sk, quic_path_saddr(paths, path), count);
 	if (!usk)
 		return -EINVAL;
 
@@ -212,12 +328,15 @@ next:
 
 int quic_path_bind(struct sock *sk, struct quic_path_group *paths, u8 path)
 {
+	u32 count = 1;
 	int err;
 
+	if (quic_path_saddr(paths, path)->v4.sin_port) /* not an ephemeral port */
+		count = quic_udp_sock_count();
 	err = quic_path_set_bind_port(sk, paths, path);
 	if (err)
 		return err;
-	err = quic_path_set_udp_sock(sk, paths, path);
+	err = quic_path_set_udp_sock(sk, paths, path, count);
 	if (err)
 		quic_path_free(sk, paths, path);
 	return err;
@@ -299,17 +418,34 @@ enum quic_plpmtud_state {
 };
 
 #define QUIC_BASE_PLPMTU        1200
-#define QUIC_MAX_PLPMTU         9000
+#define QUIC_MAX_PLPMTU         QUIC_MAX_UDP_PAYLOAD
 #define QUIC_MIN_PLPMTU         512
 
 #define QUIC_MAX_PROBES         3
 
-#define QUIC_PL_BIG_STEP        32
 #define QUIC_PL_MIN_STEP        4
 
+/* The search first probes probe_max, the largest PLPMTU the route and the peer allow, so
+ * that a path with no smaller MTU on it, like in a datacenter with jumbo frames, completes
+ * in one round.  After a probe fails, it becomes probe_high and the search continues with
+ * a binary search between the confirmed PLPMTU and it.  Returns 0 once that range is
+ * down to QUIC_PL_MIN_STEP, i.e. the search is complete.
+ */
+static u16 quic_path_pl_next(struct quic_path_group *paths)
+{
+	u16 pmtu = paths->pl.pmtu, high = paths->pl.probe_high;
+
+	if (!high)
+		return paths->pl.probe_max > pmtu ? paths->pl.probe_max : 0;
+	if (high - pmtu <= QUIC_PL_MIN_STEP)
+		return 0;
+	return pmtu + (high - pmtu) / 2;
+}
+
 u32 quic_path_pl_send(struct quic_path_group *paths, s64 number)
 {
 	u32 pathmtu = 0;
+	u16 next;
 
 	paths->pl.number = number;
 	if (paths->pl.probe_count < QUIC_MAX_PROBES)
@@ -335,12 +471,15 @@ u32 quic_path_pl_send(struct quic_path_group *paths, s64 number)
 			pathmtu = paths->pathmtu;
 		} else { /* Normal probe failure. */
 			paths->pl.probe_high = paths->pl.probe_size;
-			paths->pl.probe_size = paths->pl.pmtu;
+			next = quic_path_pl_next(paths);
+			/* with nothing left to search, the ACK of the confirmed size completes it */
+			paths->pl.probe_size = next ?: paths->pl.pmtu;
 		}
 	} else if (paths->pl.state == QUIC_PL_COMPLETE) {
 		if (paths->pl.pmtu == paths->pl.probe_size) { /* Black Hole Detected */
 			paths->pl.state = QUIC_PL_BASE;  /* Search Complete -> Base */
 			paths->pl.probe_size = QUIC_BASE_PLPMTU;
+			paths->pl.probe_high = 0;
 
 			paths->pl.pmtu = QUIC_BASE_PLPMTU;
 			paths->pathmtu = QUIC_BASE_PLPMTU;
@@ -358,6 +497,7 @@ out:
 u32 quic_path_pl_recv(struct quic_path_group *paths, bool *raise_timer, bool *complete)
 {
 	u32 pathmtu = 0;
+	u16 next;
 
 	pr_debug("%s: dst: %p, state: %d, pmtu: %d, size: %d, high: %d\n", __func__, paths,
 		 paths->pl.state, paths->pl.pmtu, paths->pl.probe_size, paths->pl.probe_high);
@@ -368,46 +508,36 @@ u32 quic_path_pl_recv(struct quic_path_group *paths, bool *raise_timer, bool *co
 	paths->pl.probe_count = 0;
 	if (paths->pl.state == QUIC_PL_BASE) {
 		paths->pl.state = QUIC_PL_SEARCH; /* Base -> Search */
-		paths->pl.probe_size += QUIC_PL_BIG_STEP;
 	} else if (paths->pl.state == QUIC_PL_ERROR) {
 		paths->pl.state = QUIC_PL_SEARCH; /* Error -> Search */
 
-		paths->pl.pmtu = paths->pl.probe_size;
 		paths->pathmtu = (u32)paths->pl.pmtu;
 		pathmtu = paths->pathmtu;
-		paths->pl.probe_size += QUIC_PL_BIG_STEP;
-	} else if (paths->pl.state == QUIC_PL_SEARCH) {
-		if (!paths->pl.probe_high) {
-			if (paths->pl.probe_size < QUIC_MAX_PLPMTU) {
-				paths->pl.probe_size =
-					(u16)min(paths->pl.probe_size + QUIC_PL_BIG_STEP,
-						 QUIC_MAX_PLPMTU);
-				*complete = false;
-				return pathmtu;
-			}
-			paths->pl.probe_high = QUIC_MAX_PLPMTU;
-		}
-		paths->pl.probe_size += QUIC_PL_MIN_STEP;
-		if (paths->pl.probe_size >= paths->pl.probe_high) {
-			paths->pl.probe_high = 0;
-			paths->pl.state = QUIC_PL_COMPLETE; /* Search -> Search Complete */
-
-			paths->pl.probe_size = paths->pl.pmtu;
-			paths->pathmtu = (u32)paths->pl.pmtu;
-			pathmtu = paths->pathmtu;
-			*raise_timer = true;
-		}
 	} else if (paths->pl.state == QUIC_PL_COMPLETE) {
 		/* Raise probe_size again after 30 * interval in Search Complete */
 		paths->pl.state = QUIC_PL_SEARCH; /* Search Complete -> Search */
-		paths->pl.probe_size = (u16)min(paths->pl.probe_size + QUIC_PL_MIN_STEP,
-						QUIC_MAX_PLPMTU);
+		paths->pl.probe_high = 0;
+	}
+
+	next = quic_path_pl_next(paths);
+	if (next) {
+		paths->pl.probe_size = next;
+		*complete = false;
+		return pathmtu;
 	}
 
-	*complete = (paths->pl.state == QUIC_PL_COMPLETE);
+	paths->pl.probe_high = 0;
+	paths->pl.state = QUIC_PL_COMPLETE; /* Search -> Search Complete */
+
+	paths->pl.probe_size = paths->pl.pmtu;
+	paths->pathmtu = (u32)paths->pl.pmtu;
+	pathmtu = paths->pathmtu;
+	*raise_timer = true;
+	*complete = true;
 	return pathmtu;
 }
 
+/* A PTB is only a hint: its size is probed next, and used once the probe confirms it */
 u32 quic_path_pl_toobig(struct quic_path_group *paths, u32 pmtu, bool *reset_timer)
 {
 	u32 pathmtu = 0;
@@ -439,6 +569,7 @@ u32 quic_path_pl_toobig(struct quic_path_group *paths, u32 pmtu, bool *reset_tim
 			pathmtu = paths->pathmtu;
 		} else if (pmtu > (u32)paths->pl.pmtu && pmtu < (u32)paths->pl.probe_size) {
 			paths->pl.probe_size = (u16)pmtu;
+			paths->pl.probe_high = (u16)pmtu + 1; /* complete once the PTB size is confirmed */
 			paths->pl.probe_count = 0;
 		}
 	} else if (paths->pl.state == QUIC_PL_COMPLETE) {
@@ -457,12 +588,35 @@ u32 quic_path_pl_toobig(struct quic_path_group *paths, u32 pmtu, bool *reset_tim
 	return pathmtu;
 }
 
-void quic_path_pl_reset(struct quic_path_group *paths)
+/* max is the largest PLPMTU that the route and the peer's max_udp_payload_size allow */
+void quic_path_pl_reset(struct quic_path_group *paths, u32 max)
 {
 	paths->pl.number = 0;
 	paths->pl.state = QUIC_PL_BASE;
 	paths->pl.pmtu = QUIC_BASE_PLPMTU;
 	paths->pl.probe_size = QUIC_BASE_PLPMTU;
+	paths->pl.probe_high = 0;
+	paths->pl.probe_max = (u16)clamp_t(u32, max, QUIC_BASE_PLPMTU, QUIC_MAX_PLPMTU);
+}
+
+/* the PLPMTU confirmed by probing, to be cached for the peer, or 0 */
+u32 quic_path_pl_pmtu(struct quic_path_group *paths)
+{
+	if (paths->pl.state != QUIC_PL_SEARCH && paths->pl.state != QUIC_PL_COMPLETE)
+		return 0;
+	return paths->pl.pmtu > QUIC_BASE_PLPMTU ? paths->pl.pmtu : 0;
+}
+
+/* probe a PLPMTU known for the peer first, and complete the search once it is confirmed */
+void quic_path_pl_seed(struct quic_path_group *paths, u32 pmtu)
+{
+	if (paths->pl.state != QUIC_PL_BASE || pmtu <= QUIC_BASE_PLPMTU ||
+	    pmtu > paths->pl.probe_max)
+		return;
+
+	paths->pl.state = QUIC_PL_SEARCH;
+	paths->pl.probe_size = (u16)pmtu;
+	paths->pl.probe_high = (u16)pmtu + 1;
 }
 
 bool quic_path_pl_confirm(struct quic_path_group *paths, s64 largest, s64 smallest)
@@ -470,6 +624,80 @@ bool quic_path_pl_confirm(struct quic_path_group *paths, s64 largest, s64 smalle
 	return paths->pl.number && paths->pl.number >= smallest && paths->pl.number <= largest;
 }
 
+/* path schedulers registered by other modules, none of which are built in */
+static LIST_HEAD(quic_path_sched_list);
+static DEFINE_SPINLOCK(quic_path_sched_list_lock);
+
+static struct quic_path_sched_ops *quic_path_sched_find(const char *name)
+{
+	struct quic_path_sched_ops *ops;
+
+	/* callers hold either rcu_read_lock() or quic_path_sched_list_lock */
+	list_for_each_entry_rcu(ops, &quic_path_sched_list, list,
+				lockdep_is_held(&quic_path_sched_list_lock)) {
+		if (!strcmp(ops->name, name))
+			return ops;
+	}
+	return NULL;
+}
+
+int quic_path_sched_register(struct quic_path_sched_ops *ops)
+{
+	if (!ops->select || !ops->name[0])
+		return -EINVAL;
+
+	spin_lock(&quic_path_sched_list_lock);
+	if (quic_path_sched_find(ops->name)) {
+		spin_unlock(&quic_path_sched_list_lock);
+		pr_debug("%s: %s already registered\n", __func__, ops->name);
+		return -EEXIST;
+	}
+	list_add_tail_rcu(&ops->list, &quic_path_sched_list);
+	spin_unlock(&quic_path_sched_list_lock);
+
+	pr_debug("%s: %s registered\n", __func__, ops->name);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_path_sched_register);
+
+void quic_path_sched_unregister(struct quic_path_sched_ops *ops)
+{
+	spin_lock(&quic_path_sched_list_lock);
+	list_del_rcu(&ops->list);
+	spin_unlock(&quic_path_sched_list_lock);
+
+	synchronize_rcu();
+}
+EXPORT_SYMBOL_GPL(quic_path_sched_unregister);
+
+/* Sockets hold a reference on the module of their scheduler until it is released */
+int quic_path_set_sched(struct quic_path_group *paths, const char *name)
+{
+	struct quic_path_sched_ops *ops;
+
+	rcu_read_lock();
+	ops = quic_path_sched_find(name);
+	if (!ops || !try_module_get(ops->owner)) {
+		rcu_read_unlock();
+		return -ENOENT;
+	}
+	rcu_read_unlock();
+
+	quic_path_sched_release(paths);
+	paths->sched = ops;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(quic_path_set_sched);
+
+void quic_path_sched_release(struct quic_path_group *paths)
+{
+	if (!paths->sched)
+		return;
+	module_put(paths->sched->owner);
+	paths->sched = NULL;
+}
+EXPORT_SYMBOL_GPL(quic_path_sched_release);
+
 int quic_path_init(int (*rcv)(struct sk_buff *skb, u8 err))
 {
 	quic_wq = create_workqueue("quic_workqueue");
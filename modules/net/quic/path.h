@@ -11,6 +11,8 @@
 #define QUIC_PATH_MIN_PMTU	1200U
 #define QUIC_PATH_MAX_PMTU	65536U
 
+extern int sysctl_quic_udp_socks;
+
 #define QUIC_MIN_UDP_PAYLOAD	1200
 #define QUIC_MAX_UDP_PAYLOAD	65527
 
@@ -32,7 +34,8 @@ struct quic_udp_sock {
 	struct hlist_node node;
 	union quic_addr addr;
 	refcount_t refcnt;
-	struct sock *sk;
+	u32 count;
+	struct sock *sk[]; /* a reuseport group if count > 1 */
 };
 
 struct quic_path {
@@ -42,10 +45,34 @@ struct quic_path {
 	struct quic_udp_sock *udp_sk;
 };
 
+/* path[0] is the active path and path[1] the alternate one being probed or migrated to.
+ * The others are for the additional paths of multipath, which a scheduler can pick.
+ */
+#define QUIC_PATH_MAX_PATHS	4
+
+#define QUIC_PATH_SCHED_NAME_MAX	16
+
+struct quic_path_group;
+
+/* Chooses the path for each packet, see quic_packet_config(). The default, with no
+ * scheduler set, sends on the path the frames were queued for.
+ */
+struct quic_path_sched_ops {
+	/* the path to send a packet of @level, with frames queued for @path, on; a path
+	 * that is not set up falls back to the active one
+	 */
+	u8 (*select)(struct quic_path_group *paths, u8 level, u8 path);
+
+	char name[QUIC_PATH_SCHED_NAME_MAX];
+	struct list_head list;	/* in quic_path_sched_list */
+	struct module *owner;
+};
+
 struct quic_path_group {
 	struct quic_conn_id retry_dcid;
 	struct quic_conn_id orig_dcid;
-	struct quic_path path[2];
+	struct quic_path path[QUIC_PATH_MAX_PATHS];
+	struct quic_path_sched_ops *sched;
 	u16 ampl_sndlen; /* amplificationlimit send counting */
 	u16 ampl_rcvlen; /* amplificationlimit recv counting */
 	u8 entropy[8];
@@ -58,6 +85,7 @@ struct quic_path_group {
 
 		u16 probe_size;
 		u16 probe_high;
+		u16 probe_max;
 		u8 probe_count;
 		u8 state;
 	} pl; /* plpmtud related */
@@ -128,6 +156,11 @@ static inline void quic_path_set_pref_addr(struct quic_path_group *paths, u8 pre
 	paths->pref_addr = pref_addr;
 }
 
+static inline u8 quic_path_pl_state(struct quic_path_group *paths)
+{
+	return paths->pl.state;
+}
+
 static inline u16 quic_path_ampl_sndlen(struct quic_path_group *paths)
 {
 	return paths->ampl_sndlen;
@@ -248,6 +281,23 @@ static inline u8 quic_path_disable_saddr_alt(struct quic_path_group *paths)
 	return paths->disable_saddr_alt;
 }
 
+static inline u8 quic_path_sched_select(struct quic_path_group *paths, u8 level, u8 path)
+{
+	struct quic_path_sched_ops *ops = paths->sched;
+
+	if (!ops)
+		return path;
+	path = ops->select(paths, level, path);
+	if (path >= QUIC_PATH_MAX_PATHS || !paths->path[path].udp_sk)
+		return 0;
+	return path;
+}
+
+int quic_path_sched_register(struct quic_path_sched_ops *ops);
+void quic_path_sched_unregister(struct quic_path_sched_ops *ops);
+int quic_path_set_sched(struct quic_path_group *paths, const char *name);
+void quic_path_sched_release(struct quic_path_group *paths);
+
 int quic_path_detect_alt(struct quic_path_group *paths, union quic_addr *sa, union quic_addr *da);
 int quic_path_bind(struct sock *sk, struct quic_path_group *paths, u8 path);
 void quic_path_free(struct sock *sk, struct quic_path_group *paths, u8 path);
@@ -260,7 +310,10 @@ u32 quic_path_pl_send(struct quic_path_group *paths, s64 number);
 void quic_path_get_param(struct quic_path_group *paths, struct quic_transport_param *p);
 void quic_path_set_param(struct quic_path_group *paths, struct quic_transport_param *p);
 bool quic_path_pl_confirm(struct quic_path_group *paths, s64 largest, s64 smallest);
-void quic_path_pl_reset(struct quic_path_group *paths);
+void quic_path_pl_reset(struct quic_path_group *paths, u32 max);
+void quic_path_pl_seed(struct quic_path_group *paths, u32 pmtu);
+u32 quic_path_pl_pmtu(struct quic_path_group *paths);
 
+struct sk_buff *quic_udp_rcv_segment(struct sock *sk, struct sk_buff *skb);
 int quic_path_init(int (*rcv)(struct sk_buff *skb, u8 err));
 void quic_path_destroy(void);
@@ -14,41 +14,45 @@
 
 #include "pnspace.h"
 
-static int quic_pnspace_grow(struct quic_pnspace *space, u16 size)
+/* index of the first range starting above pn */
+static u16 quic_pnspace_find(const struct quic_pnspace *space, s64 pn)
 {
-	u16 len, inc, offset;
-	unsigned long *new;
+	u16 lo = 0, hi = space->ranges_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (space->ranges[mid].start > pn)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
 
-	if (size > QUIC_PN_MAP_SIZE)
-		return 0;
+static void quic_pnspace_remove(struct quic_pnspace *space, u16 i, u16 count)
+{
+	space->ranges_count -= count;
+	memmove(&space->ranges[i], &space->ranges[i + count],
+		(space->ranges_count - i) * sizeof(*space->ranges));
+}
 
-	inc = ALIGN((size - space->pn_map_len), BITS_PER_LONG) + QUIC_PN_MAP_INCREMENT;
-	len = (u16)min(space->pn_map_len + inc, QUIC_PN_MAP_SIZE);
+static int quic_pnspace_grow(struct quic_pnspace *space)
+{
+	struct quic_pn_range *new;
+	u16 len;
 
-	new = kzalloc(len >> 3, GFP_ATOMIC);
+	len = space->ranges_len ? space->ranges_len * 2 : QUIC_PN_RANGES_INITIAL;
+	new = krealloc(space->ranges, len * sizeof(*new), GFP_ATOMIC);
 	if (!new)
-		return 0;
-
-	offset = (u16)(space->max_pn_seen + 1 - space->base_pn);
-	bitmap_copy(new, space->pn_map, offset);
-	kfree(space->pn_map);
-	space->pn_map = new;
-	space->pn_map_len = len;
-
-	return 1;
+		return -ENOMEM;
+	space->ranges = new;
+	space->ranges_len = len;
+	return 0;
 }
 
 int quic_pnspace_init(struct quic_pnspace *space)
 {
-	if (!space->pn_map) {
-		space->pn_map = kzalloc(QUIC_PN_MAP_INITIAL >> 3, GFP_KERNEL);
-		if (!space->pn_map)
-			return -ENOMEM;
-		space->pn_map_len = QUIC_PN_MAP_INITIAL;
-	} else {
-		bitmap_zero(space->pn_map, space->pn_map_len);
-	}
-
+	space->ranges_count = 0;
 	space->max_time_limit = QUIC_PNSPACE_TIME_LIMIT;
 	space->next_pn = QUIC_PNSPACE_NEXT_PN;
 	space->base_pn = -1;
@@ -58,23 +62,30 @@ EXPORT_SYMBOL_GPL(quic_pnspace_init);
 
 void quic_pnspace_free(struct quic_pnspace *space)
 {
-	space->pn_map_len = 0;
-	kfree(space->pn_map);
+	kfree(space->ranges);
+	space->ranges = NULL;
+	space->ranges_len = 0;
+	space->ranges_count = 0;
 }
 EXPORT_SYMBOL_GPL(quic_pnspace_free);
 
 int quic_pnspace_check(struct quic_pnspace *space, s64 pn)
 {
+	u16 i;
+
 	if (space->base_pn == -1) {
 		quic_pnspace_set_base_pn(space, pn + 1);
 		return 0;
 	}
 
-	if (pn < space->min_pn_seen || pn >= space->base_pn + QUIC_PN_MAP_SIZE)
+	if (pn < space->min_pn_seen || pn >= space->base_pn + QUIC_PN_MAX_SPAN)
 		return -1;
 
-	if (pn < space->base_pn || (pn - space->base_pn < space->pn_map_len &&
-				    test_bit(pn - space->base_pn, space->pn_map)))
+	if (pn < space->base_pn)
+		return 1;
+
+	i = quic_pnspace_find(space, pn);
+	if (i && space->ranges[i - 1].end >= pn)
 		return 1;
 
 	return 0;
@@ -84,100 +95,105 @@ EXPORT_SYMBOL_GPL(quic_pnspace_check);
 /* move base_pn next to pn */
 static void quic_pnspace_move(struct quic_pnspace *space, s64 pn)
 {
-	u16 offset;
+	u16 i = 0;
+
+	space->base_pn = pn + 1;
+	while (i < space->ranges_count && space->ranges[i].end < space->base_pn)
+		i++;
+	if (i < space->ranges_count && space->ranges[i].start <= space->base_pn)
+		space->base_pn = space->ranges[i++].end + 1;
+	quic_pnspace_remove(space, 0, i);
+}
+
+/* add pn above base_pn, merging it with the ranges next to it */
+static int quic_pnspace_insert(struct quic_pnspace *space, s64 pn)
+{
+	struct quic_pn_range *r = space->ranges;
+	bool prev, next;
+	u16 i;
+
+	i = quic_pnspace_find(space, pn);
+	if (i && r[i - 1].end >= pn)
+		return 0;
+
+	prev = (i && r[i - 1].end + 1 == pn);
+	next = (i < space->ranges_count && r[i].start == pn + 1);
+	if (prev && next) {
+		r[i - 1].end = r[i].end;
+		quic_pnspace_remove(space, i, 1);
+		return 0;
+	}
+	if (prev) {
+		r[i - 1].end = pn;
+		return 0;
+	}
+	if (next) {
+		r[i].start = pn;
+		return 0;
+	}
 
-	offset = (u16)(pn + 1 - space->base_pn);
-	offset = (u16)find_next_zero_bit(space->pn_map, space->pn_map_len, offset);
-	space->base_pn += offset;
-	bitmap_shift_right(space->pn_map, space->pn_map, offset, space->pn_map_len);
+	if (space->ranges_count == space->ranges_len) {
+		if (space->ranges_len < QUIC_PN_MAX_RANGES)
+			return quic_pnspace_grow(space) ?: quic_pnspace_insert(space, pn);
+		/* full: give up the lowest range, or pn itself if it is the lowest. The
+		 * lowest ACK block is [min_pn_seen, base_pn - 1], so min_pn_seen moves up
+		 * too, and the numbers missing below it are never acknowledged.
+		 */
+		if (!i) {
+			space->min_pn_seen = pn;
+			space->base_pn = pn + 1;
+			return 0;
+		}
+		space->min_pn_seen = r[0].start;
+		space->base_pn = r[0].end + 1;
+		quic_pnspace_remove(space, 0, 1);
+		i--;
+	}
+
+	memmove(&r[i + 1], &r[i], (space->ranges_count - i) * sizeof(*r));
+	r[i].start = pn;
+	r[i].end = pn;
+	space->ranges_count++;
+	return 0;
 }
 
 int quic_pnspace_mark(struct quic_pnspace *space, s64 pn)
 {
-	s64 mid_pn_seen;
-	u16 gap;
+	int err;
 
 	if (pn < space->base_pn)
 		return 0;
 
-	gap = (u16)(pn - space->base_pn);
-	if (gap >= space->pn_map_len && !quic_pnspace_grow(space, gap + 1))
-		return -ENOMEM;
+	if (space->base_pn == pn) {
+		space->base_pn++;
+		if (space->ranges_count && space->ranges[0].start == space->base_pn) {
+			space->base_pn = space->ranges[0].end + 1;
+			quic_pnspace_remove(space, 0, 1);
+		}
+	} else {
+		err = quic_pnspace_insert(space, pn);
+		if (err)
+			return err;
+	}
 
 	if (space->max_pn_seen < pn) {
 		space->max_pn_seen = pn;
 		space->max_pn_time = space->time;
 	}
 
-	if (space->base_pn == pn) {
-		if (quic_pnspace_has_gap(space))
-			quic_pnspace_move(space, pn);
-		else /* fast path */
-			space->base_pn++;
-	} else {
-		set_bit(gap, space->pn_map);
-	}
-
 	/* move forward min and mid_pn_seen only when receiving max_pn */
 	if (space->max_pn_seen != pn)
 		return 0;
 
-	mid_pn_seen = min_t(s64, space->mid_pn_seen, space->base_pn);
-	if (space->max_pn_time < space->mid_pn_time + space->max_time_limit &&
-	    space->max_pn_seen <= mid_pn_seen + QUIC_PN_MAP_LIMIT)
+	if (space->max_pn_time < space->mid_pn_time + space->max_time_limit)
 		return 0;
 
 	if (space->mid_pn_seen + 1 > space->base_pn)
 		quic_pnspace_move(space, space->mid_pn_seen);
 
-	space->min_pn_seen = space->mid_pn_seen;
+	space->min_pn_seen = max(space->min_pn_seen, space->mid_pn_seen);
 	space->mid_pn_seen = space->max_pn_seen;
 	space->mid_pn_time = space->max_pn_time;
 	return 0;
 }
 EXPORT_SYMBOL_GPL(quic_pnspace_mark);
-
-static int quic_pnspace_next_gap_ack(const struct quic_pnspace *space,
-				     s64 *iter, u16 *start, u16 *end)
-{
-	u16 start_ = 0, end_ = 0, offset = (u16)(*iter - space->base_pn);
-
-	start_ = (u16)find_next_zero_bit(space->pn_map, space->pn_map_len, offset);
-	if (space->max_pn_seen <= space->base_pn + start_)
-		return 0;
-
-	end_ = (u16)find_next_bit(space->pn_map, space->pn_map_len, start_);
-	if (space->max_pn_seen <= space->base_pn + end_ - 1)
-		return 0;
-
-	*start = start_ + 1;
-	*end = end_;
-	*iter = space->base_pn + *end;
-	return 1;
-}
-
-u16 quic_pnspace_num_gabs(struct quic_pnspace *space, struct quic_gap_ack_block *gabs)
-{
-	u16 start, end, ngaps = 0;
-	s64 iter;
-
-	if (!quic_pnspace_has_gap(space))
-		return 0;
-
-	iter = space->base_pn;
-	if (!iter) /* use min_pn_seen if base_pn hasn't moved */
-		iter = space->min_pn_seen + 1;
-
-	while (quic_pnspace_next_gap_ack(space, &iter, &start, &end)) {
-		gabs[ngaps].start = start;
-		if (ngaps == QUIC_PN_MAX_GABS - 1) {
-			gabs[ngaps].end = (u16)(space->max_pn_seen - space->base_pn);
-			ngaps++;
-			break;
-		}
-		gabs[ngaps].end = end;
-		ngaps++;
-	}
-	return ngaps;
-}
-EXPORT_SYMBOL_GPL(quic_pnspace_num_gabs);
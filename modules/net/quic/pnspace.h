@@ -8,44 +8,47 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
-#define QUIC_PN_MAX_GABS	32
 #define QUIC_PN_MAP_MAX_PN	((1LL << 62) - 1)
 
-#define QUIC_PN_MAP_INITIAL	64
-#define QUIC_PN_MAP_INCREMENT	QUIC_PN_MAP_INITIAL
-#define QUIC_PN_MAP_SIZE	4096
-#define QUIC_PN_MAP_LIMIT	(QUIC_PN_MAP_SIZE * 3 / 4)
+#define QUIC_PN_RANGES_INITIAL	8
+#define QUIC_PN_MAX_RANGES	256
+#define QUIC_PN_MAX_SPAN	(1LL << 30)
 
 #define QUIC_PNSPACE_MAX	(QUIC_CRYPTO_MAX - 1)
 #define QUIC_PNSPACE_NEXT_PN	0
 #define QUIC_PNSPACE_TIME_LIMIT	(333000 * 3)
 
-struct quic_gap_ack_block {
-	u16 start;
-	u16 end;
+/* a run of received packet numbers, from start to end inclusive */
+struct quic_pn_range {
+	s64 start;
+	s64 end;
 };
 
-/* pn_map:
- * min_pn_seen -->  |----------------------|---------------------|...
- *        base_pn --^        mid_pn_seen --^       max_pn_seen --^
+/* ranges:
+ *   min_pn_seen -->  ...received...|  |[start, end]|  |[start, end]|...
+ *                         base_pn --^                       max_pn_seen --^
+ *
+ * All numbers from min_pn_seen up to base_pn are taken as received, and the ones
+ * received above it are kept in ranges[], sorted and neither overlapping nor adjacent,
+ * which is only allocated once packets arrive out of order and grows up to
+ * QUIC_PN_MAX_RANGES. When full, the lowest range is given up by moving base_pn past
+ * it and min_pn_seen to its start, so no missing number is ever acknowledged.
  *
  * move forward:
- *   min_pn_seen = mid_pn_seen;
- *   base_pn = first_zero_bit from mid_pn_seen + 1;
+ *   min_pn_seen = max(min_pn_seen, mid_pn_seen);
+ *   base_pn = first missing pn from mid_pn_seen + 1;
  *   mid_pn_seen = max_pn_seen;
  *   mid_pn_time = now;
  * when:
- *   'max_pn_time - mid_pn_time >= max_time_limit' or
- *   'max_pn_seen - mid_pn_seen > QUIC_PN_MAP_LIMIT'
- * gaps search:
- *    from base_pn - 1 to max_pn_seen
+ *   'max_pn_time - mid_pn_time >= max_time_limit'
  */
 struct quic_pnspace {
-	unsigned long *pn_map;
+	struct quic_pn_range *ranges;
 	u64 ecn_count[2][3]; /* ECT_1, ECT_0, CE count of local and peer */
-	u16 pn_map_len;
+	u16 ranges_len;
+	u16 ranges_count;
 	u8  need_sack:1;
-	u8  sack_path:1;
+	u8  sack_path:2;
 
 	u32 max_time_limit;
 	s64 min_pn_seen;
@@ -175,6 +178,7 @@ static inline s64 quic_pnspace_base_pn(const struct quic_pnspace *space)
 
 static inline void quic_pnspace_set_base_pn(struct quic_pnspace *space, s64 pn)
 {
+	space->ranges_count = 0;
 	space->base_pn = pn;
 	space->max_pn_seen = space->base_pn - 1;
 	space->mid_pn_seen = space->max_pn_seen;
@@ -194,6 +198,17 @@ static inline bool quic_pnspace_has_gap(const struct quic_pnspace *space)
 	return space->base_pn != space->max_pn_seen + 1;
 }
 
+static inline u16 quic_pnspace_num_ranges(const struct quic_pnspace *space)
+{
+	return space->ranges_count;
+}
+
+static inline const struct quic_pn_range *quic_pnspace_range(const struct quic_pnspace *space,
+							      u16 i)
+{
+	return &space->ranges[i];
+}
+
 static inline void quic_pnspace_inc_ecn_count(struct quic_pnspace *space, u8 ecn)
 {
 	if (!ecn)
@@ -224,7 +239,6 @@ static inline bool quic_pnspace_has_ecn_count(struct quic_pnspace *space)
 	return space->ecn_count[0][0] || space->ecn_count[0][1] || space->ecn_count[0][2];
 }
 
-u16 quic_pnspace_num_gabs(struct quic_pnspace *space, struct quic_gap_ack_block *gabs);
 int quic_pnspace_check(struct quic_pnspace *space, s64 pn);
 int quic_pnspace_mark(struct quic_pnspace *space, s64 pn);
 
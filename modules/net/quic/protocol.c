@@ -17,11 +17,19 @@
 
 #include "socket.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static DEFINE_PER_CPU(int, quic_memory_per_cpu_fw_alloc);
 static unsigned int quic_net_id __read_mostly;
 
 struct quic_transport_param quic_default_param __read_mostly;
 struct kmem_cache *quic_frame_cachep __read_mostly;
+struct kmem_cache *quic_frame_data_cachep __read_mostly;
+struct kmem_cache *quic_frame_frag_cachep __read_mostly;
+struct kmem_cache *quic_packet_sent_cachep __read_mostly;
+struct kmem_cache *quic_stream_cachep __read_mostly;
+struct kmem_cache *quic_request_sock_cachep __read_mostly;
 struct percpu_counter quic_sockets_allocated;
 
 long sysctl_quic_mem[3];
@@ -77,7 +85,7 @@ static int quic_inet_listen(struct socket *sock, int backlog)
 	err = quic_conn_id_add(dest, &conn_id, 0, NULL);
 	if (err)
 		goto free;
-	quic_conn_id_generate(&conn_id);
+	quic_conn_id_set_generate(source, &conn_id);
 	err = quic_conn_id_add(source, &conn_id, 0, sk);
 	if (err)
 		goto free;
@@ -85,6 +93,9 @@ static int quic_inet_listen(struct socket *sock, int backlog)
 	quic_path_set_serv(paths);
 
 	err = quic_crypto_initial_keys_install(crypto, active, packet->version, 1);
+	if (err)
+		goto free;
+	err = quic_request_sock_hash_init(sk, backlog);
 	if (err)
 		goto free;
 	quic_set_state(sk, QUIC_SS_LISTENING);
@@ -135,11 +146,12 @@ static __poll_t quic_inet_poll(struct file *file, struct socket *sock, poll_tabl
 	if (quic_is_closed(sk))
 		return mask;
 
-	if (sk_stream_wspace(sk) > 0 && quic_outq_wspace(sk, NULL) > 0) {
+	if (quic_outq_writable(sk)) {
 		mask |= EPOLLOUT | EPOLLWRNORM;
 	} else {
 		sk_set_bit(SOCKWQ_ASYNC_NOSPACE, sk);
-		if (sk_stream_wspace(sk) > 0 && quic_outq_wspace(sk, NULL) > 0)
+		set_bit(SOCK_NOSPACE, &sock->flags);
+		if (quic_outq_writable(sk))
 			mask |= EPOLLOUT | EPOLLWRNORM;
 	}
 	return mask;
@@ -167,6 +179,14 @@ static struct ctl_table quic_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "quic_udp_socks",
+		.data		= &sysctl_quic_udp_socks,
+		.maxlen		= sizeof(sysctl_quic_udp_socks),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= SYSCTL_ZERO,
+	},
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
 	{ /* sentinel */ }
@@ -183,17 +203,18 @@ static int quic_seq_show(struct seq_file *seq, void *v)
 {
 	struct net *net = seq_file_net(seq);
 	u32 hash = (u32)(*(loff_t *)v);
+	struct hlist_nulls_node *node;
 	struct quic_path_group *paths;
 	struct quic_hash_head *head;
 	struct quic_outqueue *outq;
 	struct sock *sk;
 
-	if (hash >= 64)
+	if (hash >= quic_sock_hash_size())
 		return -ENOMEM;
 
 	head = quic_sock_hash(hash);
 	spin_lock(&head->lock);
-	sk_for_each(sk, &head->head) {
+	sk_nulls_for_each(sk, node, &head->nulls_head) {
 		if (net != sock_net(sk))
 			continue;
 
@@ -214,7 +235,7 @@ static int quic_seq_show(struct seq_file *seq, void *v)
 
 static void *quic_seq_start(struct seq_file *seq, loff_t *pos)
 {
-	if (*pos >= 64)
+	if (*pos >= quic_sock_hash_size())
 		return NULL;
 
 	if (*pos < 0)
@@ -229,7 +250,7 @@ static void *quic_seq_start(struct seq_file *seq, loff_t *pos)
 
 static void *quic_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
-	if (++*pos >= 64)
+	if (++*pos >= quic_sock_hash_size())
 		return NULL;
 
 	return pos;
@@ -258,6 +279,10 @@ static const struct snmp_mib quic_snmp_list[] = {
 	SNMP_MIB_ITEM("QuicFrmRcvBufDrop", QUIC_MIB_FRM_RCVBUFDROP),
 	SNMP_MIB_ITEM("QuicFrmRetrans", QUIC_MIB_FRM_RETRANS),
 	SNMP_MIB_ITEM("QuicFrmCloses", QUIC_MIB_FRM_CLOSES),
+	SNMP_MIB_ITEM("QuicFrmDgramExpired", QUIC_MIB_FRM_DGRAMEXPIRED),
+	SNMP_MIB_ITEM("QuicWorkSocks", QUIC_MIB_WORK_SOCKS),
+	SNMP_MIB_ITEM("QuicWorkUsecs", QUIC_MIB_WORK_USECS),
+	SNMP_MIB_ITEM("QuicWorkSqueezed", QUIC_MIB_WORK_SQUEEZED),
 	SNMP_MIB_SENTINEL
 };
 
@@ -452,14 +477,26 @@ static int __net_init quic_net_init(struct net *net)
 	quic_net(net)->stat = alloc_percpu(struct quic_mib);
 	if (!quic_net(net)->stat)
 		return -ENOMEM;
+	err = quic_crypto_token_keys_init(&quic_net(net)->token_keys);
+	if (err)
+		goto err_keys;
+	quic_metrics_table_init(&quic_net(net)->metrics);
 
 #ifdef CONFIG_PROC_FS
 	err = quic_net_proc_init(net);
-	if (err) {
-		free_percpu(quic_net(net)->stat);
-		quic_net(net)->stat = NULL;
-	}
+	if (err)
+		goto err_proc;
 #endif
+	return 0;
+
+#ifdef CONFIG_PROC_FS
+err_proc:
+	quic_metrics_table_free(&quic_net(net)->metrics);
+	quic_crypto_token_keys_free(&quic_net(net)->token_keys);
+#endif
+err_keys:
+	free_percpu(quic_net(net)->stat);
+	quic_net(net)->stat = NULL;
 	return err;
 }
 
@@ -468,6 +505,8 @@ static void __net_exit quic_net_exit(struct net *net)
 #ifdef CONFIG_PROC_FS
 	quic_net_proc_exit(net);
 #endif
+	quic_metrics_table_free(&quic_net(net)->metrics);
+	quic_crypto_token_keys_free(&quic_net(net)->token_keys);
 	free_percpu(quic_net(net)->stat);
 	quic_net(net)->stat = NULL;
 }
@@ -513,22 +552,76 @@ static void quic_sysctl_unregister(void)
 }
 #endif
 
+/* keep the caches out of slab merging so that they show up in /proc/slabinfo */
+#ifdef SLAB_NO_MERGE
+#define QUIC_SLAB_FLAGS	(SLAB_HWCACHE_ALIGN | SLAB_NO_MERGE)
+#else
+#define QUIC_SLAB_FLAGS	SLAB_HWCACHE_ALIGN
+#endif
+
+static void quic_caches_destroy(void)
+{
+	kmem_cache_destroy(quic_request_sock_cachep);
+	kmem_cache_destroy(quic_stream_cachep);
+	kmem_cache_destroy(quic_packet_sent_cachep);
+	kmem_cache_destroy(quic_frame_frag_cachep);
+	kmem_cache_destroy(quic_frame_data_cachep);
+	kmem_cache_destroy(quic_frame_cachep);
+}
+
+static int quic_caches_init(void)
+{
+	quic_frame_cachep = kmem_cache_create("quic_frame", sizeof(struct quic_frame),
+					      0, QUIC_SLAB_FLAGS, NULL);
+	quic_frame_data_cachep = kmem_cache_create("quic_frame_data", QUIC_FRAME_DATA_CACHE_SIZE,
+						   0, QUIC_SLAB_FLAGS, NULL);
+	quic_frame_frag_cachep = kmem_cache_create("quic_frame_frag",
+						   sizeof(struct quic_frame_frag) +
+						   QUIC_FRAME_FRAG_CACHE_SIZE,
+						   0, QUIC_SLAB_FLAGS, NULL);
+	quic_packet_sent_cachep = kmem_cache_create("quic_packet_sent",
+						    sizeof(struct quic_packet_sent) +
+						    QUIC_PACKET_SENT_CACHE_FRAMES *
+						    sizeof(struct quic_frame *),
+						    0, QUIC_SLAB_FLAGS, NULL);
+	quic_stream_cachep = kmem_cache_create("quic_stream", sizeof(struct quic_stream),
+					       0, QUIC_SLAB_FLAGS | SLAB_ACCOUNT, NULL);
+	quic_request_sock_cachep = kmem_cache_create("quic_request_sock",
+						     sizeof(struct quic_request_sock),
+						     0, QUIC_SLAB_FLAGS, NULL);
+	if (!quic_frame_cachep || !quic_frame_data_cachep || !quic_frame_frag_cachep ||
+	    !quic_packet_sent_cachep || !quic_stream_cachep || !quic_request_sock_cachep) {
+		quic_caches_destroy();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 static __init int quic_init(void)
 {
 	int err = -ENOMEM;
 
 	if (quic_hash_tables_init())
 		goto err;
+	err = quic_conn_id_table_init();
+	if (err)
+		goto err_conn_id;
+	err = quic_crypto_init();
+	if (err)
+		goto err_crypto;
 
-	quic_frame_cachep = kmem_cache_create("quic_frame", sizeof(struct quic_frame),
-					      0, SLAB_HWCACHE_ALIGN, NULL);
-	if (!quic_frame_cachep)
+	err = quic_caches_init();
+	if (err)
 		goto err_cachep;
 
 	err = quic_path_init(quic_packet_rcv);
 	if (err)
 		goto err_path;
 
+	err = quic_sock_work_init();
+	if (err)
+		goto err_sock_work;
+
 	err = percpu_counter_init(&quic_sockets_allocated, 0, GFP_KERNEL);
 	if (err)
 		goto err_percpu_counter;
@@ -545,20 +638,34 @@ static __init int quic_init(void)
 	quic_sysctl_register();
 #endif
 
+	err = quic_bpf_cong_init();
+	if (err)
+		goto err_bpf_cong;
+
 	quic_transport_param_init();
-	quic_crypto_init();
 	pr_info("quic: init\n");
 	return 0;
 
+err_bpf_cong:
+#ifdef CONFIG_SYSCTL
+	quic_sysctl_unregister();
+#endif
+	unregister_pernet_subsys(&quic_net_ops);
 err_def_ops:
 	quic_protosw_exit();
 err_protosw:
 	percpu_counter_destroy(&quic_sockets_allocated);
 err_percpu_counter:
+	quic_sock_work_destroy();
+err_sock_work:
 	quic_path_destroy();
 err_path:
-	kmem_cache_destroy(quic_frame_cachep);
+	quic_caches_destroy();
 err_cachep:
+	quic_crypto_exit();
+err_crypto:
+	quic_conn_id_table_destroy();
+err_conn_id:
 	quic_hash_tables_destroy();
 err:
 	return err;
@@ -572,7 +679,12 @@ static __exit void quic_exit(void)
 	unregister_pernet_subsys(&quic_net_ops);
 	quic_protosw_exit();
 	percpu_counter_destroy(&quic_sockets_allocated);
+	quic_sock_work_destroy();
 	quic_path_destroy();
+	quic_packet_destroy();
+	quic_crypto_exit();
+	quic_caches_destroy();
+	quic_conn_id_table_destroy();
 	quic_hash_tables_destroy();
 	pr_info("quic: exit\n");
 }
@@ -10,6 +10,10 @@
 
 extern struct quic_transport_param quic_default_param __read_mostly;
 extern struct kmem_cache *quic_frame_cachep __read_mostly;
+extern struct kmem_cache *quic_frame_data_cachep __read_mostly;
+extern struct kmem_cache *quic_frame_frag_cachep __read_mostly;
+extern struct kmem_cache *quic_packet_sent_cachep __read_mostly;
+extern struct kmem_cache *quic_request_sock_cachep __read_mostly;
 extern struct percpu_counter quic_sockets_allocated;
 
 extern long sysctl_quic_mem[3];
@@ -36,6 +40,10 @@ enum {
 	QUIC_MIB_FRM_RCVBUFDROP,
 	QUIC_MIB_FRM_RETRANS,
 	QUIC_MIB_FRM_CLOSES,
+	QUIC_MIB_FRM_DGRAMEXPIRED,
+	QUIC_MIB_WORK_SOCKS,
+	QUIC_MIB_WORK_USECS,
+	QUIC_MIB_WORK_SQUEEZED,
 	QUIC_MIB_MAX
 };
 
@@ -45,6 +53,8 @@ struct quic_mib {
 
 struct quic_net {
 	DEFINE_SNMP_STAT(struct quic_mib, stat);
+	struct quic_metrics_table metrics;
+	struct quic_token_keys token_keys;
 #ifdef CONFIG_PROC_FS
 	struct proc_dir_entry *proc_net;
 #endif
@@ -54,3 +64,4 @@ struct quic_net *quic_net(struct net *net);
 
 #define QUIC_INC_STATS(net, field)	SNMP_INC_STATS(quic_net(net)->stat, field)
 #define QUIC_DEC_STATS(net, field)	SNMP_DEC_STATS(quic_net(net)->stat, field)
+#define QUIC_ADD_STATS(net, field, val)	SNMP_ADD_STATS(quic_net(net)->stat, field, val)
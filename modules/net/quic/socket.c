@@ -10,8 +10,10 @@
  *    Xin Long <lucien.xin@gmail.com>
  */
 
+#include <net/sock_reuseport.h>
 #include <net/inet_common.h>
 #include <linux/version.h>
+#include <linux/log2.h>
 #include <net/tls.h>
 
 #include "socket.h"
@@ -24,12 +26,216 @@ static void quic_enter_memory_pressure(struct sock *sk)
 	WRITE_ONCE(quic_memory_pressure, 1);
 }
 
+/* Async crypto completions may run on any CPU. Instead of a work item per socket queued on
+ * the CPU of each completion, a socket with packets to resume is added to the list of the
+ * CPU that receives its packets (sk_incoming_cpu), and one work item on that CPU processes
+ * the listed sockets in turn, QUIC_SOCK_WORK_BUDGET of them per run like a NAPI poll. This
+ * keeps a connection's lock and state on one CPU, as for its softirq receive path.
+ *
+ * Like the softirq receive path, the work only takes the socket spinlock. A socket owned by
+ * the user is not waited for, as that would stall all the others listed on the CPU; it is
+ * marked QUIC_WORK_DEFERRED instead and processed by quic_release_cb().
+ */
+#define QUIC_SOCK_WORK_BUDGET	64
+
+struct quic_sock_work {
+	struct work_struct	work;
+	struct llist_head	list;	/* added to by quic_sock_work_schedule() */
+	struct llist_node	*todo;	/* taken from list in FIFO order, only used by work */
+	int			cpu;
+};
+
+static struct quic_sock_work __percpu *quic_sock_works __read_mostly;
+
+static void quic_sock_work_process(struct sock *sk)
+{
+	struct quic_sock *qs = quic_sk(sk);
+
+	if (test_and_clear_bit(QUIC_SOCK_WORK_DECRYPTED, &qs->work_flags))
+		quic_inq_decrypted_process(sk);
+	if (test_and_clear_bit(QUIC_SOCK_WORK_ENCRYPTED, &qs->work_flags))
+		quic_outq_encrypted_process(sk);
+}
+
+static void quic_sock_work_run(struct work_struct *work)
+{
+	struct quic_sock_work *w = container_of(work, struct quic_sock_work, work);
+	int budget = QUIC_SOCK_WORK_BUDGET;
+	struct llist_node *node;
+	struct quic_sock *qs;
+	struct sock *sk;
+	u64 start;
+
+	while (budget--) {
+		if (!w->todo)
+			w->todo = llist_reverse_order(llist_del_all(&w->list));
+		node = w->todo;
+		if (!node)
+			return;
+		w->todo = node->next;
+
+		qs = llist_entry(node, struct quic_sock, work_node);
+		sk = &qs->inet.sk;
+		/* clear it before the work bits, so that a later schedule lists it again */
+		clear_bit(QUIC_SOCK_WORK_QUEUED, &qs->work_flags);
+		smp_mb__after_atomic();
+
+		start = ktime_get_ns();
+		local_bh_disable();
+		bh_lock_sock(sk);
+		if (sock_owned_by_user(sk)) {
+			if (!test_and_set_bit(QUIC_WORK_DEFERRED, &sk->sk_tsq_flags))
+				sock_hold(sk);
+		} else {
+			quic_sock_work_process(sk);
+		}
+		bh_unlock_sock(sk);
+		local_bh_enable();
+
+		QUIC_INC_STATS(sock_net(sk), QUIC_MIB_WORK_SOCKS);
+		QUIC_ADD_STATS(sock_net(sk), QUIC_MIB_WORK_USECS,
+			       div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+		if (!budget && (w->todo || !llist_empty(&w->list)))
+			QUIC_INC_STATS(sock_net(sk), QUIC_MIB_WORK_SQUEEZED);
+		sock_put(sk);
+	}
+	/* out of budget: yield to other work on this CPU and continue in the next run */
+	queue_work_on(w->cpu, system_highpri_wq, &w->work);
+}
+
+void quic_sock_work_schedule(struct sock *sk, u8 work)
+{
+	struct quic_sock *qs = quic_sk(sk);
+	struct quic_sock_work *w;
+	int cpu;
+
+	set_bit(work, &qs->work_flags);
+	if (test_and_set_bit(QUIC_SOCK_WORK_QUEUED, &qs->work_flags))
+		return;
+
+	cpu = READ_ONCE(sk->sk_incoming_cpu);
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		cpu = raw_smp_processor_id();
+	w = per_cpu_ptr(quic_sock_works, cpu);
+
+	sock_hold(sk);
+	if (llist_add(&qs->work_node, &w->list)) /* the list was empty */
+		queue_work_on(cpu, system_highpri_wq, &w->work);
+}
+
+/* Preparing the next key phase sets the keys of AEAD transforms, which may allocate with
+ * GFP_KERNEL and sleep, so it runs from a work item of its own under lock_sock() rather than
+ * from the per-CPU socket work, which only takes the socket spinlock.
+ */
+static void quic_sock_key_work(struct work_struct *work)
+{
+	struct quic_sock *qs = container_of(work, struct quic_sock, key_work);
+	struct sock *sk = &qs->inet.sk;
+
+	lock_sock(sk);
+	if (!sock_flag(sk, SOCK_DEAD))
+		quic_crypto_key_prepare(quic_crypto(sk, QUIC_CRYPTO_APP));
+	release_sock(sk);
+	sock_put(sk);
+}
+
+void quic_sock_key_work_schedule(struct sock *sk)
+{
+	sock_hold(sk);
+	if (!queue_work(system_wq, &quic_sk(sk)->key_work))
+		sock_put(sk);
+}
+
+int quic_sock_work_init(void)
+{
+	struct quic_sock_work *w;
+	int cpu;
+
+	quic_sock_works = alloc_percpu(struct quic_sock_work);
+	if (!quic_sock_works)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		w = per_cpu_ptr(quic_sock_works, cpu);
+		INIT_WORK(&w->work, quic_sock_work_run);
+		init_llist_head(&w->list);
+		w->cpu = cpu;
+	}
+	return 0;
+}
+
+void quic_sock_work_destroy(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		cancel_work_sync(&per_cpu_ptr(quic_sock_works, cpu)->work);
+	free_percpu(quic_sock_works);
+}
+
+#define QUIC_REQS_HT_MIN_SIZE	16
+#define QUIC_REQS_HT_MAX_SIZE	4096
+
+static struct quic_hash_head *quic_request_sock_head(struct sock *sk, union quic_addr *s,
+						     union quic_addr *d)
+{
+	struct quic_hash_table *ht = quic_reqs_ht(sk);
+
+	return &ht->hash[quic_ahash(sock_net(sk), s, d) & (ht->size - 1)];
+}
+
+/* Pending requests are kept on quic_reqs() in arrival order for accept(), and hashed by
+ * address so that each Initial from a client finds its request without walking a full
+ * backlog.  The DCID is not part of the key, as the client switches to the server's
+ * connection ID once it has the server's Initial, while its packets may still come to
+ * the listen sock before accept() creates the new one.
+ */
+int quic_request_sock_hash_init(struct sock *sk, int backlog)
+{
+	struct quic_hash_table *ht = quic_reqs_ht(sk);
+	int i, size;
+
+	if (ht->hash)
+		return 0;
+
+	size = roundup_pow_of_two(clamp(backlog, QUIC_REQS_HT_MIN_SIZE, QUIC_REQS_HT_MAX_SIZE));
+	ht->hash = kmalloc_array(size, sizeof(*ht->hash), GFP_KERNEL);
+	if (!ht->hash)
+		return -ENOMEM;
+	for (i = 0; i < size; i++) {
+		spin_lock_init(&ht->hash[i].lock);
+		INIT_HLIST_HEAD(&ht->hash[i].head);
+	}
+	ht->size = size;
+	return 0;
+}
+
+void quic_request_sock_hash_free(struct sock *sk)
+{
+	struct quic_hash_table *ht = quic_reqs_ht(sk);
+	struct quic_request_sock *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, quic_reqs(sk), list) {
+		list_del_init(&req->list);
+		sk_acceptq_removed(sk);
+		kmem_cache_free(quic_request_sock_cachep, req);
+	}
+	kfree(ht->hash);
+	ht->hash = NULL;
+	ht->size = 0;
+}
+
 bool quic_request_sock_exists(struct sock *sk)
 {
 	struct quic_packet *packet = quic_packet(sk);
 	struct quic_request_sock *req;
+	struct quic_hash_head *head;
+
+	if (!quic_reqs_ht(sk)->hash)
+		return false;
 
-	list_for_each_entry(req, quic_reqs(sk), list) {
+	head = quic_request_sock_head(sk, &packet->saddr, &packet->daddr);
+	hlist_for_each_entry(req, &head->head, node) {
 		if (!memcmp(&req->saddr, &packet->saddr, sizeof(req->saddr)) &&
 		    !memcmp(&req->daddr, &packet->daddr, sizeof(req->daddr)))
 			return true;
@@ -41,11 +247,12 @@ int quic_request_sock_enqueue(struct sock *sk, struct quic_conn_id *odcid, u8 re
 {
 	struct quic_packet *packet = quic_packet(sk);
 	struct quic_request_sock *req;
+	struct quic_hash_head *head;
 
-	if (sk_acceptq_is_full(sk))
+	if (sk_acceptq_is_full(sk) || !quic_reqs_ht(sk)->hash)
 		return -ENOMEM;
 
-	req = kzalloc(sizeof(*req), GFP_ATOMIC);
+	req = kmem_cache_zalloc(quic_request_sock_cachep, GFP_ATOMIC);
 	if (!req)
 		return -ENOMEM;
 
@@ -57,6 +264,8 @@ int quic_request_sock_enqueue(struct sock *sk, struct quic_conn_id *odcid, u8 re
 	req->orig_dcid = *odcid;
 	req->retry = retry;
 
+	head = quic_request_sock_head(sk, &req->saddr, &req->daddr);
+	hlist_add_head(&req->node, &head->head);
 	list_add_tail(&req->list, quic_reqs(sk));
 	sk_acceptq_added(sk);
 	return 0;
@@ -68,6 +277,7 @@ struct quic_request_sock *quic_request_sock_dequeue(struct sock *sk)
 
 	req = list_first_entry(quic_reqs(sk), struct quic_request_sock, list);
 
+	hlist_del_init(&req->node);
 	list_del_init(&req->list);
 	sk_acceptq_removed(sk);
 	return req;
@@ -81,8 +291,10 @@ int quic_accept_sock_exists(struct sock *sk, struct sk_buff *skb)
 
 	local_bh_disable();
 	nsk = quic_sock_lookup(skb, &packet->saddr, &packet->daddr);
-	if (nsk == sk)
+	if (!nsk)
 		goto out;
+	if (nsk == sk)
+		goto put;
 	/* the request sock was just accepted */
 	bh_lock_sock(nsk);
 	if (sock_owned_by_user(nsk)) {
@@ -93,87 +305,197 @@ int quic_accept_sock_exists(struct sock *sk, struct sk_buff *skb)
 	}
 	bh_unlock_sock(nsk);
 	ret = 1;
+put:
+	sock_put(nsk);
 out:
 	local_bh_enable();
 	return ret;
 }
 
-struct sock *quic_sock_lookup(struct sk_buff *skb, union quic_addr *sa, union quic_addr *da)
+static bool quic_sock_match(struct net *net, struct sock *sk, union quic_addr *sa,
+			    union quic_addr *da)
 {
-	struct net *net = dev_net(skb->dev);
-	struct quic_data alpns = {}, alpn;
-	struct sock *sk = NULL, *tmp;
+	return net == sock_net(sk) && !quic_is_closed(sk) &&
+	       !quic_path_cmp_saddr(quic_paths(sk), 0, sa) &&
+	       !quic_path_cmp_daddr(quic_paths(sk), 0, da);
+}
+
+/* The quic sock slab is SLAB_TYPESAFE_BY_RCU, a regular socket found in the chain may be
+ * freed and reused at any time. It is returned only once a reference is held and it still
+ * matches, and a walk that ends on the nulls value of another chain is restarted, as it
+ * followed a socket that was reused and rehashed.
+ */
+static struct sock *quic_sock_lookup_regular(struct net *net, union quic_addr *sa,
+					     union quic_addr *da)
+{
+	struct quic_hash_head *head = quic_sock_head(net, sa, da);
+	u32 slot = quic_sock_hash_slot(head);
+	struct hlist_nulls_node *node;
+	struct sock *sk;
+
+begin:
+	sk_nulls_for_each_rcu(sk, node, &head->nulls_head) {
+		if (!quic_sock_match(net, sk, sa, da))
+			continue;
+		if (unlikely(!refcount_inc_not_zero(&sk->sk_refcnt)))
+			return NULL;
+		if (unlikely(!quic_sock_match(net, sk, sa, da))) {
+			sock_put(sk);
+			goto begin;
+		}
+		return sk;
+	}
+	if (get_nulls_value(node) != slot)
+		goto begin;
+	return NULL;
+}
+
+/* Find the listen socket for one ALPN in the (netns, port, ALPN) index, where a socket
+ * bound to the address is preferred to a wildcard one.
+ */
+static struct sock *quic_sock_lookup_alpn(struct net *net, union quic_addr *sa,
+					  struct quic_data *alpn)
+{
+	u16 port = ntohs(sa->v4.sin_port);
+	struct quic_listen_alpn *la;
 	struct quic_hash_head *head;
+	struct sock *sk = NULL;
+	union quic_addr *a;
+
+	head = quic_listen_alpn_head(net, port, alpn->data, alpn->len);
+	hlist_for_each_entry_rcu(la, &head->head, node) {
+		if (la->port != port || la->len != alpn->len ||
+		    memcmp(la->data, alpn->data, alpn->len) || net != sock_net(la->sk))
+			continue;
+		a = quic_path_saddr(quic_paths(la->sk), 0);
+		if (quic_is_listen(la->sk) && quic_cmp_sk_addr(la->sk, a, sa)) {
+			sk = la->sk;
+			if (!quic_is_any_addr(a))
+				break;
+		}
+	}
+	return sk;
+}
+
+/* Listen sockets are SOCK_RCU_FREE and stay valid during the walk, but regular sockets
+ * on the same chain may still move it to another chain. With ALPNs in the Initial, the
+ * port chain is not walked, and the ALPN index is looked up in the client's order.
+ */
+static struct sock *quic_sock_lookup_listen(struct net *net, struct quic_hash_head *head,
+					    union quic_addr *sa, struct quic_data *alpns)
+{
+	u32 slot = quic_sock_hash_slot(head);
+	struct hlist_nulls_node *node;
+	struct sock *sk, *tmp;
+	struct quic_data alpn;
 	union quic_addr *a;
 	u64 length;
 	u32 len;
 	u8 *p;
 
-	/* Search for regular socket first */
-	head = quic_sock_head(net, sa, da);
-	spin_lock(&head->lock);
-	sk_for_each(tmp, &head->head) {
-		if (net == sock_net(tmp) && !quic_is_closed(tmp) &&
-		    !quic_path_cmp_saddr(quic_paths(tmp), 0, sa) &&
-		    !quic_path_cmp_daddr(quic_paths(tmp), 0, da)) {
+	if (alpns->len) {
+		for (p = alpns->data, len = alpns->len; len; len -= length, p += length) {
+			quic_get_int(&p, &len, &length, 1);
+			quic_data(&alpn, p, length);
+			sk = quic_sock_lookup_alpn(net, sa, &alpn);
+			if (sk)
+				return sk;
+		}
+		return NULL;
+	}
+
+begin:
+	sk = NULL;
+	sk_nulls_for_each_rcu(tmp, node, &head->nulls_head) {
+		/* alpns->data != NULL means TLS parse succeed but no ALPN was found,
+		 * in such case it only matches the sock with no ALPN set.
+		 */
+		a = quic_path_saddr(quic_paths(tmp), 0);
+		if (net == sock_net(tmp) && quic_is_listen(tmp) &&
+		    quic_cmp_sk_addr(tmp, a, sa) && (!alpns->data || !quic_alpn(tmp)->len)) {
 			sk = tmp;
-			break;
+			if (!quic_is_any_addr(a))
+				break;
 		}
 	}
-	spin_unlock(&head->lock);
-	if (sk)
-		return sk;
-
-	/* Search for listen socket */
-	head = quic_listen_sock_head(net, ntohs(sa->v4.sin_port));
-	spin_lock(&head->lock);
+	if (is_a_nulls(node) && get_nulls_value(node) != slot)
+		goto begin;
+	return sk;
+}
 
-	if (hlist_empty(&head->head) || quic_packet_parse_alpn(skb, &alpns))
-		goto unlock;
-
-	if (!alpns.len) {
-		sk_for_each(tmp, &head->head) {
-			/* alpns.data != NULL means TLS parse succeed but no ALPN was found,
-			 * in such case it only matches the sock with no ALPN set.
-			 */
-			a = quic_path_saddr(quic_paths(tmp), 0);
-			if (net == sock_net(tmp) && quic_is_listen(tmp) &&
-			    quic_cmp_sk_addr(tmp, a, sa) && (!alpns.data || !quic_alpn(tmp)->len)) {
-				sk = tmp;
-				if (!quic_is_any_addr(a))
-					break;
-			}
+/* A reuseport group of listen sockets with connection ID prefixes is steered by the DCID
+ * instead of the remote address. A DCID that we chose goes to the socket with its prefix,
+ * and any other, like the client's original one, is hashed, so that the same socket still
+ * gets the packets after a NAT rebinding. A BPF program attached to the group runs first.
+ */
+static struct sock *quic_sock_select_reuseport(struct net *net, struct sock *sk,
+					       struct sk_buff *skb, union quic_addr *da)
+{
+	struct sock_reuseport *reuse;
+	struct quic_conn_id dcid;
+	struct sock *nsk;
+	u16 i, num;
+
+	if (!quic_source(sk)->prefix_len || quic_packet_get_dcid(&dcid, skb))
+		return reuseport_select_sock(sk, quic_shash(net, da), skb, 1);
+
+	reuse = rcu_dereference(sk->sk_reuseport_cb);
+	if (reuse && !rcu_access_pointer(reuse->prog)) {
+		num = READ_ONCE(reuse->num_socks);
+		for (i = 0; i < num; i++) {
+			nsk = READ_ONCE(reuse->socks[i]);
+			if (nsk && quic_conn_id_has_prefix(quic_source(nsk), &dcid))
+				return nsk;
 		}
-		goto unlock;
 	}
+	return reuseport_select_sock(sk, jhash(dcid.data, dcid.len, net_hash_mix(net)), skb, 1);
+}
 
-	for (p = alpns.data, len = alpns.len; len; len -= length, p += length) {
-		quic_get_int(&p, &len, &length, 1);
-		quic_data(&alpn, p, length);
-		sk_for_each(tmp, &head->head) {
-			a = quic_path_saddr(quic_paths(tmp), 0);
-			if (net == sock_net(tmp) && quic_is_listen(tmp) &&
-			    quic_cmp_sk_addr(tmp, a, sa) && quic_data_has(quic_alpn(tmp), &alpn)) {
-				sk = tmp;
-				if (!quic_is_any_addr(a))
-					break;
-			}
-		}
-		if (sk)
-			break;
-	}
-unlock:
-	spin_unlock(&head->lock);
+/* Look up the socket for a received packet under RCU without taking any bucket lock. The
+ * returned socket is held and has to be released with sock_put().
+ */
+struct sock *quic_sock_lookup(struct sk_buff *skb, union quic_addr *sa, union quic_addr *da)
+{
+	struct net *net = dev_net(skb->dev);
+	struct quic_hash_head *head;
+	struct quic_data alpns = {};
+	struct sock *sk;
+
+	rcu_read_lock();
+	/* Search for regular socket first */
+	sk = quic_sock_lookup_regular(net, sa, da);
+	if (sk)
+		goto out;
+
+	/* Search for listen socket */
+	/* Parse the ALPN before the walk, as it has to decrypt the Initial packet */
+	head = quic_listen_sock_head(net, ntohs(sa->v4.sin_port));
+	if (hlist_nulls_empty(&head->nulls_head) || quic_packet_parse_alpn(skb, &alpns))
+		goto out;
 
+	sk = quic_sock_lookup_listen(net, head, sa, &alpns);
 	if (sk && sk->sk_reuseport)
-		sk = reuseport_select_sock(sk, quic_shash(net, da), skb, 1);
+		sk = quic_sock_select_reuseport(net, sk, skb, da);
+	if (sk && unlikely(!refcount_inc_not_zero(&sk->sk_refcnt)))
+		sk = NULL;
+out:
+	rcu_read_unlock();
 	return sk;
 }
 
 static void quic_write_space(struct sock *sk)
 {
+	struct socket *sock = sk->sk_socket;
 	struct socket_wq *wq;
 
+	/* crypto and datagram writers only need sndbuf, stream writers also the peer's credit */
+	if (sk_stream_wspace(sk) < sk_stream_min_wspace(sk))
+		return;
+	quic_outq_wake_streams(sk);
+
+	if (!sock)
+		return;
+	clear_bit(SOCK_NOSPACE, &sock->flags);
 	rcu_read_lock();
 	wq = rcu_dereference(sk->sk_wq);
 	if (skwq_has_sleeper(wq))
@@ -211,10 +533,16 @@ static int quic_init_sock(struct sock *sk)
 	sk->sk_destruct = inet_sock_destruct;
 	sk->sk_write_space = quic_write_space;
 	sock_set_flag(sk, SOCK_USE_WRITE_QUEUE);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	/* io_uring SEND_ZC, accepted sockets inherit it in inet_accept() */
+	if (sk->sk_socket)
+		set_bit(SOCK_SUPPORT_ZC, &sk->sk_socket->flags);
+#endif
 
 	quic_conn_id_set_init(quic_source(sk), 1);
 	quic_conn_id_set_init(quic_dest(sk), 0);
 	quic_cong_init(quic_cong(sk));
+	INIT_WORK(&quic_sk(sk)->key_work, quic_sock_key_work);
 
 	quic_sock_apply_transport_param(sk, p);
 
@@ -253,10 +581,13 @@ static void quic_destroy_sock(struct sock *sk)
 
 	quic_timer_free(sk);
 	quic_stream_free(quic_streams(sk));
+	quic_cong_free(quic_cong(sk));
+	quic_path_sched_release(quic_paths(sk));
 
 	quic_data_free(quic_ticket(sk));
 	quic_data_free(quic_token(sk));
 	quic_data_free(quic_alpn(sk));
+	quic_request_sock_hash_free(sk);
 
 	local_bh_disable();
 	sk_sockets_allocated_dec(sk);
@@ -306,6 +637,7 @@ static int quic_connect(struct sock *sk, struct sockaddr *addr, int addr_len)
 	if (err < 0)
 		goto out;
 	quic_set_sk_addr(sk, &a, false);
+	quic_metrics_apply(sk);
 
 	sa = quic_path_saddr(paths, 0);
 	if (!sa->v4.sin_port) { /* auto bind */
@@ -320,7 +652,7 @@ static int quic_connect(struct sock *sk, struct sockaddr *addr, int addr_len)
 	if (err)
 		goto out;
 	quic_path_set_orig_dcid(paths, &conn_id);
-	quic_conn_id_generate(&conn_id);
+	quic_conn_id_set_generate(source, &conn_id);
 	err = quic_conn_id_add(source, &conn_id, 0, sk);
 	if (err)
 		goto free;
@@ -344,11 +676,68 @@ free:
 	goto out;
 }
 
+static void quic_listen_alpn_unhash(struct sock *sk)
+{
+	u16 port = ntohs(quic_path_saddr(quic_paths(sk), 0)->v4.sin_port);
+	struct quic_data *alpns = quic_alpn(sk);
+	struct quic_listen_alpn *la;
+	struct quic_hash_head *head;
+	struct hlist_node *tmp;
+	u64 length;
+	u32 len;
+	u8 *p;
+
+	for (p = alpns->data, len = alpns->len; len; len -= length, p += length) {
+		quic_get_int(&p, &len, &length, 1);
+		head = quic_listen_alpn_head(sock_net(sk), port, p, length);
+		spin_lock(&head->lock);
+		hlist_for_each_entry_safe(la, tmp, &head->head, node) {
+			if (la->sk != sk)
+				continue;
+			hlist_del_rcu(&la->node);
+			kfree_rcu(la, rcu);
+		}
+		spin_unlock(&head->lock);
+	}
+}
+
+/* Add a listen socket to the ALPN index for each of its ALPNs, a partial add is undone
+ * by quic_unhash().
+ */
+static int quic_listen_alpn_hash(struct sock *sk)
+{
+	u16 port = ntohs(quic_path_saddr(quic_paths(sk), 0)->v4.sin_port);
+	struct quic_data *alpns = quic_alpn(sk);
+	struct quic_listen_alpn *la;
+	struct quic_hash_head *head;
+	u64 length;
+	u32 len;
+	u8 *p;
+
+	for (p = alpns->data, len = alpns->len; len; len -= length, p += length) {
+		quic_get_int(&p, &len, &length, 1);
+		la = kzalloc(struct_size(la, data, length), GFP_KERNEL);
+		if (!la)
+			return -ENOMEM;
+		la->sk = sk;
+		la->port = port;
+		la->len = (u8)length;
+		memcpy(la->data, p, length);
+
+		head = quic_listen_alpn_head(sock_net(sk), port, p, length);
+		spin_lock(&head->lock);
+		hlist_add_head_rcu(&la->node, &head->head);
+		spin_unlock(&head->lock);
+	}
+	return 0;
+}
+
 static int quic_hash(struct sock *sk)
 {
 	struct quic_path_group *paths = quic_paths(sk);
 	struct quic_data *alpns = quic_alpn(sk);
 	struct net *net = sock_net(sk);
+	struct hlist_nulls_node *node;
 	struct quic_hash_head *head;
 	union quic_addr *sa, *da;
 	struct sock *nsk;
@@ -360,15 +749,13 @@ static int quic_hash(struct sock *sk)
 		head = quic_sock_head(net, sa, da);
 		spin_lock(&head->lock);
 
-		sk_for_each(nsk, &head->head) {
-			if (net == sock_net(nsk) && !quic_is_closed(nsk) &&
-			    !quic_path_cmp_saddr(quic_paths(nsk), 0, sa) &&
-			    !quic_path_cmp_daddr(quic_paths(nsk), 0, da)) {
+		sk_nulls_for_each(nsk, node, &head->nulls_head) {
+			if (quic_sock_match(net, nsk, sa, da)) {
 				spin_unlock(&head->lock);
 				return -EADDRINUSE;
 			}
 		}
-		__sk_add_node(sk, &head->head);
+		__sk_nulls_add_node_rcu(sk, &head->nulls_head);
 
 		spin_unlock(&head->lock);
 		return 0;
@@ -377,8 +764,10 @@ static int quic_hash(struct sock *sk)
 	head = quic_listen_sock_head(net, ntohs(sa->v4.sin_port));
 	spin_lock(&head->lock);
 
+	/* freed after a grace period, see quic_sock_lookup_listen() */
+	sock_set_flag(sk, SOCK_RCU_FREE);
 	any = quic_is_any_addr(sa);
-	sk_for_each(nsk, &head->head) {
+	sk_nulls_for_each(nsk, node, &head->nulls_head) {
 		if (net == sock_net(nsk) && quic_is_listen(nsk) &&
 		    !quic_path_cmp_saddr(quic_paths(nsk), 0, sa)) {
 			if (!quic_data_cmp(alpns, quic_alpn(nsk))) {
@@ -386,7 +775,7 @@ static int quic_hash(struct sock *sk)
 				if (sk->sk_reuseport && nsk->sk_reuseport) {
 					err = reuseport_add_sock(sk, nsk, any);
 					if (!err)
-						__sk_add_node(sk, &head->head);
+						__sk_nulls_add_node_rcu(sk, &head->nulls_head);
 				}
 				goto out;
 			}
@@ -402,9 +791,11 @@ static int quic_hash(struct sock *sk)
 		if (err)
 			goto out;
 	}
-	__sk_add_node(sk, &head->head);
+	__sk_nulls_add_node_rcu(sk, &head->nulls_head);
 out:
 	spin_unlock(&head->lock);
+	if (!err)
+		err = quic_listen_alpn_hash(sk);
 	return err;
 }
 
@@ -421,6 +812,7 @@ static void quic_unhash(struct sock *sk)
 	sa = quic_path_saddr(paths, 0);
 	da = quic_path_daddr(paths, 0);
 	if (sk->sk_max_ack_backlog) {
+		quic_listen_alpn_unhash(sk);
 		head = quic_listen_sock_head(net, ntohs(sa->v4.sin_port));
 		goto out;
 	}
@@ -430,7 +822,7 @@ out:
 	spin_lock(&head->lock);
 	if (rcu_access_pointer(sk->sk_reuseport_cb))
 		reuseport_detach_sock(sk);
-	__sk_del_node_init(sk);
+	__sk_nulls_del_node_init_rcu(sk);
 	spin_unlock(&head->lock);
 }
 
@@ -438,16 +830,35 @@ out:
 	(MSG_STREAM_NEW | MSG_STREAM_FIN | MSG_STREAM_UNI | MSG_STREAM_DONTWAIT)
 
 #define QUIC_MSG_FLAGS \
-	(QUIC_MSG_STREAM_FLAGS | MSG_BATCH | MSG_MORE | MSG_DONTWAIT | MSG_DATAGRAM | MSG_NOSIGNAL)
+	(QUIC_MSG_STREAM_FLAGS | MSG_BATCH | MSG_MORE | MSG_DONTWAIT | MSG_DATAGRAM | MSG_NOSIGNAL | \
+	 MSG_WAITALL | MSG_ZEROCOPY | QUIC_MSG_SPLICE_PAGES)
+
+static void quic_msghdr_stream_id(struct sock *sk, struct quic_stream_info *sinfo)
+{
+	struct quic_stream_table *streams = quic_streams(sk);
+	s64 active;
+
+	if (sinfo->stream_id != -1)
+		return;
+
+	active = quic_stream_send_active_id(streams);
+	if (active != -1) {
+		sinfo->stream_id = active;
+		return;
+	}
+	sinfo->stream_id = quic_stream_send_next_bidi_id(streams);
+	if (sinfo->stream_flags & MSG_STREAM_UNI)
+		sinfo->stream_id = quic_stream_send_next_uni_id(streams);
+}
 
 static int quic_msghdr_parse(struct sock *sk, struct msghdr *msg, struct quic_handshake_info *hinfo,
-			     struct quic_stream_info *sinfo, bool *has_hinfo)
+			     struct quic_stream_info *sinfo, bool *has_hinfo, u32 *records)
 {
 	struct quic_handshake_info *h = NULL;
 	struct quic_stream_info *s = NULL;
-	struct quic_stream_table *streams;
+	struct quic_record_info *r;
 	struct cmsghdr *cmsg;
-	s64 active;
+	u64 len = 0;
 
 	if (msg->msg_flags & ~QUIC_MSG_FLAGS)
 		return -EINVAL;
@@ -476,11 +887,26 @@ static int quic_msghdr_parse(struct sock *sk, struct msghdr *msg, struct quic_ha
 			sinfo->stream_id = s->stream_id;
 			sinfo->stream_flags = s->stream_flags;
 			break;
+		case QUIC_RECORD_INFO:
+			if (cmsg->cmsg_len != CMSG_LEN(sizeof(*r)))
+				return -EINVAL;
+			r = CMSG_DATA(cmsg);
+			if (r->flags & ~(QUIC_MSG_STREAM_FLAGS | MSG_DATAGRAM))
+				return -EINVAL;
+			len += r->len;
+			(*records)++;
+			break;
 		default:
 			return -EINVAL;
 		}
 	}
 
+	if (*records) {
+		if (h || s || (msg->msg_flags & MSG_DATAGRAM) || len != iov_iter_count(&msg->msg_iter))
+			return -EINVAL;
+		return 0;
+	}
+
 	if (h) {
 		*has_hinfo = true;
 		return 0;
@@ -489,18 +915,7 @@ static int quic_msghdr_parse(struct sock *sk, struct msghdr *msg, struct quic_ha
 	if (!s) /* in case someone uses 'flags' argument to set stream_flags */
 		sinfo->stream_flags |= msg->msg_flags;
 
-	if (sinfo->stream_id != -1)
-		return 0;
-
-	streams = quic_streams(sk);
-	active = quic_stream_send_active_id(streams);
-	if (active != -1) {
-		sinfo->stream_id = active;
-		return 0;
-	}
-	sinfo->stream_id = quic_stream_send_next_bidi_id(streams);
-	if (sinfo->stream_flags & MSG_STREAM_UNI)
-		sinfo->stream_id = quic_stream_send_next_uni_id(streams);
+	quic_msghdr_stream_id(sk, sinfo);
 	return 0;
 }
 
@@ -513,6 +928,7 @@ static int quic_wait_for_stream(struct sock *sk, s64 stream_id, u32 flags)
 
 	for (;;) {
 		prepare_to_wait_exclusive(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+		set_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
 		if (quic_is_closed(sk)) {
 			err = -EPIPE;
 			pr_debug("%s: sk closed\n", __func__);
@@ -590,6 +1006,7 @@ static int quic_wait_for_send(struct sock *sk, u32 flags, u32 len)
 
 	for (;;) {
 		prepare_to_wait_exclusive(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+		set_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
 		if (quic_is_closed(sk)) {
 			err = -EPIPE;
 			pr_debug("%s: sk closed\n", __func__);
@@ -638,6 +1055,7 @@ static int quic_wait_for_stream_send(struct sock *sk, struct quic_stream *stream
 
 	for (;;) {
 		prepare_to_wait_exclusive(sk_sleep(sk), &wait, TASK_INTERRUPTIBLE);
+		set_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
 		if (quic_is_closed(sk)) {
 			err = -EPIPE;
 			pr_debug("%s: sk closed\n", __func__);
@@ -669,21 +1087,169 @@ static int quic_wait_for_stream_send(struct sock *sk, struct quic_stream *stream
 	return err;
 }
 
+/* Queue the data in msginfo->msg on msginfo->stream, returning the bytes queued, or the
+ * error if none was.
+ */
+static int quic_sendmsg_stream(struct sock *sk, struct quic_msginfo *msginfo, u32 flags,
+			       bool delay)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_stream *stream = msginfo->stream;
+	int err, bytes = 0, len = 1;
+	struct quic_frame *frame;
+
+	do {
+		if (!quic_sock_stream_writable(sk, stream, flags, len)) {
+			if (delay) {
+				quic_outq_set_force_delay(outq, 0);
+				quic_outq_transmit(sk);
+			}
+			err = quic_wait_for_stream_send(sk, stream, flags, len);
+			if (err) {
+				if (err == -EAGAIN || err == -ENOSPC)
+					quic_outq_stream_blocked(sk, stream);
+				if (err == -EPIPE || !bytes)
+					return err;
+				break;
+			}
+		}
+
+		len = quic_outq_stream_append(sk, msginfo, 0);
+		if (len >= 0) {
+			if (!sk_wmem_schedule(sk, len))
+				continue;
+			bytes += quic_outq_stream_append(sk, msginfo, 1);
+			len = 1;
+			continue;
+		}
+
+		frame = quic_frame_create(sk, QUIC_FRAME_STREAM, msginfo);
+		if (!frame) {
+			if (!bytes)
+				return -ENOMEM;
+			break;
+		}
+		len = frame->bytes;
+		if (!sk_wmem_schedule(sk, len)) {
+			iov_iter_revert(msginfo->msg, len);
+			quic_frame_put(frame);
+			continue;
+		}
+		bytes += frame->bytes;
+		quic_outq_set_force_delay(outq, delay);
+		quic_outq_stream_tail(sk, frame, delay);
+		len = 1;
+	} while (iov_iter_count(msginfo->msg) > 0);
+
+	return bytes;
+}
+
+static int quic_sendmsg_dgram(struct sock *sk, struct iov_iter *iter, u32 flags, bool delay)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_frame *frame;
+	int len, err;
+
+	if (!quic_outq_max_dgram(outq))
+		return -EINVAL;
+	frame = quic_frame_create(sk, QUIC_FRAME_DATAGRAM_LEN, iter);
+	if (!frame)
+		return -EINVAL;
+
+	len = frame->bytes;
+	if (sk_stream_wspace(sk) < len || !sk_wmem_schedule(sk, len)) {
+		if (delay) { /* the corked datagrams may be what holds the space */
+			quic_outq_set_force_delay(outq, 0);
+			quic_outq_transmit(sk);
+		}
+		err = quic_wait_for_send(sk, flags, len);
+		if (err) {
+			quic_frame_put(frame);
+			return err;
+		}
+	}
+	quic_outq_set_force_delay(outq, delay);
+	quic_outq_dgram_tail(sk, frame, delay);
+	return len;
+}
+
+/* Send to many streams in one call: msg_iter holds the records back to back, each one
+ * described by a QUIC_RECORD_INFO cmsg in the same order, as recvmsg with
+ * MSG_RECORD_BATCH returns them.  The frames of all records are queued with transmission
+ * corked, so that small records of different streams share packets, and are transmitted
+ * once at the end unless MSG_MORE is set.  A record with MSG_DATAGRAM is sent as a
+ * datagram instead.  A record that can not be queued entirely ends the batch, and the
+ * bytes queued until then are returned.
+ */
+static int quic_sendmsg_batch(struct sock *sk, struct msghdr *msg, struct quic_msginfo *msginfo)
+{
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_stream_info sinfo = {};
+	struct quic_record_info *r;
+	struct quic_stream *stream;
+	int err = 0, bytes = 0;
+	struct cmsghdr *cmsg;
+	size_t count;
+
+	for_each_cmsghdr(cmsg, msg) {
+		if (cmsg->cmsg_level != SOL_QUIC || cmsg->cmsg_type != QUIC_RECORD_INFO)
+			continue;
+		r = CMSG_DATA(cmsg);
+		if (!r->len && !(r->flags & MSG_STREAM_FIN))
+			continue;
+
+		count = iov_iter_count(msginfo->msg);
+		if (r->flags & MSG_DATAGRAM) {
+			iov_iter_truncate(msginfo->msg, r->len);
+			err = quic_sendmsg_dgram(sk, msginfo->msg, msg->msg_flags, true);
+		} else {
+			sinfo.stream_id = r->stream_id;
+			sinfo.stream_flags = r->flags;
+			quic_msghdr_stream_id(sk, &sinfo);
+			stream = quic_sock_send_stream(sk, &sinfo);
+			if (IS_ERR(stream)) {
+				err = PTR_ERR(stream);
+				break;
+			}
+
+			msginfo->stream = stream;
+			msginfo->flags = r->flags;
+			iov_iter_truncate(msginfo->msg, r->len);
+			err = quic_sendmsg_stream(sk, msginfo, msg->msg_flags | r->flags, true);
+		}
+		if (err < 0)
+			break;
+		bytes += err;
+		if ((u32)err < r->len)
+			break;
+		iov_iter_reexpand(msginfo->msg, count - r->len);
+	}
+
+	if (!(msg->msg_flags & MSG_MORE)) {
+		quic_outq_set_force_delay(outq, 0);
+		quic_outq_transmit(sk);
+	}
+	if (err == -EPIPE || !bytes)
+		return err;
+	return bytes;
+}
+
 static int quic_sendmsg(struct sock *sk, struct msghdr *msg, size_t msg_len)
 {
 	struct quic_outqueue *outq = quic_outq(sk);
 	struct quic_handshake_info hinfo = {};
 	struct quic_stream_info sinfo = {};
+	struct quic_msginfo msginfo = {};
 	int err = 0, bytes = 0, len = 1;
 	bool delay, has_hinfo = false;
-	struct quic_msginfo msginfo;
 	struct quic_crypto *crypto;
 	struct quic_stream *stream;
 	u32 flags = msg->msg_flags;
 	struct quic_frame *frame;
+	u32 records = 0;
 
 	lock_sock(sk);
-	err = quic_msghdr_parse(sk, msg, &hinfo, &sinfo, &has_hinfo);
+	err = quic_msghdr_parse(sk, msg, &hinfo, &sinfo, &has_hinfo, &records);
 	if (err)
 		goto err;
 
@@ -694,6 +1260,10 @@ static int quic_sendmsg(struct sock *sk, struct msghdr *msg, size_t msg_len)
 
 	delay = !!(flags & MSG_MORE);
 	if (has_hinfo) {
+		/* sendmmsg() sets MSG_BATCH on all but the last message, so a flight of
+		 * crypto messages of all levels is packed and transmitted together.
+		 */
+		delay |= !!(flags & MSG_BATCH);
 		if (hinfo.crypto_level >= QUIC_CRYPTO_EARLY) {
 			err = -EINVAL;
 			goto err;
@@ -736,27 +1306,29 @@ static int quic_sendmsg(struct sock *sk, struct msghdr *msg, size_t msg_len)
 	}
 
 	if (flags & MSG_DATAGRAM) {
-		if (!quic_outq_max_dgram(outq)) {
-			err = -EINVAL;
-			goto err;
-		}
-		frame = quic_frame_create(sk, QUIC_FRAME_DATAGRAM_LEN, &msg->msg_iter);
-		if (!frame) {
-			err = -EINVAL;
+		/* as for crypto messages, a sendmmsg() of datagrams is transmitted together */
+		delay |= !!(flags & MSG_BATCH);
+		err = quic_sendmsg_dgram(sk, &msg->msg_iter, flags, delay);
+		goto err;
+	}
+
+	/* stream frames refer to the user or page cache pages until they are acked */
+	msginfo.msg = &msg->msg_iter;
+	msginfo.zc = NULL;
+	if (quic_msg_ubuf(msg))
+		flags |= MSG_ZEROCOPY;
+	msginfo.pages = !!(flags & (MSG_ZEROCOPY | QUIC_MSG_SPLICE_PAGES));
+	if ((flags & MSG_ZEROCOPY) && iov_iter_count(&msg->msg_iter)) {
+		msginfo.zc = quic_frame_zc_alloc(sk, quic_msg_ubuf(msg));
+		if (!msginfo.zc) {
+			err = -ENOBUFS;
 			goto err;
 		}
-		len = frame->bytes;
-		if (sk_stream_wspace(sk) < len || !sk_wmem_schedule(sk, len)) {
-			err = quic_wait_for_send(sk, flags, len);
-			if (err) {
-				quic_frame_put(frame);
-				goto err;
-			}
-		}
-		bytes += frame->bytes;
-		quic_outq_set_force_delay(outq, delay);
-		quic_outq_dgram_tail(sk, frame, delay);
-		goto out;
+	}
+
+	if (records) {
+		err = quic_sendmsg_batch(sk, msg, &msginfo);
+		goto err;
 	}
 
 	stream = quic_sock_send_stream(sk, &sinfo);
@@ -766,57 +1338,20 @@ static int quic_sendmsg(struct sock *sk, struct msghdr *msg, size_t msg_len)
 	}
 
 	msginfo.stream = stream;
-	msginfo.msg = &msg->msg_iter;
 	msginfo.flags = sinfo.stream_flags;
 	flags |= sinfo.stream_flags;
-
-	do {
-		if (!quic_sock_stream_writable(sk, stream, flags, len)) {
-			if (delay) {
-				quic_outq_set_force_delay(outq, 0);
-				quic_outq_transmit(sk);
-			}
-			err = quic_wait_for_stream_send(sk, stream, flags, len);
-			if (err) {
-				if (err == -EPIPE || !bytes)
-					goto err;
-				goto out;
-			}
-		}
-
-		len = quic_outq_stream_append(sk, &msginfo, 0);
-		if (len >= 0) {
-			if (!sk_wmem_schedule(sk, len))
-				continue;
-			bytes += quic_outq_stream_append(sk, &msginfo, 1);
-			len = 1;
-			continue;
-		}
-
-		frame = quic_frame_create(sk, QUIC_FRAME_STREAM, &msginfo);
-		if (!frame) {
-			if (!bytes) {
-				err = -ENOMEM;
-				goto err;
-			}
-			goto out;
-		}
-		len = frame->bytes;
-		if (!sk_wmem_schedule(sk, len)) {
-			iov_iter_revert(msginfo.msg, len);
-			quic_frame_put(frame);
-			continue;
-		}
-		bytes += frame->bytes;
-		quic_outq_set_force_delay(outq, delay);
-		quic_outq_stream_tail(sk, frame, delay);
-		len = 1;
-	} while (iov_iter_count(msginfo.msg) > 0);
+	err = quic_sendmsg_stream(sk, &msginfo, flags, delay);
+	goto err;
 out:
 	err = bytes;
 err:
+	/* sendmmsg() stops at an error */
+	if (err < 0 && (has_hinfo || (flags & MSG_DATAGRAM)) && (flags & MSG_BATCH))
+		quic_outq_transmit(sk);
 	if (err < 0 && !has_hinfo && !(flags & MSG_DATAGRAM))
 		err = sk_stream_error(sk, flags, err);
+	if (msginfo.zc)
+		quic_frame_zc_put(msginfo.zc);
 	release_sock(sk);
 	return err;
 }
@@ -859,6 +1394,106 @@ static int quic_wait_for_packet(struct sock *sk, int nonblock)
 	return err;
 }
 
+static void quic_recvmsg_stream_read(struct sock *sk, struct quic_stream *stream, u32 freed)
+{
+	quic_inq_flow_control(sk, stream, freed);
+	if (stream->recv.state == QUIC_STREAM_RECV_STATE_READ) {
+		quic_inq_stream_purge(sk, stream);
+		quic_stream_recv_put(quic_streams(sk), stream, quic_is_serv(sk));
+	}
+}
+
+/* Copy stream data and datagrams of possibly many streams in one call, until msg_iter
+ * or msg_control is full or an event/handshake message is reached. Each record is
+ * described by a QUIC_RECORD_INFO cmsg, and adjacent frames of the same stream are
+ * merged into one record.
+ */
+static int quic_recvmsg_batch(struct sock *sk, struct msghdr *msg, size_t len)
+{
+	u32 off, flen, copy, copied = 0, freed = 0, bytes = 0;
+	struct quic_record_info rinfo = {};
+	struct quic_stream *stream = NULL;
+	struct quic_frame *frame, *next;
+	struct list_head *head;
+	u8 fin, dgram, record = 0;
+	int err = 0;
+
+	head = quic_inq_recv_list(quic_inq(sk));
+	list_for_each_entry_safe(frame, next, head, list) {
+		if (frame->event || frame->level)
+			break;
+		if (frame->dgram || frame->stream != stream) {
+			if (record)
+				put_cmsg(msg, SOL_QUIC, QUIC_RECORD_INFO, sizeof(rinfo), &rinfo);
+			record = 0;
+			if (stream)
+				quic_recvmsg_stream_read(sk, stream, freed);
+			stream = frame->stream;
+			freed = 0;
+		}
+		off = (u32)frame->offset;
+		flen = (u32)frame->len;
+		if (!record) {
+			if (copied >= len)
+				break;
+			if (msg->msg_controllen < CMSG_SPACE(sizeof(rinfo))) {
+				/* returning 0 here would read as EOF to the caller */
+				if (!copied)
+					err = -EINVAL;
+				else
+					msg->msg_flags |= MSG_CTRUNC;
+				break;
+			}
+			memset(&rinfo, 0, sizeof(rinfo));
+			rinfo.stream_id = -1;
+			if (stream) {
+				rinfo.stream_id = stream->id;
+				rinfo.offset = stream->recv.bytes + freed + off;
+			}
+			record = 1;
+		}
+		copy = min((u32)(flen - off), (u32)(len - copied));
+		if (copy) {
+			copy = copy_to_iter(frame->data + off, copy, &msg->msg_iter);
+			if (!copy) {
+				if (!copied)
+					err = -EFAULT;
+				break;
+			}
+			copied += copy;
+			rinfo.len += copy;
+		}
+		fin = frame->stream_fin;
+		dgram = frame->dgram;
+		if (dgram)
+			rinfo.flags |= MSG_DATAGRAM;
+		if (copy != flen - off) {
+			frame->offset += copy;
+			break;
+		}
+		bytes += flen;
+		list_del(&frame->list);
+		quic_frame_put(frame);
+		if (dgram) {
+			rinfo.flags |= MSG_EOR;
+			continue;
+		}
+		freed += flen;
+		if (fin) {
+			stream->recv.state = QUIC_STREAM_RECV_STATE_READ;
+			rinfo.flags |= (MSG_STREAM_FIN | MSG_EOR);
+		}
+	}
+
+	if (record && !err)
+		put_cmsg(msg, SOL_QUIC, QUIC_RECORD_INFO, sizeof(rinfo), &rinfo);
+	if (stream)
+		quic_recvmsg_stream_read(sk, stream, freed);
+
+	quic_inq_data_read(sk, bytes);
+	return err ?: (int)copied;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
 static int quic_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int flags,
 			int *addr_len)
@@ -878,6 +1513,9 @@ static int quic_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int non
 	struct list_head *head;
 	int err;
 
+	if (flags & MSG_ERRQUEUE)
+		return quic_recv_error(sk, msg, (int)len);
+
 	lock_sock(sk);
 
 	err = quic_wait_for_packet(sk, nonblock);
@@ -885,6 +1523,12 @@ static int quic_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int non
 		goto out;
 
 	head = quic_inq_recv_list(quic_inq(sk));
+	frame = list_first_entry(head, struct quic_frame, list);
+	if ((flags & MSG_RECORD_BATCH) && !(flags & MSG_PEEK) && !frame->event && !frame->level) {
+		err = quic_recvmsg_batch(sk, msg, len);
+		goto out;
+	}
+
 	list_for_each_entry_safe(frame, next, head, list) {
 		off = (u32)frame->offset;
 		flen = (u32)frame->len;
@@ -956,16 +1600,18 @@ static int quic_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int non
 		if (msg->msg_flags & MSG_CTRUNC)
 			msg->msg_flags |= sinfo.stream_flags;
 
-		quic_inq_flow_control(sk, stream, freed);
-		if (stream->recv.state == QUIC_STREAM_RECV_STATE_READ) {
-			quic_inq_stream_list_purge(sk, stream);
-			quic_stream_recv_put(quic_streams(sk), stream, quic_is_serv(sk));
-		}
+		quic_recvmsg_stream_read(sk, stream, freed);
 	}
 
 	quic_inq_data_read(sk, bytes);
 	err = (int)copied;
 out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	/* lets io_uring multishot recv go on without waiting for another poll wakeup */
+	if (msg->msg_get_inq)
+		msg->msg_inq = list_empty(quic_inq_recv_list(quic_inq(sk))) ? 0 :
+			       sk_rmem_alloc_get(sk);
+#endif
 	release_sock(sk);
 	return err;
 }
@@ -1027,6 +1673,11 @@ static int quic_param_check_and_copy(struct quic_transport_param *p,
 			return -EINVAL;
 		param->max_ack_delay = p->max_ack_delay;
 	}
+	if (p->min_ack_delay) {
+		if (p->min_ack_delay > param->max_ack_delay)
+			return -EINVAL;
+		param->min_ack_delay = p->min_ack_delay;
+	}
 	if (p->active_connection_id_limit) {
 		if (p->active_connection_id_limit < QUIC_CONN_ID_LEAST ||
 		    p->active_connection_id_limit > QUIC_CONN_ID_LIMIT)
@@ -1066,22 +1717,11 @@ static int quic_param_check_and_copy(struct quic_transport_param *p,
 			return -EINVAL;
 		param->max_stream_data_uni = p->max_stream_data_uni;
 	}
-	if (p->max_streams_bidi) {
-		if (p->max_streams_bidi > QUIC_MAX_STREAMS) {
-			if (!p->remote)
-				return -EINVAL;
-			p->max_streams_bidi = QUIC_MAX_STREAMS;
-		}
+	/* u16 fields, so never above QUIC_MAX_STREAMS */
+	if (p->max_streams_bidi)
 		param->max_streams_bidi = p->max_streams_bidi;
-	}
-	if (p->max_streams_uni) {
-		if (p->max_streams_uni > QUIC_MAX_STREAMS) {
-			if (!p->remote)
-				return -EINVAL;
-			p->max_streams_uni = QUIC_MAX_STREAMS;
-		}
+	if (p->max_streams_uni)
 		param->max_streams_uni = p->max_streams_uni;
-	}
 	if (p->disable_active_migration)
 		param->disable_active_migration = p->disable_active_migration;
 	if (p->disable_1rtt_encryption)
@@ -1096,14 +1736,20 @@ static int quic_param_check_and_copy(struct quic_transport_param *p,
 	return 0;
 }
 
-static int quic_sock_set_config(struct sock *sk, struct quic_config *c, u32 len)
+/* struct quic_config as it was before datagram_ttl was added, still accepted from
+ * binaries built against the older header, with the fields they lack as zero
+ */
+#define QUIC_CONFIG_MIN_LEN	offsetofend(struct quic_config, disable_hystart)
+
+static int quic_sock_set_config(struct sock *sk, struct quic_config *uc, u32 len)
 {
-	struct quic_config *config = quic_config(sk);
+	struct quic_config *config = quic_config(sk), _c = {}, *c = &_c;
 	struct quic_packet *packet = quic_packet(sk);
 	struct quic_cong *cong = quic_cong(sk);
 
-	if (len < sizeof(*config) || quic_is_established(sk))
+	if (len < QUIC_CONFIG_MIN_LEN || quic_is_established(sk))
 		return -EINVAL;
+	memcpy(c, uc, min_t(u32, len, sizeof(*c)));
 
 	if (c->validate_peer_address)
 		config->validate_peer_address = c->validate_peer_address;
@@ -1144,6 +1790,19 @@ static int quic_sock_set_config(struct sock *sk, struct quic_config *c, u32 len)
 	}
 	if (c->stream_data_nodelay)
 		config->stream_data_nodelay = c->stream_data_nodelay;
+	if (c->stream_scheduler) {
+		if (c->stream_scheduler >= QUIC_STREAM_SCHED_MAX)
+			return -EINVAL;
+		config->stream_scheduler = c->stream_scheduler;
+	}
+	if (c->edt_pacing)
+		config->edt_pacing = c->edt_pacing;
+	if (c->disable_hystart) {
+		config->disable_hystart = c->disable_hystart;
+		quic_cong_set_hystart(cong, 0);
+	}
+	if (c->datagram_ttl)
+		config->datagram_ttl = c->datagram_ttl;
 
 	return 0;
 }
@@ -1205,6 +1864,10 @@ static int quic_copy_sock(struct sock *nsk, struct sock *sk, struct quic_request
 		inet_sk(nsk)->pinet6 = &((struct quic6_sock *)nsk)->inet6;
 
 	quic_sock_set_config(nsk, quic_config(sk), sizeof(struct quic_config));
+	memcpy(quic_source(nsk)->prefix, quic_source(sk)->prefix, QUIC_CONN_ID_PREFIX_MAX_LEN);
+	quic_source(nsk)->prefix_len = quic_source(sk)->prefix_len;
+	if (quic_cong_set_algo_name(quic_cong(nsk), quic_cong(sk)->ops->name))
+		return -ENOENT;
 	quic_sock_fetch_transport_param(sk, &param);
 	quic_sock_apply_transport_param(nsk, &param);
 	events = quic_inq_events(inq);
@@ -1235,8 +1898,9 @@ static int quic_accept_sock_init(struct sock *sk, struct quic_request_sock *req)
 	if (err < 0)
 		goto out;
 	quic_set_sk_addr(sk, &req->daddr, false);
+	quic_metrics_apply(sk);
 
-	quic_conn_id_generate(&conn_id);
+	quic_conn_id_set_generate(quic_source(sk), &conn_id);
 	err = quic_conn_id_add(quic_source(sk), &conn_id, 0, sk);
 	if (err)
 		goto out;
@@ -1297,6 +1961,9 @@ static struct sock *quic_accept(struct sock *sk, int flags, int *errp, bool kern
 	if (err)
 		goto out;
 	req = quic_request_sock_dequeue(sk);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	arg->is_empty = list_empty(quic_reqs(sk));	/* for io_uring multishot accept */
+#endif
 
 	nsk = sk_alloc(sock_net(sk), sk->sk_family, GFP_KERNEL, sk->sk_prot, kern);
 	if (!nsk) {
@@ -1324,7 +1991,8 @@ static struct sock *quic_accept(struct sock *sk, int flags, int *errp, bool kern
 out:
 	release_sock(sk);
 	*errp = err;
-	kfree(req);
+	if (req)
+		kmem_cache_free(quic_request_sock_cachep, req);
 	return nsk;
 free:
 	nsk->sk_prot->close(nsk, 0);
@@ -1334,17 +2002,21 @@ free:
 
 static void quic_close(struct sock *sk, long timeout)
 {
+	u32 i;
+
 	lock_sock(sk);
 
 	quic_outq_transmit_app_close(sk);
+	if (quic_is_established(sk))
+		quic_metrics_save(sk);
 
 	quic_set_state(sk, QUIC_SS_CLOSED);
 
 	quic_outq_free(sk);
 	quic_inq_free(sk);
 
-	quic_path_free(sk, quic_paths(sk), 0);
-	quic_path_free(sk, quic_paths(sk), 1);
+	for (i = 0; i < QUIC_PATH_MAX_PATHS; i++)
+		quic_path_free(sk, quic_paths(sk), (u8)i);
 
 	quic_conn_id_set_free(quic_source(sk));
 	quic_conn_id_set_free(quic_dest(sk));
@@ -1472,6 +2144,7 @@ static int quic_sock_set_crypto_secret(struct sock *sk, struct quic_crypto_secre
 		return 0;
 	}
 
+	quic_crypto_offload_add(crypto, sk, secret->send);
 	if (secret->send) { /* app send key is ready */
 		quic_outq_set_data_level(outq, QUIC_CRYPTO_APP);
 		if (!quic_crypto_recv_ready(crypto))
@@ -1514,6 +2187,8 @@ static int quic_sock_set_crypto_secret(struct sock *sk, struct quic_crypto_secre
 	if (quic_outq_transmit_frame(sk, QUIC_FRAME_HANDSHAKE_DONE, NULL, 0, true))
 		return -ENOMEM;
 out:
+	/* a failure here is not fatal, the first key update derives the keys itself then */
+	quic_crypto_key_prepare(crypto);
 	if (quic_outq_transmit_new_conn_id(sk, 0, 0, false))
 		return -ENOMEM;
 	quic_timer_start(sk, QUIC_TIMER_PMTU, c->plpmtud_probe_interval);
@@ -1598,6 +2273,29 @@ static int quic_sock_set_alpn(struct sock *sk, u8 *data, u32 len)
 	return 0;
 }
 
+static int quic_sock_set_congestion(struct sock *sk, char *name, u32 len)
+{
+	char algo[QUIC_CONG_NAME_MAX] = {};
+
+	if (!len || len >= QUIC_CONG_NAME_MAX)
+		return -EINVAL;
+
+	memcpy(algo, name, len);
+	return quic_cong_set_algo_name(quic_cong(sk), algo);
+}
+
+static int quic_sock_set_connection_id_prefix(struct sock *sk, u8 *prefix, u32 len)
+{
+	struct quic_conn_id_set *id_set = quic_source(sk);
+
+	if (len > QUIC_CONN_ID_PREFIX_MAX_LEN)
+		return -EINVAL;
+
+	memcpy(id_set->prefix, prefix, len);
+	id_set->prefix_len = (u8)len;
+	return 0;
+}
+
 static int quic_sock_stream_reset(struct sock *sk, struct quic_errinfo *info, u32 len)
 {
 	struct quic_stream_table *streams = quic_streams(sk);
@@ -1624,6 +2322,23 @@ static int quic_sock_stream_reset(struct sock *sk, struct quic_errinfo *info, u3
 	return 0;
 }
 
+static int quic_sock_set_stream_priority(struct sock *sk, struct quic_stream_priority *prio,
+					 u32 len)
+{
+	struct quic_stream_table *streams = quic_streams(sk);
+	struct quic_stream *stream;
+
+	if (len != sizeof(*prio) || prio->urgency > QUIC_STREAM_URGENCY_MAX)
+		return -EINVAL;
+
+	stream = quic_stream_send_get(streams, prio->stream_id, 0, quic_is_serv(sk));
+	if (IS_ERR(stream))
+		return PTR_ERR(stream);
+
+	quic_outq_stream_set_priority(sk, stream, prio->urgency, prio->incremental);
+	return 0;
+}
+
 static int quic_sock_stream_stop_sending(struct sock *sk, struct quic_errinfo *info, u32 len)
 {
 	struct quic_stream_table *streams = quic_streams(sk);
@@ -1742,6 +2457,15 @@ static int quic_do_setsockopt(struct sock *sk, int optname, sockptr_t optval, un
 	case QUIC_SOCKOPT_CRYPTO_SECRET:
 		retval = quic_sock_set_crypto_secret(sk, kopt, optlen);
 		break;
+	case QUIC_SOCKOPT_STREAM_PRIORITY:
+		retval = quic_sock_set_stream_priority(sk, kopt, optlen);
+		break;
+	case QUIC_SOCKOPT_CONGESTION:
+		retval = quic_sock_set_congestion(sk, kopt, optlen);
+		break;
+	case QUIC_SOCKOPT_CONNECTION_ID_PREFIX:
+		retval = quic_sock_set_connection_id_prefix(sk, kopt, optlen);
+		break;
 	default:
 		retval = -ENOPROTOOPT;
 		break;
@@ -1835,9 +2559,9 @@ static int quic_sock_get_config(struct sock *sk, u32 len, sockptr_t optval, sock
 {
 	struct quic_config config, *c = quic_config(sk);
 
-	if (len < sizeof(config))
+	if (len < QUIC_CONFIG_MIN_LEN)
 		return -EINVAL;
-	len = sizeof(config);
+	len = min_t(u32, len, sizeof(config));
 
 	config = *c;
 	if (copy_to_sockptr(optlen, &len, sizeof(len)) || copy_to_sockptr(optval, &config, len))
@@ -1960,6 +2684,102 @@ static int quic_sock_stream_open(struct sock *sk, u32 len, sockptr_t optval, soc
 	return 0;
 }
 
+static int quic_sock_get_stream_priority(struct sock *sk, u32 len,
+					 sockptr_t optval, sockptr_t optlen)
+{
+	struct quic_stream_table *streams = quic_streams(sk);
+	struct quic_stream_priority prio;
+	struct quic_stream *stream;
+
+	if (len < sizeof(prio))
+		return -EINVAL;
+	len = sizeof(prio);
+	if (copy_from_sockptr(&prio, optval, len))
+		return -EFAULT;
+
+	stream = quic_stream_send_get(streams, prio.stream_id, 0, quic_is_serv(sk));
+	if (IS_ERR(stream))
+		return PTR_ERR(stream);
+
+	prio.urgency = stream->send.urgency;
+	prio.incremental = stream->send.incremental;
+	if (copy_to_sockptr(optlen, &len, sizeof(len)) || copy_to_sockptr(optval, &prio, len))
+		return -EFAULT;
+	return 0;
+}
+
+static int quic_sock_get_congestion(struct sock *sk, u32 len, sockptr_t optval, sockptr_t optlen)
+{
+	const char *name = quic_cong(sk)->ops->name;
+
+	len = min_t(u32, len, strnlen(name, QUIC_CONG_NAME_MAX));
+	if (copy_to_sockptr(optlen, &len, sizeof(len)) || copy_to_sockptr(optval, name, len))
+		return -EFAULT;
+	return 0;
+}
+
+static int quic_sock_get_connection_id_prefix(struct sock *sk, u32 len, sockptr_t optval,
+					      sockptr_t optlen)
+{
+	struct quic_conn_id_set *id_set = quic_source(sk);
+
+	if (len < id_set->prefix_len)
+		return -EINVAL;
+	len = id_set->prefix_len;
+	if (copy_to_sockptr(optlen, &len, sizeof(len)) || copy_to_sockptr(optval, id_set->prefix, len))
+		return -EFAULT;
+	return 0;
+}
+
+/* Called with the socket locked, by QUIC_SOCKOPT_INFO and by quic_diag under lock_sock_fast() */
+void quic_sock_info(struct sock *sk, struct quic_info *info)
+{
+	struct quic_path_group *paths = quic_paths(sk);
+	struct quic_outqueue *outq = quic_outq(sk);
+	struct quic_cong *cong = quic_cong(sk);
+
+	info->smoothed_rtt = cong->smoothed_rtt;
+	info->latest_rtt = cong->latest_rtt;
+	info->min_rtt = cong->min_rtt;
+	info->rttvar = cong->rttvar;
+	info->pto = cong->pto;
+	info->pto_count = outq->pto_count;
+
+	info->window = cong->window;
+	info->ssthresh = cong->ssthresh;
+	info->inflight = outq->inflight;
+	info->mss = cong->mss;
+	info->pacing_rate = READ_ONCE(cong->pacing_rate);
+	info->delivery_rate = cong->rs.rate;
+	info->cong_state = cong->state;
+	info->pl_state = quic_path_pl_state(paths);
+	info->pl_pmtu = (u16)quic_path_pl_pmtu(paths);
+
+	info->bytes_sent = outq->bytes_sent;
+	info->bytes_acked = outq->bytes_acked;
+	info->bytes_lost = outq->bytes_lost;
+	info->bytes_retrans = outq->bytes_retrans;
+	info->packets_sent = outq->packets_sent;
+	info->packets_acked = outq->packets_acked;
+	info->packets_lost = outq->packets_lost;
+	info->frames_retrans = outq->frames_retrans;
+	info->blocked_time = outq->blocked_time;
+	if (outq->blocked_start)
+		info->blocked_time += jiffies_to_usecs(jiffies) - outq->blocked_start;
+}
+EXPORT_SYMBOL_GPL(quic_sock_info);
+
+static int quic_sock_get_info(struct sock *sk, u32 len, sockptr_t optval, sockptr_t optlen)
+{
+	struct quic_info info = {};
+
+	quic_sock_info(sk, &info);
+	len = min_t(u32, len, sizeof(info));
+	if (copy_to_sockptr(optlen, &len, sizeof(len)) || copy_to_sockptr(optval, &info, len))
+		return -EFAULT;
+	return 0;
+}
+
 static int quic_sock_get_event(struct sock *sk, u32 len, sockptr_t optval, sockptr_t optlen)
 {
 	struct quic_inqueue *inq = quic_inq(sk);
@@ -2051,6 +2871,18 @@ static int quic_do_getsockopt(struct sock *sk, int optname, sockptr_t optval, so
 	case QUIC_SOCKOPT_CRYPTO_SECRET:
 		retval = quic_sock_get_crypto_secret(sk, len, optval, optlen);
 		break;
+	case QUIC_SOCKOPT_STREAM_PRIORITY:
+		retval = quic_sock_get_stream_priority(sk, len, optval, optlen);
+		break;
+	case QUIC_SOCKOPT_CONGESTION:
+		retval = quic_sock_get_congestion(sk, len, optval, optlen);
+		break;
+	case QUIC_SOCKOPT_CONNECTION_ID_PREFIX:
+		retval = quic_sock_get_connection_id_prefix(sk, len, optval, optlen);
+		break;
+	case QUIC_SOCKOPT_INFO:
+		retval = quic_sock_get_info(sk, len, optval, optlen);
+		break;
 	default:
 		retval = -ENOPROTOOPT;
 		break;
@@ -2109,6 +2941,10 @@ static void quic_release_cb(struct sock *sk)
 		quic_timer_pace_handler(sk);
 		__sock_put(sk);
 	}
+	if (flags & QUIC_F_WORK_DEFERRED) {
+		quic_sock_work_process(sk);
+		__sock_put(sk);
+	}
 }
 
 static int quic_disconnect(struct sock *sk, int flags)
@@ -2147,6 +2983,7 @@ struct proto quic_prot = {
 	.backlog_rcv	=  quic_packet_process,
 	.release_cb	=  quic_release_cb,
 	.no_autobind	=  true,
+	.slab_flags	=  SLAB_TYPESAFE_BY_RCU,
 	.obj_size	=  sizeof(struct quic_sock),
 	.sysctl_mem		=  sysctl_quic_mem,
 	.sysctl_rmem		=  sysctl_quic_rmem,
@@ -2177,6 +3014,7 @@ struct proto quicv6_prot = {
 	.backlog_rcv	=  quic_packet_process,
 	.release_cb	=  quic_release_cb,
 	.no_autobind	=  true,
+	.slab_flags	=  SLAB_TYPESAFE_BY_RCU,
 	.obj_size	= sizeof(struct quic6_sock),
 	.sysctl_mem		=  sysctl_quic_mem,
 	.sysctl_rmem		=  sysctl_quic_rmem,
@@ -22,6 +22,7 @@
 #include "crypto.h"
 #include "cong.h"
 #include "path.h"
+#include "metrics.h"
 
 #include "packet.h"
 #include "frame.h"
@@ -45,7 +46,8 @@ enum quic_state {
 };
 
 struct quic_request_sock {
-	struct list_head	list;
+	struct list_head	list; /* accept order in quic_reqs() */
+	struct hlist_node	node; /* lookup by address in quic_reqs_ht() */
 
 	struct quic_conn_id	dcid;
 	struct quic_conn_id	scid;
@@ -57,6 +59,16 @@ struct quic_request_sock {
 	u8			retry;
 };
 
+/* an entry of a listen socket in the (netns, port, ALPN) index, one for each of its ALPNs */
+struct quic_listen_alpn {
+	struct hlist_node	node;
+	struct rcu_head		rcu;
+	struct sock		*sk;
+	u16			port;
+	u8			len;
+	u8			data[];
+};
+
 enum quic_tsq_enum {
 	QUIC_MTU_REDUCED_DEFERRED,
 	QUIC_LOSS_DEFERRED,
@@ -64,6 +76,7 @@ enum quic_tsq_enum {
 	QUIC_PATH_DEFERRED,
 	QUIC_PMTU_DEFERRED,
 	QUIC_TSQ_DEFERRED,
+	QUIC_WORK_DEFERRED,
 };
 
 enum quic_tsq_flags {
@@ -73,6 +86,7 @@ enum quic_tsq_flags {
 	QUIC_F_PATH_DEFERRED		= BIT(QUIC_PATH_DEFERRED),
 	QUIC_F_PMTU_DEFERRED		= BIT(QUIC_PMTU_DEFERRED),
 	QUIC_F_TSQ_DEFERRED		= BIT(QUIC_TSQ_DEFERRED),
+	QUIC_F_WORK_DEFERRED		= BIT(QUIC_WORK_DEFERRED),
 };
 
 #define QUIC_DEFERRED_ALL (QUIC_F_MTU_REDUCED_DEFERRED |	\
@@ -80,11 +94,20 @@ enum quic_tsq_flags {
 			   QUIC_F_SACK_DEFERRED |		\
 			   QUIC_F_PATH_DEFERRED |		\
 			   QUIC_F_PMTU_DEFERRED |		\
-			   QUIC_F_TSQ_DEFERRED)
+			   QUIC_F_TSQ_DEFERRED |		\
+			   QUIC_F_WORK_DEFERRED)
+
+/* bits of quic_sock->work_flags, see quic_sock_work_schedule() */
+enum quic_sock_work_enum {
+	QUIC_SOCK_WORK_QUEUED,		/* on a per-CPU work list */
+	QUIC_SOCK_WORK_DECRYPTED,	/* async decrypted packets in sk_receive_queue */
+	QUIC_SOCK_WORK_ENCRYPTED,	/* async encrypted packets in sk_write_queue */
+};
 
 struct quic_sock {
 	struct inet_sock		inet;
 	struct list_head		reqs;
+	struct quic_hash_table		reqs_ht;
 
 	struct quic_config		config;
 	struct quic_data		ticket;
@@ -102,7 +125,12 @@ struct quic_sock {
 	struct quic_outqueue		outq;
 	struct quic_inqueue		inq;
 	struct quic_packet		packet;
-	struct quic_timer		timers[QUIC_TIMER_MAX];
+	struct quic_timer		timers[QUIC_TIMER_PACE];
+	struct hrtimer			pace_timer;
+
+	struct llist_node		work_node;
+	unsigned long			work_flags;
+	struct work_struct		key_work;	/* see quic_sock_key_work_schedule() */
 };
 
 struct quic6_sock {
@@ -157,7 +185,9 @@ static inline struct quic_path_group *quic_paths(const struct sock *sk)
 
 static inline void *quic_timer(const struct sock *sk, u8 type)
 {
-	return (void *)&quic_sk(sk)->timers[type];
+	if (type == QUIC_TIMER_PACE)
+		return (void *)&quic_sk(sk)->pace_timer;
+	return (void *)&quic_sk(sk)->timers[type].t;
 }
 
 static inline struct list_head *quic_reqs(const struct sock *sk)
@@ -165,6 +195,11 @@ static inline struct list_head *quic_reqs(const struct sock *sk)
 	return &quic_sk(sk)->reqs;
 }
 
+static inline struct quic_hash_table *quic_reqs_ht(const struct sock *sk)
+{
+	return &quic_sk(sk)->reqs_ht;
+}
+
 static inline struct quic_config *quic_config(const struct sock *sk)
 {
 	return &quic_sk(sk)->config;
@@ -250,10 +285,24 @@ static inline bool quic_under_memory_pressure(const struct sock *sk)
 	return !!READ_ONCE(*sk->sk_prot->memory_pressure);
 }
 
+/* EDT pacing leaves the packet release to the qdisc, see skb->tstamp */
+static inline bool quic_edt_pacing(const struct sock *sk)
+{
+	return quic_config(sk)->edt_pacing ||
+	       smp_load_acquire(&sk->sk_pacing_status) == SK_PACING_FQ;
+}
+
 struct sock *quic_sock_lookup(struct sk_buff *skb, union quic_addr *sa, union quic_addr *da);
 int quic_request_sock_enqueue(struct sock *sk, struct quic_conn_id *odcid, u8 retry);
 struct quic_request_sock *quic_request_sock_dequeue(struct sock *sk);
 int quic_accept_sock_exists(struct sock *sk, struct sk_buff *skb);
 bool quic_request_sock_exists(struct sock *sk);
+int quic_request_sock_hash_init(struct sock *sk, int backlog);
+void quic_request_sock_hash_free(struct sock *sk);
+void quic_sock_info(struct sock *sk, struct quic_info *info);
+void quic_sock_work_schedule(struct sock *sk, u8 work);
+void quic_sock_key_work_schedule(struct sock *sk);
+int quic_sock_work_init(void);
+void quic_sock_work_destroy(void);
 
 #endif /* __net_quic_h__ */
@@ -53,28 +53,99 @@ static bool quic_stream_id_uni(s64 stream_id)
 
 struct quic_stream *quic_stream_find(struct quic_stream_table *streams, s64 stream_id)
 {
-	struct quic_hash_head *head = quic_stream_head(&streams->ht, stream_id);
-	struct quic_stream *stream;
+	struct quic_stream *stream = streams->last;
+	struct quic_hash_head *head;
+
+	if (stream && stream->id == stream_id)
+		return stream;
 
+	head = quic_stream_head(&streams->ht, stream_id);
 	hlist_for_each_entry(stream, &head->head, node) {
-		if (stream->id == stream_id)
+		if (stream->id == stream_id) {
+			streams->last = stream;
 			break;
+		}
 	}
 	return stream;
 }
 
+static struct quic_hash_head *quic_stream_hash_alloc(int size, gfp_t gfp)
+{
+	struct quic_hash_head *head;
+	int i;
+
+	head = kmalloc_array(size, sizeof(*head), gfp);
+	if (!head)
+		return NULL;
+	for (i = 0; i < size; i++) {
+		spin_lock_init(&head[i].lock);
+		INIT_HLIST_HEAD(&head[i].head);
+	}
+	return head;
+}
+
+/* Streams may be opened while processing packets, so the table grows with GFP_ATOMIC,
+ * up to QUIC_STREAM_HT_MAX_BYTES. If that fails, or once it is that large, the current
+ * table is kept and only the chains get longer.
+ */
+static void quic_stream_hash_grow(struct quic_stream_table *streams)
+{
+	struct quic_hash_table *ht = &streams->ht;
+	struct quic_hash_head *head = ht->hash;
+	struct quic_stream *stream;
+	struct hlist_node *tmp;
+	int i, size = ht->size;
+
+	if (size * 2 * sizeof(*head) > QUIC_STREAM_HT_MAX_BYTES)
+		return;
+	ht->hash = quic_stream_hash_alloc(size * 2, GFP_ATOMIC | __GFP_NOWARN);
+	if (!ht->hash) {
+		ht->hash = head;
+		return;
+	}
+	ht->size = size * 2;
+
+	for (i = 0; i < size; i++) {
+		hlist_for_each_entry_safe(stream, tmp, &head[i].head, node)
+			hlist_add_head(&stream->node, &quic_stream_head(ht, stream->id)->head);
+	}
+	kfree(head);
+}
+
 static void quic_stream_add(struct quic_stream_table *streams, struct quic_stream *stream)
 {
 	struct quic_hash_head *head;
 
+	if (++streams->count > streams->ht.size)
+		quic_stream_hash_grow(streams);
 	head = quic_stream_head(&streams->ht, stream->id);
 	hlist_add_head(&stream->node, &head->head);
 }
 
-static void quic_stream_delete(struct quic_stream *stream)
+static struct quic_stream *quic_stream_alloc(s64 stream_id)
 {
+	struct quic_stream *stream;
+
+	stream = kmem_cache_zalloc(quic_stream_cachep, GFP_ATOMIC);
+	if (!stream)
+		return NULL;
+
+	stream->id = stream_id;
+	INIT_LIST_HEAD(&stream->send.frame_list);
+	INIT_LIST_HEAD(&stream->send.list);
+	INIT_LIST_HEAD(&stream->send.blocked);
+	stream->send.urgency = QUIC_STREAM_URGENCY_DEFAULT;
+	return stream;
+}
+
+static void quic_stream_delete(struct quic_stream_table *streams, struct quic_stream *stream)
+{
+	if (streams->last == stream)
+		streams->last = NULL;
+	streams->count--;
 	hlist_del_init(&stream->node);
-	kfree(stream);
+	list_del(&stream->send.blocked);
+	kmem_cache_free(quic_stream_cachep, stream);
 }
 
 static struct quic_stream *quic_stream_send_create(struct quic_stream_table *streams,
@@ -88,11 +159,10 @@ static struct quic_stream *quic_stream_send_create(struct quic_stream_table *str
 		stream_id = streams->send.next_uni_stream_id;
 
 	while (stream_id <= max_stream_id) {
-		stream = kzalloc(sizeof(*stream), GFP_ATOMIC);
+		stream = quic_stream_alloc(stream_id);
 		if (!stream)
 			return NULL;
 
-		stream->id = stream_id;
 		if (quic_stream_id_uni(stream_id)) {
 			stream->send.window = streams->send.max_stream_data_uni;
 			stream->send.max_bytes = stream->send.window;
@@ -137,11 +207,10 @@ static struct quic_stream *quic_stream_recv_create(struct quic_stream_table *str
 		stream_id = streams->recv.next_uni_stream_id;
 
 	while (stream_id <= max_stream_id) {
-		stream = kzalloc(sizeof(*stream), GFP_ATOMIC);
+		stream = quic_stream_alloc(stream_id);
 		if (!stream)
 			return NULL;
 
-		stream->id = stream_id;
 		if (quic_stream_id_uni(stream_id)) {
 			stream->recv.window = streams->recv.max_stream_data_uni;
 			stream->recv.max_bytes = stream->recv.window;
@@ -223,6 +292,17 @@ bool quic_stream_id_send_exceeds(struct quic_stream_table *streams, s64 stream_i
 	return false;
 }
 
+/* the recv window a stream starts with, from the local transport parameters */
+u64 quic_stream_recv_init_window(struct quic_stream_table *streams, s64 stream_id,
+				 bool is_serv)
+{
+	if (quic_stream_id_uni(stream_id))
+		return streams->recv.max_stream_data_uni;
+	if (quic_stream_id_local(stream_id, is_serv))
+		return streams->recv.max_stream_data_bidi_local;
+	return streams->recv.max_stream_data_bidi_remote;
+}
+
 bool quic_stream_id_send_overflow(struct quic_stream_table *streams, s64 stream_id)
 {
 	u64 nstreams;
@@ -309,7 +389,7 @@ void quic_stream_send_put(struct quic_stream_table *streams, struct quic_stream
 {
 	if (quic_stream_id_uni(stream->id)) {
 		streams->send.streams_uni--;
-		quic_stream_delete(stream);
+		quic_stream_delete(streams, stream);
 		return;
 	}
 
@@ -332,7 +412,7 @@ void quic_stream_send_put(struct quic_stream_table *streams, struct quic_stream
 	}
 out:
 	if (stream->recv.state == QUIC_STREAM_RECV_STATE_READ || !stream->recv.offset)
-		quic_stream_delete(stream);
+		quic_stream_delete(streams, stream);
 }
 
 void quic_stream_recv_put(struct quic_stream_table *streams, struct quic_stream *stream,
@@ -365,7 +445,7 @@ void quic_stream_recv_put(struct quic_stream_table *streams, struct quic_stream
 	}
 out:
 	if (stream->recv.state == QUIC_STREAM_RECV_STATE_READ || !stream->recv.offset)
-		quic_stream_delete(stream);
+		quic_stream_delete(streams, stream);
 }
 
 bool quic_stream_max_streams_update(struct quic_stream_table *streams, s64 *max_uni, s64 *max_bidi)
@@ -389,18 +469,11 @@ bool quic_stream_max_streams_update(struct quic_stream_table *streams, s64 *max_
 int quic_stream_init(struct quic_stream_table *streams)
 {
 	struct quic_hash_table *ht = &streams->ht;
-	struct quic_hash_head *head;
-	int i, size = 16;
 
-	head = kmalloc_array(size, sizeof(*head), GFP_KERNEL);
-	if (!head)
+	ht->hash = quic_stream_hash_alloc(QUIC_STREAM_HT_MIN_SIZE, GFP_KERNEL);
+	if (!ht->hash)
 		return -ENOMEM;
-	for (i = 0; i < size; i++) {
-		spin_lock_init(&head[i].lock);
-		INIT_HLIST_HEAD(&head[i].head);
-	}
-	ht->size = size;
-	ht->hash = head;
+	ht->size = QUIC_STREAM_HT_MIN_SIZE;
 	return 0;
 }
 
@@ -416,9 +489,11 @@ void quic_stream_free(struct quic_stream_table *streams)
 		head = &ht->hash[i];
 		hlist_for_each_entry_safe(stream, tmp, &head->head, node) {
 			hlist_del_init(&stream->node);
-			kfree(stream);
+			kmem_cache_free(quic_stream_cachep, stream);
 		}
 	}
+	streams->last = NULL;
+	streams->count = 0;
 	kfree(ht->hash);
 }
 
@@ -9,7 +9,11 @@
  */
 
 #define QUIC_DEF_STREAMS	100
-#define QUIC_MAX_STREAMS	4096ULL
+#define QUIC_MAX_STREAMS	65535ULL	/* u16 max_streams_* in struct quic_transport_param */
+
+#define QUIC_STREAM_HT_MIN_SIZE	16
+/* the table grows with GFP_ATOMIC, so it is kept within a non-costly order allocation */
+#define QUIC_STREAM_HT_MAX_BYTES	(PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
 
 #define QUIC_STREAM_TYPE_CLIENT_BIDI	0x00
 #define QUIC_STREAM_TYPE_SERVER_BIDI	0x01
@@ -26,11 +30,19 @@ struct quic_stream {
 		u64 offset;
 		u64 bytes;
 
+		struct list_head frame_list;	/* stream frames waiting to be sent */
+		struct list_head list;		/* in outq stream_list while frame_list is not empty */
+		struct list_head blocked;	/* in outq blocked_list, see quic_outq_stream_blocked() */
+
 		u32 errcode;
 		u32 frags;
 		u8 state;
 
 		u8 data_blocked;
+		u8 urgency;
+		u8 quantum;	/* frames left in the turn of this stream */
+		u8 incremental:1;
+		u8 write_blocked:1;	/* a write failed on this stream's MAX_STREAM_DATA */
 		u8 done:1;
 	} send;
 	struct {
@@ -40,7 +52,10 @@ struct quic_stream {
 		u64 window;
 		u64 offset;
 		u64 bytes;
+		u64 space_bytes;	/* read by the application since space_time */
+		u32 space_time;
 
+		struct rb_root frame_tree;	/* out-of-order frames, keyed by offset */
 		u32 frags;
 		u8 state;
 		u8 done:1;
@@ -48,7 +63,9 @@ struct quic_stream {
 };
 
 struct quic_stream_table {
-	struct quic_hash_table ht;
+	struct quic_hash_table ht;	/* doubled when count reaches its size */
+	struct quic_stream *last;	/* one-entry cache for quic_stream_find() */
+	u32 count;
 
 	struct {
 		u64 max_stream_data_bidi_remote;
@@ -145,6 +162,8 @@ static inline s64 quic_stream_streams_to_id(u64 streams, u8 type)
 	return (s64)((streams - 1) << 2) | type;
 }
 
+extern struct kmem_cache *quic_stream_cachep __read_mostly;
+
 struct quic_stream *quic_stream_send_get(struct quic_stream_table *streams, s64 stream_id,
 					 u32 flags, bool is_serv);
 struct quic_stream *quic_stream_recv_get(struct quic_stream_table *streams, s64 stream_id,
@@ -155,7 +174,10 @@ void quic_stream_recv_put(struct quic_stream_table *streams, struct quic_stream
 			  bool is_serv);
 
 bool quic_stream_max_streams_update(struct quic_stream_table *streams, s64 *max_uni, s64 *max_bidi);
+
 struct quic_stream *quic_stream_find(struct quic_stream_table *streams, s64 stream_id);
+u64 quic_stream_recv_init_window(struct quic_stream_table *streams, s64 stream_id,
+				 bool is_serv);
 bool quic_stream_id_send_overflow(struct quic_stream_table *streams, s64 stream_id);
 bool quic_stream_id_send_exceeds(struct quic_stream_table *streams, s64 stream_id);
 
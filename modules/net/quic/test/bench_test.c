@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is kernel test of the QUIC kernel implementation
+ *
+ * Microbenchmarks of the per-packet primitives. Loading the module runs them all and
+ * prints one line per case, in key=value form for scripts to compare between builds:
+ *
+ *   quic_bench: case=crypto_encrypt cipher=aes_gcm_128 size=1200 iters=10000 ns_per_op=812
+ */
+
+#include <uapi/linux/quic.h>
+#include <uapi/linux/tls.h>
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include <linux/random.h>
+#include <linux/completion.h>
+#include <net/sock.h>
+
+#include "../socket.h"
+
+static int iters = 10000;
+
+static void quic_bench_report(const char *name, const char *cipher, u32 size, u64 ns)
+{
+	pr_info("quic_bench: case=%s cipher=%s size=%u iters=%d ns_per_op=%llu\n",
+		name, cipher, size, iters, div_u64(ns, iters));
+}
+
+static void quic_bench_pnspace_init(struct quic_pnspace *space)
+{
+	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
+	quic_pnspace_set_max_time_limit(space, 30000);
+}
+
+/* in order, as on a path without loss or reordering */
+static int quic_bench_pnspace_mark(void)
+{
+	struct quic_pnspace space = {};
+	u64 start;
+	int i;
+
+	if (quic_pnspace_init(&space))
+		return -ENOMEM;
+	quic_bench_pnspace_init(&space);
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++)
+		quic_pnspace_mark(&space, i);
+	quic_bench_report("pnspace_mark", "none", 0, ktime_get_ns() - start);
+
+	quic_pnspace_free(&space);
+	return 0;
+}
+
+/* every second packet of a block first, then the others, so that gaps open and close */
+static int quic_bench_pnspace_mark_gaps(void)
+{
+	struct quic_pnspace space = {};
+	s64 base;
+	u64 start;
+	int i;
+
+	if (quic_pnspace_init(&space))
+		return -ENOMEM;
+	quic_bench_pnspace_init(&space);
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		base = i & ~63;
+		quic_pnspace_mark(&space, base + ((i & 31) << 1) + ((i & 32) >> 5));
+	}
+	quic_bench_report("pnspace_mark_gaps", "none", 0, ktime_get_ns() - start);
+
+	quic_pnspace_free(&space);
+	return 0;
+}
+
+/* an ACK frame for the APP space of a socket, with the given number of ranges as size */
+static int quic_bench_ack_create(u32 ranges)
+{
+	u8 level = QUIC_CRYPTO_APP;
+	struct quic_pnspace *space;
+	struct quic_frame *frame;
+	struct socket *sock;
+	u64 start;
+	int err, i;
+
+	err = __sock_create(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_QUIC, &sock, 1);
+	if (err)
+		return err;
+
+	lock_sock(sock->sk);
+	space = quic_pnspace(sock->sk, level);
+	quic_bench_pnspace_init(space);
+	for (i = 0; i <= ranges; i++)
+		quic_pnspace_mark(space, i * 2);
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		frame = quic_frame_create(sock->sk, QUIC_FRAME_ACK, &level);
+		if (!frame) {
+			err = -ENOMEM;
+			break;
+		}
+		quic_frame_put(frame);
+	}
+	if (!err)
+		quic_bench_report("ack_create", "none", ranges, ktime_get_ns() - start);
+	release_sock(sock->sk);
+
+	sock_release(sock);
+	return err;
+}
+
+#define QUIC_BENCH_HLEN		17	/* short header with a 16-byte DCID */
+#define QUIC_BENCH_PN_LEN	4
+
+/* completed when an async cipher finishes the one request left in flight */
+static DECLARE_COMPLETION(quic_bench_crypto_wait);
+
+static void quic_bench_crypto_done(struct sk_buff *skb, int err)
+{
+	complete(&quic_bench_crypto_wait);
+}
+
+static void quic_bench_skb_init(struct sk_buff *skb, u8 *data, u32 len)
+{
+	struct quic_crypto_cb *cb = QUIC_CRYPTO_CB(skb);
+
+	skb_trim(skb, 0);
+	skb_put_data(skb, data, len);
+	memset(cb, 0, sizeof(*cb));
+	cb->number_offset = QUIC_BENCH_HLEN;
+	cb->number_len = QUIC_BENCH_PN_LEN;
+	cb->length = (u16)(len - cb->number_offset);
+	cb->crypto_done = quic_bench_crypto_done;
+}
+
+static const struct {
+	const char *name;
+	u32 type;
+} quic_bench_ciphers[] = {
+	{ "aes_gcm_128", TLS_CIPHER_AES_GCM_128 },
+	{ "aes_gcm_256", TLS_CIPHER_AES_GCM_256 },
+	{ "aes_ccm_128", TLS_CIPHER_AES_CCM_128 },
+	{ "chacha20_poly1305", TLS_CIPHER_CHACHA20_POLY1305 },
+};
+
+static const u32 quic_bench_sizes[] = { 64, 512, 1200, 1452 };
+
+/* Payload encryption and header protection of a 1-RTT packet as quic_crypto_encrypt()
+ * and quic_crypto_decrypt() do them. A case is skipped if the cipher is async, since
+ * only the submission would be timed.
+ */
+static int quic_bench_crypto(struct sock *sk, u32 c, u32 size)
+{
+	struct quic_crypto_secret srt = {};
+	struct quic_crypto *tx, *rx;
+	u8 *data, *enc;
+	struct sk_buff *skb;
+	int err = -ENOMEM, i;
+	u64 start;
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	rx = kzalloc(sizeof(*rx), GFP_KERNEL);
+	data = kmalloc(size, GFP_KERNEL);
+	enc = kmalloc(size + QUIC_TAG_LEN, GFP_KERNEL);
+	skb = alloc_skb(size + QUIC_TAG_LEN, GFP_KERNEL);
+	if (!tx || !rx || !data || !enc || !skb)
+		goto out;
+	WARN_ON(!skb_set_owner_sk_safe(skb, sk));
+	skb_reset_transport_header(skb);
+
+	get_random_bytes(data, size);
+	data[0] = QUIC_BENCH_PN_LEN - 1 + 0x40; /* short header, fixed bit */
+
+	srt.type = quic_bench_ciphers[c].type;
+	get_random_bytes(srt.secret, sizeof(srt.secret));
+	srt.send = 1;
+	err = quic_crypto_set_secret(tx, &srt, QUIC_VERSION_V1, 0);
+	if (err)
+		goto out;
+	srt.send = 0;
+	err = quic_crypto_set_secret(rx, &srt, QUIC_VERSION_V1, 0);
+	if (err)
+		goto out;
+
+	reinit_completion(&quic_bench_crypto_wait);
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		quic_bench_skb_init(skb, data, size);
+		err = quic_crypto_encrypt(tx, skb);
+		if (err)
+			goto out;
+	}
+	quic_bench_report("crypto_encrypt", quic_bench_ciphers[c].name, size,
+			  ktime_get_ns() - start);
+	memcpy(enc, skb->data, skb->len);
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		quic_bench_skb_init(skb, enc, size + QUIC_TAG_LEN);
+		err = quic_crypto_decrypt(rx, skb);
+		if (err)
+			goto out;
+	}
+	quic_bench_report("crypto_decrypt", quic_bench_ciphers[c].name, size,
+			  ktime_get_ns() - start);
+out:
+	if (err == -EINPROGRESS) {
+		pr_info("quic_bench: case=crypto cipher=%s size=%u skipped=async\n",
+			quic_bench_ciphers[c].name, size);
+		wait_for_completion(&quic_bench_crypto_wait);
+		err = 0;
+	}
+	kfree_skb(skb);
+	kfree(enc);
+	kfree(data);
+	if (rx)
+		quic_crypto_destroy(rx);
+	if (tx)
+		quic_crypto_destroy(tx);
+	kfree(rx);
+	kfree(tx);
+	return err;
+}
+
+#define QUIC_BENCH_HP_SEGS	64
+
+/* Header protection of a GSO bundle of 1-RTT packets in one quic_crypto_header_encrypt_batch()
+ * call, as quic_packet_flush() does it, with the number of packets as size.
+ */
+static int quic_bench_hp_batch(u32 c)
+{
+	struct quic_crypto_secret srt = {};
+	struct sk_buff *head = NULL, *skb;
+	struct quic_crypto *tx;
+	int err = -ENOMEM, i;
+	u32 size = 1200;
+	u64 start;
+	u8 *data;
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	data = kmalloc(size, GFP_KERNEL);
+	if (!tx || !data)
+		goto out;
+
+	srt.type = quic_bench_ciphers[c].type;
+	get_random_bytes(srt.secret, sizeof(srt.secret));
+	srt.send = 1;
+	err = quic_crypto_set_secret(tx, &srt, QUIC_VERSION_V1, 0);
+	if (err)
+		goto out;
+
+	get_random_bytes(data, size);
+	for (i = 0; i < QUIC_BENCH_HP_SEGS; i++) {
+		skb = alloc_skb(size, GFP_KERNEL);
+		if (!skb) {
+			err = -ENOMEM;
+			goto out;
+		}
+		quic_bench_skb_init(skb, data, size);
+		QUIC_CRYPTO_CB(skb)->hp_batch = 1;
+		if (!head) {
+			head = skb;
+			continue;
+		}
+		skb->next = skb_shinfo(head)->frag_list;
+		skb_shinfo(head)->frag_list = skb;
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++) {
+		err = quic_crypto_header_encrypt_batch(tx, head);
+		if (err)
+			goto out;
+	}
+	quic_bench_report("hp_batch", quic_bench_ciphers[c].name, QUIC_BENCH_HP_SEGS,
+			  ktime_get_ns() - start);
+out:
+	kfree_skb(head);
+	kfree(data);
+	if (tx)
+		quic_crypto_destroy(tx);
+	kfree(tx);
+	return err;
+}
+
+static int quic_bench_crypto_all(void)
+{
+	struct socket *sock;
+	int err, c, s;
+
+	err = __sock_create(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_QUIC, &sock, 1);
+	if (err)
+		return err;
+
+	for (c = 0; c < ARRAY_SIZE(quic_bench_ciphers) && !err; c++) {
+		for (s = 0; s < ARRAY_SIZE(quic_bench_sizes) && !err; s++)
+			err = quic_bench_crypto(sock->sk, c, quic_bench_sizes[s]);
+		if (!err)
+			err = quic_bench_hp_batch(c);
+	}
+
+	sock_release(sock);
+	return err;
+}
+
+static int __init quic_bench_init(void)
+{
+	int err;
+
+	if (iters <= 0)
+		return -EINVAL;
+
+	err = quic_bench_pnspace_mark();
+	if (err)
+		goto out;
+	err = quic_bench_pnspace_mark_gaps();
+	if (err)
+		goto out;
+	err = quic_bench_ack_create(1);
+	if (err)
+		goto out;
+	err = quic_bench_ack_create(32);
+	if (err)
+		goto out;
+	err = quic_bench_crypto_all();
+out:
+	if (err)
+		pr_info("quic_bench: err=%d\n", err);
+	return err;
+}
+
+static void __exit quic_bench_exit(void)
+{
+}
+
+module_init(quic_bench_init);
+module_exit(quic_bench_exit);
+
+module_param_named(iters, iters, int, 0644);
+MODULE_PARM_DESC(iters, "iterations per case");
+
+MODULE_DESCRIPTION("Microbenchmarks For the QUIC protocol (RFC9000)");
+MODULE_LICENSE("GPL");
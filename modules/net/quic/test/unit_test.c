@@ -13,21 +13,25 @@
 #include <uapi/linux/quic.h>
 #include <uapi/linux/tls.h>
 #include <linux/version.h>
+#include <linux/if_ether.h>
 #include <linux/skbuff.h>
 #include <linux/delay.h>
+#include <linux/ip.h>
 #include <kunit/test.h>
+#include <net/route.h>
 #include <net/sock.h>
+#include <net/udp.h>
 
 #include "../pnspace.h"
 #include "../common.h"
 #include "../connid.h"
 #include "../crypto.h"
 #include "../cong.h"
+#include "../path.h"
 
 static void quic_pnspace_test1(struct kunit *test)
 {
 	struct quic_pnspace _space = {}, *space = &_space;
-	struct quic_gap_ack_block gabs[QUIC_PN_MAX_GABS];
 	int i;
 
 	KUNIT_ASSERT_EQ(test, 0, quic_pnspace_init(space));
@@ -37,10 +41,10 @@ static void quic_pnspace_test1(struct kunit *test)
 
 	KUNIT_EXPECT_EQ(test, space->base_pn, 1);
 	KUNIT_EXPECT_EQ(test, space->min_pn_seen, 0);
-	KUNIT_EXPECT_EQ(test, space->pn_map_len, QUIC_PN_MAP_INITIAL);
+	KUNIT_EXPECT_EQ(test, space->ranges_len, 0);
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, -1));
-	KUNIT_EXPECT_EQ(test, -ENOMEM, quic_pnspace_mark(space, QUIC_PN_MAP_SIZE + 1));
+	KUNIT_EXPECT_EQ(test, -1, quic_pnspace_check(space, space->base_pn + QUIC_PN_MAX_SPAN));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 0));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 1));
@@ -50,7 +54,8 @@ static void quic_pnspace_test1(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 0, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 3, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, space->ranges_len, 0);
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 4));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 6));
@@ -62,33 +67,38 @@ static void quic_pnspace_test1(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 0, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 24, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 5, quic_pnspace_num_gabs(space, gabs));
-	KUNIT_EXPECT_EQ(test, 6, gabs[0].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 6, gabs[0].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 8, gabs[1].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 9, gabs[1].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 11, gabs[2].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 13, gabs[2].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 15, gabs[3].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 18, gabs[3].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 20, gabs[4].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 24, gabs[4].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 4, gabs[0].start - 1 + quic_pnspace_base_pn(space) -
-				 (quic_pnspace_min_pn_seen(space) + 1));
+	KUNIT_EXPECT_EQ(test, 5, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, QUIC_PN_RANGES_INITIAL, space->ranges_len);
+	KUNIT_EXPECT_EQ(test, 6, space->ranges[0].start);
+	KUNIT_EXPECT_EQ(test, 6, space->ranges[0].end);
+	KUNIT_EXPECT_EQ(test, 9, space->ranges[1].start);
+	KUNIT_EXPECT_EQ(test, 9, space->ranges[1].end);
+	KUNIT_EXPECT_EQ(test, 13, space->ranges[2].start);
+	KUNIT_EXPECT_EQ(test, 13, space->ranges[2].end);
+	KUNIT_EXPECT_EQ(test, 18, space->ranges[3].start);
+	KUNIT_EXPECT_EQ(test, 18, space->ranges[3].end);
+	KUNIT_EXPECT_EQ(test, 24, space->ranges[4].start);
+	KUNIT_EXPECT_EQ(test, 24, space->ranges[4].end);
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 4));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_check(space, 5));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 13));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_check(space, 14));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 7));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 8));
 	KUNIT_EXPECT_EQ(test, 5, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 4, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 4, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, 6, space->ranges[0].start);
+	KUNIT_EXPECT_EQ(test, 9, space->ranges[0].end);
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 5));
 	KUNIT_EXPECT_EQ(test, 10, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 15));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 16));
 	KUNIT_EXPECT_EQ(test, 10, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 4, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 4, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 14));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 17));
@@ -96,74 +106,54 @@ static void quic_pnspace_test1(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 11));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 12));
 	KUNIT_EXPECT_EQ(test, 19, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 128));
 	KUNIT_EXPECT_EQ(test, 19, space->base_pn);
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 128, space->max_pn_seen);
 	KUNIT_EXPECT_EQ(test, 0, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 128 + QUIC_PN_MAP_INITIAL, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_ranges(space));
 
-	/* ! space->max_pn_seen <= space->mid_pn_seen + QUIC_PN_MAP_LIMIT */
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3073));
+	/* well beyond the span of the former 4096-bit map */
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_check(space, 65536));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 65536));
 	KUNIT_EXPECT_EQ(test, 19, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3073, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3073, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3136, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_gabs(space, gabs));
-
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3074));
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3075));
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3090));
+	KUNIT_EXPECT_EQ(test, 65536, space->max_pn_seen);
+	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 128));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_check(space, 129));
+
+	for (i = 1; i <= QUIC_PN_MAX_RANGES - 3; i++)
+		KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, (s64)(65536 + 2 * i)));
 	KUNIT_EXPECT_EQ(test, 19, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 3090, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3073, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3136, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 4, quic_pnspace_num_gabs(space, gabs));
-
-	/* ! space->max_pn_seen <= space->base_pn + QUIC_PN_MAP_LIMIT */
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3190));
-	KUNIT_EXPECT_EQ(test, 3076, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 3190, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3190, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3264, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
-
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3290));
-	KUNIT_EXPECT_EQ(test, 3076, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 3290, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3190, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3264, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_gabs(space, gabs));
-
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3289));
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3288));
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3192));
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 3191));
-	KUNIT_EXPECT_EQ(test, 3076, space->base_pn);
-	KUNIT_EXPECT_EQ(test, 3290, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3190, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 3264, space->pn_map_len);
-	KUNIT_EXPECT_EQ(test, 3, quic_pnspace_num_gabs(space, gabs));
-
-	for (i = 1; i <= 128; i++)
-		KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, (s64)(256 * i)));
-
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, QUIC_PN_MAP_SIZE + 1));
-	KUNIT_EXPECT_EQ(test, -ENOMEM,
-			quic_pnspace_mark(space, space->base_pn + QUIC_PN_MAP_SIZE + 1));
+	KUNIT_EXPECT_EQ(test, QUIC_PN_MAX_RANGES, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, QUIC_PN_MAX_RANGES, space->ranges_len);
+
+	/* full: the lowest range is given up */
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 65536 + 2 * (QUIC_PN_MAX_RANGES - 2)));
+	KUNIT_EXPECT_EQ(test, 25, space->base_pn);
+	KUNIT_EXPECT_EQ(test, 24, space->min_pn_seen);
+	KUNIT_EXPECT_EQ(test, QUIC_PN_MAX_RANGES, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, 128, space->ranges[0].start);
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 24));
+	KUNIT_EXPECT_EQ(test, -1, quic_pnspace_check(space, 20));
+
+	/* full and the lowest one: pn itself is given up */
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 100));
+	KUNIT_EXPECT_EQ(test, 101, space->base_pn);
+	KUNIT_EXPECT_EQ(test, 100, space->min_pn_seen);
+	KUNIT_EXPECT_EQ(test, QUIC_PN_MAX_RANGES, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, -1, quic_pnspace_check(space, 50));
 
 	quic_pnspace_free(space);
-	KUNIT_EXPECT_EQ(test, space->pn_map_len, 0);
+	KUNIT_EXPECT_EQ(test, space->ranges_len, 0);
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_ranges(space));
 }
 
 static void quic_pnspace_test2(struct kunit *test)
 {
 	struct quic_pnspace _space = {}, *space = &_space;
-	struct quic_gap_ack_block gabs[QUIC_PN_MAX_GABS];
 
 	KUNIT_ASSERT_EQ(test, 0, quic_pnspace_init(space));
 	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
@@ -177,13 +167,11 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 0, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 5, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
-	KUNIT_EXPECT_EQ(test, 2, gabs[0].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 2, gabs[0].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 5, gabs[1].start + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 5, gabs[1].end + space->base_pn);
-	KUNIT_EXPECT_EQ(test, 0, gabs[0].start - 1 + quic_pnspace_base_pn(space) -
-				 (quic_pnspace_min_pn_seen(space) + 1));
+	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_ranges(space));
+	KUNIT_EXPECT_EQ(test, 2, space->ranges[0].start);
+	KUNIT_EXPECT_EQ(test, 3, space->ranges[0].end);
+	KUNIT_EXPECT_EQ(test, 5, space->ranges[1].start);
+	KUNIT_EXPECT_EQ(test, 5, space->ranges[1].end);
 
 	msleep(50);
 	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
@@ -196,21 +184,21 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 6, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 6, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 8));
 	KUNIT_EXPECT_EQ(test, 7, space->base_pn);
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 6, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 8, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 7));
 	KUNIT_EXPECT_EQ(test, 9, space->base_pn);
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 6, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 8, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 11));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 10));
@@ -218,7 +206,7 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 0, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 6, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 11, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_ranges(space));
 
 	msleep(50);
 	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
@@ -227,14 +215,14 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 6, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 9));
 	KUNIT_EXPECT_EQ(test, 12, space->base_pn);
 	KUNIT_EXPECT_EQ(test, 6, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_ranges(space));
 
 	msleep(50);
 	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
@@ -243,14 +231,14 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 6, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->max_pn_seen);
-	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 19));
 	KUNIT_EXPECT_EQ(test, 20, space->base_pn);
 	KUNIT_EXPECT_EQ(test, 19, space->max_pn_seen);
 	KUNIT_EXPECT_EQ(test, 19, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->min_pn_seen);
-	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 25));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_mark(space, 26));
@@ -259,7 +247,7 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 29, space->max_pn_seen);
 	KUNIT_EXPECT_EQ(test, 19, space->mid_pn_seen);
 	KUNIT_EXPECT_EQ(test, 18, space->min_pn_seen);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_ranges(space));
 
 	msleep(50);
 	quic_pnspace_set_time(space, jiffies_to_usecs(jiffies));
@@ -268,15 +256,15 @@ static void quic_pnspace_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, 30, space->max_pn_seen);
 	KUNIT_EXPECT_EQ(test, 19, space->min_pn_seen);
 	KUNIT_EXPECT_EQ(test, 30, space->mid_pn_seen);
-	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_gabs(space, gabs));
+	KUNIT_EXPECT_EQ(test, 2, quic_pnspace_num_ranges(space));
 
 	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 29));
 	KUNIT_EXPECT_EQ(test, 1, quic_pnspace_check(space, 19));
 	KUNIT_EXPECT_EQ(test, 0, quic_pnspace_check(space, 35));
-	KUNIT_EXPECT_EQ(test, -1, quic_pnspace_check(space, space->base_pn + QUIC_PN_MAP_SIZE));
+	KUNIT_EXPECT_EQ(test, -1, quic_pnspace_check(space, space->base_pn + QUIC_PN_MAX_SPAN));
 
 	quic_pnspace_free(space);
-	KUNIT_EXPECT_EQ(test, space->pn_map_len, 0);
+	KUNIT_EXPECT_EQ(test, space->ranges_len, 0);
 }
 
 static u8 secret[48] = {
@@ -361,10 +349,11 @@ static void quic_crypto_test1(struct kunit *test)
 {
 	struct quic_conn_id conn_id, tmpid = {};
 	struct quic_crypto_secret srt = {};
+	struct quic_token_keys keys = {};
 	struct sockaddr_in addr = {};
 	struct sk_buff *skb;
 	int ret, tokenlen;
-	u8 token[72];
+	u8 token[QUIC_TOKEN_MAX_LEN], nonce[QUIC_IV_LEN];
 
 	srt.send = 1;
 	memcpy(srt.secret, secret, 48);
@@ -386,8 +375,22 @@ static void quic_crypto_test1(struct kunit *test)
 	ret = quic_crypto_set_secret(&crypto, &srt, QUIC_VERSION_V1, 0);
 	KUNIT_EXPECT_EQ(test, ret, 0);
 
+	ret = quic_crypto_key_prepare(&crypto);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	KUNIT_EXPECT_TRUE(test, crypto.key_next_ready);
+
+	ret = quic_crypto_key_update(&crypto);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	KUNIT_EXPECT_TRUE(test, crypto.key_phase);
+	KUNIT_EXPECT_FALSE(test, crypto.key_next_ready);
+
+	ret = quic_crypto_key_update(&crypto);
+	KUNIT_EXPECT_EQ(test, ret, -EINVAL);
+
+	crypto.key_pending = 0; /* retired with the next keys not prepared yet */
 	ret = quic_crypto_key_update(&crypto);
 	KUNIT_EXPECT_EQ(test, ret, 0);
+	KUNIT_EXPECT_FALSE(test, crypto.key_phase);
 
 	quic_conn_id_generate(&conn_id);
 	quic_crypto_destroy(&crypto);
@@ -406,24 +409,42 @@ static void quic_crypto_test1(struct kunit *test)
 						      conn_id.len, token, 16);
 	KUNIT_EXPECT_EQ(test, ret, 0);
 
+	ret = quic_crypto_token_keys_init(&keys);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	if (ret)
+		goto out;
+
 	addr.sin_port = htons(1234);
-	token[0] = 1;
-	ret = quic_crypto_generate_token(&crypto, &addr, sizeof(addr),
+	token[0] = QUIC_TOKEN_FLAG_RETRY;
+	ret = quic_crypto_generate_token(&keys, &addr, sizeof(addr),
 					 &conn_id, token, &tokenlen);
 	KUNIT_EXPECT_EQ(test, ret, 0);
-	KUNIT_EXPECT_EQ(test, tokenlen, 1 + sizeof(addr) + 4 + conn_id.len + QUIC_TAG_LEN);
+	KUNIT_EXPECT_EQ(test, tokenlen,
+			1 + QUIC_IV_LEN + sizeof(addr) + 4 + conn_id.len + QUIC_TAG_LEN);
 
-	ret = quic_crypto_verify_token(&crypto, &addr, sizeof(addr), &tmpid, token, tokenlen);
+	ret = quic_crypto_verify_token(&keys, &addr, sizeof(addr), &tmpid, token, tokenlen);
 	KUNIT_EXPECT_EQ(test, ret, 0);
 	KUNIT_EXPECT_EQ(test, tmpid.len, conn_id.len);
 	KUNIT_EXPECT_EQ(test, memcmp(tmpid.data, conn_id.data, tmpid.len), 0);
 
+	memcpy(nonce, token + 1, QUIC_IV_LEN);
+	token[0] = QUIC_TOKEN_FLAG_RETRY;
+	ret = quic_crypto_generate_token(&keys, &addr, sizeof(addr),
+					 &conn_id, token, &tokenlen);
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	KUNIT_EXPECT_NE(test, memcmp(nonce, token + 1, QUIC_IV_LEN), 0);
+
+	token[0] ^= QUIC_TOKEN_FLAG_PHASE;
+	ret = quic_crypto_verify_token(&keys, &addr, sizeof(addr), &tmpid, token, tokenlen);
+	KUNIT_EXPECT_NE(test, ret, 0);
+	quic_crypto_token_keys_free(&keys);
+
 	skb = alloc_skb(296, GFP_ATOMIC);
 	if (!skb)
 		goto out;
 	skb_put_data(skb, data, 280);
 
-	ret = quic_crypto_get_retry_tag(&crypto, skb, &conn_id, QUIC_VERSION_V1, token);
+	ret = quic_crypto_get_retry_tag(skb, &conn_id, QUIC_VERSION_V1, token);
 	KUNIT_EXPECT_EQ(test, ret, 0);
 	kfree_skb(skb);
 out:
@@ -432,11 +453,11 @@ out:
 
 static void quic_crypto_test2(struct kunit *test)
 {
+	struct sk_buff *skb, *batch[2] = {}, *head = NULL;
 	struct quic_crypto_secret srt = {};
 	struct quic_crypto_cb *cb;
 	struct socket *sock;
-	struct sk_buff *skb;
-	int err;
+	int err, i;
 
 	err = __sock_create(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_QUIC, &sock, 1);
 	if (err)
@@ -470,6 +491,35 @@ static void quic_crypto_test2(struct kunit *test)
 	}
 
 	KUNIT_EXPECT_EQ(test, memcmp(encrypted_data, skb->data, skb->len), 0);
+
+	/* the same packet twice, chained as in a GSO bundle, with the header protection
+	 * left to quic_crypto_header_encrypt_batch()
+	 */
+	for (i = 0; i < 2; i++) {
+		batch[i] = alloc_skb(296, GFP_ATOMIC);
+		if (!batch[i])
+			goto out;
+		WARN_ON(!skb_set_owner_sk_safe(batch[i], sock->sk));
+		skb_reset_transport_header(batch[i]);
+		skb_put_data(batch[i], data, 280);
+		cb = QUIC_CRYPTO_CB(batch[i]);
+		cb->number_len = 4;
+		cb->number_offset = 17;
+		cb->crypto_done = quic_encrypt_done;
+		cb->hp_batch = 1;
+		err = quic_crypto_encrypt(&crypto, batch[i]);
+		if (err) {
+			if (err != -EINPROGRESS)
+				goto out;
+			msleep(50);
+		}
+	}
+	head = batch[0];
+	skb_shinfo(head)->frag_list = batch[1];
+	err = quic_crypto_header_encrypt_batch(&crypto, head);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	for (i = 0; i < 2; i++)
+		KUNIT_EXPECT_EQ(test, memcmp(encrypted_data, batch[i]->data, batch[i]->len), 0);
 	quic_crypto_destroy(&crypto);
 
 	srt.send = 0;
@@ -496,11 +546,107 @@ static void quic_crypto_test2(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, memcmp(data, skb->data, 280), 0);
 
 out:
+	if (head)
+		kfree_skb(head);
+	else
+		for (i = 0; i < 2; i++)
+			kfree_skb(batch[i]);
 	kfree_skb(skb);
 	quic_crypto_destroy(&crypto);
 	sock_release(sock);
 }
 
+static int quic_offload_adds, quic_offload_dels;
+
+static int quic_offload_add(struct net_device *dev, struct sock *sk, struct quic_crypto *crypto,
+			    struct quic_crypto_offload_keys *keys, u8 send)
+{
+	quic_offload_adds++;
+	return 0;
+}
+
+static int quic_offload_update(struct net_device *dev, struct quic_crypto *crypto,
+			       struct quic_crypto_offload_keys *keys, u8 send)
+{
+	return 0;
+}
+
+static void quic_offload_del(struct net_device *dev, struct quic_crypto *crypto, u8 send)
+{
+	quic_offload_dels++;
+}
+
+static const struct quic_crypto_offload_ops quic_offload_ops = {
+	.add = quic_offload_add,
+	.update = quic_offload_update,
+	.del = quic_offload_del,
+};
+
+/* offload to the loopback device, which the route to 127.0.0.1 goes via */
+static void quic_crypto_test3(struct kunit *test)
+{
+	struct flowi4 fl4 = { .daddr = htonl(INADDR_LOOPBACK) };
+	struct quic_crypto_secret srt = {};
+	struct quic_crypto *c;
+	struct net_device *dev;
+	struct socket *sock;
+	struct rtable *rt;
+	int err;
+
+	c = kunit_kzalloc(test, sizeof(*c), GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, !!c);
+	err = __sock_create(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_QUIC, &sock, 1);
+	KUNIT_ASSERT_EQ(test, err, 0);
+	rt = ip_route_output_key(&init_net, &fl4);
+	if (IS_ERR(rt)) {
+		sock_release(sock);
+		kunit_skip(test, "no route to loopback");
+	}
+	dev = rt->dst.dev;
+	lock_sock(sock->sk);
+	sk_dst_set(sock->sk, &rt->dst);
+
+	srt.send = 1;
+	srt.type = TLS_CIPHER_AES_GCM_128;
+	memcpy(srt.secret, secret, 48);
+	err = quic_crypto_set_secret(c, &srt, QUIC_VERSION_V1, 0);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	err = quic_crypto_offload_register(dev, &quic_offload_ops);
+	if (err) {
+		release_sock(sock->sk);
+		quic_crypto_destroy(c);
+		sock_release(sock);
+		kunit_skip(test, "no offload support");
+	}
+
+	/* unregister takes the device from the crypto, and destroy calls no ops after it */
+	quic_offload_adds = 0;
+	quic_offload_dels = 0;
+	quic_crypto_offload_add(c, sock->sk, 1);
+	KUNIT_EXPECT_EQ(test, quic_offload_adds, 1);
+	KUNIT_EXPECT_EQ(test, c->tx_offload, 1);
+	KUNIT_EXPECT_PTR_EQ(test, c->offload_dev, dev);
+	quic_crypto_offload_unregister(dev);
+	KUNIT_EXPECT_PTR_EQ(test, c->offload_dev, (struct net_device *)NULL);
+	quic_crypto_destroy(c);
+	KUNIT_EXPECT_EQ(test, quic_offload_dels, 0);
+
+	/* destroy before unregister releases the driver state */
+	err = quic_crypto_set_secret(c, &srt, QUIC_VERSION_V1, 0);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	err = quic_crypto_offload_register(dev, &quic_offload_ops);
+	KUNIT_EXPECT_EQ(test, err, 0);
+	quic_crypto_offload_add(c, sock->sk, 1);
+	KUNIT_EXPECT_EQ(test, quic_offload_adds, 2);
+	quic_crypto_destroy(c);
+	KUNIT_EXPECT_EQ(test, quic_offload_dels, 1);
+	KUNIT_EXPECT_PTR_EQ(test, c->offload_dev, (struct net_device *)NULL);
+	quic_crypto_offload_unregister(dev);
+
+	release_sock(sock->sk);
+	sock_release(sock);
+}
+
 static void quic_cong_test1(struct kunit *test)
 {
 	struct quic_cong cong = {};
@@ -1021,16 +1167,16 @@ static void quic_cong_test3(struct kunit *test)
 	number = 100;
 	quic_cong_on_packet_sent(&cong, time, bytes, number);
 	/*
-	 * cubic->window_end = 100;
-	 * cubic->last_round_min_rtt = U32_MAX;
-	 * cubic->rtt_sample_count = 0;
+	 * hystart->window_end = 100;
+	 * hystart->last_round_min_rtt = U32_MAX;
+	 * hystart->rtt_sample_count = 0;
 	 */
 	quic_cong_rtt_update(&cong, time, 0);
 	/*
-	 * cubic->current_round_min_rtt = 300000
-	 * cubic->css_baseline_min_rtt = U32_MAX;
-	 * cubic->css_rounds = 0;
-	 * cubic->rtt_sample_count = 1;
+	 * hystart->current_round_min_rtt = 300000
+	 * hystart->css_baseline_min_rtt = U32_MAX;
+	 * hystart->css_rounds = 0;
+	 * hystart->rtt_sample_count = 1;
 	 */
 	time = quic_cong_time(&cong) - 300000;
 	bytes = 14000;
@@ -1045,16 +1191,16 @@ static void quic_cong_test3(struct kunit *test)
 	number = 110;
 	quic_cong_on_packet_sent(&cong, time, bytes, number);
 	/*
-	 * cubic->window_end = 110;
-	 * cubic->last_round_min_rtt = cubic->current_round_min_rtt;
-	 * cubic->rtt_sample_count = 0;
+	 * hystart->window_end = 110;
+	 * hystart->last_round_min_rtt = hystart->current_round_min_rtt;
+	 * hystart->rtt_sample_count = 0;
 	 */
 	quic_cong_rtt_update(&cong, time, 0);
 	/*
-	 * cubic->current_round_min_rtt = 500000
-	 * cubic->css_baseline_min_rtt = U32_MAX;
-	 * cubic->css_rounds = 0;
-	 * cubic->rtt_sample_count = 1;
+	 * hystart->current_round_min_rtt = 500000
+	 * hystart->css_baseline_min_rtt = U32_MAX;
+	 * hystart->css_rounds = 0;
+	 * hystart->rtt_sample_count = 1;
 	 */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 14000;
@@ -1071,42 +1217,42 @@ static void quic_cong_test3(struct kunit *test)
 	quic_cong_rtt_update(&cong, time, 0);
 	quic_cong_rtt_update(&cong, time, 0);
 	quic_cong_rtt_update(&cong, time, 0);
-	/* cubic->rtt_sample_count = 8, and enter CSS */
+	/* hystart->rtt_sample_count = 8, and enter CSS */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
 	number = 102;
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
 	KUNIT_EXPECT_EQ(test, cong.window, 46800);
-	/* cubic->css_baseline_min_rtt = 500000 */
+	/* hystart->css_baseline_min_rtt = 500000 */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
 	number = 103;
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
 	KUNIT_EXPECT_EQ(test, cong.window, 48000);
-	/* cubic->rtt_sample_count = 1 */
+	/* hystart->rtt_sample_count = 1 */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
 	number = 104;
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
 	KUNIT_EXPECT_EQ(test, cong.window, 49200);
-	/* cubic->rtt_sample_count = 2 */
+	/* hystart->rtt_sample_count = 2 */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
 	number = 104;
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
 	KUNIT_EXPECT_EQ(test, cong.window, 50400);
-	/* cubic->rtt_sample_count = 3 */
+	/* hystart->rtt_sample_count = 3 */
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
 	number = 105;
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
 	KUNIT_EXPECT_EQ(test, cong.window, 51600);
-	/* cubic->rtt_sample_count = 4 */
+	/* hystart->rtt_sample_count = 4 */
 
 	 /* slow_start -> cong_avoid: go to cong_void after SACK if cwnd > ssthresh */
 	time = quic_cong_time(&cong) - 500000;
@@ -1115,7 +1261,7 @@ static void quic_cong_test3(struct kunit *test)
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_CONGESTION_AVOIDANCE);
 	KUNIT_EXPECT_EQ(test, cong.window, 52800);
-	/* cubic->rtt_sample_count = 5 */
+	/* hystart->rtt_sample_count = 5 */
 
 	time = quic_cong_time(&cong) - 500000;
 	bytes = 4800;
@@ -1123,7 +1269,7 @@ static void quic_cong_test3(struct kunit *test)
 	quic_cong_on_packet_acked(&cong, time, bytes, number);
 	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_CONGESTION_AVOIDANCE);
 	KUNIT_EXPECT_EQ(test, cong.window, 52803);
-	/* cubic->rtt_sample_count = 6 */
+	/* hystart->rtt_sample_count = 6 */
 
 	/* cong_avoid -> recovery: go back to recovery after ECN */
 	quic_cong_on_process_ecn(&cong);
@@ -1131,14 +1277,238 @@ static void quic_cong_test3(struct kunit *test)
 	KUNIT_EXPECT_EQ(test, cong.window, 36962);
 }
 
+static void quic_cong_test4(struct kunit *test)
+{
+	struct quic_cong_rate_state st[10];
+	struct quic_cong cong = {};
+	u32 time, sent_time;
+	int i;
+
+	quic_cong_set_max_ack_delay(&cong, 25000);
+	quic_cong_set_max_window(&cong, 106496);
+	quic_cong_set_mss(&cong, 1400);
+
+	quic_cong_set_algo(&cong, QUIC_CONG_ALG_BBR);
+	quic_cong_set_srtt(&cong, QUIC_RTT_INIT);
+	cong.is_rtt_set = 1;
+
+	KUNIT_EXPECT_EQ(test, cong.window, 14000);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
+
+	time = jiffies_to_usecs(jiffies);
+	sent_time = time - 100000;
+	quic_cong_set_time(&cong, time);
+
+	/* 10 packets sent at once and acked by one ACK 100ms later */
+	for (i = 0; i < 10; i++)
+		quic_cong_rate_on_sent(&cong, &st[i], sent_time, i * 1400);
+	quic_cong_rtt_update(&cong, sent_time, 0);
+	for (i = 9; i >= 0; i--)
+		quic_cong_rate_on_acked(&cong, &st[i], sent_time, 1400);
+	KUNIT_EXPECT_EQ(test, cong.delivered, 14000);
+
+	quic_cong_on_ack_recv(&cong, 14000, 0, U32_MAX);
+	/* delivery rate: 14000 bytes over 100ms */
+	KUNIT_EXPECT_EQ(test, cong.rs.rate, 140000);
+	KUNIT_EXPECT_EQ(test, cong.rs.interval, 100000);
+	/* pacing_rate: rate * startup gain * 99% */
+	KUNIT_EXPECT_EQ(test, cong.pacing_rate, 383856);
+	/* startup: cwnd grows by bytes acked up to 2 * bdp + 3 * mss */
+	KUNIT_EXPECT_EQ(test, cong.window, 28000);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
+
+	/* nothing left to send with cwnd open: the next samples are app-limited */
+	quic_cong_rate_check_app_limited(&cong, 0);
+	KUNIT_EXPECT_EQ(test, cong.app_limited, 14000);
+	quic_cong_rate_on_sent(&cong, &st[0], time, 0);
+	KUNIT_EXPECT_EQ(test, st[0].app_limited, 1);
+	KUNIT_EXPECT_EQ(test, st[0].delivered, 14000);
+}
+
+static void quic_cong_test5(struct kunit *test)
+{
+	struct quic_cong cong = {};
+	u32 time;
+	int i;
+
+	quic_cong_set_max_ack_delay(&cong, 25000);
+	quic_cong_set_max_window(&cong, 106496);
+	quic_cong_set_mss(&cong, 1400);
+
+	quic_cong_set_algo(&cong, QUIC_CONG_ALG_RENO);
+	quic_cong_set_srtt(&cong, QUIC_RTT_INIT);
+	cong.is_rtt_set = 1;
+
+	time = jiffies_to_usecs(jiffies);
+	quic_cong_set_time(&cong, time);
+
+	/* round 1: rtt 100ms */
+	quic_cong_on_packet_sent(&cong, time, 1400, 10);
+	for (i = 0; i < 8; i++)
+		quic_cong_rtt_update(&cong, time - 100000, 0);
+	quic_cong_on_packet_acked(&cong, time, 14000, 10);
+	KUNIT_EXPECT_EQ(test, cong.window, 28000);
+
+	/* round 2: rtt 120ms, over last_round_min_rtt + eta (12.5ms), enter CSS */
+	quic_cong_on_packet_sent(&cong, time, 1400, 20);
+	for (i = 0; i < 8; i++)
+		quic_cong_rtt_update(&cong, time - 120000, 0);
+	quic_cong_on_packet_acked(&cong, time, 14000, 11);
+	KUNIT_EXPECT_EQ(test, cong.window, 42000);
+	KUNIT_EXPECT_EQ(test, cong.hystart.css_baseline_min_rtt, 120000);
+
+	/* CSS: cwnd grows by a quarter of bytes acked */
+	quic_cong_on_packet_acked(&cong, time, 4000, 12);
+	KUNIT_EXPECT_EQ(test, cong.window, 43000);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
+
+	/* CSS -> cong_avoid after 5 rounds */
+	quic_cong_on_packet_acked(&cong, time, 4000, 20);
+	for (i = 1; i < 4; i++) {
+		quic_cong_on_packet_sent(&cong, time, 1400, 20 + i * 10);
+		quic_cong_on_packet_acked(&cong, time, 4000, 20 + i * 10);
+	}
+	KUNIT_EXPECT_EQ(test, cong.window, 47000);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
+	KUNIT_EXPECT_EQ(test, cong.hystart.css_rounds, 4);
+
+	quic_cong_on_packet_sent(&cong, time, 1400, 60);
+	quic_cong_on_packet_acked(&cong, time, 4000, 60);
+	KUNIT_EXPECT_EQ(test, cong.window, 48000);
+	KUNIT_EXPECT_EQ(test, cong.ssthresh, 48000);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_CONGESTION_AVOIDANCE);
+
+	/* disabled: plain slow start to the first loss */
+	quic_cong_set_hystart(&cong, 0);
+	quic_cong_set_algo(&cong, QUIC_CONG_ALG_RENO);
+	quic_cong_on_packet_sent(&cong, time, 1400, 70);
+	for (i = 0; i < 8; i++)
+		quic_cong_rtt_update(&cong, time - 200000, 0);
+	quic_cong_on_packet_acked(&cong, time, 14000, 70);
+	KUNIT_EXPECT_EQ(test, cong.window, 62000);
+	KUNIT_EXPECT_EQ(test, cong.hystart.css_baseline_min_rtt, U32_MAX);
+	KUNIT_EXPECT_EQ(test, cong.state, QUIC_CONG_SLOW_START);
+}
+
+#define QUIC_TEST_GRO_SEGS	3
+#define QUIC_TEST_GRO_SIZE	1200
+
+/* a UDP GRO skb as udp_gro_complete() leaves it for an encap sock with UDP_GRO set, with
+ * skb->data at the UDP header as encap_rcv is called
+ */
+static void quic_path_test1(struct kunit *test)
+{
+	u32 len = sizeof(struct udphdr) + QUIC_TEST_GRO_SEGS * QUIC_TEST_GRO_SIZE;
+	struct sk_buff *skb, *segs;
+	struct socket *sock;
+	struct udphdr *uh;
+	struct iphdr *iph;
+	int err, n = 0;
+
+	err = sock_create_kern(&init_net, PF_INET, SOCK_DGRAM, IPPROTO_UDP, &sock);
+	KUNIT_ASSERT_EQ(test, err, 0);
+
+	skb = alloc_skb(NET_SKB_PAD + ETH_HLEN + sizeof(*iph) + len, GFP_KERNEL);
+	if (!skb) {
+		sock_release(sock);
+		KUNIT_FAIL(test, "no memory");
+		return;
+	}
+	skb_reserve(skb, NET_SKB_PAD);
+	skb_reset_mac_header(skb);
+	((struct ethhdr *)skb_put_zero(skb, ETH_HLEN))->h_proto = htons(ETH_P_IP);
+	skb->mac_len = ETH_HLEN;
+	skb->protocol = htons(ETH_P_IP);
+
+	skb_set_network_header(skb, skb->len);
+	iph = skb_put_zero(skb, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htons(sizeof(*iph) + len);
+	iph->saddr = htonl(INADDR_LOOPBACK);
+	iph->daddr = htonl(INADDR_LOOPBACK);
+	iph->check = ip_fast_csum((u8 *)iph, iph->ihl);
+
+	skb_set_transport_header(skb, skb->len);
+	uh = skb_put_zero(skb, len);
+	uh->source = htons(1234);
+	uh->dest = htons(4321);
+	uh->len = htons(len);
+	__skb_pull(skb, skb_transport_offset(skb));
+
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct udphdr, check);
+	skb_shinfo(skb)->gso_size = QUIC_TEST_GRO_SIZE;
+	skb_shinfo(skb)->gso_segs = QUIC_TEST_GRO_SEGS;
+	skb_shinfo(skb)->gso_type = SKB_GSO_UDP_L4;
+
+	segs = quic_udp_rcv_segment(sock->sk, skb);
+	for (skb = segs; skb; skb = skb->next) {
+		KUNIT_EXPECT_EQ(test, skb->len, sizeof(struct udphdr) + QUIC_TEST_GRO_SIZE);
+		KUNIT_EXPECT_EQ(test, skb_transport_offset(skb), sizeof(struct udphdr));
+		n++;
+	}
+	KUNIT_EXPECT_EQ(test, n, QUIC_TEST_GRO_SEGS);
+	kfree_skb_list(segs);
+	sock_release(sock);
+}
+
+static u8 quic_test_sched_select(struct quic_path_group *paths, u8 level, u8 path)
+{
+	return level == QUIC_CRYPTO_APP ? 2 : path;
+}
+
+static struct quic_path_sched_ops quic_test_sched = {
+	.select = quic_test_sched_select,
+	.name = "test",
+	.owner = THIS_MODULE,
+};
+
+static void quic_path_test2(struct kunit *test)
+{
+	struct quic_path_group *paths;
+	struct quic_udp_sock *us;
+
+	paths = kunit_kzalloc(test, sizeof(*paths), GFP_KERNEL);
+	us = kunit_kzalloc(test, sizeof(*us), GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, paths && us);
+	paths->path[0].udp_sk = us;
+	paths->path[1].udp_sk = us;
+
+	KUNIT_EXPECT_EQ(test, quic_path_set_sched(paths, "test"), -ENOENT);
+	KUNIT_EXPECT_EQ(test, quic_path_sched_select(paths, QUIC_CRYPTO_APP, 1), 1);
+
+	KUNIT_ASSERT_EQ(test, quic_path_sched_register(&quic_test_sched), 0);
+	KUNIT_EXPECT_EQ(test, quic_path_sched_register(&quic_test_sched), -EEXIST);
+	KUNIT_EXPECT_EQ(test, quic_path_set_sched(paths, "test"), 0);
+
+	/* path 2 is not set up, so the active path is used */
+	KUNIT_EXPECT_EQ(test, quic_path_sched_select(paths, QUIC_CRYPTO_APP, 0), 0);
+	paths->path[2].udp_sk = us;
+	KUNIT_EXPECT_EQ(test, quic_path_sched_select(paths, QUIC_CRYPTO_APP, 0), 2);
+	KUNIT_EXPECT_EQ(test, quic_path_sched_select(paths, QUIC_CRYPTO_HANDSHAKE, 1), 1);
+
+	quic_path_sched_release(paths);
+	KUNIT_EXPECT_TRUE(test, !paths->sched);
+	quic_path_sched_unregister(&quic_test_sched);
+}
+
 static struct kunit_case quic_test_cases[] = {
 	KUNIT_CASE(quic_pnspace_test1),
 	KUNIT_CASE(quic_pnspace_test2),
 	KUNIT_CASE(quic_crypto_test1),
 	KUNIT_CASE(quic_crypto_test2),
+	KUNIT_CASE(quic_crypto_test3),
 	KUNIT_CASE(quic_cong_test1),
 	KUNIT_CASE(quic_cong_test2),
 	KUNIT_CASE(quic_cong_test3),
+	KUNIT_CASE(quic_cong_test4),
+	KUNIT_CASE(quic_cong_test5),
+	KUNIT_CASE(quic_path_test1),
+	KUNIT_CASE(quic_path_test2),
 	{}
 };
 
@@ -12,6 +12,23 @@
 
 #include "socket.h"
 
+/* Timers are reset on most packets sent or received, usually to a later time than they are
+ * set to. In that case only quic_timer->expires is moved, and the timer when it fires
+ * re-arms itself for it, so that timer_list is modified at most once per timeout instead
+ * of once per packet. An earlier deadline still modifies the timer right away.
+ */
+static bool quic_timer_rearm(struct sock *sk, struct timer_list *t)
+{
+	struct quic_timer *qt = container_of(t, struct quic_timer, t);
+	unsigned long expires = READ_ONCE(qt->expires);
+
+	if (!time_before(jiffies, expires))
+		return false;
+	if (mod_timer(t, expires)) /* re-armed by quic_timer_reset() with its own hold */
+		sock_put(sk);
+	return true;
+}
+
 void quic_timer_sack_handler(struct sock *sk)
 {
 	struct quic_pnspace *space = quic_pnspace(sk, QUIC_CRYPTO_APP);
@@ -46,6 +63,9 @@ static void quic_timer_sack_timeout(struct timer_list *t)
 	struct quic_sock *qs = from_timer(qs, t, timers[QUIC_TIMER_SACK].t);
 	struct sock *sk = &qs->inet.sk;
 
+	if (quic_timer_rearm(sk, t))
+		return;
+
 	bh_lock_sock(sk);
 	if (sock_owned_by_user(sk)) {
 		if (!test_and_set_bit(QUIC_SACK_DEFERRED, &sk->sk_tsq_flags))
@@ -72,6 +92,9 @@ static void quic_timer_loss_timeout(struct timer_list *t)
 	struct quic_sock *qs = from_timer(qs, t, timers[QUIC_TIMER_LOSS].t);
 	struct sock *sk = &qs->inet.sk;
 
+	if (quic_timer_rearm(sk, t))
+		return;
+
 	bh_lock_sock(sk);
 	if (sock_owned_by_user(sk)) {
 		if (!test_and_set_bit(QUIC_LOSS_DEFERRED, &sk->sk_tsq_flags))
@@ -113,6 +136,9 @@ static void quic_timer_path_timeout(struct timer_list *t)
 	struct quic_sock *qs = from_timer(qs, t, timers[QUIC_TIMER_PATH].t);
 	struct sock *sk = &qs->inet.sk;
 
+	if (quic_timer_rearm(sk, t))
+		return;
+
 	bh_lock_sock(sk);
 	if (sock_owned_by_user(sk)) {
 		if (!test_and_set_bit(QUIC_PATH_DEFERRED, &sk->sk_tsq_flags))
@@ -149,6 +175,9 @@ static void quic_timer_pmtu_timeout(struct timer_list *t)
 	struct quic_sock *qs = from_timer(qs, t, timers[QUIC_TIMER_PMTU].t);
 	struct sock *sk = &qs->inet.sk;
 
+	if (quic_timer_rearm(sk, t))
+		return;
+
 	bh_lock_sock(sk);
 	if (sock_owned_by_user(sk)) {
 		if (!test_and_set_bit(QUIC_PMTU_DEFERRED, &sk->sk_tsq_flags))
@@ -172,7 +201,7 @@ void quic_timer_pace_handler(struct sock *sk)
 
 static enum hrtimer_restart quic_timer_pace_timeout(struct hrtimer *hr)
 {
-	struct quic_sock *qs = container_of(hr, struct quic_sock, timers[QUIC_TIMER_PACE].hr);
+	struct quic_sock *qs = container_of(hr, struct quic_sock, pace_timer);
 	struct sock *sk = &qs->inet.sk;
 
 	bh_lock_sock(sk);
@@ -191,15 +220,25 @@ out:
 
 void quic_timer_reset(struct sock *sk, u8 type, u64 timeout)
 {
-	struct timer_list *t = quic_timer(sk, type);
+	struct quic_timer *qt = &quic_sk(sk)->timers[type];
+	struct timer_list *t = &qt->t;
+	unsigned long expires;
 
-	if (timeout && !mod_timer(t, jiffies + usecs_to_jiffies(timeout)))
+	if (!timeout)
+		return;
+
+	expires = jiffies + usecs_to_jiffies(timeout);
+	WRITE_ONCE(qt->expires, expires);
+	if (timer_pending(t) && !time_before(expires, t->expires))
+		return;
+	if (!mod_timer(t, expires))
 		sock_hold(sk);
 }
 
 void quic_timer_start(struct sock *sk, u8 type, u64 timeout)
 {
-	struct timer_list *t;
+	struct quic_timer *qt;
+	unsigned long expires;
 	struct hrtimer *hr;
 
 	if (type == QUIC_TIMER_PACE) {
@@ -212,18 +251,24 @@ void quic_timer_start(struct sock *sk, u8 type, u64 timeout)
 		return;
 	}
 
-	t = quic_timer(sk, type);
-	if (timeout && !timer_pending(t)) {
-		if (!mod_timer(t, jiffies + usecs_to_jiffies(timeout)))
+	qt = &quic_sk(sk)->timers[type];
+	if (timeout && !timer_pending(&qt->t)) {
+		expires = jiffies + usecs_to_jiffies(timeout);
+		WRITE_ONCE(qt->expires, expires);
+		if (!mod_timer(&qt->t, expires))
 			sock_hold(sk);
 	}
 }
 
 void quic_timer_stop(struct sock *sk, u8 type)
 {
+	struct quic_timer *qt;
+
 	if (type == QUIC_TIMER_PACE)
 		return;
-	if (del_timer(quic_timer(sk, type)))
+	qt = &quic_sk(sk)->timers[type];
+	WRITE_ONCE(qt->expires, jiffies); /* no re-arming if it is firing now */
+	if (del_timer(&qt->t))
 		sock_put(sk);
 }
 
@@ -18,11 +18,10 @@ enum {
 	QUIC_TIMER_IDLE = QUIC_TIMER_SACK,
 };
 
+/* QUIC_TIMER_PACE is an hrtimer, and the others are timer_lists */
 struct quic_timer {
-	union {
-		struct timer_list t;
-		struct hrtimer hr;
-	};
+	struct timer_list t;
+	unsigned long expires;	/* the deadline, which t.expires may be earlier than */
 };
 
 #define QUIC_MIN_PROBE_TIMEOUT	5000000
@@ -0,0 +1,216 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* QUIC kernel implementation
+ * (C) Copyright Red Hat Corp. 2023
+ *
+ * This file is part of the QUIC kernel implementation
+ *
+ * Tracepoints on the packet, loss and congestion paths, with the fields that
+ * tests/qlog needs to convert a trace into qlog.
+ *
+ * Written or modified by:
+ *    Xin Long <lucien.xin@gmail.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM quic
+
+#if !defined(_QUIC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _QUIC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* the active source connection ID identifies the connection in all events */
+#define quic_trace_assign_cid(sk)							\
+	do {										\
+		struct quic_conn_id *__id = quic_conn_id_active(quic_source(sk));	\
+											\
+		__entry->cid_len = __id ? __id->len : 0;				\
+		if (__id)								\
+			memcpy(__entry->cid, __id->data, __id->len);			\
+	} while (0)
+
+DECLARE_EVENT_CLASS(quic_packet_class,
+
+	TP_PROTO(struct sock *sk, u8 level, s64 number, u32 len),
+
+	TP_ARGS(sk, level, number, len),
+
+	TP_STRUCT__entry(
+		__array(u8, cid, QUIC_CONN_ID_MAX_LEN)
+		__field(u8, cid_len)
+		__field(u8, level)
+		__field(s64, number)
+		__field(u32, len)
+		__field(u32, window)
+		__field(u32, inflight)
+		__field(u32, smoothed_rtt)
+	),
+
+	TP_fast_assign(
+		quic_trace_assign_cid(sk);
+		__entry->level = level;
+		__entry->number = number;
+		__entry->len = len;
+		__entry->window = quic_cong_window(quic_cong(sk));
+		__entry->inflight = quic_outq_inflight(quic_outq(sk));
+		__entry->smoothed_rtt = quic_cong_smoothed_rtt(quic_cong(sk));
+	),
+
+	TP_printk("cid=%s level=%u number=%lld len=%u window=%u inflight=%u srtt=%u",
+		  __print_hex_str(__entry->cid, __entry->cid_len), __entry->level,
+		  __entry->number, __entry->len, __entry->window, __entry->inflight,
+		  __entry->smoothed_rtt)
+);
+
+DEFINE_EVENT(quic_packet_class, quic_packet_rcv,
+	TP_PROTO(struct sock *sk, u8 level, s64 number, u32 len),
+	TP_ARGS(sk, level, number, len)
+);
+
+DEFINE_EVENT(quic_packet_class, quic_packet_xmit,
+	TP_PROTO(struct sock *sk, u8 level, s64 number, u32 len),
+	TP_ARGS(sk, level, number, len)
+);
+
+DEFINE_EVENT(quic_packet_class, quic_packet_lost,
+	TP_PROTO(struct sock *sk, u8 level, s64 number, u32 len),
+	TP_ARGS(sk, level, number, len)
+);
+
+TRACE_EVENT(quic_sack,
+
+	TP_PROTO(struct sock *sk, u8 level, s64 largest, s64 smallest, u32 acked),
+
+	TP_ARGS(sk, level, largest, smallest, acked),
+
+	TP_STRUCT__entry(
+		__array(u8, cid, QUIC_CONN_ID_MAX_LEN)
+		__field(u8, cid_len)
+		__field(u8, level)
+		__field(s64, largest)
+		__field(s64, smallest)
+		__field(u32, acked)
+		__field(u32, window)
+		__field(u32, inflight)
+		__field(u32, smoothed_rtt)
+		__field(u32, latest_rtt)
+		__field(u32, min_rtt)
+	),
+
+	TP_fast_assign(
+		quic_trace_assign_cid(sk);
+		__entry->level = level;
+		__entry->largest = largest;
+		__entry->smallest = smallest;
+		__entry->acked = acked;
+		__entry->window = quic_cong_window(quic_cong(sk));
+		__entry->inflight = quic_outq_inflight(quic_outq(sk));
+		__entry->smoothed_rtt = quic_cong_smoothed_rtt(quic_cong(sk));
+		__entry->latest_rtt = quic_cong(sk)->latest_rtt;
+		__entry->min_rtt = quic_cong(sk)->min_rtt;
+	),
+
+	TP_printk("cid=%s level=%u largest=%lld smallest=%lld acked=%u window=%u inflight=%u "
+		  "srtt=%u latest_rtt=%u min_rtt=%u",
+		  __print_hex_str(__entry->cid, __entry->cid_len), __entry->level,
+		  __entry->largest, __entry->smallest, __entry->acked, __entry->window,
+		  __entry->inflight, __entry->smoothed_rtt, __entry->latest_rtt,
+		  __entry->min_rtt)
+);
+
+TRACE_EVENT(quic_cong_state,
+
+	TP_PROTO(struct sock *sk, u8 old_state),
+
+	TP_ARGS(sk, old_state),
+
+	TP_STRUCT__entry(
+		__array(u8, cid, QUIC_CONN_ID_MAX_LEN)
+		__field(u8, cid_len)
+		__field(u8, old_state)
+		__field(u8, new_state)
+		__field(u32, window)
+		__field(u32, ssthresh)
+		__field(u32, smoothed_rtt)
+	),
+
+	TP_fast_assign(
+		quic_trace_assign_cid(sk);
+		__entry->old_state = old_state;
+		__entry->new_state = quic_cong(sk)->state;
+		__entry->window = quic_cong_window(quic_cong(sk));
+		__entry->ssthresh = quic_cong(sk)->ssthresh;
+		__entry->smoothed_rtt = quic_cong_smoothed_rtt(quic_cong(sk));
+	),
+
+	TP_printk("cid=%s old=%u new=%u window=%u ssthresh=%u srtt=%u",
+		  __print_hex_str(__entry->cid, __entry->cid_len), __entry->old_state,
+		  __entry->new_state, __entry->window, __entry->ssthresh, __entry->smoothed_rtt)
+);
+
+TRACE_EVENT(quic_pto,
+
+	TP_PROTO(struct sock *sk, u8 level, u8 pto_count),
+
+	TP_ARGS(sk, level, pto_count),
+
+	TP_STRUCT__entry(
+		__array(u8, cid, QUIC_CONN_ID_MAX_LEN)
+		__field(u8, cid_len)
+		__field(u8, level)
+		__field(u8, pto_count)
+		__field(u32, pto)
+		__field(u32, window)
+		__field(u32, inflight)
+	),
+
+	TP_fast_assign(
+		quic_trace_assign_cid(sk);
+		__entry->level = level;
+		__entry->pto_count = pto_count;
+		__entry->pto = quic_cong_pto(quic_cong(sk));
+		__entry->window = quic_cong_window(quic_cong(sk));
+		__entry->inflight = quic_outq_inflight(quic_outq(sk));
+	),
+
+	TP_printk("cid=%s level=%u pto_count=%u pto=%u window=%u inflight=%u",
+		  __print_hex_str(__entry->cid, __entry->cid_len), __entry->level,
+		  __entry->pto_count, __entry->pto, __entry->window, __entry->inflight)
+);
+
+TRACE_EVENT(quic_pmtu_probe,
+
+	TP_PROTO(struct sock *sk, s64 number, u32 probe_size),
+
+	TP_ARGS(sk, number, probe_size),
+
+	TP_STRUCT__entry(
+		__array(u8, cid, QUIC_CONN_ID_MAX_LEN)
+		__field(u8, cid_len)
+		__field(u8, pl_state)
+		__field(s64, number)
+		__field(u32, probe_size)
+		__field(u32, mss)
+	),
+
+	TP_fast_assign(
+		quic_trace_assign_cid(sk);
+		__entry->pl_state = quic_path_pl_state(quic_paths(sk));
+		__entry->number = number;
+		__entry->probe_size = probe_size;
+		__entry->mss = quic_packet_mss(quic_packet(sk));
+	),
+
+	TP_printk("cid=%s number=%lld probe_size=%u pl_state=%u mss=%u",
+		  __print_hex_str(__entry->cid, __entry->cid_len), __entry->number,
+		  __entry->probe_size, __entry->pl_state, __entry->mss)
+);
+
+#endif /* _QUIC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,220 @@
+#!/bin/bash
+#
+# Congestion control, pacing and ACK policy comparison on emulated paths.
+#
+# A client and a server network namespace are joined by a veth pair. netem on both
+# ends adds half of the RTT, the loss and the reordering, and a tbf under the netem
+# of each end limits the bandwidth. For every path in the sweep, perf_test runs once
+# per congestion control, pacing and ACK setting, REPEAT times. Each run records its
+# RESULT line (goodput, retransmit and loss ratios from QUIC_SOCKOPT_INFO, completion
+# time percentiles) and the /proc/net/quic/snmp deltas of both namespaces, in
+# <prefix>.csv and <prefix>.json.
+#
+# Usage: ./netem_bench.sh [prefix]
+#
+# The sweep is set from the environment, for example:
+#
+#   RTTS="10 100" LOSSES="0 2" CONGS="cubic bbr" ./netem_bench.sh results/run1
+#
+#   RTTS      round trip times in msecs          (default "10 50 200")
+#   LOSSES    loss on each direction in %        (default "0 1 5")
+#   REORDERS  reordering on each direction in %  (default "0 10")
+#   RATES     bandwidth of each direction, Mbit  (default "100 1000")
+#   CONGS     congestion control algorithms      (default "reno cubic bbr")
+#   PACINGS   EDT pacing off and on              (default "0 1")
+#   ACKS      max_ack_delay[/min_ack_delay] in usecs, 0 for the defaults; a
+#             min_ack_delay enables the ACK Frequency extension (default "0 5000/1000")
+#   ARGS      perf_test client arguments         (default bulk, 4 conns, 4 streams)
+#   REPEAT    runs of each combination           (default 3)
+
+PREFIX=${1:-netem_bench}
+RTTS=${RTTS:-"10 50 200"}
+LOSSES=${LOSSES:-"0 1 5"}
+REORDERS=${REORDERS:-"0 10"}
+RATES=${RATES:-"100 1000"}
+CONGS=${CONGS:-"reno cubic bbr"}
+PACINGS=${PACINGS:-"0 1"}
+ACKS=${ACKS:-"0 5000/1000"}
+ARGS=${ARGS:-"--conns 4 --threads 2 --streams 4 --tot_len 16777216"}
+REPEAT=${REPEAT:-3}
+TIMEOUT=${TIMEOUT:-600}
+
+NS_C=quic-bench-c
+NS_S=quic-bench-s
+ADDR_C=10.199.0.1
+ADDR_S=10.199.0.2
+
+KEYS="--pkey ./keys/server-key.pem --cert ./keys/server-cert.pem"
+CSV_KEYS="mode conns streams bytes secs goodput_mbps retrans_ratio loss_ratio max_srtt \
+	  fct_p50 fct_p99 fct_p999 req_p50 req_p99 req_p999 dgram_ratio cpu_sec_per_gbit"
+SNMP_KEYS="QuicFrmRetrans QuicPktRcvDrop QuicPktDecDrop QuicPktInvNumDrop QuicFrmRcvBufDrop"
+
+SERVER_PID=""
+JSON_SEP=""
+JSON_OPEN=""
+
+cleanup()
+{
+	[ "$SERVER_PID" != "" ] && kill $SERVER_PID > /dev/null 2>&1
+	ip netns del $NS_C > /dev/null 2>&1
+	ip netns del $NS_S > /dev/null 2>&1
+	[ "$JSON_OPEN" != "" ] && echo "]" >> $PREFIX.json
+}
+
+setup_netns()
+{
+	modprobe -a udp_tunnel ip6_udp_tunnel sch_netem sch_tbf || return 1
+	if [ -f ../modules/net/quic/quic.ko ]; then
+		[ -d /sys/module/quic ] || insmod ../modules/net/quic/quic.ko || return 1
+	else
+		modprobe quic || return 1
+	fi
+
+	ip netns add $NS_C || return 1
+	ip netns add $NS_S || return 1
+	ip link add veth0 netns $NS_C type veth peer name veth0 netns $NS_S || return 1
+	ip -n $NS_C addr add $ADDR_C/24 dev veth0
+	ip -n $NS_S addr add $ADDR_S/24 dev veth0
+	ip -n $NS_C link set veth0 up
+	ip -n $NS_S link set veth0 up
+	ip -n $NS_C link set lo up
+	ip -n $NS_S link set lo up
+}
+
+# set_path <rtt msecs> <loss %> <reorder %> <rate Mbit>
+set_path()
+{
+	local delay=$(($1 / 2)) reorder="" ns
+
+	# netem reorders by sending some packets without the delay, so it needs one
+	[ "$3" != "0" ] && [ "$delay" != "0" ] && reorder="reorder $3% 50%"
+	for ns in $NS_C $NS_S; do
+		ip netns exec $ns tc qdisc replace dev veth0 root handle 1: netem \
+			delay ${delay}ms loss $2% $reorder limit 100000 || return 1
+		ip netns exec $ns tc qdisc replace dev veth0 parent 1:1 handle 10: tbf \
+			rate ${4}mbit burst 256kb latency 1000ms || return 1
+	done
+}
+
+# read_snmp <netns> <array name>
+read_snmp()
+{
+	local -n counters=$2
+	local name value
+
+	while read name value; do
+		counters[$name]=$value
+	done < <(ip netns exec $1 cat /proc/net/quic/snmp)
+}
+
+# run_one <rtt> <loss> <reorder> <rate> <cong> <pacing> <ack> <run>
+run_one()
+{
+	local ack_args="" opts="--cong $5" result status=ok key value line json i
+	local -A res c0 c1 s0 s1
+
+	[ "$6" = "1" ] && opts="$opts --pacing"
+	if [ "$7" != "0" ]; then
+		ack_args="--ack_delay ${7%%/*}"
+		[ "${7#*/}" != "$7" ] && ack_args="$ack_args --min_ack_delay ${7#*/}"
+	fi
+
+	ip netns exec $NS_S ./perf_test -l --addr 0.0.0.0 $KEYS $opts $ack_args \
+		> /dev/null 2>&1 &
+	SERVER_PID=$!
+	sleep 1
+
+	read_snmp $NS_C c0
+	read_snmp $NS_S s0
+	result=$(timeout $TIMEOUT ip netns exec $NS_C ./perf_test --addr $ADDR_S $ARGS $opts \
+		 $ack_args | grep "^RESULT: ")
+	[ "$result" = "" ] && status=fail
+	read_snmp $NS_C c1
+	read_snmp $NS_S s1
+
+	kill $SERVER_PID > /dev/null 2>&1
+	wait $SERVER_PID > /dev/null 2>&1
+	SERVER_PID=""
+
+	for i in ${result#RESULT: }; do
+		res[${i%%=*}]=${i#*=}
+	done
+
+	line="$1,$2,$3,$4,$5,$6,$7,$8,$status"
+	for key in $CSV_KEYS; do
+		line="$line,${res[$key]}"
+	done
+	for key in $SNMP_KEYS; do
+		line="$line,$((${c1[$key]:-0} - ${c0[$key]:-0})),$((${s1[$key]:-0} - ${s0[$key]:-0}))"
+	done
+	echo "$line" >> $PREFIX.csv
+
+	json="{\"rtt_ms\": $1, \"loss_pct\": $2, \"reorder_pct\": $3, \"rate_mbit\": $4,"
+	json="$json \"cong\": \"$5\", \"pacing\": $6, \"ack\": \"$7\", \"run\": $8,"
+	json="$json \"status\": \"$status\", \"result\": {"
+	i=""
+	for key in "${!res[@]}"; do
+		value=${res[$key]}
+		[ "$key" = "mode" ] && value="\"$value\""
+		json="$json$i\"$key\": $value"
+		i=", "
+	done
+	json="$json}, \"snmp_client\": {"
+	i=""
+	for key in "${!c1[@]}"; do
+		json="$json$i\"$key\": $((${c1[$key]} - ${c0[$key]:-0}))"
+		i=", "
+	done
+	json="$json}, \"snmp_server\": {"
+	i=""
+	for key in "${!s1[@]}"; do
+		json="$json$i\"$key\": $((${s1[$key]} - ${s0[$key]:-0}))"
+		i=", "
+	done
+	echo "$JSON_SEP$json}}" >> $PREFIX.json
+	JSON_SEP=","
+
+	echo "rtt=$1 loss=$2 reorder=$3 rate=$4 cong=$5 pacing=$6 ack=$7 run=$8: $status" \
+	     "goodput_mbps=${res[goodput_mbps]} retrans_ratio=${res[retrans_ratio]}" \
+	     "fct_p99=${res[fct_p99]}"
+}
+
+trap cleanup EXIT
+
+make perf_test || exit 1
+mkdir -p $(dirname $PREFIX) || exit 1
+[ -f keys/server-key.pem ] || (cd keys && sh ca_cert_pkey_psk.sh) || exit 1
+setup_netns || exit 1
+
+line="rtt_ms,loss_pct,reorder_pct,rate_mbit,cong,pacing,ack,run,status"
+for key in $CSV_KEYS; do
+	line="$line,$key"
+done
+for key in $SNMP_KEYS; do
+	line="$line,client_$key,server_$key"
+done
+echo "$line" > $PREFIX.csv
+echo "[" > $PREFIX.json
+JSON_OPEN=1
+
+for rtt in $RTTS; do
+for loss in $LOSSES; do
+for reorder in $REORDERS; do
+for rate in $RATES; do
+	set_path $rtt $loss $reorder $rate || exit 1
+	for cong in $CONGS; do
+	for pacing in $PACINGS; do
+	for ack in $ACKS; do
+		for run in $(seq 1 $REPEAT); do
+			run_one $rtt $loss $reorder $rate $cong $pacing $ack $run
+		done
+	done
+	done
+	done
+done
+done
+done
+done
+
+echo ""
+echo "RESULTS: $PREFIX.csv $PREFIX.json"
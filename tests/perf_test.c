@@ -2,24 +2,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <linux/tls.h>
 #include <arpa/inet.h>
 #include <netinet/quic.h>
 
 #define SND_MSG_LEN	4096
 #define RCV_MSG_LEN	4096 * 16
+#define DGRAM_MSG_LEN	1024
 #define ALPN_LEN	20
 #define TOT_LEN		1 * 1024 * 1024 * 1024
 
+#define MAX_STREAMS	64
+#define MAX_THREADS	256
+#define SERV_STREAMS	1024	/* streams a server connection tracks, more than MAX_STREAMS */
+
 #define SECONDS		1000000
 
 char snd_msg[SND_MSG_LEN];
-char rcv_msg[RCV_MSG_LEN];
 char alpn[ALPN_LEN] = "sample";
 
 struct options {
@@ -29,8 +36,18 @@ struct options {
 	char *ca;
 	char *addr;
 	char *port;
+	char *cong;
 	uint8_t is_serv;
 	uint8_t no_crypt;
+	uint8_t rr;
+	uint8_t dgram;
+	uint8_t hs_bench;
+	uint8_t pacing;
+	uint32_t ack_delay;
+	uint32_t min_ack_delay;
+	uint32_t conns;
+	uint32_t threads;
+	uint32_t streams;
 	uint64_t tot_len;
 	uint64_t msg_len;
 };
@@ -44,6 +61,16 @@ static struct option long_options[] = {
 	{"ca",		required_argument,	0,	's'},
 	{"msg_len",	required_argument,	0,	'm'},
 	{"tot_len",	required_argument,	0,	't'},
+	{"conns",	required_argument,	0,	'n'},
+	{"threads",	required_argument,	0,	'T'},
+	{"streams",	required_argument,	0,	'S'},
+	{"rr",		no_argument,		0,	'r'},
+	{"dgram",	no_argument,		0,	'd'},
+	{"hs_bench",	no_argument,		0,	'H'},
+	{"cong",	required_argument,	0,	'C'},
+	{"pacing",	no_argument,		0,	'P'},
+	{"ack_delay",	required_argument,	0,	'A'},
+	{"min_ack_delay", required_argument,	0,	'M'},
 	{"listen",	no_argument,		0,	'l'},
 	{"no_crypt",	no_argument,		0,	'x'},
 	{"help",	no_argument,		0,	'h'},
@@ -62,7 +89,17 @@ static void print_usage(char *cmd)
 	printf("    --ca/-s <s>:            ca file\n");
 	printf("    --help/-h <h>:          show help\n");
 	printf("    --msg_len/-m <m>:       msg_len to send\n");
-	printf("    --tot_len/-t <t>:       tot_len to send\n");
+	printf("    --tot_len/-t <t>:       tot_len to send on each connection\n");
+	printf("    --conns/-n <n>:         connections to open\n");
+	printf("    --threads/-T <T>:       threads to drive the connections\n");
+	printf("    --streams/-S <S>:       concurrent streams on each connection\n");
+	printf("    --rr/-r <r>:            send msg_len requests and time their responses\n");
+	printf("    --dgram/-d <d>:         send tot_len in datagrams instead of streams\n");
+	printf("    --hs_bench/-H <H>:      only do the handshakes of the connections\n");
+	printf("    --cong/-C <C>:          congestion control algorithm\n");
+	printf("    --pacing/-P <P>:        enable EDT pacing\n");
+	printf("    --ack_delay/-A <A>:     max_ack_delay in usecs\n");
+	printf("    --min_ack_delay/-M <M>: min_ack_delay in usecs, for ACK frequency\n");
 	printf("    --no_crypt/-x <x>:      disable 1rtt encryption\n\n");
 }
 
@@ -71,7 +108,8 @@ static int parse_options(int argc, char *argv[], struct options *opts)
 	int c, option_index = 0;
 
 	while (1) {
-		c = getopt_long(argc, argv, "la:p:m:t:k:c:s:i:xh", long_options, &option_index);
+		c = getopt_long(argc, argv, "la:p:m:t:k:c:s:i:n:T:S:rdHC:PA:M:xh", long_options,
+				&option_index);
 		if (c == -1)
 			break;
 
@@ -97,7 +135,7 @@ static int parse_options(int argc, char *argv[], struct options *opts)
 			break;
 		case 'm':
 			opts->msg_len = atoi(optarg);
-			if (opts->msg_len > SND_MSG_LEN)
+			if (!opts->msg_len || opts->msg_len > SND_MSG_LEN)
 				return -1;
 			break;
 		case 't':
@@ -105,6 +143,42 @@ static int parse_options(int argc, char *argv[], struct options *opts)
 			if (opts->tot_len > TOT_LEN)
 				return -1;
 			break;
+		case 'n':
+			opts->conns = atoi(optarg);
+			if (!opts->conns)
+				return -1;
+			break;
+		case 'T':
+			opts->threads = atoi(optarg);
+			if (!opts->threads || opts->threads > MAX_THREADS)
+				return -1;
+			break;
+		case 'S':
+			opts->streams = atoi(optarg);
+			if (!opts->streams || opts->streams > MAX_STREAMS)
+				return -1;
+			break;
+		case 'r':
+			opts->rr = 1;
+			break;
+		case 'd':
+			opts->dgram = 1;
+			break;
+		case 'H':
+			opts->hs_bench = 1;
+			break;
+		case 'C':
+			opts->cong = optarg;
+			break;
+		case 'P':
+			opts->pacing = 1;
+			break;
+		case 'A':
+			opts->ack_delay = atoi(optarg);
+			break;
+		case 'M':
+			opts->min_ack_delay = atoi(optarg);
+			break;
 		case 'x':
 			opts->no_crypt = 1;
 			break;
@@ -118,18 +192,192 @@ static int parse_options(int argc, char *argv[], struct options *opts)
 
 	if (opts->is_serv && (!opts->cert && !opts->pkey))
 		return -1;
+	if (opts->rr && opts->dgram)
+		return -1;
+	if (!opts->msg_len)
+		opts->msg_len = opts->dgram ? DGRAM_MSG_LEN : SND_MSG_LEN;
+	if (opts->threads > opts->conns)
+		opts->threads = opts->conns;
 	return 0;
 }
 
-static int do_server(struct options *opts)
+static uint64_t get_now_time(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * SECONDS + t.tv_nsec / 1000;
+}
+
+/* Log-linear latency histogram in usecs: values below 32 get a bucket each, and every
+ * power of two above is split into 32 buckets, so a bucket is within 3% of its values.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_LEN	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+static uint32_t hist_index(uint64_t v)
+{
+	uint32_t msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(uint32_t i)
+{
+	uint32_t msb;
+
+	if (i < HIST_SUB)
+		return i;
+	msb = i / HIST_SUB + HIST_SUB_BITS - 1;
+	return (uint64_t)(HIST_SUB + i % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(uint64_t *hist, uint64_t count, double p)
+{
+	uint64_t n = 0, rank = (uint64_t)(count * p + 0.5);
+	uint32_t i;
+
+	if (!rank)
+		rank = 1;
+	for (i = 0; i < HIST_LEN; i++) {
+		n += hist[i];
+		if (n >= rank)
+			return hist_value(i);
+	}
+	return 0;
+}
+
+static void hist_print(const char *name, uint64_t *hist)
+{
+	uint64_t count = 0, max = 0;
+	uint32_t i;
+
+	for (i = 0; i < HIST_LEN; i++) {
+		count += hist[i];
+		if (hist[i])
+			max = hist_value(i);
+	}
+	if (!count)
+		return;
+	printf("%s LATENCY (usecs): p50 %lu, p99 %lu, p999 %lu, max %lu, count %lu\n", name,
+	       hist_percentile(hist, count, 0.50), hist_percentile(hist, count, 0.99),
+	       hist_percentile(hist, count, 0.999), max, count);
+}
+
+static void hist_result(const char *name, uint64_t *hist)
+{
+	uint64_t count = 0;
+	uint32_t i;
+
+	for (i = 0; i < HIST_LEN; i++)
+		count += hist[i];
+	printf(" %s_p50=%lu %s_p99=%lu %s_p999=%lu", name, hist_percentile(hist, count, 0.50),
+	       name, hist_percentile(hist, count, 0.99), name, hist_percentile(hist, count, 0.999));
+}
+
+static void set_socket_options(int sockfd, struct options *opts, uint8_t dgram)
 {
 	struct quic_transport_param param = {};
-	uint32_t flags = 0, addrlen, len = 0;
+	struct quic_config config = {};
+
+	param.grease_quic_bit = opts->is_serv;
+	param.stateless_reset = opts->is_serv;
+	param.max_idle_timeout = 120 * SECONDS;
+	param.disable_1rtt_encryption = opts->no_crypt;
+	param.max_ack_delay = opts->ack_delay;
+	param.min_ack_delay = opts->min_ack_delay;
+	if (dgram)
+		param.max_datagram_frame_size = 1400;
+	if (setsockopt(sockfd, SOL_QUIC, QUIC_SOCKOPT_TRANSPORT_PARAM, &param, sizeof(param))) {
+		printf("socket setsockopt transport param failed\n");
+		exit(-1);
+	}
+
+	config.edt_pacing = opts->pacing;
+	if (setsockopt(sockfd, SOL_QUIC, QUIC_SOCKOPT_CONFIG, &config, sizeof(config))) {
+		printf("socket setsockopt config failed\n");
+		exit(-1);
+	}
+	if (opts->cong && setsockopt(sockfd, SOL_QUIC, QUIC_SOCKOPT_CONGESTION, opts->cong,
+				     strlen(opts->cong))) {
+		printf("socket setsockopt congestion %s failed\n", opts->cong);
+		exit(-1);
+	}
+}
+
+/* A server connection answers each stream once its FIN arrives, with as many bytes as the
+ * stream carried, up to --msg_len.  The answer starts with the number of datagram bytes the
+ * connection has received so far, for the datagram mode of the client to report its loss.
+ */
+struct server_conn {
+	struct options *opts;
+	uint64_t stream_len[SERV_STREAMS];
+	uint64_t dgram_len;
+	char rcv_msg[RCV_MSG_LEN];
+	char snd_msg[SND_MSG_LEN];
+	int sockfd;
+};
+
+static void *do_server_conn(void *arg)
+{
+	struct server_conn *conn = arg;
+	uint64_t len, tot_len = 0;
+	uint32_t flags;
+	int64_t sid;
+	int ret;
+
+	if (quic_server_handshake(conn->sockfd, conn->opts->pkey, conn->opts->cert, alpn))
+		goto out;
+
+	while (1) {
+		flags = 0;
+		ret = quic_recvmsg(conn->sockfd, conn->rcv_msg, sizeof(conn->rcv_msg), &sid, &flags);
+		if (ret == -1) {
+			if (errno != ENOTCONN)
+				printf("recv error %d %d\n", ret, errno);
+			break;
+		}
+		if (flags & MSG_DATAGRAM) {
+			conn->dgram_len += ret;
+			continue;
+		}
+		tot_len += ret;
+		conn->stream_len[(sid >> 2) % SERV_STREAMS] += ret;
+		if (!(flags & MSG_STREAM_FIN))
+			continue;
+
+		len = conn->stream_len[(sid >> 2) % SERV_STREAMS];
+		conn->stream_len[(sid >> 2) % SERV_STREAMS] = 0;
+		if (len > conn->opts->msg_len)
+			len = conn->opts->msg_len;
+		snprintf(conn->snd_msg, sizeof(conn->snd_msg), "%lu", conn->dgram_len);
+		ret = quic_sendmsg(conn->sockfd, conn->snd_msg, len, sid, MSG_STREAM_FIN);
+		if (ret == -1) {
+			printf("send %d %d\n", ret, errno);
+			break;
+		}
+	}
+
+	printf("CLOSE DONE: tot_len %lu, dgram_len %lu\n", tot_len, conn->dgram_len);
+out:
+	close(conn->sockfd);
+	free(conn);
+	return NULL;
+}
+
+static int do_server(struct options *opts)
+{
+	uint32_t addrlen;
 	struct sockaddr_storage ra = {};
+	struct server_conn *conn;
 	struct sockaddr_in la = {};
-	int ret, sockfd, listenfd;
+	int sockfd, listenfd;
 	struct addrinfo *rp;
-	int64_t sid = 0;
+	pthread_t thread;
 
 	if (getaddrinfo(opts->addr, opts->port, NULL, &rp)) {
 		printf("getaddrinfo error\n");
@@ -168,197 +416,496 @@ static int do_server(struct options *opts)
 	}
 
 listen:
-	param.grease_quic_bit = 1;
-	param.stateless_reset = 1;
-	param.max_idle_timeout = 120 * SECONDS;
-	param.disable_1rtt_encryption = opts->no_crypt;
-	if (setsockopt(listenfd, SOL_QUIC, QUIC_SOCKOPT_TRANSPORT_PARAM, &param, sizeof(param))) {
-		printf("socket setsockopt transport param failed\n");
-		return -1;
-	}
+	/* datagrams are always accepted, whichever mode the client runs in */
+	set_socket_options(listenfd, opts, 1);
 	if (setsockopt(listenfd, SOL_QUIC, QUIC_SOCKOPT_ALPN, alpn, strlen(alpn))) {
 		printf("socket setsockopt alpn failed\n");
 		return -1;
 	}
 
-	if (listen(listenfd, 1)) {
+	if (listen(listenfd, SOMAXCONN)) {
 		printf("socket listen failed\n");
 		return -1;
 	}
 
-loop:
 	printf("Waiting for New Socket...\n");
-	addrlen = sizeof(ra);
-	sockfd = accept(listenfd, (struct sockaddr *)&ra, &addrlen);
-	if (sockfd < 0) {
-		printf("socket accept failed %d %d\n", errno, sockfd);
-		return -1;
+	while (1) {
+		addrlen = sizeof(ra);
+		sockfd = accept(listenfd, (struct sockaddr *)&ra, &addrlen);
+		if (sockfd < 0) {
+			printf("socket accept failed %d %d\n", errno, sockfd);
+			return -1;
+		}
+
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(sockfd);
+			continue;
+		}
+		conn->sockfd = sockfd;
+		conn->opts = opts;
+		if (pthread_create(&thread, NULL, do_server_conn, conn)) {
+			printf("thread create failed %d\n", errno);
+			close(sockfd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
 	}
+	return 0;
+}
 
-	printf("accept %d\n", sockfd);
+enum {
+	STREAM_IDLE,
+	STREAM_SEND,
+	STREAM_WAIT,
+};
 
-	if (quic_server_handshake(sockfd, opts->pkey, opts->cert, alpn))
-		return -1;
+struct client_stream {
+	int64_t sid;
+	uint64_t left;
+	uint64_t start;
+	uint8_t state;
+	uint8_t new;
+};
 
-	printf("HANDSHAKE DONE\n");
+/* A client connection sends its requests on up to --streams streams at a time: in bulk
+ * mode one request of tot_len / streams bytes per stream, in rr mode tot_len / msg_len
+ * requests of msg_len bytes, each on a new stream, and in datagram mode tot_len in
+ * datagrams and then one request to learn how many of them arrived.
+ */
+struct client_conn {
+	struct client_stream streams[MAX_STREAMS];
+	uint64_t dgram_left;
+	uint64_t dgram_recvd;
+	uint64_t reqs_left;
+	uint64_t req_len;
+	uint32_t inflight;
+	uint64_t start;
+	int64_t next_sid;
+	uint8_t blocked;
+	int sockfd;
+};
 
-	while (1) {
-		ret = quic_recvmsg(sockfd, &rcv_msg, opts->msg_len * 16, &sid, &flags);
-		if (ret == -1) {
-			printf("recv error %d %d\n", ret, errno);
-			return 1;
-		}
-		len += ret;
-		usleep(20);
-		if (flags & MSG_STREAM_FIN)
-			break;
-		printf("  recv len: %u, stream_id: %d, flags: %u.\n", len, (int)sid, flags);
-	}
+struct client_worker {
+	struct options *opts;
+	struct addrinfo *rp;
+	struct client_conn *conns;
+	uint32_t count;
+	pthread_barrier_t *barrier;
+	uint64_t hist[HIST_LEN];
+	uint64_t fct_hist[HIST_LEN];	/* connection completion times */
+	struct quic_info info;		/* sums of the connections' sender counters */
+	uint64_t dgram_recvd;
+	uint64_t reqs;
+	uint64_t bytes;
+	char rcv_msg[RCV_MSG_LEN];
+	int err;
+};
 
-	printf("RECV DONE: tot_len %u, stream_id: %d, flags: %u.\n", len, (int)sid, flags);
+static uint32_t hs_next;
+
+static int client_connect(struct client_worker *w)
+{
+	int sockfd;
 
-	flags = MSG_STREAM_FIN;
-	strcpy(snd_msg, "recv done");
-	ret = quic_sendmsg(sockfd, snd_msg, strlen(snd_msg), sid, flags);
-	if (ret == -1) {
-		printf("send %d %d\n", ret, errno);
+	sockfd = socket(w->rp->ai_family, SOCK_DGRAM, IPPROTO_QUIC);
+	if (sockfd < 0) {
+		printf("socket create failed\n");
 		return -1;
 	}
+	set_socket_options(sockfd, w->opts, w->opts->dgram);
 
-	flags = 0;
-	quic_recvmsg(sockfd, &rcv_msg, sizeof(rcv_msg), &sid, &flags);
-
-	close(sockfd);
-	printf("CLOSE DONE\n");
+	if (connect(sockfd, w->rp->ai_addr, w->rp->ai_addrlen)) {
+		printf("socket connect failed\n");
+		close(sockfd);
+		return -1;
+	}
 
-	len = 0;
-	goto loop;
-	return 0;
+	if (quic_client_handshake(sockfd, w->opts->pkey, NULL, alpn)) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
 }
 
-static uint64_t get_now_time()
+static void client_conn_init(struct client_worker *w, struct client_conn *c)
 {
-	struct timespec t ;
-	clock_gettime ( CLOCK_REALTIME , & t ) ;
-	return t.tv_sec * 1000 + ( t.tv_nsec + 500000 ) / 1000000 ;
+	struct options *opts = w->opts;
+
+	c->next_sid = 0;
+	c->start = get_now_time();
+	if (opts->dgram) {
+		c->dgram_left = opts->tot_len;
+		c->reqs_left = 1;
+		c->req_len = 32;
+	} else if (opts->rr) {
+		c->reqs_left = opts->tot_len / opts->msg_len;
+		if (!c->reqs_left)
+			c->reqs_left = 1;
+		c->req_len = opts->msg_len;
+	} else {
+		c->reqs_left = opts->streams;
+		c->req_len = opts->tot_len / opts->streams;
+		if (!c->req_len)
+			c->req_len = 1;
+	}
 }
 
-static int do_client(struct options *opts)
+static int client_conn_send(struct client_worker *w, struct client_conn *c)
 {
-	struct quic_transport_param param = {};
-	struct sockaddr_in ra = {};
-	uint32_t len = 0, flags;
-	struct addrinfo *rp;
-	uint64_t start, end;
-	int ret, sockfd;
-	int64_t sid = 0;
-	float rate;
+	struct options *opts = w->opts;
+	struct client_stream *s;
+	uint32_t i, len, flags;
+	int ret, progress;
+
+	c->blocked = 0;
+	while (c->dgram_left) {
+		len = c->dgram_left < opts->msg_len ? c->dgram_left : opts->msg_len;
+		ret = quic_sendmsg(c->sockfd, snd_msg, len, 0, MSG_DATAGRAM);
+		if (ret == -1)
+			goto err;
+		c->dgram_left -= len;
+		w->bytes += len;
+	}
 
-	if (getaddrinfo(opts->addr, opts->port, NULL, &rp)) {
-		printf("getaddrinfo error\n");
-		return -1;
+	/* one msg_len chunk per stream in each round, so that the streams share the packets */
+	do {
+		progress = 0;
+		for (i = 0; i < opts->streams; i++) {
+			s = &c->streams[i];
+			if (s->state == STREAM_IDLE) {
+				if (!c->reqs_left)
+					continue;
+				c->reqs_left--;
+				c->inflight++;
+				s->sid = c->next_sid;
+				c->next_sid += 4;
+				s->left = c->req_len;
+				s->start = get_now_time();
+				s->state = STREAM_SEND;
+				s->new = 1;
+			}
+			if (s->state != STREAM_SEND)
+				continue;
+
+			len = s->left < opts->msg_len ? s->left : opts->msg_len;
+			flags = s->new ? MSG_STREAM_NEW : 0;
+			if (len == s->left)
+				flags |= MSG_STREAM_FIN;
+			ret = quic_sendmsg(c->sockfd, snd_msg, len, s->sid, flags);
+			if (ret == -1)
+				goto err;
+			s->new = 0;
+			s->left -= ret;
+			if (!opts->dgram)
+				w->bytes += ret;
+			if (!s->left)
+				s->state = STREAM_WAIT;
+			progress = 1;
+		}
+	} while (progress);
+	return 0;
+
+err:
+	if (errno == EAGAIN || errno == ENOSPC) {
+		c->blocked = 1;
+		return 0;
 	}
+	printf("send %d %d\n", ret, errno);
+	return -1;
+}
 
-	if (rp->ai_family == AF_INET6) {
-		struct sockaddr_in6 ra = {};
+static int client_conn_recv(struct client_worker *w, struct client_conn *c)
+{
+	struct client_stream *s = NULL;
+	uint32_t i, flags;
+	int64_t sid;
+	int ret;
 
-		sockfd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_QUIC);
-		if (sockfd < 0) {
-			printf("socket create failed\n");
+	while (1) {
+		flags = 0;
+		ret = quic_recvmsg(c->sockfd, w->rcv_msg, sizeof(w->rcv_msg) - 1, &sid, &flags);
+		if (ret == -1) {
+			if (errno == EAGAIN)
+				return 0;
+			printf("recv error %d %d\n", ret, errno);
 			return -1;
 		}
+		if (!(flags & MSG_STREAM_FIN) || (flags & MSG_DATAGRAM))
+			continue;
 
-		param.max_idle_timeout = 120 * SECONDS;
-		param.disable_1rtt_encryption = opts->no_crypt;
-		if (setsockopt(sockfd, SOL_QUIC, QUIC_SOCKOPT_TRANSPORT_PARAM, &param, sizeof(param))) {
-			printf("socket setsockopt transport param failed\n");
-			return -1;
+		for (i = 0; i < w->opts->streams; i++) {
+			s = &c->streams[i];
+			if (s->state == STREAM_WAIT && s->sid == sid)
+				break;
+		}
+		if (i == w->opts->streams)
+			continue;
+
+		if (w->opts->rr)
+			w->hist[hist_index(get_now_time() - s->start)]++;
+		if (w->opts->dgram) {
+			w->rcv_msg[ret] = '\0';
+			c->dgram_recvd = strtoull(w->rcv_msg, NULL, 10);
 		}
+		s->state = STREAM_IDLE;
+		c->inflight--;
+		w->reqs++;
+	}
+}
 
-		ra.sin6_family = AF_INET6;
-		ra.sin6_port = htons(atoi(opts->port));
-		inet_pton(AF_INET6, opts->addr, &ra.sin6_addr);
+static void client_conn_done(struct client_worker *w, struct client_conn *c)
+{
+	socklen_t len = sizeof(struct quic_info);
+	struct quic_info info = {};
+
+	w->fct_hist[hist_index(get_now_time() - c->start)]++;
+	w->dgram_recvd += c->dgram_recvd;
+	if (!getsockopt(c->sockfd, SOL_QUIC, QUIC_SOCKOPT_INFO, &info, &len)) {
+		w->info.bytes_sent += info.bytes_sent;
+		w->info.bytes_lost += info.bytes_lost;
+		w->info.bytes_retrans += info.bytes_retrans;
+		w->info.packets_sent += info.packets_sent;
+		w->info.packets_lost += info.packets_lost;
+		if (info.smoothed_rtt > w->info.smoothed_rtt)
+			w->info.smoothed_rtt = info.smoothed_rtt;
+	}
+	close(c->sockfd);
+	c->sockfd = -1;
+}
+
+static int client_conns_run(struct client_worker *w)
+{
+	struct pollfd pfds[w->count];
+	struct client_conn *c;
+	uint32_t i, live = 0;
+	int ret;
 
-		if (connect(sockfd, (struct sockaddr *)&ra, sizeof(ra))) {
-			printf("socket connect failed\n");
+	for (i = 0; i < w->count; i++) {
+		c = &w->conns[i];
+		if (fcntl(c->sockfd, F_SETFL, fcntl(c->sockfd, F_GETFL) | O_NONBLOCK)) {
+			printf("socket set nonblock failed %d\n", errno);
 			return -1;
 		}
-		goto handshake;
+		client_conn_init(w, c);
+		if (client_conn_send(w, c))
+			return -1;
+		live++;
 	}
 
-	sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_QUIC);
-	if (sockfd < 0) {
-		printf("socket create failed\n");
-		return -1;
+	while (live) {
+		for (i = 0; i < w->count; i++) {
+			c = &w->conns[i];
+			pfds[i].fd = c->sockfd;
+			pfds[i].events = POLLIN | (c->blocked ? POLLOUT : 0);
+			pfds[i].revents = 0;
+		}
+		/* stream limits are not reported by POLLOUT, so blocked sends are retried */
+		ret = poll(pfds, w->count, 100);
+		if (ret == -1) {
+			printf("poll error %d\n", errno);
+			return -1;
+		}
+		for (i = 0; i < w->count; i++) {
+			c = &w->conns[i];
+			if (c->sockfd < 0)
+				continue;
+			if (pfds[i].revents & (POLLERR | POLLHUP)) {
+				printf("connection closed by peer\n");
+				return -1;
+			}
+			if ((pfds[i].revents & POLLIN) && client_conn_recv(w, c))
+				return -1;
+			if ((c->blocked || c->reqs_left) && client_conn_send(w, c))
+				return -1;
+			if (!c->reqs_left && !c->inflight && !c->dgram_left) {
+				client_conn_done(w, c);
+				live--;
+			}
+		}
 	}
+	return 0;
+}
 
-	param.max_idle_timeout = 120 * SECONDS;
-	param.disable_1rtt_encryption = opts->no_crypt;
-	if (setsockopt(sockfd, SOL_QUIC, QUIC_SOCKOPT_TRANSPORT_PARAM, &param, sizeof(param))) {
-		printf("socket setsockopt transport param failed\n");
-		return -1;
+static void *do_client_worker(void *arg)
+{
+	struct client_worker *w = arg;
+	uint64_t start;
+	uint32_t i;
+	int sockfd;
+
+	if (w->opts->hs_bench) {
+		pthread_barrier_wait(w->barrier);
+		while (__atomic_fetch_add(&hs_next, 1, __ATOMIC_RELAXED) < w->opts->conns) {
+			start = get_now_time();
+			sockfd = client_connect(w);
+			if (sockfd < 0) {
+				w->err = -1;
+				break;
+			}
+			w->hist[hist_index(get_now_time() - start)]++;
+			w->reqs++;
+			close(sockfd);
+		}
+		return NULL;
 	}
 
-        ra.sin_family = AF_INET;
-        ra.sin_port = htons(atoi(opts->port));
-        inet_pton(AF_INET, opts->addr, &ra.sin_addr.s_addr);
-
-	if (connect(sockfd, (struct sockaddr *)&ra, sizeof(ra))) {
-		printf("socket connect failed\n");
-		return -1;
+	for (i = 0; i < w->count; i++) {
+		w->conns[i].sockfd = client_connect(w);
+		if (w->conns[i].sockfd < 0) {
+			w->err = -1;
+			break;
+		}
 	}
+	/* throughput is measured from when all connections of all threads are up */
+	pthread_barrier_wait(w->barrier);
+	if (!w->err)
+		w->err = client_conns_run(w);
+
+	for (i = 0; i < w->count; i++)
+		if (w->conns[i].sockfd > 0)
+			close(w->conns[i].sockfd);
+	return NULL;
+}
 
-handshake:
-	if (quic_client_handshake(sockfd, opts->pkey, NULL, alpn))
-		return -1;
+static double get_cpu_time(struct rusage *r1, struct rusage *r2, int sys)
+{
+	struct timeval *t1 = sys ? &r1->ru_stime : &r1->ru_utime;
+	struct timeval *t2 = sys ? &r2->ru_stime : &r2->ru_utime;
 
-	printf("HANDSHAKE DONE.\n");
+	return (t2->tv_sec - t1->tv_sec) + (double)(t2->tv_usec - t1->tv_usec) / SECONDS;
+}
 
-	start = get_now_time();
-	flags = MSG_STREAM_NEW; /* open stream when send first msg */
-	ret = quic_sendmsg(sockfd, snd_msg, opts->msg_len, sid, flags);
-	if (ret == -1) {
-		printf("send %d %d\n", ret, errno);
+static int do_client(struct options *opts)
+{
+	uint64_t start, end, bytes = 0, reqs = 0, dgram_recvd = 0;
+	uint64_t hist[HIST_LEN] = {}, fct_hist[HIST_LEN] = {};
+	struct client_worker *workers;
+	struct quic_info info = {};
+	pthread_t threads[MAX_THREADS];
+	struct rusage ru_start, ru_end;
+	pthread_barrier_t barrier;
+	double secs, cpu, usr, sys;
+	struct addrinfo *rp;
+	uint32_t i, j;
+	int err = 0;
+	float rate;
+
+	if (getaddrinfo(opts->addr, opts->port, NULL, &rp)) {
+		printf("getaddrinfo error\n");
 		return -1;
 	}
-	len += ret;
-	flags = 0;
-	while (1) {
-		ret = quic_sendmsg(sockfd, snd_msg, opts->msg_len, sid, flags);
-		if (ret == -1) {
-			printf("send %d %d\n", ret, errno);
+
+	workers = calloc(opts->threads, sizeof(*workers));
+	if (!workers) {
+		printf("workers alloc failed\n");
+		return -1;
+	}
+	pthread_barrier_init(&barrier, NULL, opts->threads + 1);
+	for (i = 0; i < opts->threads; i++) {
+		workers[i].opts = opts;
+		workers[i].rp = rp;
+		workers[i].barrier = &barrier;
+		workers[i].count = opts->conns / opts->threads + (i < opts->conns % opts->threads);
+		workers[i].conns = calloc(workers[i].count, sizeof(struct client_conn));
+		if (!workers[i].conns) {
+			printf("conns alloc failed\n");
+			return -1;
+		}
+		if (pthread_create(&threads[i], NULL, do_client_worker, &workers[i])) {
+			printf("thread create failed %d\n", errno);
 			return -1;
 		}
-		len += ret;
-		if (!(len % (opts->msg_len * 1024)))
-			printf("  send len: %u, stream_id: %d, flags: %u.\n", len, (int)sid, flags);
-		if (len > opts->tot_len - opts->msg_len)
-			break;
-	}
-	flags = MSG_STREAM_FIN; /* close stream when send last msg */
-	ret = quic_sendmsg(sockfd, snd_msg, opts->msg_len, sid, flags);
-	if (ret == -1) {
-		printf("send %d %d\n", ret, errno);
-		return -1;
 	}
-	len += ret;
-	printf("SEND DONE: tot_len: %u, stream_id: %d, flags: %u.\n", len, (int)sid, flags);
 
-	memset(rcv_msg, 0, sizeof(rcv_msg));
-	ret = quic_recvmsg(sockfd, rcv_msg, opts->msg_len * 16, &sid, &flags);
-	if (ret == -1) {
-		printf("recv error %d %d\n", ret, errno);
-		return 1;
+	pthread_barrier_wait(&barrier);
+	start = get_now_time();
+	getrusage(RUSAGE_SELF, &ru_start);
+	if (!opts->hs_bench)
+		printf("HANDSHAKE DONE: %u connections over %u threads.\n", opts->conns,
+		       opts->threads);
+
+	for (i = 0; i < opts->threads; i++) {
+		pthread_join(threads[i], NULL);
+		if (workers[i].err)
+			err = -1;
+		bytes += workers[i].bytes;
+		reqs += workers[i].reqs;
+		dgram_recvd += workers[i].dgram_recvd;
+		for (j = 0; j < HIST_LEN; j++) {
+			hist[j] += workers[i].hist[j];
+			fct_hist[j] += workers[i].fct_hist[j];
+		}
+		info.bytes_sent += workers[i].info.bytes_sent;
+		info.bytes_lost += workers[i].info.bytes_lost;
+		info.bytes_retrans += workers[i].info.bytes_retrans;
+		info.packets_sent += workers[i].info.packets_sent;
+		info.packets_lost += workers[i].info.packets_lost;
+		if (workers[i].info.smoothed_rtt > info.smoothed_rtt)
+			info.smoothed_rtt = workers[i].info.smoothed_rtt;
+		free(workers[i].conns);
 	}
 	end = get_now_time();
-	start = end - start;
-	rate = ((float)opts->tot_len * 8 * 1000) / 1024 / start;
+	getrusage(RUSAGE_SELF, &ru_end);
+	free(workers);
+	if (err)
+		return -1;
+
+	secs = (double)(end - start) / SECONDS;
+	usr = get_cpu_time(&ru_start, &ru_end, 0);
+	sys = get_cpu_time(&ru_start, &ru_end, 1);
+	cpu = usr + sys;
+
+	if (opts->hs_bench) {
+		printf("ALL HANDSHAKES DONE: %lu in %.3f Sec, %.1f Conns/Sec\n", reqs, secs,
+		       reqs / secs);
+		hist_print("HANDSHAKE", hist);
+		printf("CPU: %.2f Sec (user %.2f, sys %.2f), %.3f Msec/Handshake\n", cpu, usr, sys,
+		       cpu * 1000 / reqs);
+		printf("RESULT: mode=hs conns=%lu secs=%.3f conns_per_sec=%.1f", reqs, secs,
+		       reqs / secs);
+		hist_result("hs", hist);
+		printf(" cpu_msec_per_hs=%.3f\n", cpu * 1000 / reqs);
+		return 0;
+	}
+
+	printf("SEND DONE: tot_len: %lu, requests: %lu\n", bytes, reqs);
+	rate = ((float)bytes * 8 * 1000) / 1024 / ((end - start) / 1000 ?: 1);
 	if (rate < 1024)
 		printf("ALL RECVD: %.1f Kbits/Sec\n", rate);
 	else
 		printf("ALL RECVD: %.1f Mbits/Sec\n", rate / 1024);
-
-	close(sockfd);
+	if (opts->dgram)
+		printf("DGRAM RECVD by peer: %lu of %lu bytes\n", dgram_recvd, bytes);
+	if (opts->rr) {
+		printf("REQUESTS: %lu in %.3f Sec, %.1f Reqs/Sec\n", reqs, secs, reqs / secs);
+		hist_print("REQUEST", hist);
+	}
+	hist_print("COMPLETION", fct_hist);
+	printf("SENDER: bytes sent %lu, lost %lu, retrans %lu, packets sent %lu, lost %lu, "
+	       "max srtt %u usecs\n", info.bytes_sent, info.bytes_lost, info.bytes_retrans,
+	       info.packets_sent, info.packets_lost, info.smoothed_rtt);
+	/* the process time only: the softirq time spent on its packets may be accounted to
+	 * other tasks, so compare runs on an otherwise idle host
+	 */
+	printf("CPU: %.2f Sec (user %.2f, sys %.2f), %.3f Sec/Gbit\n", cpu, usr, sys,
+	       bytes ? cpu * 1000000000 / ((double)bytes * 8) : 0);
+
+	/* one key=value line for scripts, with goodput in Mbits (10^6) per second */
+	printf("RESULT: mode=%s conns=%u streams=%u bytes=%lu secs=%.3f goodput_mbps=%.1f "
+	       "retrans_ratio=%.4f loss_ratio=%.4f max_srtt=%u",
+	       opts->rr ? "rr" : (opts->dgram ? "dgram" : "bulk"), opts->conns, opts->streams,
+	       bytes, secs, bytes * 8 / secs / 1000000,
+	       info.bytes_sent ? (double)info.bytes_retrans / info.bytes_sent : 0,
+	       info.packets_sent ? (double)info.packets_lost / info.packets_sent : 0,
+	       info.smoothed_rtt);
+	hist_result("fct", fct_hist);
+	if (opts->rr)
+		hist_result("req", hist);
+	if (opts->dgram)
+		printf(" dgram_ratio=%.4f", bytes ? (double)dgram_recvd / bytes : 0);
+	printf(" cpu_sec_per_gbit=%.3f\n", bytes ? cpu * 1000000000 / ((double)bytes * 8) : 0);
 	return 0;
 }
 
@@ -367,10 +914,12 @@ int main(int argc, char *argv[])
 	struct options opts = {};
 	int ret;
 
-	opts.msg_len = SND_MSG_LEN;
 	opts.tot_len = TOT_LEN;
 	opts.addr = "::";
 	opts.port = "1234";
+	opts.conns = 1;
+	opts.threads = 1;
+	opts.streams = 1;
 
 	ret = parse_options(argc, argv, &opts);
 	if (ret) {
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Convert the quic tracepoint output, from trace_pipe or perf script, into
+ * qlog JSON-SEQ (draft-ietf-quic-qlog-main-schema) on stdout:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/quic/enable
+ *   cat /sys/kernel/tracing/trace_pipe > quic.trace
+ *   ./qlog < quic.trace > quic.sqlog
+ *
+ * Events from all connections go into one trace, with group_id set to the
+ * source connection ID, unless one is selected with "./qlog <cid>".
+ */
+
+#define LINE_LEN	1024
+#define FIELD_MAX	16
+
+struct field {
+	char *key;
+	char *val;
+};
+
+static const char *packet_type[] = { "1RTT", "initial", "handshake", "0RTT" };
+static const char *space[] = { "application_data", "initial", "handshake", "application_data" };
+static const char *cong_state[] = { "slow_start", "recovery", "congestion_avoidance" };
+
+static char *get(struct field *f, int n, const char *key)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(f[i].key, key))
+			return f[i].val;
+	return "0";
+}
+
+static unsigned int get_u(struct field *f, int n, const char *key)
+{
+	return strtoul(get(f, n, key), NULL, 10);
+}
+
+static double get_ms(struct field *f, int n, const char *key)
+{
+	return get_u(f, n, key) / 1000.0;
+}
+
+static const char *get_name(struct field *f, int n, const char *key, const char **names,
+			    unsigned int len)
+{
+	unsigned int v = get_u(f, n, key);
+
+	return v < len ? names[v] : "unknown";
+}
+
+#define LEVEL_NAME(names)	\
+	get_name(f, n, "level", names, sizeof(names) / sizeof(names[0]))
+
+static int print_event(const char *event, struct field *f, int n)
+{
+	if (!strcmp(event, "quic_packet_xmit") || !strcmp(event, "quic_packet_rcv")) {
+		printf("\"name\":\"transport:%s\",\"data\":{\"header\":{\"packet_type\":\"%s\","
+		       "\"packet_number\":%s},\"raw\":{\"length\":%s}}",
+		       strcmp(event, "quic_packet_rcv") ? "packet_sent" : "packet_received",
+		       LEVEL_NAME(packet_type), get(f, n, "number"), get(f, n, "len"));
+		return 0;
+	}
+	if (!strcmp(event, "quic_packet_lost")) {
+		printf("\"name\":\"recovery:packet_lost\",\"data\":{\"header\":{\"packet_type\":"
+		       "\"%s\",\"packet_number\":%s}}", LEVEL_NAME(packet_type), get(f, n, "number"));
+		return 0;
+	}
+	if (!strcmp(event, "quic_sack")) {
+		printf("\"name\":\"recovery:metrics_updated\",\"data\":{\"smoothed_rtt\":%.3f,"
+		       "\"latest_rtt\":%.3f,\"min_rtt\":%.3f,\"congestion_window\":%u,"
+		       "\"bytes_in_flight\":%u}", get_ms(f, n, "srtt"), get_ms(f, n, "latest_rtt"),
+		       get_ms(f, n, "min_rtt"), get_u(f, n, "window"), get_u(f, n, "inflight"));
+		return 0;
+	}
+	if (!strcmp(event, "quic_cong_state")) {
+		printf("\"name\":\"recovery:congestion_state_updated\",\"data\":{\"old\":\"%s\","
+		       "\"new\":\"%s\"}", get_name(f, n, "old", cong_state, 3),
+		       get_name(f, n, "new", cong_state, 3));
+		return 0;
+	}
+	if (!strcmp(event, "quic_pto")) {
+		printf("\"name\":\"recovery:loss_timer_updated\",\"data\":{\"timer_type\":\"pto\","
+		       "\"packet_number_space\":\"%s\",\"event_type\":\"expired\"}",
+		       LEVEL_NAME(space));
+		return 0;
+	}
+	if (!strcmp(event, "quic_pmtu_probe")) {
+		printf("\"name\":\"connectivity:mtu_probe_sent\",\"data\":{\"packet_number\":%s,"
+		       "\"probe_size\":%u,\"mtu\":%u}", get(f, n, "number"),
+		       get_u(f, n, "probe_size"), get_u(f, n, "mss"));
+		return 0;
+	}
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	char line[LINE_LEN], *event, *p, *ts;
+	struct field f[FIELD_MAX];
+	const char *cid, *sel;
+	double time;
+	int n;
+
+	sel = argc > 1 ? argv[1] : NULL;
+	printf("\x1e{\"qlog_version\":\"0.3\",\"qlog_format\":\"JSON-SEQ\",\"trace\":"
+	       "{\"vantage_point\":{\"type\":\"unknown\"},\"common_fields\":"
+	       "{\"time_format\":\"absolute\",\"reference_time\":0}}}\n");
+
+	while (fgets(line, sizeof(line), stdin)) {
+		event = strstr(line, ": quic_");
+		if (!event)
+			continue;
+		*event = '\0';
+		event += 2;
+
+		ts = strrchr(line, ' ');
+		time = strtod(ts ? ts + 1 : line, NULL) * 1000;
+
+		p = strchr(event, ':');
+		if (!p)
+			continue;
+		*p++ = '\0';
+
+		n = 0;
+		for (p = strtok(p, " \n"); p && n < FIELD_MAX; p = strtok(NULL, " \n")) {
+			f[n].key = p;
+			p = strchr(p, '=');
+			if (!p)
+				continue;
+			*p++ = '\0';
+			f[n++].val = p;
+		}
+
+		cid = get(f, n, "cid");
+		if (sel && strcmp(sel, cid))
+			continue;
+
+		printf("\x1e{\"time\":%.3f,\"group_id\":\"%s\",", time, cid);
+		if (print_event(event, f, n))
+			printf("\"name\":\"quic:%s\",\"data\":{}", event);
+		printf("}\n");
+	}
+	return 0;
+}
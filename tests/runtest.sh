@@ -91,6 +91,15 @@ perf_tests()
 	./perf_test --addr 127.0.0.1 || return 1
 	daemon_stop "perf_test"
 
+	print_start "Performance Tests (IPv4, Connections, Streams, Requests and Handshakes)"
+	daemon_run ./perf_test -l --pkey ./keys/server-key.pem --cert ./keys/server-cert.pem
+	./perf_test --addr 127.0.0.1 --conns 8 --threads 2 --streams 4 --tot_len 67108864 || return 1
+	./perf_test --addr 127.0.0.1 --conns 8 --threads 2 --streams 4 --rr --msg_len 1024 \
+		    --tot_len 1048576 || return 1
+	./perf_test --addr 127.0.0.1 --conns 2 --dgram --tot_len 1048576 || return 1
+	./perf_test --addr 127.0.0.1 --conns 200 --threads 4 --hs_bench || return 1
+	daemon_stop "perf_test"
+
 	print_start "Performance Tests (IPv6, Disable 1RTT Encryption)"
 	daemon_run ./perf_test -l --pkey ./keys/server-key.pem \
 				  --cert ./keys/server-cert.pem --no_crypt